@@ -0,0 +1,139 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <pthread.h>
+
+#include <sxmc/checkpoint.h>
+
+/** Tag at the start of a checkpoint file, with a format version */
+static const char CHECKPOINT_MAGIC[8] = {'S', 'X', 'M', 'C', 'C', 'K', 'P', '3'};
+
+
+template <typename T>
+static void write_vector(std::ofstream& f, const std::vector<T>& v) {
+  unsigned long long n = v.size();
+  f.write(reinterpret_cast<const char*>(&n), sizeof(n));
+  if (n > 0) {
+    f.write(reinterpret_cast<const char*>(&v[0]), n * sizeof(T));
+  }
+}
+
+
+template <typename T>
+static bool read_vector(std::ifstream& f, std::vector<T>& v) {
+  unsigned long long n = 0;
+  f.read(reinterpret_cast<char*>(&n), sizeof(n));
+  if (!f || n > (1ULL << 40) / sizeof(T)) {
+    return false;
+  }
+  v.resize(n);
+  if (n > 0) {
+    f.read(reinterpret_cast<char*>(&v[0]), n * sizeof(T));
+  }
+  return !!f;
+}
+
+
+bool write_chain_state(const std::string& path, const ChainState& s) {
+  const std::string tmp = path + ".tmp";
+  std::ofstream f(tmp.c_str(), std::ios::binary | std::ios::trunc);
+  f.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  f.write(reinterpret_cast<const char*>(&s.seed), sizeof(s.seed));
+  const unsigned header[10] = {
+    s.experiment, s.nparameters, s.nblocks, s.nsteps, s.burnin_steps,
+    s.step, s.adapt_phase, s.phase_start, s.phase_end, s.host_seed
+  };
+  f.write(reinterpret_cast<const char*>(header), sizeof(header));
+  f.write(reinterpret_cast<const char*>(&s.phase_first),
+          sizeof(s.phase_first));
+  f.write(reinterpret_cast<const char*>(&s.current_nll),
+          sizeof(s.current_nll));
+  write_vector(f, s.current_vector);
+  write_vector(f, s.proposed_vector);
+  write_vector(f, s.jump_width);
+  write_vector(f, s.cholesky);
+  write_vector(f, s.use_cholesky);
+  write_vector(f, s.walk_stats);
+  write_vector(f, s.rngs);
+  write_vector(f, s.samples);
+  write_vector(f, s.recycled);
+  f.close();
+  if (!f || rename(tmp.c_str(), path.c_str()) != 0) {
+    std::cerr << "MCMC: Failed to write checkpoint " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Read the scalar fields of a chain state, at the start of a checkpoint.
+ *
+ * \param f The checkpoint file
+ * \param s Output: the chain state; the vectors are left alone
+ * \returns False, with s partly set, if the header is not readable
+ */
+static bool read_chain_header(std::ifstream& f, ChainState& s) {
+  char magic[sizeof(CHECKPOINT_MAGIC)];
+  f.read(magic, sizeof(magic));
+  if (!f || !std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC)) {
+    return false;
+  }
+  f.read(reinterpret_cast<char*>(&s.seed), sizeof(s.seed));
+  unsigned header[10];
+  f.read(reinterpret_cast<char*>(header), sizeof(header));
+  s.experiment = header[0];
+  s.nparameters = header[1];
+  s.nblocks = header[2];
+  s.nsteps = header[3];
+  s.burnin_steps = header[4];
+  s.step = header[5];
+  s.adapt_phase = header[6];
+  s.phase_start = header[7];
+  s.phase_end = header[8];
+  s.host_seed = header[9];
+  f.read(reinterpret_cast<char*>(&s.phase_first), sizeof(s.phase_first));
+  f.read(reinterpret_cast<char*>(&s.current_nll), sizeof(s.current_nll));
+  return !!f;
+}
+
+
+bool read_chain_state(const std::string& path, ChainState& s,
+                      bool header_only) {
+  std::ifstream f(path.c_str(), std::ios::binary);
+  if (!read_chain_header(f, s)) {
+    return false;
+  }
+  if (header_only) {
+    return true;
+  }
+  return (read_vector(f, s.current_vector) &&
+          read_vector(f, s.proposed_vector) &&
+          read_vector(f, s.jump_width) &&
+          read_vector(f, s.cholesky) &&
+          read_vector(f, s.use_cholesky) &&
+          read_vector(f, s.walk_stats) &&
+          read_vector(f, s.rngs) &&
+          read_vector(f, s.samples) &&
+          read_vector(f, s.recycled));
+}
+
+
+/** Thread entry point for write_chain_state */
+static void* write_chain_state_thread(void* arg) {
+  CheckpointWrite* w = static_cast<CheckpointWrite*>(arg);
+  write_chain_state(w->path, w->state);
+  return NULL;
+}
+
+
+bool write_chain_state_async(CheckpointWrite& w, pthread_t& thread) {
+  if (pthread_create(&thread, NULL, write_chain_state_thread, &w) == 0) {
+    return true;
+  }
+  write_chain_state(w.path, w.state);
+  return false;
+}
@@ -0,0 +1,94 @@
+/**
+ * \file checkpoint.h
+ *
+ * Checkpoints of Metropolis walks, so a long job can be stopped and picked
+ * up again where it left off.
+ */
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <vector>
+#include <string>
+#include <pthread.h>
+
+/**
+ * \struct ChainState
+ * \brief Everything a Metropolis chain needs to continue from a buffer flush
+ *
+ * The walk is only checkpointed just after a flush, when the step buffer
+ * and counters are empty and the kept mixture sums are stale anyway.
+ */
+struct ChainState {
+  unsigned long long seed;  //!< checked against the resuming chain
+  unsigned experiment;  //!< checked against the resuming chain
+  unsigned nparameters;  //!< checked against the resuming chain
+  unsigned nblocks;  //!< checked against the resuming chain
+  unsigned nsteps;  //!< checked against the resuming chain
+  unsigned burnin_steps;  //!< checked against the resuming chain
+  unsigned step;  //!< next step to take
+  unsigned adapt_phase;  //!< adaptation phases completed
+  unsigned phase_start;  //!< step at which the current phase began
+  unsigned phase_end;  //!< step at which the current phase ends
+  unsigned long long phase_first;  //!< first saved step of the phase
+  unsigned host_seed;  //!< seed of the host RNG from this step on
+  double current_nll;  //!< NLL at the current point
+  std::vector<double> current_vector;  //!< the current point
+  std::vector<double> proposed_vector;  //!< the next proposal, already drawn
+  std::vector<float> jump_width;  //!< jump widths in each block
+  std::vector<float> cholesky;  //!< jump Cholesky factors in each block
+  std::vector<char> use_cholesky;  //!< blocks with correlated jumps
+  std::vector<double> walk_stats;  //!< running statistics of the walk
+  std::vector<char> rngs;  //!< raw device RNG states
+  std::vector<float> samples;  //!< steps saved so far
+  std::vector<float> recycled;  //!< points not taken at the saved steps
+};
+
+
+/**
+ * Write a chain state to a file.
+ *
+ * The state goes to a temporary file that then replaces the old checkpoint,
+ * so a job killed while writing leaves the previous checkpoint intact.
+ *
+ * \param path The checkpoint file
+ * \param s The chain state
+ * \returns False if the file could not be written
+ */
+bool write_chain_state(const std::string& path, const ChainState& s);
+
+
+/**
+ * Read a chain state written by write_chain_state.
+ *
+ * \param path The checkpoint file
+ * \param s Output: the chain state
+ * \param header_only Stop after the scalar fields, leaving the vectors
+ * \returns False, with s partly set, if there is no readable checkpoint
+ */
+bool read_chain_state(const std::string& path, ChainState& s,
+                      bool header_only=false);
+
+
+/**
+ * \struct CheckpointWrite
+ * \brief A chain state being written on a thread of its own
+ */
+struct CheckpointWrite {
+  std::string path;  //!< the checkpoint file
+  ChainState state;  //!< snapshot of the chain
+};
+
+
+/**
+ * Write a chain state on a thread of its own, or right away if no thread
+ * can be started.
+ *
+ * \param w The chain state and its file, left alone until the thread is
+ *          joined
+ * \param thread Output: the writing thread
+ * \returns True if the thread was started, and must be joined
+ */
+bool write_chain_state_async(CheckpointWrite& w, pthread_t& thread);
+
+#endif  // __CHECKPOINT_H__
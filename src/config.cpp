@@ -4,6 +4,7 @@
 #include <streambuf>
 #include <string>
 #include <algorithm>
+#include <cmath>
 #include <stdlib.h>
 #include <vector>
 #include <assert.h>
@@ -123,6 +124,14 @@ FitConfig::FitConfig(std::string filename) {
     s.mean = s_json["mean"].asFloat();
     s.sigma = s_json.get("sigma", 0.0).asFloat();
     s.fixed = s_json.get("fixed", false).asBool();
+    s.lower = s_json.get("lower", -HUGE_VAL).asDouble();
+    s.upper = s_json.get("upper", HUGE_VAL).asDouble();
+    if (!(s.lower <= s.mean && s.mean <= s.upper)) {
+      std::cerr << "FitConfig::FitConfig: Mean of systematic "
+                << it.key().asString() << " is outside its limits"
+                << std::endl;
+      throw(1);
+    }
 
     all_systematics[it.key().asString()] = s;
   }
@@ -136,6 +145,102 @@ FitConfig::FitConfig(std::string filename) {
   this->burnin_fraction = fit_params.get("burnin_fraction", 0.1).asFloat();
   this->output_file = fit_params.get("output_file", "fit_spectrum").asString();
   this->debug_mode = fit_params.get("debug_mode", false).asBool();
+  this->fit_only = fit_params.get("fit_only", false).asBool();
+
+  this->mcmc_options.proposals = fit_params.get("proposals", 1).asUInt();
+  assert(this->mcmc_options.proposals > 0);
+
+  this->mcmc_options.chains = fit_params.get("chains", 1).asUInt();
+  assert(this->mcmc_options.chains > 0);
+
+  std::string sampler_string = \
+    fit_params.get("sampler", "metropolis").asString();
+  if (sampler_string == "metropolis") {
+    this->mcmc_options.sampler = MCMCOptions::SAMPLER_METROPOLIS;
+  }
+  else if (sampler_string == "ensemble") {
+    this->mcmc_options.sampler = MCMCOptions::SAMPLER_ENSEMBLE;
+  }
+  else if (sampler_string == "hmc") {
+    this->mcmc_options.sampler = MCMCOptions::SAMPLER_HMC;
+  }
+  else if (sampler_string == "nuts") {
+    this->mcmc_options.sampler = MCMCOptions::SAMPLER_NUTS;
+  }
+  else {
+    std::cerr << "FitConfig::FitConfig: Unknown sampler "
+              << sampler_string << std::endl;
+    throw(1);
+  }
+  this->mcmc_options.walkers = fit_params.get("walkers", 0).asUInt();
+  this->mcmc_options.leapfrog_steps = \
+    fit_params.get("leapfrog_steps", 16).asUInt();
+  assert(this->mcmc_options.leapfrog_steps > 0);
+  this->mcmc_options.adapt_covariance = \
+    fit_params.get("adapt_covariance", true).asBool();
+  this->mcmc_options.rate_steps = fit_params.get("rate_steps", 0).asUInt();
+  this->mcmc_options.component_updates = \
+    fit_params.get("component_updates", false).asBool();
+  this->mcmc_options.reflect_bounds = \
+    fit_params.get("reflect_bounds", false).asBool();
+  this->mcmc_options.speculation_depth = \
+    fit_params.get("speculation_depth", 0).asUInt();
+  // All 2^d - 1 points of a speculative round must fit in one NLL batch
+  const unsigned depth = this->mcmc_options.speculation_depth;
+  if (depth > 16 || (1u << depth) - 1 > NLL_MAX_BATCH) {
+    std::cerr << "FitConfig::FitConfig: Speculation depth " << depth
+              << " is too large" << std::endl;
+    throw(1);
+  }
+  this->mcmc_options.delayed_acceptance = \
+    fit_params.get("delayed_acceptance", false).asBool();
+  this->mcmc_options.replicas = fit_params.get("replicas", 0).asUInt();
+  this->mcmc_options.max_temperature = \
+    fit_params.get("max_temperature", 10.0).asDouble();
+  assert(this->mcmc_options.max_temperature >= 1);
+  this->mcmc_options.swap_interval = \
+    fit_params.get("swap_interval", 10).asUInt();
+  assert(this->mcmc_options.swap_interval > 0);
+  this->mcmc_options.seed_from_fit = \
+    fit_params.get("seed_from_fit", false).asBool();
+  this->mcmc_options.auto_burnin = \
+    fit_params.get("auto_burnin", false).asBool();
+  this->mcmc_options.target_ess = \
+    fit_params.get("target_ess", 0.0).asDouble();
+  assert(this->mcmc_options.target_ess >= 0);
+  this->mcmc_options.checkpoint_file = \
+    fit_params.get("checkpoint_file", "").asString();
+  this->mcmc_options.checkpoint_interval = \
+    fit_params.get("checkpoint_interval", 100000).asUInt();
+  assert(this->mcmc_options.checkpoint_interval > 0);
+  this->mcmc_options.resume = fit_params.get("resume", false).asBool();
+  // Zero leaves the seed to be drawn from the clock
+  this->mcmc_options.seed = fit_params.get("seed", 0).asUInt();
+  this->mcmc_options.recycle = \
+    fit_params.get("recycle_proposals", false).asBool();
+  this->mcmc_options.max_block_size = \
+    fit_params.get("max_block_size", 0).asUInt();
+  this->mcmc_options.thin = fit_params.get("thin", 1).asUInt();
+  assert(this->mcmc_options.thin > 0);
+
+  std::string lut_string = \
+    fit_params.get("lookup_table", "auto").asString();
+  if (lut_string == "auto") {
+    this->mcmc_options.lookup_table = NLLEvaluator::LUT_AUTO;
+  }
+  else if (lut_string == "float") {
+    this->mcmc_options.lookup_table = NLLEvaluator::LUT_FLOAT;
+  }
+  else if (lut_string == "bfloat16") {
+    this->mcmc_options.lookup_table = NLLEvaluator::LUT_BFLOAT16;
+  }
+  else {
+    std::cerr << "FitConfig::FitConfig: Unknown lookup_table "
+              << lut_string << std::endl;
+    throw(1);
+  }
+  this->mcmc_options.mc_statistics = \
+    fit_params.get("mc_statistics", false).asBool();
 
   // Find observables we want to fit for
   for (Json::Value::const_iterator it=fit_params["observables"].begin();
@@ -253,10 +358,60 @@ FitConfig::FitConfig(std::string filename) {
 
 
 void FitConfig::print() const {
+  const char* lut_names[] = { "auto", "float", "bfloat16" };
+  const char* sampler_names[] = { "metropolis", "ensemble", "hmc", "nuts" };
+
   std::cout << "Fit:" << std::endl
     << "  Fake experiments: " << this->experiments << std::endl
     << "  MCMC steps: " << this->steps << std::endl
     << "  Burn-in fraction: " << this->burnin_fraction << std::endl
+    << "  Lookup table: " << lut_names[this->mcmc_options.lookup_table]
+    << std::endl
+    << "  Profile MC statistics per bin: "
+    << (this->mcmc_options.mc_statistics ? "yes" : "no") << std::endl
+    << "  Proposals per step: " << this->mcmc_options.proposals << std::endl
+    << "  Chains: " << this->mcmc_options.chains << std::endl
+    << "  Sampler: " << sampler_names[this->mcmc_options.sampler]
+    << std::endl
+    << "  Ensemble walkers: " << this->mcmc_options.walkers << std::endl
+    << "  HMC leapfrog steps: " << this->mcmc_options.leapfrog_steps
+    << std::endl
+    << "  Adapt jump covariance: "
+    << (this->mcmc_options.adapt_covariance ? "yes" : "no") << std::endl
+    << "  Rate steps per systematic step: " << this->mcmc_options.rate_steps
+    << std::endl
+    << "  Component-wise rate updates: "
+    << (this->mcmc_options.component_updates ? "yes" : "no") << std::endl
+    << "  Reflect jumps at bounds: "
+    << (this->mcmc_options.reflect_bounds ? "yes" : "no") << std::endl
+    << "  Speculation depth: " << this->mcmc_options.speculation_depth
+    << std::endl
+    << "  Delayed acceptance: "
+    << (this->mcmc_options.delayed_acceptance ? "yes" : "no") << std::endl
+    << "  Tempered replicas: " << this->mcmc_options.replicas << std::endl
+    << "  Maximum temperature: " << this->mcmc_options.max_temperature
+    << std::endl
+    << "  Steps between replica swaps: " << this->mcmc_options.swap_interval
+    << std::endl
+    << "  Start at best fit: "
+    << (this->mcmc_options.seed_from_fit ? "yes" : "no") << std::endl
+    << "  Automatic burn-in length: "
+    << (this->mcmc_options.auto_burnin ? "yes" : "no") << std::endl
+    << "  Target effective sample size: " << this->mcmc_options.target_ess
+    << std::endl
+    << "  Checkpoint file: " << this->mcmc_options.checkpoint_file
+    << std::endl
+    << "  Steps between checkpoints: "
+    << this->mcmc_options.checkpoint_interval << std::endl
+    << "  Resume from checkpoint: "
+    << (this->mcmc_options.resume ? "yes" : "no") << std::endl
+    << "  Random seed: " << this->mcmc_options.seed << std::endl
+    << "  Recycle rejected proposals: "
+    << (this->mcmc_options.recycle ? "yes" : "no") << std::endl
+    << "  Maximum proposal block size: "
+    << this->mcmc_options.max_block_size << std::endl
+    << "  Save every nth step: " << this->mcmc_options.thin << std::endl
+    << "  Fit only: " << (this->fit_only ? "yes" : "no") << std::endl
     << "  Output plot: " << this->output_file << std::endl;
 
   std::cout << "Experiment:" << std::endl
@@ -323,6 +478,8 @@ void FitConfig::print() const {
       else {
         std::cout << "no" << std::endl;
       }
+      std::cout << "    Limits: " << it->lower << " to " << it->upper
+                << std::endl;
     }
   }
 }
@@ -13,6 +13,7 @@
 #include <sxmc/utils.h>
 #include <sxmc/signals.h>
 #include <sxmc/pdfz.h>
+#include <sxmc/mcmc.h>
 
 class TH1D;
 class TH2F;
@@ -67,6 +68,8 @@ class FitConfig {
     float efficiency_correction;  //!< Overall efficiency correction
     float burnin_fraction;  //!< Fraction of steps to use for burn-in period
     bool debug_mode;  //!< Enable/disable debugging mode (accept/save all)
+    bool fit_only;  //!< Find the best fit only, with no random walk
+    MCMCOptions mcmc_options;  //!< MCMC sampler settings
     std::string output_file;  //!< Base filename for output
     std::vector<Signal> signals;  //!< Signal histograms and metadata
     std::vector<Systematic> systematics;  //!< Systematics used in PDFs
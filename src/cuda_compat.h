@@ -21,6 +21,20 @@ inline unsigned int atomicAdd(unsigned int* address, int val) {
   *address = old + val;
   return old;
 }
+
+/**
+ * Replacement for the 64-bit atomicAdd on CPU. NOT THREAD-SAFE.
+ *
+ * \param address Address of the integer to add to
+ * \param val Value to add to the integer at address
+ * \returns The value stored at the address before the addition operation
+ */
+inline unsigned long long atomicAdd(unsigned long long* address,
+                                    unsigned long long val) {
+  unsigned long long old = *address;
+  *address = old + val;
+  return old;
+}
 #endif
 
 #endif  // __CUDA_COMPAT_H__
@@ -15,7 +15,8 @@ std::pair<std::vector<float>, std::vector<int> >
 make_fake_dataset(std::vector<Signal>& signals,
                   std::vector<Systematic>& systematics,
                   std::vector<Observable>& observables,
-                  std::vector<double> params, bool poisson, int maxsamples) {
+                  std::vector<double> params, bool poisson, int maxsamples,
+                  RNGState* rng) {
   std::cout << "make_fake_dataset: Generating dataset..." << std::endl;
 
   std::vector<double> syst_vals;
@@ -37,7 +38,7 @@ make_fake_dataset(std::vector<Signal>& signals,
     observed[i] = \
       dynamic_cast<pdfz::EvalHist*>(signals[i].histogram)->RandomSample(
         events, weights, params[i], syst_vals,upper, lower,
-        poisson, maxsamples);
+        poisson, maxsamples, rng);
 
     std::cout << "make_fake_dataset: " << signals[i].name << ": "
               << observed[i] << " events (" << signals[i].nexpected
@@ -49,7 +50,8 @@ make_fake_dataset(std::vector<Signal>& signals,
 
 
 std::pair<std::vector<float>, std::vector<int> >
-sample_pdf(TH1* hist, long int nsamples, long int maxsamples) {
+sample_pdf(TH1* hist, long int nsamples, long int maxsamples,
+           RNGState* rng) {
   std::vector<float> events;
   std::vector<int> weights;
 
@@ -108,7 +110,7 @@ sample_pdf(TH1* hist, long int nsamples, long int maxsamples) {
     double obs;
     long int j;
     for (j=0; j<nsamples; j++) {
-      obs = ht->GetRandom();
+      sample_histogram(ht, rng, &obs);
 
       events.push_back(obs);
 
@@ -131,11 +133,12 @@ sample_pdf(TH1* hist, long int nsamples, long int maxsamples) {
     weights.reserve(allocatesize);
     TH2D* ht = dynamic_cast<TH2D*>(hist);
 
-    double obs0;
-    double obs1;
+    double obs[2];
     long int j;
     for (j=0; j<nsamples; j++) {
-      ht->GetRandom2(obs0, obs1);
+      sample_histogram(ht, rng, obs);
+      const double obs0 = obs[0];
+      const double obs1 = obs[1];
 
       events.push_back(obs0);
       events.push_back(obs1);
@@ -159,12 +162,13 @@ sample_pdf(TH1* hist, long int nsamples, long int maxsamples) {
     weights.reserve(allocatesize);
     TH3D* ht = dynamic_cast<TH3D*>(hist);
 
-    double obs0;
-    double obs1;
-    double obs2;
+    double obs[3];
     long int j;
     for (j=0; j<nsamples; j++) {
-      ht->GetRandom3(obs0, obs1, obs2);
+      sample_histogram(ht, rng, obs);
+      const double obs0 = obs[0];
+      const double obs1 = obs[1];
+      const double obs2 = obs[2];
 
       events.push_back(obs0);
       events.push_back(obs1);
@@ -12,6 +12,7 @@
 #include <TH1.h>
 
 #include <sxmc/signals.h>
+#include <sxmc/rng.h>
 
 /**
  * Make a fake data set.
@@ -31,6 +32,8 @@
  * \param observables List of Observables common to all PDFs
  * \param params List of parameters (normalizations then systematics)
  * \param poisson If true, Poisson-distribute the signal rates
+ * \param maxsamples Most events to draw for one signal; more are weighted
+ * \param rng Random number stream, or NULL to use gRandom
  * \return Array with samples
  */
 std::pair<std::vector<float>, std::vector<int> >
@@ -38,14 +41,22 @@ make_fake_dataset(std::vector<Signal>& signals,
                   std::vector<Systematic>& systematics,
                   std::vector<Observable>& observables,
                   std::vector<double> params,
-                  bool poisson=true, int maxsamples=1e7);
+                  bool poisson=true, int maxsamples=1e7,
+                  RNGState* rng=NULL);
 
 
 /**
  * Sample a ROOT TH1 (TH1, TH2, or TH3) histogram.
+ *
+ * \param hist The histogram
+ * \param nsamples Number of events to draw
+ * \param maxsamples Most events to draw; more are weighted
+ * \param rng Random number stream, or NULL to use gRandom
+ * \return Array with samples, and their weights
  */
 std::pair<std::vector<float>, std::vector<int> >
-sample_pdf(TH1* hist, long int nsamples, long int maxsamples=1e7);
+sample_pdf(TH1* hist, long int nsamples, long int maxsamples=1e7,
+           RNGState* rng=NULL);
 
 
 /**
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <map>
 #include <string>
@@ -15,14 +17,31 @@
 #include <sxmc/projection.h>
 #include <sxmc/utils.h>
 
-LikelihoodSpace::LikelihoodSpace(TNtuple* _samples) {
+LikelihoodSpace::LikelihoodSpace(TNtuple* _samples, TNtuple* _recycled) {
   this->samples = _samples;
+  this->recycled = _recycled;
   this->ml_params = extract_best_fit(this->ml);
 }
 
 
 LikelihoodSpace::~LikelihoodSpace() {
   samples->Delete();
+  if (recycled) {
+    recycled->Delete();
+  }
+}
+
+
+std::vector<std::string> LikelihoodSpace::get_parameter_names() {
+  std::vector<std::string> names;
+  for (int i=0; i<this->samples->GetListOfBranches()->GetEntries(); i++) {
+    std::string name = this->samples->GetListOfBranches()->At(i)->GetName();
+    if (name == "likelihood" || name == "chain") {
+      continue;
+    }
+    names.push_back(name);
+  }
+  return names;
 }
 
 
@@ -44,18 +63,59 @@ void LikelihoodSpace::print_best_fit() {
 }
 
 
+std::map<std::string, double> LikelihoodSpace::get_means() {
+  std::vector<std::string> names = get_parameter_names();
+  TNtuple* nt = estimate_samples();
+
+  float* params_branch = new float[names.size()];
+  for (size_t j=0; j<names.size(); j++) {
+    nt->SetBranchAddress(names[j].c_str(), &params_branch[j]);
+  }
+
+  float weight = 1;
+  if (nt == this->recycled) {
+    nt->SetBranchAddress("weight", &weight);
+  }
+
+  std::vector<double> sums(names.size(), 0);
+  double total_weight = 0;
+  for (int i=0; i<nt->GetEntries(); i++) {
+    nt->GetEntry(i);
+    for (size_t j=0; j<names.size(); j++) {
+      sums[j] += weight * params_branch[j];
+    }
+    total_weight += weight;
+  }
+
+  nt->ResetBranchAddresses();
+  delete[] params_branch;
+
+  std::map<std::string, double> means;
+  for (size_t j=0; j<names.size() && total_weight > 0; j++) {
+    means[names[j]] = sums[j] / total_weight;
+  }
+
+  return means;
+}
+
+
+void LikelihoodSpace::print_means() {
+  std::cout << "-- Posterior means"
+            << (this->recycled ? " (waste-recycled)" : "") << " --"
+            << std::endl;
+  std::map<std::string, double> means = get_means();
+  std::map<std::string, double>::iterator it;
+  for (it=means.begin(); it!=means.end(); ++it) {
+    std::cout << " " << it->first << ": " << it->second << std::endl;
+  }
+}
+
+
 void LikelihoodSpace::print_correlations() {
   std::cout << "-- Correlation matrix --" << std::endl;
   std::vector<float> correlations = get_correlation_matrix(this->samples);
 
-  std::vector<std::string> names;
-  for (int i=0; i<this->samples->GetListOfBranches()->GetEntries(); i++) {
-    std::string name = this->samples->GetListOfBranches()->At(i)->GetName();
-    if (name == "likelihood") {
-      continue;
-    }
-    names.push_back(name);
-  }
+  std::vector<std::string> names = get_parameter_names();
 
   for(size_t i=0; i<names.size(); i++) {
     std::cout << std::setw(20) << names[i] << " ";
@@ -73,7 +133,9 @@ TH1F* LikelihoodSpace::get_projection(std::string name) {
   int default_nbins = 100;
   gEnv->GetValue("Hist.Binning.1D.x", default_nbins);
   gEnv->SetValue("Hist.Binning.1D.x", 10000);
-  this->samples->Draw((name + ">>_hp").c_str(), "", "goff");
+  TNtuple* nt = estimate_samples();
+  nt->Draw((name + ">>_hp").c_str(),
+           (nt == this->recycled ? "weight" : ""), "goff");
   gEnv->SetValue("Hist.Binning.1D.x", default_nbins);
   TH1F* hp = dynamic_cast<TH1F*>(gDirectory->FindObject("_hp"));
   assert(hp);
@@ -87,69 +149,155 @@ TNtuple* LikelihoodSpace::get_contour(float delta) {
   TNtuple* contour = (TNtuple*) this->samples->Clone("lscontour");
   contour->Reset();
 
-  // Get list of branch names
-  std::vector<std::string> names;
-  for (int i=0; i<this->samples->GetListOfBranches()->GetEntries(); i++) {
-    std::string name = this->samples->GetListOfBranches()->At(i)->GetName();
+  // Copy every branch, in order; recycled samples have the same branches
+  // then a weight, which is dropped
+  TNtuple* nt = estimate_samples();
+  int nbranches = nt->GetListOfBranches()->GetEntries();
+  float* v = new float[nbranches];
+  float* ml_branch = NULL;
+  for (int i=0; i<nbranches; i++) {
+    std::string name = nt->GetListOfBranches()->At(i)->GetName();
+    nt->SetBranchAddress(name.c_str(), &v[i]);
     if (name == "likelihood") {
-      continue;
+      ml_branch = &v[i];
+    }
+  }
+  assert(ml_branch);
+
+  // Build a new TNtuple with samples inside the contour
+  for (int i=0; i<nt->GetEntries(); i++) {
+    nt->GetEntry(i);
+    if (*ml_branch < this->ml + delta) {
+      contour->Fill(v);
     }
-    names.push_back(name);
   }
 
+  nt->ResetBranchAddresses();
+  delete[] v;
+
+  return contour;
+}
+
+
+std::map<std::string, float> LikelihoodSpace::get_split_rhat() {
+  std::vector<std::string> names = get_parameter_names();
+
+  // Group the samples by chain
   float* params_branch = new float[names.size()];
-  for (size_t i=0; i<names.size(); i++) {
-    this->samples->SetBranchAddress(names[i].c_str(), &params_branch[i]);
+  for (size_t j=0; j<names.size(); j++) {
+    this->samples->SetBranchAddress(names[j].c_str(), &params_branch[j]);
   }
 
-  float ml_branch;
-  this->samples->SetBranchAddress("likelihood", &ml_branch);
+  float chain_branch = 0;
+  this->samples->SetBranchAddress("chain", &chain_branch);
 
-  // Build a new TNtuple with samples inside the contour
-  float* v = new float[names.size() + 1];
+  std::map<int, std::vector<float> > chains;
   for (int i=0; i<this->samples->GetEntries(); i++) {
     this->samples->GetEntry(i);
-    if (ml_branch < this->ml + delta) {
-      for (size_t j=0; j<names.size(); j++) {
-        v[j] = params_branch[j];
+    std::vector<float>& chain = chains[(int) chain_branch];
+    chain.insert(chain.end(), params_branch, params_branch + names.size());
+  }
+
+  this->samples->ResetBranchAddresses();
+  delete[] params_branch;
+
+  // Split each chain in half, with halves of equal length n
+  size_t n = 0;
+  std::map<int, std::vector<float> >::iterator it;
+  for (it=chains.begin(); it!=chains.end(); ++it) {
+    size_t half = it->second.size() / names.size() / 2;
+    n = (it == chains.begin() ? half : std::min(n, half));
+  }
+
+  std::map<std::string, float> rhat;
+  if (n < 2) {
+    return rhat;
+  }
+
+  // Gelman et al., Bayesian Data Analysis (3rd ed.), eq. 11.4
+  const size_t m = 2 * chains.size();
+  for (size_t j=0; j<names.size(); j++) {
+    std::vector<double> means;
+    std::vector<double> variances;
+    for (it=chains.begin(); it!=chains.end(); ++it) {
+      const std::vector<float>& chain = it->second;
+      size_t nsamples = chain.size() / names.size();
+      size_t starts[2] = { 0, nsamples - n };
+      for (int h=0; h<2; h++) {
+        double sum = 0;
+        for (size_t k=starts[h]; k<starts[h]+n; k++) {
+          sum += chain[k * names.size() + j];
+        }
+        double mean = sum / n;
+        double ss = 0;
+        for (size_t k=starts[h]; k<starts[h]+n; k++) {
+          double d = chain[k * names.size() + j] - mean;
+          ss += d * d;
+        }
+        means.push_back(mean);
+        variances.push_back(ss / (n - 1));
       }
-      v[names.size()] = ml_branch;
-      contour->Fill(v);
     }
+
+    double grand_mean = 0;
+    double w = 0;
+    for (size_t k=0; k<m; k++) {
+      grand_mean += means[k] / m;
+      w += variances[k] / m;
+    }
+    double b = 0;
+    for (size_t k=0; k<m; k++) {
+      b += (means[k] - grand_mean) * (means[k] - grand_mean) * n / (m - 1);
+    }
+
+    // Constant parameters, e.g. fixed systematics, have nothing to mix
+    if (w <= 0) {
+      continue;
+    }
+
+    double var_plus = (n - 1.0) / n * w + b / n;
+    rhat[names[j]] = sqrt(var_plus / w);
   }
 
-  this->samples->ResetBranchAddresses();
-  delete[] v;
+  return rhat;
+}
 
-  return contour;
+
+void LikelihoodSpace::print_convergence() {
+  std::cout << "-- Convergence (split R-hat) --" << std::endl;
+  std::map<std::string, float> rhat = get_split_rhat();
+  if (rhat.empty()) {
+    std::cout << " Too few samples" << std::endl;
+    return;
+  }
+
+  std::map<std::string, float>::iterator it;
+  for (it=rhat.begin(); it!=rhat.end(); ++it) {
+    std::cout << " " << it->first << ": " << it->second
+              << (it->second > 1.01 ? " (not converged)" : "") << std::endl;
+  }
 }
 
 
 std::map<std::string, Interval>
 LikelihoodSpace::extract_best_fit(float& ml, ErrorType error_type) {
-  // Get list of branch names
-  std::vector<std::string> names;
-  for (int i=0; i<this->samples->GetListOfBranches()->GetEntries(); i++) {
-    std::string name = this->samples->GetListOfBranches()->At(i)->GetName();
-    if (name == "likelihood") {
-      continue;
-    }
-    names.push_back(name);
-  }
+  std::vector<std::string> names = get_parameter_names();
 
-  // Extract likelihood-maximizing parameters
+  // Extract likelihood-maximizing parameters, from every point evaluated
+  // if the rejected proposals were kept
+  TNtuple* nt = estimate_samples();
   float* params_branch = new float[names.size()];
   for (size_t j=0; j<names.size(); j++) {
-    this->samples->SetBranchAddress(names[j].c_str(), &params_branch[j]);
+    nt->SetBranchAddress(names[j].c_str(), &params_branch[j]);
   }
 
   float ml_branch;
-  this->samples->SetBranchAddress("likelihood", &ml_branch);
+  nt->SetBranchAddress("likelihood", &ml_branch);
 
   float* params = new float[names.size()];
   ml = 1e9;
-  for (int j=0; j<this->samples->GetEntries(); j++) {
-    this->samples->GetEntry(j);
+  for (int j=0; j<nt->GetEntries(); j++) {
+    nt->GetEntry(j);
     if (ml_branch < ml) {
       ml = ml_branch;
       for (size_t k=0; k<names.size(); k++) {
@@ -158,7 +306,7 @@ LikelihoodSpace::extract_best_fit(float& ml, ErrorType error_type) {
     }
   }
 
-  this->samples->ResetBranchAddresses();
+  nt->ResetBranchAddresses();
 
   // Extract errors
   ErrorEstimator* error = NULL;
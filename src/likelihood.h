@@ -9,6 +9,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <sxmc/error_estimator.h>
 #include <sxmc/interval.h>
@@ -20,18 +21,28 @@ class TH1F;
  * Samples from a likelihood function.
  *
  * Wraps a TNtuple containing samples from the likelihood function, providing
- * statistics functions.
+ * statistics functions. The "likelihood" column holds the NLL of each sample,
+ * and the "chain" column the index of the chain that drew it.
+ *
+ * A second, optional TNtuple holds waste-recycled samples: every point
+ * evaluated by a Metropolis walk, including rejected proposals, with a
+ * "weight" column (see MCMCOptions::recycle). When it is given, the best
+ * fit, projections, contours and means are estimated from the weighted
+ * points, which carry more information per NLL evaluation than the steps
+ * alone. Correlations and convergence diagnostics always use the steps.
  */
 class LikelihoodSpace {
   public:
     /**
      * Constructor.
      *
-     * Note: The instance takes over ownership of the samples TNtuple!
+     * Note: The instance takes over ownership of the TNtuples!
      *
      * \param samples A set of samples of the likelihood space
+     * \param recycled Weighted samples including rejected proposals, with
+     *                 the columns of samples then "weight", or NULL
      */
-    LikelihoodSpace(TNtuple* samples);
+    LikelihoodSpace(TNtuple* samples, TNtuple* recycled=NULL);
 
     /** Destructor. */
     virtual ~LikelihoodSpace();
@@ -42,9 +53,35 @@ class LikelihoodSpace {
     /** Print the parameters for the maximum-likelihood point. */
     void print_best_fit();
 
+    /**
+     * Get the posterior mean of each parameter.
+     *
+     * \returns A map from parameter names to means
+     */
+    std::map<std::string, double> get_means();
+
+    /** Print the posterior mean of each parameter. */
+    void print_means();
+
     /** Print the correlation matrix for all of the parameters. */
     void print_correlations();
 
+    /**
+     * Get the split-R-hat convergence diagnostic for each parameter.
+     *
+     * Each chain is split into halves, and the variance between the halves
+     * is compared to the variance within them (Gelman et al., 2013). Values
+     * near 1 indicate the chains have mixed; above 1.01 suggests they have
+     * not. Parameters that never change are left out.
+     *
+     * \returns A map from parameter names to R-hat, empty if there are
+     *          too few samples
+     */
+    std::map<std::string, float> get_split_rhat();
+
+    /** Print the split-R-hat convergence diagnostic for each parameter. */
+    void print_convergence();
+
     /**
      * Get a projection.
      *
@@ -78,8 +115,23 @@ class LikelihoodSpace {
      */
     const TNtuple* get_samples() { return samples; }
 
+    /**
+     * Get a pointer to the TNtuple of waste-recycled samples.
+     *
+     * \returns A pointer to the weighted samples, or NULL if there are none
+     */
+    const TNtuple* get_recycled() { return recycled; }
+
+  protected:
+    /** Names of the parameter columns */
+    std::vector<std::string> get_parameter_names();
+
+    /** Samples for the estimates: the recycled ones, if there are any */
+    TNtuple* estimate_samples() { return (recycled ? recycled : samples); }
+
   private:
     TNtuple* samples;  //!< Samples of the likelihood function
+    TNtuple* recycled;  //!< Weighted samples including rejected proposals
     std::map<std::string, Interval> ml_params;  //!< Likelihood-maximizing pars
     float ml;  //!< The maximum likelihood (negative for NLL)
 };
@@ -1,8 +1,12 @@
 #include <iostream>
+#include <sstream>
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include <string>
+#include <cstdio>
 #include <assert.h>
+#include <pthread.h>
 #include <hemi/hemi.h>
 #include <TH1D.h>
 #include <TH1F.h>
@@ -10,50 +14,181 @@
 #include <TF1.h>
 #include <TNtuple.h>
 #include <TRandom.h>
+#include <TRandom3.h>
 #include <TStopwatch.h>
 #include <TDirectory.h>
+#include <TMath.h>
 
 #include <sxmc/mcmc.h>
+#include <sxmc/nll_evaluator.h>
 #include <sxmc/signals.h>
 #include <sxmc/likelihood.h>
+#include <sxmc/utils.h>
 
 #ifndef __HEMI_ARRAY_H__
 #define __HEMI_ARRAY_H__
 #include <hemi/array.h>
 #endif
 
+/**
+ * Factor the Haario (2001) jump covariance of a block of parameters.
+ *
+ * The covariance is 2.4^2/d * C, with C from the running co-moments of the
+ * walk and d the size of the block, plus a little extra on the diagonal to
+ * keep it positive-definite.
+ *
+ * \param comoment Lower triangle of the block's co-moments, nb x nb,
+ *                 row-major
+ * \param n Number of samples in the co-moments
+ * \param nb Number of parameters in the block
+ * \param l Output: Cholesky factor, nb x nb
+ * \returns False, with l unset, if the covariance is singular
+ */
+static bool block_cholesky(const double* comoment, double n, size_t nb,
+                           float* l) {
+  const double sd = 2.4 * 2.4 / nb;
+  std::vector<double> c(nb * nb);
+  for (size_t j=0; j<nb; j++) {
+    for (size_t k=0; k<=j; k++) {
+      double v = sd * comoment[j * nb + k] / (n - 1);
+      c[j * nb + k] = v;
+      c[k * nb + j] = v;
+    }
+    c[j * nb + j] *= 1 + 1e-6;
+  }
+  if (!cholesky(c, nb)) {
+    return false;
+  }
+  std::copy(c.begin(), c.end(), l);
+  return true;
+}
+
+
+/**
+ * Pick out the rows and columns of a block of parameters from a square
+ * matrix over all of them.
+ *
+ * \param m The matrix, np x np, row-major
+ * \param np Number of parameters
+ * \param block Indices of the parameters in the block
+ * \returns The block's nb x nb part of m, row-major
+ */
+static std::vector<double> block_submatrix(const double* m, size_t np,
+                                           const std::vector<size_t>& block) {
+  const size_t nb = block.size();
+  std::vector<double> sub(nb * nb);
+  for (size_t j=0; j<nb; j++) {
+    for (size_t k=0; k<nb; k++) {
+      sub[j * nb + k] = m[block[j] * np + block[k]];
+    }
+  }
+  return sub;
+}
+
+
+/**
+ * Hessian of the NLL by central differences of its gradient.
+ *
+ * Differences are one-sided where a step would cross a bound. The result is
+ * symmetrized.
+ *
+ * \param nll Evaluator for the data set
+ * \param v Scratch buffer for a parameter vector
+ * \param x Point at which to differentiate
+ * \param g Gradient at x
+ * \param free Indices of the parameters to include
+ * \param steps Difference step for each parameter
+ * \param lower Lower bound of each parameter
+ * \param upper Upper bound of each parameter
+ * \param diagonal If true, only find the diagonal
+ * \param hessian Output: the Hessian of the free parameters, row-major
+ */
+static void gradient_hessian(NLLEvaluator& nll, hemi::Array<double>& v,
+                             const std::vector<double>& x,
+                             const std::vector<double>& g,
+                             const std::vector<size_t>& free,
+                             const std::vector<double>& steps,
+                             const double* lower, const double* upper,
+                             const bool diagonal,
+                             std::vector<double>& hessian) {
+  const size_t np = x.size();
+  const size_t nf = free.size();
+  std::vector<double> gp(np);
+  std::vector<double> gm(np);
+  hessian.assign(nf * nf, 0);
+  for (size_t a=0; a<nf; a++) {
+    const size_t j = free[a];
+    const double h = steps[j];
+    double dx = 0;
+    gp = g;
+    gm = g;
+    for (int d=0; d<2; d++) {
+      const double xj = x[j] + (d == 0 ? h : -h);
+      if (xj < lower[j] || xj > upper[j]) {
+        continue;
+      }
+      std::copy(x.begin(), x.end(), v.writeOnlyHostPtr());
+      v.hostPtr()[j] = xj;
+      nll.nll_gradient(&v, (d == 0 ? &gp[0] : &gm[0]));
+      dx += h;
+    }
+    for (size_t b=0; b<nf && dx>0; b++) {
+      if (!diagonal || a == b) {
+        hessian[b * nf + a] = (gp[free[b]] - gm[free[b]]) / dx;
+      }
+    }
+  }
+  for (size_t a=0; a<nf; a++) {
+    for (size_t b=0; b<a; b++) {
+      double hab = 0.5 * (hessian[a * nf + b] + hessian[b * nf + a]);
+      hessian[a * nf + b] = hab;
+      hessian[b * nf + a] = hab;
+    }
+  }
+}
+
+
 MCMC::MCMC(const std::vector<Signal>& signals,
            const std::vector<Systematic>& systematics,
-           const std::vector<Observable>& observables) {
+           const std::vector<Observable>& observables,
+           const MCMCOptions& options) : options(options) {
   this->nsignals = signals.size();
   this->nsystematics = systematics.size();
   this->nobservables = observables.size();
 
-#ifdef __CUDACC__
-  this->nnllblocks = 64;
-  this->nllblocksize = 256;
-#else
-  this->nnllblocks = 1;
-  this->nllblocksize = 1;
-#endif
-  this->nnllthreads = this->nnllblocks * this->nllblocksize;
   this->nreducethreads = 128;
 
   // Set mean/expectation and sigma for all parameters
   this->nparameters = this->nsignals + this->nsystematics;
   this->parameter_means = new hemi::Array<double>(this->nparameters, true);
   this->parameter_sigma = new hemi::Array<double>(this->nparameters, true);
+  this->parameter_lower = new hemi::Array<double>(this->nparameters, true);
+  this->parameter_upper = new hemi::Array<double>(this->nparameters, true);
   for (size_t i=0; i<this->nsignals; i++) {
     this->parameter_means->writeOnlyHostPtr()[i] = signals[i].nexpected;
     this->parameter_sigma->writeOnlyHostPtr()[i] = signals[i].sigma;
+    this->parameter_lower->writeOnlyHostPtr()[i] = 0;
+    this->parameter_upper->writeOnlyHostPtr()[i] = HUGE_VAL;
   }
   for (size_t i=0; i<this->nsystematics; i++) {
     this->parameter_means->writeOnlyHostPtr()[this->nsignals + i] = \
       systematics[i].mean;
     this->parameter_sigma->writeOnlyHostPtr()[this->nsignals + i] = \
       systematics[i].sigma;
+    this->parameter_lower->writeOnlyHostPtr()[this->nsignals + i] = \
+      systematics[i].lower;
+    this->parameter_upper->writeOnlyHostPtr()[this->nsignals + i] = \
+      systematics[i].upper;
   }
 
+  // Fixed systematics stay at their means; rates always float
+  this->parameter_fixed.resize(this->nparameters, false);
+  for (size_t i=0; i<this->nsystematics; i++) {
+    this->parameter_fixed[this->nsignals + i] = systematics[i].fixed;
+  }
+  this->nfree = std::count(this->parameter_fixed.begin(),
+                           this->parameter_fixed.end(), false);
+
   // References to pdfz::Eval histograms
   this->pdfs.resize(this->nsignals);
   for (size_t i=0; i<this->nsignals; i++) {
@@ -69,28 +204,42 @@ MCMC::MCMC(const std::vector<Signal>& signals,
     this->varlist += (systematics[i].name + ":");
     this->parameter_names.push_back(systematics[i].name);
   }
-  this->varlist += "likelihood";
+  this->varlist += "likelihood:chain";
   this->parameter_names.push_back("likelihood");
-
-  this->rngs = new hemi::Array<RNGState>(this->nparameters, true);
-
-  // If compiling device code, initialize the RNGs
-#ifdef __CUDACC__
-  this->rngs->writeOnlyHostPtr();
-  int bs = 128;
-  int nb = this->nparameters / bs + 1;
-  assert(nb < 8);
-  init_device_rngs<<<nb, bs>>>(this->nparameters, 1234, this->rngs->ptr());
-#else
-  this->rngs->writeOnlyHostPtr();
-#endif
 }
 
 
 MCMC::~MCMC() {
   delete parameter_means;
   delete parameter_sigma;
-  delete rngs;
+  delete parameter_lower;
+  delete parameter_upper;
+}
+
+
+bool MCMC::in_bounds(const double* v) const {
+  const double* lower = this->parameter_lower->readOnlyHostPtr();
+  const double* upper = this->parameter_upper->readOnlyHostPtr();
+  for (size_t i=0; i<this->nparameters; i++) {
+    if (!(v[i] >= lower[i] && v[i] <= upper[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool MCMC::in_bounds(const double* v,
+                     const std::vector<size_t>& indices) const {
+  const double* lower = this->parameter_lower->readOnlyHostPtr();
+  const double* upper = this->parameter_upper->readOnlyHostPtr();
+  for (size_t k=0; k<indices.size(); k++) {
+    const size_t i = indices[k];
+    if (!(v[i] >= lower[i] && v[i] <= upper[i])) {
+      return false;
+    }
+  }
+  return true;
 }
 
 
@@ -98,224 +247,2152 @@ LikelihoodSpace*
 MCMC::operator()(std::vector<float>& data, std::vector<int>& weights,
                  unsigned nsteps, float burnin_fraction, const bool debug_mode,
                  unsigned sync_interval) {
-  // CUDA/hemi block sizes
-  int bs = 128;
-  int nb = this->nsignals / bs + 1;
-  assert(nb < 8);
+  const unsigned nchains = this->options.chains;
+  assert(nchains > 0);
+
+  // Shared read-only inputs must be valid on the device before the chains
+  // start, so no thread triggers a transfer
+  this->parameter_means->readOnlyPtr();
+  this->parameter_sigma->readOnlyPtr();
+  this->parameter_lower->readOnlyPtr();
+  this->parameter_upper->readOnlyPtr();
+
+  // Flush often enough that the step buffers stay within a fixed size,
+  // however many parameters there are
+  const size_t max_buffer = 1 << 24;
+  sync_interval = \
+    std::max(std::min(sync_interval,
+                      (unsigned) (max_buffer / (this->nparameters + 2))),
+             1u);
+
+  // The first chain uses the signal pdfs, the rest get private copies
+  std::vector<Chain> chains(nchains);
+  for (unsigned c=0; c<nchains; c++) {
+    chains[c].mcmc = this;
+    chains[c].id = c;
+    for (size_t i=0; i<this->nsignals; i++) {
+      chains[c].pdfs.push_back(c == 0 ? this->pdfs[i] : this->pdfs[i]->Clone());
+    }
+    chains[c].seed = this->options.seed;
+    chains[c].stream = rng_stream(this->options.experiment, c);
+    chains[c].data = &data;
+    chains[c].weights = &weights;
+    chains[c].nsteps = nsteps;
+    chains[c].burnin_steps = nsteps * burnin_fraction;
+    chains[c].debug_mode = debug_mode;
+    chains[c].sync_interval = sync_interval;
+    chains[c].fit = NULL;
+  }
+
+  // Fit once for all the chains that start afresh, before any of them
+  // start; chains resuming from a checkpoint need no fit
+  const bool metropolis = \
+    (this->options.sampler == MCMCOptions::SAMPLER_METROPOLIS &&
+     this->options.replicas <= 1 && this->options.speculation_depth <= 1);
+  bool fresh = false;
+  for (unsigned c=0; c<nchains && !fresh; c++) {
+    fresh = !this->resumable(chains[c]);
+  }
+  FitResult best_fit;
+  if (this->options.seed_from_fit && metropolis && fresh) {
+    best_fit = this->fit(data, weights);
+    for (unsigned c=0; c<nchains; c++) {
+      chains[c].fit = &best_fit;
+    }
+  }
+
+  TStopwatch timer;
+  timer.Start();
+
+  if (nchains == 1) {
+    this->run_chain(chains[0]);
+  }
+  else {
+    std::cout << "MCMC: Running " << nchains << " chains" << std::endl;
+    std::vector<pthread_t> threads(nchains);
+    for (unsigned c=0; c<nchains; c++) {
+      int rc = pthread_create(&threads[c], NULL, MCMC::run_chain_thread,
+                              &chains[c]);
+      if (rc != 0) {
+        std::cerr << "MCMC: Failed to start chain " << c << std::endl;
+        throw(1);
+      }
+    }
+    for (unsigned c=0; c<nchains; c++) {
+      pthread_join(threads[c], NULL);
+    }
+  }
+
+  const double elapsed = timer.RealTime();
+  std::cout << "MCMC: Elapsed time: " << elapsed << std::endl;
+
+  // Effective sample size of each free parameter, summed over the chains
+  const size_t nfields = this->nparameters + 1;
+  for (size_t j=0; j<this->nparameters; j++) {
+    if (this->parameter_fixed[j]) {
+      continue;
+    }
+    double ess = 0;
+    for (unsigned c=0; c<nchains; c++) {
+      ess += effective_sample_size(chains[c].samples, nfields, 0,
+                                   chains[c].samples.size() / nfields, j);
+    }
+    std::cout << "MCMC: Effective sample size: " << this->parameter_names[j]
+              << ": " << ess << " (" << ess / elapsed << "/s)" << std::endl;
+  }
+
+  for (unsigned c=1; c<nchains; c++) {
+    for (size_t i=0; i<this->nsignals; i++) {
+      delete chains[c].pdfs[i];
+    }
+  }
+
+  return this->merge_chains(chains);
+}
 
-  unsigned burnin_steps = nsteps * burnin_fraction;
 
-  // Ntuple to hold likelihood space
+LikelihoodSpace* MCMC::merge_chains(const std::vector<Chain>& chains) const {
+  const size_t nfields = this->nparameters + 1;
+  const unsigned nchains = chains.size();
   TNtuple* nt = new TNtuple("lspace", "Likelihood space",
                             this->varlist.c_str());
 
-  // Buffers for current and proposed parameter vectors
-  hemi::Array<double> current_vector(this->nparameters, true);
-  for (size_t i=0; i<this->nparameters; i++) {
-    current_vector.writeOnlyHostPtr()[i] = \
-      this->parameter_means->readOnlyHostPtr()[i];
+  // With waste recycling, each step and the point not taken there go to a
+  // second ntuple, weighted; points that could not have been taken are
+  // left out
+  TNtuple* recycled = NULL;
+  for (unsigned c=0; c<nchains && !recycled; c++) {
+    if (!chains[c].recycled.empty()) {
+      recycled = new TNtuple("lspace_recycled", "Recycled likelihood space",
+                             (this->varlist + ":weight").c_str());
+    }
+  }
+
+  float* jump_vector = new float[nfields + 2];
+  for (unsigned c=0; c<nchains; c++) {
+    const std::vector<float>& samples = chains[c].samples;
+    const std::vector<float>& others = chains[c].recycled;
+    for (size_t j=0; j<samples.size() / nfields; j++) {
+      for (size_t k=0; k<nfields; k++) {
+        jump_vector[k] = samples[j * nfields + k];
+      }
+      jump_vector[nfields] = c;
+      nt->Fill(jump_vector);
+
+      if (others.empty()) {
+        continue;
+      }
+      const float* other = &others[j * (nfields + 1)];
+      const float w = other[nfields];
+      if (w < 1) {
+        jump_vector[nfields + 1] = 1 - w;
+        recycled->Fill(jump_vector);
+      }
+      if (w > 0) {
+        std::copy(other, other + nfields, jump_vector);
+        jump_vector[nfields + 1] = w;
+        recycled->Fill(jump_vector);
+      }
+    }
+  }
+  delete[] jump_vector;
+
+  return new LikelihoodSpace(nt, recycled);
+}
+
+
+std::string MCMC::checkpoint_path(const Chain& chain) const {
+  if (this->options.checkpoint_file.empty()) {
+    return "";
+  }
+  std::ostringstream ss;
+  ss << this->options.checkpoint_file << "." << this->options.experiment
+     << "." << chain.seed;
+  if (this->options.chains > 1) {
+    ss << "." << chain.id;
+  }
+  return ss.str();
+}
+
+
+bool MCMC::resumable(const Chain& chain) const {
+  const std::string path = this->checkpoint_path(chain);
+  ChainState s;
+  return (!path.empty() && this->options.resume &&
+          read_chain_state(path, s, true) &&
+          s.seed == chain.seed && s.experiment == this->options.experiment &&
+          s.nparameters == this->nparameters && s.nsteps == chain.nsteps &&
+          s.burnin_steps == chain.burnin_steps && s.step < chain.nsteps);
+}
+
+
+FitResult MCMC::fit(std::vector<float>& data, std::vector<int>& weights) {
+  NLLEvaluator* nll = this->new_evaluator(this->pdfs, data, weights);
+  FitResult result;
+  this->find_mode(*nll, result);
+  delete nll;
+  return result;
+}
+
+
+NLLEvaluator* MCMC::new_evaluator(const std::vector<pdfz::Eval*>& pdfs,
+                                  const std::vector<float>& data,
+                                  const std::vector<int>& weights) const {
+  NLLEvaluator* nll = \
+    new NLLEvaluator(pdfs, this->nsystematics, this->nobservables,
+                     this->parameter_means, this->parameter_sigma,
+                     this->parameter_lower, this->parameter_upper,
+                     this->options.lookup_table,
+                     this->options.mc_statistics);
+  nll->fix_parameters(this->parameter_fixed);
+  nll->set_data(data, weights);
+  return nll;
+}
+
+
+void MCMC::find_mode(NLLEvaluator& nll, FitResult& result) {
+  const size_t np = this->nparameters;
+  const size_t memory = 8;  // L-BFGS correction pairs
+  const unsigned max_iterations = 500;
+  const double ftol = 1e-6;  // NLL units
+  const double gtol = 1e-4;  // NLL units per scale width
+  const double* lower = this->parameter_lower->readOnlyHostPtr();
+  const double* upper = this->parameter_upper->readOnlyHostPtr();
+  const double* sigmas = this->parameter_sigma->readOnlyHostPtr();
+
+  std::vector<double> x(this->parameter_means->readOnlyHostPtr(),
+                        this->parameter_means->readOnlyHostPtr() + np);
+  std::vector<size_t> free;
+  for (size_t j=0; j<np; j++) {
+    if (!this->parameter_fixed[j]) {
+      free.push_back(j);
+    }
+  }
+  const size_t nf = free.size();
+
+  hemi::Array<double> v(np, true);
+  hemi::Array<double> v_nll(1, true);
+  std::vector<double> g(np);
+  std::copy(x.begin(), x.end(), v.writeOnlyHostPtr());
+  nll.eval_pdfs(&v);
+  double f = nll.nll_gradient(&v, &g[0]);
+
+  // Work in units of the curvature at the start, or of the constraint (or
+  // Poisson) widths where it is not positive. Histogram PDFs make the NLL
+  // far narrower in some systematics than their constraints.
+  std::vector<double> w(np);
+  std::vector<double> steps(np);
+  for (size_t j=0; j<np; j++) {
+    w[j] = (sigmas[j] > 0 ? sigmas[j] : sqrt(max(x[j], 10.0)));
+    steps[j] = (j < this->nsignals ? 0.1 : 0.2) * w[j];
+  }
+  std::vector<double> hessian;
+  gradient_hessian(nll, v, x, g, free, steps, lower, upper, true, hessian);
+  for (size_t a=0; a<nf; a++) {
+    const double haa = hessian[a * nf + a];
+    if (haa > 0) {
+      w[free[a]] = 1.0 / sqrt(haa);
+    }
+  }
+
+  std::vector<std::vector<double> > s_history;
+  std::vector<std::vector<double> > y_history;
+  std::vector<double> d(np);
+  std::vector<double> xn(np);
+  std::vector<double> gn(np);
+  std::vector<double> alpha(memory);
+  std::vector<bool> active(np);
+  result.converged = false;
+
+  unsigned iteration = 0;
+  for (; iteration<max_iterations; iteration++) {
+    // Parameters held at a bound by the gradient, or fixed, do not move
+    double gmax = 0;
+    for (size_t j=0; j<np; j++) {
+      active[j] = (this->parameter_fixed[j] ||
+                   (x[j] <= lower[j] && g[j] > 0) ||
+                   (x[j] >= upper[j] && g[j] < 0));
+      d[j] = (active[j] ? 0 : -g[j] * w[j]);
+      gmax = std::max(gmax, fabs(d[j]));
+    }
+    if (gmax < gtol) {
+      result.converged = true;
+      break;
+    }
+
+    // Two-loop recursion for the L-BFGS direction, in scaled parameters
+    const size_t nh = s_history.size();
+    for (size_t k=nh; k-->0;) {
+      const std::vector<double>& s = s_history[k];
+      const std::vector<double>& y = y_history[k];
+      double sy = 0;
+      double sd = 0;
+      for (size_t j=0; j<np; j++) {
+        sy += s[j] * y[j];
+        sd += s[j] * d[j];
+      }
+      alpha[k] = sd / sy;
+      for (size_t j=0; j<np; j++) {
+        d[j] -= alpha[k] * y[j];
+      }
+    }
+    if (nh > 0) {
+      const std::vector<double>& s = s_history[nh - 1];
+      const std::vector<double>& y = y_history[nh - 1];
+      double sy = 0;
+      double yy = 0;
+      for (size_t j=0; j<np; j++) {
+        sy += s[j] * y[j];
+        yy += y[j] * y[j];
+      }
+      for (size_t j=0; j<np; j++) {
+        d[j] *= sy / yy;
+      }
+    }
+    for (size_t k=0; k<nh; k++) {
+      const std::vector<double>& s = s_history[k];
+      const std::vector<double>& y = y_history[k];
+      double sy = 0;
+      double yd = 0;
+      for (size_t j=0; j<np; j++) {
+        sy += s[j] * y[j];
+        yd += y[j] * d[j];
+      }
+      for (size_t j=0; j<np; j++) {
+        d[j] += (alpha[k] - yd / sy) * s[j];
+      }
+    }
+
+    // Backtracking line search along the direction, projected onto the
+    // bounds, for sufficient decrease (Armijo)
+    double t = 1;
+    double fn = f;
+    bool moved = false;
+    for (int k=0; k<40 && !moved; k++) {
+      double decrease = 0;
+      for (size_t j=0; j<np; j++) {
+        xn[j] = x[j];
+        if (!active[j]) {
+          xn[j] = std::min(std::max(x[j] + t * d[j] * w[j], lower[j]),
+                           upper[j]);
+        }
+        decrease += g[j] * (xn[j] - x[j]);
+      }
+      std::copy(xn.begin(), xn.end(), v.writeOnlyHostPtr());
+      nll.eval_pdfs(&v);
+      nll.nll(v.readOnlyPtr(), v_nll.writeOnlyPtr());
+      fn = v_nll.readOnlyHostPtr()[0];
+      moved = (fn <= f + 1e-4 * decrease);
+      if (!moved) {
+        t *= 0.5;
+      }
+    }
+    if (!moved) {
+      // Start again from steepest descent, once
+      if (nh == 0) {
+        break;
+      }
+      s_history.clear();
+      y_history.clear();
+      continue;
+    }
+
+    // Keep the correction pair, if it has positive curvature
+    std::copy(xn.begin(), xn.end(), v.writeOnlyHostPtr());
+    fn = nll.nll_gradient(&v, &gn[0]);
+    std::vector<double> s(np);
+    std::vector<double> y(np);
+    double sy = 0;
+    for (size_t j=0; j<np; j++) {
+      s[j] = (xn[j] - x[j]) / w[j];
+      y[j] = (gn[j] - g[j]) * w[j];
+      sy += s[j] * y[j];
+    }
+    if (sy > 1e-10) {
+      s_history.push_back(s);
+      y_history.push_back(y);
+      if (s_history.size() > memory) {
+        s_history.erase(s_history.begin());
+        y_history.erase(y_history.begin());
+      }
+    }
+
+    // Stop when a full step no longer lowers the NLL
+    const double df = f - fn;
+    x = xn;
+    g = gn;
+    f = fn;
+    if (t == 1 && df < ftol) {
+      result.converged = true;
+      iteration++;
+      break;
+    }
+  }
+
+  // Covariance from the inverse Hessian, or from its diagonal if it is not
+  // positive-definite
+  gradient_hessian(nll, v, x, g, free, steps, lower, upper, false, hessian);
+  result.covariance.assign(np * np, 0);
+  std::vector<double> inverse(hessian);
+  result.hessian_ok = invert_spd(inverse, nf);
+  for (size_t a=0; a<nf; a++) {
+    for (size_t b=0; b<nf; b++) {
+      double c = inverse[a * nf + b];
+      if (!result.hessian_ok) {
+        double haa = hessian[a * nf + a];
+        c = (a == b && haa > 0 ? 1.0 / haa : 0);
+      }
+      result.covariance[free[a] * np + free[b]] = c;
+    }
+  }
+
+  std::copy(x.begin(), x.end(), v.writeOnlyHostPtr());
+  nll.eval_pdfs(&v);
+  result.best_fit = x;
+  result.nll = f;
+  result.iterations = iteration;
+
+  std::cout << "MCMC: Fit " << (result.converged ? "converged" : "stopped")
+            << " after " << iteration << " iterations, NLL = " << f
+            << (result.hessian_ok ? "" : " (Hessian not positive-definite)")
+            << std::endl;
+}
+
+
+void* MCMC::run_chain_thread(void* chain) {
+  Chain* c = static_cast<Chain*>(chain);
+  c->mcmc->run_chain(*c);
+  return NULL;
+}
+
+
+void* MCMC::speculate_thread(void* speculation) {
+  Speculation* s = static_cast<Speculation*>(speculation);
+  s->nll->eval_pdfs(s->vector);
+  s->nll->nll(s->vector->readOnlyPtr(), s->result->writeOnlyPtr());
+  s->result->readOnlyHostPtr();
+  return NULL;
+}
+
+
+void MCMC::speculate(std::vector<Speculation>& speculations, double* nlls) {
+  const size_t n = speculations.size();
+  std::vector<pthread_t> threads(n);
+  std::vector<bool> threaded(n, false);
+  for (size_t k=1; k<n; k++) {
+    threaded[k] = \
+      (speculations[k].nll &&
+       pthread_create(&threads[k], NULL, MCMC::speculate_thread,
+                      &speculations[k]) == 0);
+  }
+  for (size_t k=0; k<n; k++) {
+    if (speculations[k].nll && !threaded[k]) {
+      MCMC::speculate_thread(&speculations[k]);
+    }
+  }
+  for (size_t k=0; k<n; k++) {
+    if (threaded[k]) {
+      pthread_join(threads[k], NULL);
+    }
+    nlls[k] = \
+      (speculations[k].nll ? speculations[k].result->readOnlyHostPtr()[0] :
+       1e18);
+  }
+}
+
+
+void MCMC::run_chain(Chain& chain) {
+  std::string label;
+  if (this->options.chains > 1) {
+    std::ostringstream ss;
+    ss << "Chain " << chain.id << ": ";
+    label = ss.str();
+  }
+
+  // A seed for the host generator from this chain's RNG streams
+  RNGState host_stream;
+  rng_init(&host_stream, chain.seed, chain.stream, 0xffffffff);
+  TRandom3 rng(1 + rng_next(&host_stream) % 0xfffffffe);
+
+  // Set up the data and PDFs, and perform initial evaluation
+  hemi::Array<double> means(this->nparameters, true);
+  std::copy(this->parameter_means->readOnlyHostPtr(),
+            this->parameter_means->readOnlyHostPtr() + this->nparameters,
+            means.writeOnlyHostPtr());
+  NLLEvaluator* evaluator = \
+    this->new_evaluator(chain.pdfs, *chain.data, *chain.weights);
+  NLLEvaluator& nll = *evaluator;
+  if (chain.id == 0) {
+    nll.report_lut_error(&means);
+    if (this->options.mc_statistics && !nll.profiles_mc_statistics()) {
+      std::cout << "MCMC: MC statistics are only profiled when the NLL is "
+                << "read from the PDF histograms" << std::endl;
+    }
+  }
+
+  // Checkpoints and recycling are only done in Metropolis walks
+  const bool metropolis = \
+    (this->options.sampler == MCMCOptions::SAMPLER_METROPOLIS &&
+     this->options.replicas <= 1 && this->options.speculation_depth <= 1);
+  if (!this->options.checkpoint_file.empty() && !metropolis &&
+      chain.id == 0) {
+    std::cout << "MCMC: Checkpoints are only written for Metropolis walks"
+              << std::endl;
+  }
+  if (this->options.recycle && !metropolis && chain.id == 0) {
+    std::cout << "MCMC: Rejected proposals are only recycled in Metropolis "
+              << "walks" << std::endl;
+  }
+  nll.eval_pdfs(&means);
+
+  if (this->options.sampler == MCMCOptions::SAMPLER_ENSEMBLE) {
+    this->run_ensemble(chain, nll, &rng);
+  }
+  else if (this->options.sampler == MCMCOptions::SAMPLER_HMC ||
+           this->options.sampler == MCMCOptions::SAMPLER_NUTS) {
+    this->run_hmc(chain, nll, &rng);
+  }
+  else if (this->options.replicas > 1) {
+    this->run_tempering(chain, nll, &rng);
+  }
+  else if (this->options.speculation_depth > 1) {
+    this->run_speculative(chain, nll, &rng);
+  }
+  else {
+    this->run_walk(chain, nll, &rng, label);
+  }
+  delete evaluator;
+}
+
+
+void MCMC::run_walk(Chain& chain, NLLEvaluator& nll, TRandom* rng,
+                    const std::string& label) {
+  Walk walk;
+  this->setup_walk(chain, nll, rng, label, walk);
+  this->start_walk(walk);
+
+  // Perform random walk
+  const BlockLayout& layout = walk.jumps.layout;
+  const std::vector<size_t>& schedule = layout.schedule;
+  for (unsigned i=walk.first_step; i<chain.nsteps; i++) {
+    walk.block = schedule[i % schedule.size()];
+    walk.next_block = schedule[(i + 1) % schedule.size()];
+    walk.save = (chain.debug_mode || i % this->options.thin == 0);
+
+    // Re-tune jump distribution based on burn-in phase
+    if (walk.adapt_phase < 2 && i == walk.phase_end) {
+      this->end_walk_phase(walk, i);
+    }
+
+    // Proposals outside the support are rejected before any evaluation.
+    // Reading the proposal back costs a sync on the GPU, so there it is
+    // only checked ahead of a PDF evaluation. Only the block has moved.
+    const bool systematic_step = \
+      (layout.block_systematic[walk.block] && !nll.pdfs_fixed());
+#ifdef __CUDACC__
+    const bool check_bounds = systematic_step;
+#else
+    const bool check_bounds = true;
+#endif
+
+    if (walk.mtm) {
+      this->mtm_walk_step(walk);
+    }
+    else if (check_bounds &&
+             !this->in_bounds(walk.proposed_vector->readOnlyHostPtr(),
+                              layout.blocks[walk.block])) {
+      this->reject_walk_step(walk);
+    }
+    else if (walk.proposal_evaluator && systematic_step) {
+      this->delayed_walk_step(walk);
+    }
+    else {
+      this->metropolis_walk_step(walk, systematic_step);
+    }
+
+    if (this->flush_walk(walk, i)) {
+      break;
+    }
+  }
+
+  this->finish_walk(walk);
+}
+
+
+void MCMC::setup_walk(Chain& chain, NLLEvaluator& nll, TRandom* rng,
+                      const std::string& label, Walk& walk) {
+  const size_t np = this->nparameters;
+  walk.chain = &chain;
+  walk.label = label;
+  walk.rng = rng;
+  walk.nll = &nll;
+  walk.evaluator = &nll;
+  walk.proposal_evaluator = NULL;
+
+  // Independent RNG streams for this chain, one per parameter
+  walk.rngs = new hemi::Array<RNGState>(np, true);
+  HEMI_KERNEL_LAUNCH(init_rngs, 1, 128, 0, 0,
+                     np, chain.seed, chain.stream, walk.rngs->writeOnlyPtr());
+
+  // Buffers for current and proposed parameter vectors, and their NLLs
+  walk.current_vector = new hemi::Array<double>(np, true);
+  std::copy(this->parameter_means->readOnlyHostPtr(),
+            this->parameter_means->readOnlyHostPtr() + np,
+            walk.current_vector->writeOnlyHostPtr());
+  walk.proposed_vector = new hemi::Array<double>(np, true);
+  walk.proposed_vector->writeOnlyHostPtr();  // Touch to set valid
+  walk.current_nll = new hemi::Array<double>(1, true);
+  walk.current_nll->writeOnlyHostPtr();
+  walk.proposed_nll = new hemi::Array<double>(1, true);
+  walk.proposed_nll->writeOnlyHostPtr();
+
+  // Buffer of jumps, transferred from gpu periodically
+  walk.jump_counter = new hemi::Array<int>(1, true);
+  walk.jump_counter->writeOnlyHostPtr()[0] = 0;
+  walk.accept_counter = new hemi::Array<int>(1, true);
+  walk.accept_counter->writeOnlyHostPtr()[0] = 0;
+  walk.jump_buffer = \
+    new hemi::Array<float>(chain.sync_interval * (np + 1), true);
+
+  // Multiple-try Metropolis evaluates all its trials with the same PDFs
+  walk.mtm = (this->options.proposals > 1);
+  if (walk.mtm && !nll.pdfs_fixed()) {
+    if (chain.id == 0) {
+      std::cout << "MCMC: Multiple-try Metropolis needs fixed PDFs, "
+                << "using one proposal per step" << std::endl;
+    }
+    walk.mtm = false;
+  }
+  const size_t ntrials = (walk.mtm ? this->options.proposals : 1);
+  walk.trials = new hemi::Array<double>(ntrials * np, true);
+  walk.trial_nlls = new hemi::Array<double>(ntrials, true);
+
+  // Proposal blocks: all free parameters together, or the rates and the
+  // systematics apart if the PDFs vary. In component-wise mode, each rate
+  // is a block of its own, updated through the kept mixture sums.
+  walk.component = (this->options.component_updates && !walk.mtm);
+  if (walk.component && nll.profiles_mc_statistics()) {
+    if (chain.id == 0) {
+      std::cout << "MCMC: Component-wise updates do not profile the MC "
+                << "statistics, moving the rates together" << std::endl;
+    }
+    walk.component = false;
+  }
+  walk.blocked = \
+    ((this->options.rate_steps > 0 || walk.component) && !nll.pdfs_fixed());
+  walk.max_block = (walk.mtm ? 0 : this->options.max_block_size);
+  BlockLayout& layout = walk.jumps.layout;
+  this->setup_blocks(walk.component, walk.blocked, walk.max_block, layout);
+  const size_t nblocks = layout.blocks.size();
+
+  // Running mean and co-moments of the walk during adaptation, within
+  // each block for correlated jumps or just the diagonal otherwise. The
+  // jump deciders fold in each block as it moves (see walk_update), so
+  // re-tuning does not read the saved steps.
+  this->setup_jumps(this->options.adapt_covariance && !walk.mtm, walk.jumps);
+  if (chain.id == 0 && walk.component) {
+    std::cout << "MCMC: Component-wise rate updates" << std::endl;
+  }
+  if (chain.id == 0 && walk.blocked) {
+    std::cout << "MCMC: Blocked proposals, " << layout.nrate_steps
+              << " rate steps per systematic step" << std::endl;
+  }
+  if (chain.id == 0 && nblocks > layout.ngroups) {
+    std::cout << "MCMC: Proposals split into " << nblocks << " blocks of "
+              << "at most " << walk.max_block << " parameters" << std::endl;
+  }
+
+  // The block layout on the device
+  walk.block_start = new hemi::Array<int>(nblocks + 1, true);
+  std::copy(layout.block_start.begin(), layout.block_start.end(),
+            walk.block_start->writeOnlyHostPtr());
+  walk.block_params = \
+    new hemi::Array<int>(std::max((size_t) layout.block_start[nblocks],
+                                  (size_t) 1), true);
+  int* bp = walk.block_params->writeOnlyHostPtr();
+  for (size_t b=0; b<nblocks; b++) {
+    std::copy(layout.blocks[b].begin(), layout.blocks[b].end(),
+              bp + layout.block_start[b]);
+  }
+
+  // With MCMCOptions::recycle, the point not taken at each saved step, with
+  // its NLL and weight (see jump_decider)
+  walk.recycle = (this->options.recycle && !walk.mtm);
+  if (this->options.recycle && walk.mtm && chain.id == 0) {
+    std::cout << "MCMC: Multiple-try Metropolis does not recycle rejected "
+              << "proposals" << std::endl;
+  }
+  walk.recycle_buffer = \
+    new hemi::Array<float>((walk.recycle ?
+                            chain.sync_interval * (np + 2) : 1), true);
+
+  // Independent jumps may be reflected at the parameter bounds
+  walk.reflect = this->options.reflect_bounds;
+  walk.normals = new hemi::Array<double>(np, true);
+  walk.normals->writeOnlyHostPtr();
+
+  // Sum of the constraint terms at the current point, which steps update
+  // with only the parameters they move (see finish_nll_jump_pick_combo),
+  // recomputed at every flush and whenever a step bypasses the update
+  walk.constraint = new hemi::Array<double>(1, true);
+  walk.constraint->writeOnlyHostPtr();
+  walk.constraint_current = false;
+
+  // Delayed acceptance screens proposals that move the systematics with
+  // the PDFs at the current point, and evaluates the PDFs only for those
+  // that pass, in a second evaluator. On a move the evaluators trade
+  // places, so the first always holds the PDFs at the current point.
+  if (this->options.delayed_acceptance && !nll.pdfs_fixed() && !walk.mtm) {
+    for (size_t i=0; i<this->nsignals; i++) {
+      walk.proposal_pdfs.push_back(chain.pdfs[i]->Clone());
+    }
+    walk.proposal_evaluator = \
+      this->new_evaluator(walk.proposal_pdfs, *chain.data, *chain.weights);
+    if (chain.id == 0) {
+      std::cout << "MCMC: Delayed acceptance of systematic moves"
+                << std::endl;
+    }
+  }
+  walk.screen_nll = new hemi::Array<double>(1, true);
+  walk.screen_nll->writeOnlyHostPtr();
+  walk.exact_vectors = new hemi::Array<double>(2 * np, true);
+  walk.exact_nlls = new hemi::Array<double>(2, true);
+  walk.nexact = 0;
+
+  // True while the PDFs are evaluated at the current systematics, and
+  // while the kept mixture sums match the current parameters
+  walk.pdfs_current = true;
+  walk.mixture_current = false;
+
+  // Adaptation runs in two phases of at most burnin_steps each. With
+  // MCMCOptions::auto_burnin, a phase ends early once its walk passes
+  // Geweke tests on the NLL and each free parameter, at a combined 5% level.
+  // The tests run at least every min_phase steps of a phase, once it has
+  // that many steps, saved or not.
+  const unsigned burnin_steps = chain.burnin_steps;
+  walk.auto_burnin = this->options.auto_burnin;
+  walk.min_phase = \
+    std::max(std::min(burnin_steps, std::max(500u, burnin_steps / 20)), 1u);
+  walk.tested_fields.clear();
+  for (size_t j=0; j<np; j++) {
+    if (!this->parameter_fixed[j]) {
+      walk.tested_fields.push_back(j);
+    }
+  }
+  walk.tested_fields.push_back(np);
+  walk.z_crit = TMath::NormQuantile(1 - 0.025 / walk.tested_fields.size());
+  walk.adapt_phase = 0;
+  walk.phase_start = 0;
+  walk.phase_end = burnin_steps;
+  walk.phase_first = 0;
+
+  // With MCMCOptions::target_ess, each chain stops once its saved steps
+  // hold its share of the target for every free parameter
+  walk.chain_ess = this->options.target_ess / this->options.chains;
+
+  // Checkpoints of the walk, one file per experiment, seed and chain
+  walk.checkpoint.path = this->checkpoint_path(chain);
+  walk.checkpointing = !walk.checkpoint.path.empty();
+  walk.first_step = 0;
+  walk.last_checkpoint = 0;
+  walk.writing = false;
+}
+
+
+void MCMC::start_walk(Walk& walk) {
+  const Chain& chain = *walk.chain;
+  const size_t np = this->nparameters;
+  const BlockLayout& layout = walk.jumps.layout;
+  const size_t nblocks = layout.blocks.size();
+  NLLEvaluator& nll = *walk.nll;
+
+  // Calculate nll with initial parameters
+  nll.nll(walk.current_vector->readOnlyPtr(),
+          walk.current_nll->writeOnlyPtr());
+
+  // Pick up a checkpoint of this walk, if there is one that fits it
+  const std::string& checkpoint_path = walk.checkpoint.path;
+  ChainState resume_state;
+  bool resumed = \
+    (walk.checkpointing && this->options.resume &&
+     read_chain_state(checkpoint_path, resume_state));
+  if (resumed) {
+    const ChainState& s = resume_state;
+    const size_t nfields = np + 1;
+    resumed = \
+      (s.seed == chain.seed && s.experiment == this->options.experiment &&
+       s.nparameters == np && s.nblocks == nblocks &&
+       s.nsteps == chain.nsteps && s.burnin_steps == chain.burnin_steps &&
+       s.step < chain.nsteps &&
+       s.current_vector.size() == np && s.proposed_vector.size() == np &&
+       s.jump_width.size() == (size_t) layout.block_start[nblocks] &&
+       s.cholesky.size() == layout.square_start[nblocks] &&
+       s.use_cholesky.size() == nblocks &&
+       s.walk_stats.size() == layout.stats_start[nblocks] &&
+       s.rngs.size() == np * sizeof(RNGState) &&
+       s.samples.size() % nfields == 0 &&
+       s.recycled.size() ==
+         (walk.recycle ? s.samples.size() / nfields * (np + 2) : 0));
+    if (!resumed) {
+      std::ostringstream ss;
+      ss << "MCMC: " << walk.label << "Checkpoint " << checkpoint_path
+         << " does not match this walk, starting afresh" << std::endl;
+      std::cout << ss.str() << std::flush;
+    }
+  }
+
+  // Otherwise, start the walk at the best fit. The shared fit is skipped
+  // when every chain looked resumable, so a chain whose checkpoint turns
+  // out not to fit the walk finds the mode itself.
+  const FitResult* fit = chain.fit;
+  FitResult own_fit;
+  if (!resumed && !fit && this->options.seed_from_fit) {
+    this->find_mode(nll, own_fit);
+    fit = &own_fit;
+  }
+  const bool seeded = (fit && !resumed);
+  if (seeded) {
+    std::copy(fit->best_fit.begin(), fit->best_fit.end(),
+              walk.current_vector->writeOnlyHostPtr());
+    nll.eval_pdfs(walk.current_vector);
+    nll.nll(walk.current_vector->readOnlyPtr(),
+            walk.current_nll->writeOnlyPtr());
+
+    // Jump widths from the fit's covariance, where it has any
+    float* jw = walk.jumps.width->hostPtr();
+    for (size_t i=0; i<np; i++) {
+      const int b = layout.parameter_block[i];
+      if (b >= 0 && fit->covariance[i * np + i] > 0) {
+        jw[layout.parameter_slot[i]] = \
+          sqrt(fit->covariance[i * np + i]) * layout.scale_factor[b];
+      }
+    }
+  }
+
+  // Proposals only write the block they move, so the proposed vector
+  // starts out at the current point
+  std::copy(walk.current_vector->readOnlyHostPtr(),
+            walk.current_vector->readOnlyHostPtr() + np,
+            walk.proposed_vector->writeOnlyHostPtr());
+  this->pick_walk_proposal(walk, layout.schedule[0]);
+
+  // When starting at the best fit, jumps are correlated from then on; a
+  // covariance is the co-moments of two samples
+  for (size_t b=0; b<nblocks && seeded && walk.jumps.adapt_covariance; b++) {
+    const std::vector<double> c = \
+      block_submatrix(&fit->covariance[0], np, layout.blocks[b]);
+    walk.jumps.use_cholesky[b] = \
+      block_cholesky(&c[0], 2, layout.blocks[b].size(),
+                     walk.jumps.cholesky->hostPtr() + layout.square_start[b]);
+  }
+
+  // Pick up a checkpointed walk where it left off
+  if (resumed) {
+    this->restore_walk(resume_state, walk);
+    nll.eval_pdfs(walk.current_vector);
+
+    std::ostringstream ss;
+    ss << "MCMC: " << walk.label << "Resuming from " << checkpoint_path
+       << " at step " << walk.first_step << std::endl;
+    std::cout << ss.str() << std::flush;
+  }
+  walk.last_checkpoint = walk.first_step;
+}
+
+
+void MCMC::pick_walk_proposal(Walk& walk, size_t block) {
+  const BlockLayout& layout = walk.jumps.layout;
+  const int start = layout.block_start[block];
+  const bool correlated = walk.jumps.use_cholesky[block];
+  const bool reflect = (walk.reflect && !correlated);
+  HEMI_KERNEL_LAUNCH(pick_new_vector, 1, 64, 0, 0,
+                     walk.rngs->ptr(), layout.blocks[block].size(),
+                     walk.block_params->readOnlyPtr() + start,
+                     walk.jumps.width->readOnlyPtr() + start,
+                     (correlated ?
+                      walk.jumps.cholesky->readOnlyPtr() +
+                        layout.square_start[block] :
+                      NULL),
+                     (reflect ? this->parameter_lower->readOnlyPtr() : NULL),
+                     (reflect ? this->parameter_upper->readOnlyPtr() : NULL),
+                     walk.normals->ptr(), walk.current_vector->readOnlyPtr(),
+                     walk.proposed_vector->writeOnlyPtr());
+}
+
+
+void MCMC::end_walk_phase(Walk& walk, unsigned step) {
+  Chain& chain = *walk.chain;
+  const unsigned nphase = step - walk.phase_start;
+  std::ostringstream ss;
+  this->end_burnin_phase(walk.jumps, walk.current_vector->readOnlyHostPtr(),
+                         nphase, nphase < chain.burnin_steps,
+                         !chain.debug_mode, walk.label, ss);
+  std::cout << ss.str() << std::flush;
+
+  // Save all steps when in debug mode
+  if (!chain.debug_mode) {
+    chain.samples.clear();
+    chain.recycled.clear();
   }
 
-  hemi::Array<double> proposed_vector(this->nparameters, true);
-  proposed_vector.writeOnlyHostPtr();  // Touch to set valid
+  walk.adapt_phase = (chain.burnin_steps > 0 ? walk.adapt_phase + 1 : 2);
+  walk.phase_start = step;
+  walk.phase_end = step + chain.burnin_steps;
+  walk.phase_first = chain.samples.size() / (this->nparameters + 1);
+}
+
+
+void MCMC::metropolis_walk_step(Walk& walk, bool systematic_step) {
+  NLLEvaluator* evaluator = walk.evaluator;
+  const BlockLayout& layout = walk.jumps.layout;
+  const size_t block = walk.block;
+  const size_t next_block = walk.next_block;
+
+  // If systematics are varying, re-evaluate the pdfs. Rate-only steps
+  // reuse them, unless the last systematic step was rejected.
+  if (!evaluator->pdfs_fixed()) {
+    if (systematic_step) {
+      evaluator->eval_pdfs(walk.proposed_vector);
+      walk.mixture_current = false;
+    }
+    else if (!walk.pdfs_current) {
+      evaluator->eval_pdfs(walk.current_vector);
+      walk.pdfs_current = true;
+      walk.mixture_current = false;
+    }
+  }
+  const int naccepted_before = \
+    (systematic_step ? walk.accept_counter->readOnlyHostPtr()[0] : 0);
+
+  // Partial sums of event term, updating the mixture sums if only one
+  // rate moves
+  const bool component_step = \
+    (walk.component && block < layout.nrate_blocks);
+  const size_t k = layout.blocks[block][0];
+  if (component_step) {
+    if (!walk.mixture_current) {
+      evaluator->mixture_sums(walk.current_vector->readOnlyPtr());
+      walk.mixture_current = true;
+    }
+    evaluator->component_sums(k, walk.current_vector->readOnlyPtr(),
+                              walk.proposed_vector->readOnlyPtr());
+  }
+  else {
+    evaluator->event_sums(walk.proposed_vector->readOnlyPtr());
+    walk.mixture_current = false;
+  }
+
+  if (!walk.constraint_current) {
+    HEMI_KERNEL_LAUNCH(nll_constraints, 1, 1, 0, 0,
+                       this->nparameters, walk.current_vector->readOnlyPtr(),
+                       this->nsignals,
+                       this->parameter_means->readOnlyPtr(),
+                       this->parameter_sigma->readOnlyPtr(),
+                       walk.constraint->writeOnlyPtr());
+    walk.constraint_current = true;
+  }
+
+  // Accept/reject the jump, add current position to the buffer, and draw
+  // the next proposal. Adaptation statistics are only kept during burn-in.
+  const bool adapting = (walk.adapt_phase < 2);
+  const bool next_cholesky = walk.jumps.use_cholesky[next_block];
+  const int start = layout.block_start[block];
+  const int next_start = layout.block_start[next_block];
+  HEMI_KERNEL_LAUNCH(finish_nll_jump_pick_combo, 1, this->nreducethreads,
+                     this->nreducethreads * sizeof(double), 0,
+                     evaluator->npartial_sums(),
+                     evaluator->partial_sums(),
+                     this->nsignals,
+                     this->parameter_means->readOnlyPtr(),
+                     this->parameter_sigma->readOnlyPtr(),
+                     this->parameter_lower->readOnlyPtr(),
+                     this->parameter_upper->readOnlyPtr(),
+                     walk.constraint->ptr(),
+                     layout.blocks[block].size(),
+                     walk.block_params->readOnlyPtr() + start,
+                     walk.rngs->ptr(),
+                     walk.current_nll->ptr(),
+                     walk.proposed_nll->ptr(),
+                     walk.current_vector->ptr(),
+                     walk.proposed_vector->ptr(),
+                     walk.accept_counter->ptr(),
+                     walk.jump_counter->ptr(),
+                     walk.jump_buffer->writeOnlyPtr(),
+                     walk.save,
+                     this->nparameters,
+                     layout.blocks[next_block].size(),
+                     walk.block_params->readOnlyPtr() + next_start,
+                     walk.jumps.width->readOnlyPtr() + next_start,
+                     (next_cholesky ?
+                      walk.jumps.cholesky->readOnlyPtr() +
+                        layout.square_start[next_block] :
+                      NULL),
+                     walk.reflect && !next_cholesky,
+                     walk.normals->ptr(),
+                     (adapting ? walk.jumps.walk_stats->ptr() : NULL),
+                     (adapting ?
+                      walk.jumps.walk_stats->ptr() +
+                        layout.stats_start[block] :
+                      NULL),
+                     walk.jumps.adapt_covariance,
+                     (walk.recycle ? walk.recycle_buffer->writeOnlyPtr() :
+                      NULL),
+                     walk.chain->debug_mode);
+
+  if (component_step) {
+    evaluator->commit_component(k, walk.current_vector->readOnlyPtr());
+  }
+
+  // The PDFs stay at the proposed systematics only if they were taken
+  if (systematic_step) {
+    walk.pdfs_current = \
+      (walk.accept_counter->readOnlyHostPtr()[0] > naccepted_before);
+  }
+}
+
+
+void MCMC::reject_walk_step(Walk& walk) {
+  // The PDFs go back to the current point if the last systematic step
+  // left them at a rejected proposal
+  if (!walk.evaluator->pdfs_fixed() && !walk.pdfs_current) {
+    walk.evaluator->eval_pdfs(walk.current_vector);
+    walk.pdfs_current = true;
+    walk.mixture_current = false;
+  }
+
+  // Record the current point again, and draw the next proposal
+  const BlockLayout& layout = walk.jumps.layout;
+  const bool adapting = (walk.adapt_phase < 2);
+  walk.proposed_nll->writeOnlyHostPtr()[0] = 1e18;
+  HEMI_KERNEL_LAUNCH(jump_decider, 1, 1, 0, 0,
+                     walk.rngs->ptr(), walk.current_nll->ptr(),
+                     walk.proposed_nll->readOnlyPtr(),
+                     walk.current_vector->ptr(), walk.proposed_vector->ptr(),
+                     this->nparameters, layout.blocks[walk.block].size(),
+                     walk.block_params->readOnlyPtr() +
+                       layout.block_start[walk.block],
+                     walk.accept_counter->ptr(), walk.jump_counter->ptr(),
+                     walk.jump_buffer->writeOnlyPtr(), walk.save,
+                     (adapting ? walk.jumps.walk_stats->ptr() : NULL),
+                     (adapting ?
+                      walk.jumps.walk_stats->ptr() +
+                        layout.stats_start[walk.block] :
+                      NULL),
+                     walk.jumps.adapt_covariance,
+                     (walk.recycle ? walk.recycle_buffer->writeOnlyPtr() :
+                      NULL));
+  this->pick_walk_proposal(walk, walk.next_block);
+}
+
+
+void MCMC::delayed_walk_step(Walk& walk) {
+  const size_t np = this->nparameters;
+  const bool debug_mode = walk.chain->debug_mode;
+
+  // Screen the proposal with the PDFs at the current point
+  walk.evaluator->nll(walk.proposed_vector->readOnlyPtr(),
+                      walk.screen_nll->writeOnlyPtr());
+  const double log_a = \
+    (walk.current_nll->readOnlyHostPtr()[0] -
+     walk.screen_nll->readOnlyHostPtr()[0]);
+  if (!debug_mode && log(walk.rng->Uniform()) >= log_a) {
+    this->reject_walk_step(walk);
+    return;
+  }
+
+  // Only if it passes, evaluate the PDFs there, and both the proposal's
+  // exact NLL and the current point's NLL under the proposal's PDFs
+  double* v = walk.exact_vectors->writeOnlyHostPtr();
+  std::copy(walk.proposed_vector->readOnlyHostPtr(),
+            walk.proposed_vector->readOnlyHostPtr() + np, v);
+  std::copy(walk.current_vector->readOnlyHostPtr(),
+            walk.current_vector->readOnlyHostPtr() + np, v + np);
+  walk.proposal_evaluator->eval_pdfs(walk.proposed_vector);
+  walk.proposal_evaluator->nll_batch(walk.exact_vectors->readOnlyPtr(), 2,
+                                     walk.exact_nlls->writeOnlyPtr());
+  walk.nexact++;
+  const int naccepted_before = walk.accept_counter->readOnlyHostPtr()[0];
+
+  // Decide the step, and draw the next proposal
+  const BlockLayout& layout = walk.jumps.layout;
+  const bool adapting = (walk.adapt_phase < 2);
+  HEMI_KERNEL_LAUNCH(delayed_jump_decider, 1, 1, 0, 0,
+                     walk.rngs->ptr(), walk.current_nll->ptr(),
+                     walk.screen_nll->readOnlyPtr(),
+                     walk.exact_nlls->readOnlyPtr(),
+                     walk.current_vector->ptr(), walk.proposed_vector->ptr(),
+                     np, layout.blocks[walk.block].size(),
+                     walk.block_params->readOnlyPtr() +
+                       layout.block_start[walk.block],
+                     walk.accept_counter->ptr(), walk.jump_counter->ptr(),
+                     walk.jump_buffer->writeOnlyPtr(), walk.save,
+                     (adapting ? walk.jumps.walk_stats->ptr() : NULL),
+                     (adapting ?
+                      walk.jumps.walk_stats->ptr() +
+                        layout.stats_start[walk.block] :
+                      NULL),
+                     walk.jumps.adapt_covariance,
+                     (walk.recycle ? walk.recycle_buffer->writeOnlyPtr() :
+                      NULL),
+                     debug_mode);
+  this->pick_walk_proposal(walk, walk.next_block);
+
+  // The evaluator with the PDFs at an accepted proposal takes over
+  if (walk.accept_counter->readOnlyHostPtr()[0] > naccepted_before) {
+    std::swap(walk.evaluator, walk.proposal_evaluator);
+    walk.mixture_current = false;
+    walk.constraint_current = false;
+  }
+}
+
+
+void MCMC::mtm_walk_step(Walk& walk) {
+  const size_t np = this->nparameters;
+  const BlockLayout& layout = walk.jumps.layout;
+
+  // Trials are drawn in all dimensions, with zero width if fixed
+  std::vector<float> widths(np, 0);
+  for (size_t j=0; j<np; j++) {
+    if (layout.parameter_block[j] >= 0) {
+      widths[j] = \
+        walk.jumps.width->readOnlyHostPtr()[layout.parameter_slot[j]];
+    }
+  }
+  bool accepted = this->mtm_step(*walk.evaluator, *walk.current_vector,
+                                 *walk.current_nll, *walk.trials,
+                                 *walk.trial_nlls, &widths[0], walk.rng,
+                                 walk.chain->debug_mode);
+
+  // Add current position to the buffer
+  if (walk.save) {
+    int count = walk.jump_counter->hostPtr()[0];
+    float* jump = walk.jump_buffer->hostPtr() + count * (np + 1);
+    for (size_t j=0; j<np; j++) {
+      jump[j] = walk.current_vector->readOnlyHostPtr()[j];
+    }
+    jump[np] = walk.current_nll->readOnlyHostPtr()[0];
+    walk.jump_counter->hostPtr()[0] = count + 1;
+  }
+  walk.accept_counter->hostPtr()[0] += (accepted ? 1 : 0);
+
+  // The one block moves with every trial, so it is folded in each step
+  if (walk.adapt_phase < 2) {
+    double* stats = walk.jumps.walk_stats->hostPtr();
+    stats[0] += 1;
+    walk_update(walk.current_vector->readOnlyHostPtr(),
+                layout.blocks[walk.block].size(),
+                walk.block_params->readOnlyHostPtr() +
+                  layout.block_start[walk.block],
+                stats[0], stats + layout.stats_start[walk.block], false);
+  }
+}
+
+
+bool MCMC::flush_walk(Walk& walk, unsigned step) {
+  Chain& chain = *walk.chain;
+  const unsigned i = step;
+  const size_t np = this->nparameters;
+  const size_t nfields = np + 1;
+  const size_t min_ess_steps = 1000;
+
+  // Flush the jump buffer periodically, and before each re-tuning or
+  // stationarity test
+  const bool adapting = (walk.adapt_phase < 2);
+  if (!(i % chain.sync_interval == 0 || i == chain.nsteps - 1 ||
+        (adapting && i == walk.phase_end - 1) ||
+        (walk.auto_burnin && adapting &&
+         (i - walk.phase_start) % walk.min_phase == walk.min_phase - 1))) {
+    return false;
+  }
+  this->flush_steps(walk.label, i, chain.nsteps, *walk.jump_counter,
+                    *walk.accept_counter, *walk.jump_buffer,
+                    (walk.recycle ? walk.recycle_buffer : NULL),
+                    (walk.proposal_evaluator ? &walk.nexact : NULL),
+                    chain.samples, chain.recycled);
+
+  // End the adaptation phase early once the walk looks stationary
+  const std::vector<float>& samples = chain.samples;
+  const std::vector<size_t>& tested_fields = walk.tested_fields;
+  const size_t nphase = samples.size() / nfields - walk.phase_first;
+  if (walk.auto_burnin && adapting && i + 1 < walk.phase_end &&
+      i + 1 - walk.phase_start >= walk.min_phase && nphase >= 100) {
+    bool stationary = true;
+    for (size_t k=0; k<tested_fields.size() && stationary; k++) {
+      double z = geweke_z(samples, nfields, walk.phase_first, nphase,
+                          tested_fields[k]);
+      stationary = (fabs(z) < walk.z_crit);
+    }
+    if (stationary) {
+      walk.phase_end = i + 1;
+    }
+  }
+
+  // Stop early once the sample is large enough
+  bool done = false;
+  if (walk.chain_ess > 0 && walk.adapt_phase == 2 &&
+      i + 1 - walk.phase_start >= min_ess_steps) {
+    double min_ess = HUGE_VAL;
+    for (size_t k=0; k<tested_fields.size(); k++) {
+      if (tested_fields[k] < np) {
+        min_ess = std::min(min_ess,
+                           effective_sample_size(samples, nfields,
+                                                 walk.phase_first, nphase,
+                                                 tested_fields[k]));
+      }
+    }
+    if (min_ess >= walk.chain_ess) {
+      std::ostringstream ss;
+      ss << "MCMC: " << walk.label << "Reached effective sample size "
+         << min_ess << " after " << i + 1 << " steps" << std::endl;
+      std::cout << ss.str() << std::flush;
+      done = true;
+    }
+  }
+
+  // Recompute the mixture sums and the constraint terms now and then,
+  // so rounding errors in the updates do not build up
+  walk.mixture_current = false;
+  walk.constraint_current = false;
+
+  if (walk.checkpointing && !done && i + 1 < chain.nsteps &&
+      i + 1 - walk.last_checkpoint >= this->options.checkpoint_interval) {
+    this->checkpoint_walk(walk, i + 1);
+  }
+
+  return done;
+}
+
+
+void MCMC::checkpoint_walk(Walk& walk, unsigned step) {
+  if (walk.writing) {
+    pthread_join(walk.checkpoint_thread, NULL);
+  }
+  ChainState& s = walk.checkpoint.state;
+  s.host_seed = 1 + walk.rng->Integer(0xfffffffe);
+  walk.rng->SetSeed(s.host_seed);
+  this->snapshot_walk(walk, step, s);
+  walk.writing = \
+    write_chain_state_async(walk.checkpoint, walk.checkpoint_thread);
+  walk.last_checkpoint = step;
+}
+
+
+void MCMC::snapshot_walk(const Walk& walk, unsigned step,
+                         ChainState& s) const {
+  const Chain& chain = *walk.chain;
+  const BlockLayout& layout = walk.jumps.layout;
+  const size_t np = this->nparameters;
+  const size_t nblocks = layout.blocks.size();
+  s.seed = chain.seed;
+  s.experiment = this->options.experiment;
+  s.nparameters = np;
+  s.nblocks = nblocks;
+  s.nsteps = chain.nsteps;
+  s.burnin_steps = chain.burnin_steps;
+  s.step = step;
+  s.adapt_phase = walk.adapt_phase;
+  s.phase_start = walk.phase_start;
+  s.phase_end = walk.phase_end;
+  s.phase_first = walk.phase_first;
+  s.current_nll = walk.current_nll->readOnlyHostPtr()[0];
+  s.current_vector.assign(walk.current_vector->readOnlyHostPtr(),
+                          walk.current_vector->readOnlyHostPtr() + np);
+  s.proposed_vector.assign(walk.proposed_vector->readOnlyHostPtr(),
+                           walk.proposed_vector->readOnlyHostPtr() + np);
+  s.jump_width.assign(walk.jumps.width->readOnlyHostPtr(),
+                      walk.jumps.width->readOnlyHostPtr() +
+                        layout.block_start[nblocks]);
+  s.cholesky.assign(walk.jumps.cholesky->readOnlyHostPtr(),
+                    walk.jumps.cholesky->readOnlyHostPtr() +
+                      layout.square_start[nblocks]);
+  s.use_cholesky.assign(walk.jumps.use_cholesky.begin(),
+                        walk.jumps.use_cholesky.end());
+  s.walk_stats.assign(walk.jumps.walk_stats->readOnlyHostPtr(),
+                      walk.jumps.walk_stats->readOnlyHostPtr() +
+                        layout.stats_start[nblocks]);
+  const char* r = reinterpret_cast<const char*>(walk.rngs->readOnlyHostPtr());
+  s.rngs.assign(r, r + np * sizeof(RNGState));
+  s.samples = chain.samples;
+  s.recycled = chain.recycled;
+}
+
+
+void MCMC::restore_walk(const ChainState& s, Walk& walk) const {
+  walk.first_step = s.step;
+  walk.adapt_phase = s.adapt_phase;
+  walk.phase_start = s.phase_start;
+  walk.phase_end = s.phase_end;
+  walk.phase_first = s.phase_first;
+  walk.rng->SetSeed(s.host_seed);
+  walk.current_nll->writeOnlyHostPtr()[0] = s.current_nll;
+  std::copy(s.current_vector.begin(), s.current_vector.end(),
+            walk.current_vector->writeOnlyHostPtr());
+  std::copy(s.proposed_vector.begin(), s.proposed_vector.end(),
+            walk.proposed_vector->writeOnlyHostPtr());
+  std::copy(s.jump_width.begin(), s.jump_width.end(),
+            walk.jumps.width->writeOnlyHostPtr());
+  std::copy(s.cholesky.begin(), s.cholesky.end(),
+            walk.jumps.cholesky->writeOnlyHostPtr());
+  for (size_t b=0; b<s.use_cholesky.size(); b++) {
+    walk.jumps.use_cholesky[b] = (s.use_cholesky[b] != 0);
+  }
+  std::copy(s.walk_stats.begin(), s.walk_stats.end(),
+            walk.jumps.walk_stats->writeOnlyHostPtr());
+  std::copy(s.rngs.begin(), s.rngs.end(),
+            reinterpret_cast<char*>(walk.rngs->writeOnlyHostPtr()));
+  walk.chain->samples = s.samples;
+  walk.chain->recycled = s.recycled;
+}
+
+
+void MCMC::finish_walk(Walk& walk) {
+  // A finished chain has nothing to resume
+  if (walk.writing) {
+    pthread_join(walk.checkpoint_thread, NULL);
+  }
+  if (walk.checkpointing) {
+    remove(walk.checkpoint.path.c_str());
+  }
+
+  if (walk.proposal_evaluator) {
+    delete (walk.evaluator == walk.nll ? walk.proposal_evaluator :
+            walk.evaluator);
+    for (size_t i=0; i<walk.proposal_pdfs.size(); i++) {
+      delete walk.proposal_pdfs[i];
+    }
+  }
+
+  release_jumps(walk.jumps);
+  delete walk.block_start;
+  delete walk.block_params;
+  delete walk.rngs;
+  delete walk.current_vector;
+  delete walk.proposed_vector;
+  delete walk.current_nll;
+  delete walk.proposed_nll;
+  delete walk.constraint;
+  delete walk.normals;
+  delete walk.trials;
+  delete walk.trial_nlls;
+  delete walk.screen_nll;
+  delete walk.exact_vectors;
+  delete walk.exact_nlls;
+  delete walk.jump_counter;
+  delete walk.accept_counter;
+  delete walk.jump_buffer;
+  delete walk.recycle_buffer;
+}
+
+
+void MCMC::setup_blocks(bool component, bool blocked, size_t max_block,
+                        BlockLayout& layout) const {
+  const size_t np = this->nparameters;
+  const size_t nrate_blocks = (component ? this->nsignals : 1);
+  std::vector<std::vector<size_t> > groups(nrate_blocks + (blocked ? 1 : 0));
+  for (size_t j=0; j<np; j++) {
+    if (this->parameter_fixed[j]) {
+      continue;
+    }
+    if (j < this->nsignals) {
+      groups[component ? j : 0].push_back(j);
+    }
+    else {
+      groups[blocked ? nrate_blocks : 0].push_back(j);
+    }
+  }
+  layout.ngroups = groups.size();
+  layout.nrate_blocks = nrate_blocks;
+
+  // Group moved at each step of a cycle: rate groups in turn, then the
+  // systematics. Component-wise, a cycle sweeps all the rates by default.
+  std::vector<size_t> group_schedule;
+  unsigned nrate_steps = nrate_blocks;
+  if (blocked && this->options.rate_steps > 0) {
+    nrate_steps = this->options.rate_steps;
+  }
+  for (unsigned r=0; r<nrate_steps; r++) {
+    group_schedule.push_back(r % nrate_blocks);
+  }
+  if (blocked) {
+    group_schedule.push_back(nrate_blocks);
+  }
+  layout.nrate_steps = nrate_steps;
+
+  // Each group is one proposal block, unless it is larger than max_block.
+  // Then it is split into blocks of rates and blocks of systematics, moved
+  // one after another in its place in the cycle, so steps that move only
+  // rates reuse the PDFs.
+  std::vector<std::vector<size_t> >& blocks = layout.blocks;
+  std::vector<std::vector<size_t> > group_blocks(groups.size());
+  blocks.clear();
+  for (size_t g=0; g<groups.size(); g++) {
+    const std::vector<size_t>& group = groups[g];
+    if (max_block == 0 || group.size() <= max_block) {
+      group_blocks[g].push_back(blocks.size());
+      blocks.push_back(group);
+      continue;
+    }
+    for (int rates=1; rates>=0; rates--) {
+      std::vector<size_t> block;
+      for (size_t k=0; k<group.size(); k++) {
+        if ((group[k] < this->nsignals) != (rates == 1)) {
+          continue;
+        }
+        block.push_back(group[k]);
+        if (block.size() == max_block) {
+          group_blocks[g].push_back(blocks.size());
+          blocks.push_back(block);
+          block.clear();
+        }
+      }
+      if (!block.empty()) {
+        group_blocks[g].push_back(blocks.size());
+        blocks.push_back(block);
+      }
+    }
+  }
+  const size_t nblocks = blocks.size();
+  layout.schedule.clear();
+  for (size_t s=0; s<group_schedule.size(); s++) {
+    const std::vector<size_t>& gb = group_blocks[group_schedule[s]];
+    layout.schedule.insert(layout.schedule.end(), gb.begin(), gb.end());
+  }
 
-  // Buffer for normalizations after application of systematics
-  hemi::Array<unsigned> normalizations(this->nsignals, true);
-  normalizations.writeOnlyHostPtr();
+  // Blocks that move systematics, which need the PDFs evaluated
+  layout.block_systematic.assign(nblocks, false);
+  for (size_t b=0; b<nblocks; b++) {
+    for (size_t k=0; k<blocks[b].size(); k++) {
+      layout.block_systematic[b] = \
+        (layout.block_systematic[b] || blocks[b][k] >= this->nsignals);
+    }
+  }
 
-  // Buffers for nll values at current and proposed parameter vectors
-  hemi::Array<double> current_nll(1, true);
-  current_nll.writeOnlyHostPtr();
+  // Slots of the parameters and squares of the blocks on the device
+  layout.parameter_block.assign(np, -1);
+  layout.parameter_slot.assign(np, 0);
+  layout.block_start.assign(nblocks + 1, 0);
+  layout.square_start.assign(nblocks + 1, 0);
+  layout.stats_start.assign(nblocks + 1, 1);
+  layout.scale_factor.resize(nblocks);
+  for (size_t b=0; b<nblocks; b++) {
+    const size_t nb = blocks[b].size();
+    for (size_t k=0; k<nb; k++) {
+      layout.parameter_block[blocks[b][k]] = b;
+      layout.parameter_slot[blocks[b][k]] = layout.block_start[b] + k;
+    }
+    layout.block_start[b + 1] = layout.block_start[b] + nb;
+    layout.square_start[b + 1] = layout.square_start[b] + nb * nb;
+    layout.stats_start[b + 1] = layout.stats_start[b] + 1 + nb + nb * nb;
+    layout.scale_factor[b] = 2.4 * 2.4 / nb;  // Haario, 2001
+  }
+}
 
-  hemi::Array<double> proposed_nll(1, true);
-  proposed_nll.writeOnlyHostPtr();
 
-  // Create hemi buffer for weighting data points
-  hemi::Array<int> dataweights(data.size(), true);
-  dataweights.copyFromHost(&weights.front(), weights.size());
+void MCMC::setup_jumps(bool adapt_covariance, Jumps& jumps) const {
+  const BlockLayout& layout = jumps.layout;
+  const size_t nblocks = layout.blocks.size();
+  const size_t nblock_params = layout.block_start[nblocks];
+  const size_t nsquares = layout.square_start[nblocks];
+  const size_t nwalk_stats = layout.stats_start[nblocks];
+  jumps.adapt_covariance = adapt_covariance;
 
-  // Initial standard deviations for each dimension
-  hemi::Array<float> jump_width(this->nparameters, true);
-  const float scale_factor = 2.4 * 2.4 / this->nparameters;  // Haario, 2001
+  // Initial standard deviations for each dimension in each block
+  jumps.width = \
+    new hemi::Array<float>(std::max(nblock_params, (size_t) 1), true);
+  float* jw = jumps.width->writeOnlyHostPtr();
   for (size_t i=0; i<this->nparameters; i++) {
     float mean = max(this->parameter_means->readOnlyHostPtr()[i], 10.0);
     float sigma = this->parameter_sigma->readOnlyHostPtr()[i];
     float width = (sigma > 0 ? sigma : sqrt(mean));
-    jump_width.writeOnlyHostPtr()[i] = 0.1 * width * scale_factor;
+    int b = layout.parameter_block[i];
+    if (b >= 0) {
+      jw[layout.parameter_slot[i]] = 0.1 * width * layout.scale_factor[b];
+    }
   }
 
-  // Buffers for computing event term in nll
-  hemi::Array<double> event_partial_sums(this->nnllthreads, true);
-  event_partial_sums.writeOnlyHostPtr();
+  // Cholesky factor of the jump covariance in each block, once it is known
+  jumps.cholesky = new hemi::Array<float>(std::max(nsquares, (size_t) 1),
+                                          true);
+  jumps.cholesky->writeOnlyHostPtr();
+  jumps.use_cholesky.assign(nblocks, false);
 
-  hemi::Array<double> event_total_sum(1, true);    
-  event_total_sum.writeOnlyHostPtr();
+  jumps.walk_stats = new hemi::Array<double>(nwalk_stats, true);
+  std::fill(jumps.walk_stats->writeOnlyHostPtr(),
+            jumps.walk_stats->writeOnlyHostPtr() + nwalk_stats, 0);
+}
 
-  // Buffer of jumps, transferred from gpu periodically
-  hemi::Array<int> jump_counter(1, true);
-  jump_counter.writeOnlyHostPtr()[0] = 0;
 
-  hemi::Array<int> accept_counter(1, true);
+void MCMC::release_jumps(Jumps& jumps) {
+  delete jumps.width;
+  delete jumps.cholesky;
+  delete jumps.walk_stats;
+  jumps.width = NULL;
+  jumps.cholesky = NULL;
+  jumps.walk_stats = NULL;
+}
+
+
+void MCMC::retune_jumps(Jumps& jumps, const double* current,
+                        const std::string& label, std::ostream& log) const {
+  const BlockLayout& layout = jumps.layout;
+  const size_t nblocks = layout.blocks.size();
+  const bool adapt_covariance = jumps.adapt_covariance;
+  double* walk_stats = jumps.walk_stats->hostPtr();
+  const double walk_n = walk_stats[0];
+
+  // Each block's point since it last moved is still to be folded in
+  for (size_t b=0; b<nblocks; b++) {
+    const std::vector<int> block(layout.blocks[b].begin(),
+                                 layout.blocks[b].end());
+    if (block.empty()) {
+      continue;
+    }
+    walk_update(current, block.size(), &block[0], walk_n,
+                walk_stats + layout.stats_start[b], adapt_covariance);
+  }
+
+  // Rescale jumps in each dimension based on RMS during burn-in
+  for (size_t j=0; j<this->nparameters && walk_n > 0; j++) {
+    int b = layout.parameter_block[j];
+    if (b < 0) {
+      continue;
+    }
+    const size_t nb = layout.blocks[b].size();
+    const size_t slot = layout.parameter_slot[j];
+    const size_t k = slot - layout.block_start[b];
+    const double* comoment = walk_stats + layout.stats_start[b] + 1 + nb;
+    double fit_width = sqrt(comoment[k * nb + k] / walk_n);
+
+    log << "MCMC: " << label << "Rescaling jump sigma: "
+        << this->parameter_names[j] << ": "
+        << jumps.width->readOnlyHostPtr()[slot] << " -> ";
+
+    jumps.width->hostPtr()[slot] = layout.scale_factor[b] * fit_width;
+
+    log << jumps.width->readOnlyHostPtr()[slot] << std::endl;
+  }
+
+  // Correlated jumps within each block
+  size_t ncorrelated = 0;
+  for (size_t b=0; b<nblocks && adapt_covariance && walk_n > 1; b++) {
+    const size_t nb = layout.blocks[b].size();
+    jumps.use_cholesky[b] = \
+      block_cholesky(walk_stats + layout.stats_start[b] + 1 + nb, walk_n, nb,
+                     jumps.cholesky->hostPtr() + layout.square_start[b]);
+    ncorrelated += (jumps.use_cholesky[b] ? 1 : 0);
+  }
+  if (adapt_covariance && walk_n > 1 && ncorrelated == nblocks) {
+    log << "MCMC: " << label << "Using correlated jumps" << std::endl;
+  }
+  else if (adapt_covariance && walk_n > 1) {
+    log << "MCMC: " << label << "Jump covariance is singular in "
+        << nblocks - ncorrelated << " of " << nblocks << " blocks, "
+        << "using independent jumps there" << std::endl;
+  }
+}
+
+
+void MCMC::end_burnin_phase(Jumps& jumps, const double* current,
+                            unsigned nsteps, bool stationary, bool reset,
+                            const std::string& label,
+                            std::ostream& log) const {
+  log << "MCMC: " << label << "Burn-in phase completed after " << nsteps
+      << " steps";
+  if (stationary) {
+    log << ", walk is stationary";
+  }
+  log << std::endl;
+
+  this->retune_jumps(jumps, current, label, log);
+
+  if (reset) {
+    const size_t n = jumps.layout.stats_start[jumps.layout.blocks.size()];
+    std::fill(jumps.walk_stats->writeOnlyHostPtr(),
+              jumps.walk_stats->writeOnlyHostPtr() + n, 0);
+  }
+}
+
+
+void MCMC::flush_steps(const std::string& label, unsigned step,
+                       unsigned nsteps, hemi::Array<int>& jump_counter,
+                       hemi::Array<int>& accept_counter,
+                       hemi::Array<float>& jump_buffer,
+                       hemi::Array<float>* recycle_buffer, unsigned* nexact,
+                       std::vector<float>& samples,
+                       std::vector<float>& recycled) const {
+  int njumps = jump_counter.readOnlyHostPtr()[0];
+  int naccepted = accept_counter.readOnlyHostPtr()[0];
+  std::ostringstream ss;
+  ss << "MCMC: " << label << "Step " << step << "/" << nsteps
+     << " (" << njumps << " in buffer, "
+     << naccepted << " accepted";
+  if (nexact) {
+    ss << ", " << *nexact << " exact evaluations";
+    *nexact = 0;
+  }
+  ss << ")" << std::endl;
+  std::cout << ss.str() << std::flush;
+
+  const float* jumps = jump_buffer.readOnlyHostPtr();
+  samples.insert(samples.end(), jumps,
+                 jumps + njumps * (this->nparameters + 1));
+  if (recycle_buffer) {
+    const float* others = recycle_buffer->readOnlyHostPtr();
+    recycled.insert(recycled.end(), others,
+                    others + njumps * (this->nparameters + 2));
+  }
+
+  jump_counter.writeOnlyHostPtr()[0] = 0;
   accept_counter.writeOnlyHostPtr()[0] = 0;
+}
 
-  hemi::Array<float> jump_buffer(sync_interval * (this->nparameters + 1),
-                                 true);
 
-  float* jump_vector = new float[this->nparameters + 1];
+void MCMC::run_ensemble(Chain& chain, NLLEvaluator& nll, TRandom* rng) {
+  const size_t np = this->nparameters;
+  const size_t nfields = np + 1;
+  const double a = 2.0;  // Stretch scale, Goodman & Weare (2010)
 
-  // Set up histogram and perform initial evaluation
-  size_t nevents = data.size() / this->nobservables;
-  hemi::Array<float> lut(nevents * this->nsignals, true);
-  for (size_t i=0; i<this->pdfs.size(); i++) {
-    pdfz::Eval* p = this->pdfs[i];
-    p->SetEvalPoints(data);
-    p->SetPDFValueBuffer(&lut, i * nevents, 1);
-    p->SetNormalizationBuffer(&normalizations, i);
-    p->SetParameterBuffer(&current_vector, this->nsignals);
-    p->EvalAsync();
-    p->EvalFinished();
-    p->SetParameterBuffer(&proposed_vector, this->nsignals);
+  size_t nwalkers = this->options.walkers;
+  if (nwalkers == 0) {
+    nwalkers = 2 * np + 2;
   }
+  nwalkers += nwalkers % 2;
+  const size_t nhalf = nwalkers / 2;
 
-  // Calculate nll with initial parameters
-  nll(lut.readOnlyPtr(), dataweights.readOnlyPtr(), nevents,
-      current_vector.readOnlyPtr(), current_nll.writeOnlyPtr(),
-      event_partial_sums.ptr(), event_total_sum.ptr());
+  const unsigned nsweeps = std::max(chain.nsteps / nwalkers, (size_t) 1);
+  const unsigned burnin_sweeps = \
+    nsweeps * ((double) chain.burnin_steps / chain.nsteps);
+  const unsigned sync_sweeps = \
+    std::max(chain.sync_interval / nwalkers, (size_t) 1);
 
-  HEMI_KERNEL_LAUNCH(pick_new_vector, 1, 64, 0, 0,
-                     this->nparameters, this->rngs->ptr(),
-                     jump_width.readOnlyPtr(),
-                     current_vector.readOnlyPtr(),
-                     proposed_vector.writeOnlyPtr());
+  std::string label;
+  if (this->options.chains > 1) {
+    std::ostringstream ss;
+    ss << "Chain " << chain.id << ": ";
+    label = ss.str();
+  }
+  if (chain.id == 0) {
+    std::cout << "MCMC: Ensemble of " << nwalkers << " walkers, "
+              << nsweeps << " sweeps" << std::endl;
+  }
 
-  // Perform random walk
-  TStopwatch timer;
-  timer.Start();
-  for (unsigned i=0; i<nsteps; i++) {
-    // If systematics are varying, re-evaluate the pdfs
-    // At some point, need to look for ways of doing this less often
-    if (this->nsystematics > 0) {
-      for (size_t i=0; i<this->pdfs.size(); i++) {
-        pdfs[i]->EvalAsync();
-      }
-      for (size_t i=0; i<this->pdfs.size(); i++) {
-        pdfs[i]->EvalFinished();
+  // Start the walkers in a small ball around the parameter means
+  std::vector<double> walkers(nwalkers * np);
+  std::vector<double> walker_nlls(nwalkers);
+  hemi::Array<double> trials(nhalf * np, true);
+  hemi::Array<double> trial_nlls(nhalf, true);
+
+  // If the PDFs vary, each walker in a half is evaluated with its own
+  // evaluator and PDFs, side by side; the first uses the chain's
+  const bool fixed = nll.pdfs_fixed();
+  std::vector<hemi::Array<double>*> vectors(nhalf, NULL);
+  std::vector<hemi::Array<double>*> results(nhalf, NULL);
+  std::vector<NLLEvaluator*> evaluators(nhalf, &nll);
+  std::vector<std::vector<pdfz::Eval*> > walker_pdfs(nhalf);
+  std::vector<Speculation> speculations(nhalf);
+  for (size_t k=0; k<nhalf && !fixed; k++) {
+    vectors[k] = new hemi::Array<double>(np, true);
+    results[k] = new hemi::Array<double>(1, true);
+    speculations[k].vector = vectors[k];
+    speculations[k].result = results[k];
+    if (k == 0) {
+      continue;
+    }
+    for (size_t i=0; i<this->nsignals; i++) {
+      walker_pdfs[k].push_back(chain.pdfs[i]->Clone());
+    }
+    evaluators[k] = this->new_evaluator(walker_pdfs[k], *chain.data,
+                                        *chain.weights);
+  }
+
+  for (size_t k=0; k<nwalkers; k++) {
+    for (size_t j=0; j<np; j++) {
+      double mean = this->parameter_means->readOnlyHostPtr()[j];
+      double sigma = this->parameter_sigma->readOnlyHostPtr()[j];
+      double width = (sigma > 0 ? sigma : sqrt(max(mean, 10.0)));
+      walkers[k * np + j] = mean;
+      if (!this->parameter_fixed[j]) {
+        walkers[k * np + j] += 0.1 * width * rng->Gaus();
       }
     }
+  }
 
-    // Re-tune jump distribution based on burn-in phase
-    if (i == burnin_steps || i == 2 * burnin_steps) {
-      std::cout << "MCMC: Burn-in phase completed after " << burnin_steps
-                << " steps" << std::endl;
+  // Evaluate one set of parameter vectors, in batches if the PDFs are fixed
+  for (size_t h=0; h<2; h++) {
+    double* t = trials.writeOnlyHostPtr();
+    std::copy(walkers.begin() + h * nhalf * np,
+              walkers.begin() + (h + 1) * nhalf * np, t);
+    if (fixed) {
+      nll.nll_batch(trials.readOnlyPtr(), nhalf, trial_nlls.writeOnlyPtr());
+    }
+    else {
+      for (size_t k=0; k<nhalf; k++) {
+        std::copy(t + k * np, t + (k + 1) * np, vectors[k]->writeOnlyHostPtr());
+        speculations[k].nll = evaluators[k];
+      }
+      MCMC::speculate(speculations, trial_nlls.writeOnlyHostPtr());
+    }
+    std::copy(trial_nlls.readOnlyHostPtr(),
+              trial_nlls.readOnlyHostPtr() + nhalf,
+              walker_nlls.begin() + h * nhalf);
+  }
 
-      // Rescale jumps in each dimension based on RMS during burn-in
-      for (size_t j=0; j<this->nparameters; j++) {
-        std::string name = this->parameter_names[j];
-        nt->Draw((name + ">>hsproj").c_str());
-        TH1F* hsproj = (TH1F*) gDirectory->Get("hsproj");
+  std::vector<float>& samples = chain.samples;
+  unsigned naccepted = 0;
 
-        double fit_width = hsproj->GetRMS();
+  for (unsigned i=0; i<nsweeps; i++) {
+    for (size_t h=0; h<2; h++) {
+      const size_t first = h * nhalf;
+      const size_t other = (1 - h) * nhalf;
 
-        std::cout << "MCMC: Rescaling jump sigma: " << name << ": "
-                  << jump_width.readOnlyHostPtr()[j] << " -> ";
+      // Stretch each walker in this half toward one in the other half,
+      // with z drawn from g(z) ~ 1/sqrt(z) on [1/a, a]
+      std::vector<double> z(nhalf);
+      double* t = trials.writeOnlyHostPtr();
+      for (size_t k=0; k<nhalf; k++) {
+        const double* x = &walkers[(first + k) * np];
+        const double* c = &walkers[(other + rng->Integer(nhalf)) * np];
+        double u = (a - 1) * rng->Uniform() + 1;
+        z[k] = u * u / a;
+        for (size_t j=0; j<np; j++) {
+          t[k * np + j] = c[j] + z[k] * (x[j] - c[j]);
+        }
+      }
 
-        jump_width.writeOnlyHostPtr()[j] = scale_factor * fit_width;
+      // Evaluate the whole half at once
+      if (fixed) {
+        nll.nll_batch(trials.readOnlyPtr(), nhalf,
+                      trial_nlls.writeOnlyPtr());
+      }
+      else {
+        // Walkers moved out of bounds are rejected without evaluating
+        for (size_t k=0; k<nhalf; k++) {
+          const double* tk = trials.readOnlyHostPtr() + k * np;
+          speculations[k].nll = NULL;
+          if (this->in_bounds(tk)) {
+            std::copy(tk, tk + np, vectors[k]->writeOnlyHostPtr());
+            speculations[k].nll = evaluators[k];
+          }
+        }
+        MCMC::speculate(speculations, trial_nlls.writeOnlyHostPtr());
+      }
 
-        std::cout << jump_width.readOnlyHostPtr()[j] << std::endl;
+      // Accept with probability min(1, z^(d-1) L(y) / L(x)); fixed
+      // parameters are the same in every walker, so d counts free ones
+      const double* tn = trial_nlls.readOnlyHostPtr();
+      const double* tv = trials.readOnlyHostPtr();
+      for (size_t k=0; k<nhalf; k++) {
+        double log_r = \
+          (this->nfree - 1.0) * log(z[k]) + walker_nlls[first + k] - tn[k];
+        if (chain.debug_mode || log(rng->Uniform()) < log_r) {
+          std::copy(tv + k * np, tv + (k + 1) * np,
+                    walkers.begin() + (first + k) * np);
+          walker_nlls[first + k] = tn[k];
+          naccepted++;
+        }
+      }
+    }
 
-        hsproj->Delete();
+    // Save every walker after burn-in
+    if (i >= burnin_sweeps || chain.debug_mode) {
+      for (size_t k=0; k<nwalkers; k++) {
+        samples.insert(samples.end(), walkers.begin() + k * np,
+                       walkers.begin() + (k + 1) * np);
+        samples.push_back(walker_nlls[k]);
       }
-      // Save all steps when in debug mode
-      if (!debug_mode) {
-        nt->Reset();
+    }
+
+    if (i % sync_sweeps == 0 || i == nsweeps - 1) {
+      std::ostringstream ss;
+      ss << "MCMC: " << label << "Step " << i * nwalkers << "/"
+         << nsweeps * nwalkers << " (" << samples.size() / nfields
+         << " saved, " << naccepted << " accepted)" << std::endl;
+      std::cout << ss.str() << std::flush;
+      naccepted = 0;
+    }
+  }
+
+  for (size_t k=0; k<nhalf; k++) {
+    delete vectors[k];
+    delete results[k];
+    if (k > 0 && !fixed) {
+      delete evaluators[k];
+      for (size_t i=0; i<walker_pdfs[k].size(); i++) {
+        delete walker_pdfs[k][i];
       }
     }
+  }
+}
 
-    // Partial sums of event term
-    HEMI_KERNEL_LAUNCH(nll_event_chunks, this->nnllblocks,
-                       this->nllblocksize, 0, 0,
-                       lut.readOnlyPtr(), dataweights.readOnlyPtr(),
-                       proposed_vector.readOnlyPtr(),
-                       nevents, this->nsignals,
-                       event_partial_sums.ptr());
 
-    // Accept/reject the jump, add current position to the buffer
-    HEMI_KERNEL_LAUNCH(finish_nll_jump_pick_combo, 1, this->nreducethreads,
-                       this->nreducethreads * sizeof(double), 0,
-                       this->nnllthreads,
-                       event_partial_sums.ptr(),
-                       this->nsignals, 
-                       this->parameter_means->readOnlyPtr(),
-                       this->parameter_sigma->readOnlyPtr(),
-                       this->rngs->ptr(),
-                       current_nll.ptr(),
-                       proposed_nll.ptr(),
-                       current_vector.ptr(),
-                       proposed_vector.ptr(),
-                       accept_counter.ptr(),
-                       jump_counter.ptr(),
-                       jump_buffer.writeOnlyPtr(),
-                       this->nparameters,
-                       jump_width.readOnlyPtr(),
-                       debug_mode);
-
-    // Flush the jump buffer periodically
-    if (i % sync_interval == 0 || i == nsteps - 1 || i == burnin_steps - 1) {
-      int njumps = jump_counter.readOnlyHostPtr()[0];
-      int naccepted = accept_counter.readOnlyHostPtr()[0];
-      std::cout << "MCMC: Step " << i << "/" << nsteps
-                << " (" << njumps << " in buffer, "
-                << naccepted << " accepted)" << std::endl;
-      for (int j=0; j<njumps; j++) {
-         // First nsignals elements are normalizations
-         for (unsigned k=0; k<this->nparameters; k++) {
-           int idx = j * (this->nparameters + 1) + k;
-           jump_vector[k] = jump_buffer.readOnlyHostPtr()[idx];
-         }
-         // Last element is the likelihood
-         jump_vector[this->nparameters] = \
-           jump_buffer.readOnlyHostPtr()[j * (this->nparameters + 1) +
-                                         this->nparameters];
-
-         nt->Fill(jump_vector);
-      }
-
-      // Reset counters
-      jump_counter.writeOnlyHostPtr()[0] = 0;
-      accept_counter.writeOnlyHostPtr()[0] = 0;
-    }
-  }
-
-  std::cout << "MCMC: Elapsed time: " << timer.RealTime() << std::endl;
-
-
-  LikelihoodSpace* lspace = new LikelihoodSpace(nt);
+double MCMC::hamiltonian(const PhasePoint& z,
+                         const std::vector<double>& inv_metric) {
+  // nll_total flags out-of-bounds rates with a huge NLL
+  if (!(z.nll < 1e17)) {
+    return HUGE_VAL;
+  }
+  double k = 0;
+  for (size_t j=0; j<z.p.size(); j++) {
+    k += inv_metric[j] * z.p[j] * z.p[j];
+  }
+  return z.nll + 0.5 * k;
+}
 
-  delete[] jump_vector;
 
-  return lspace;
+bool MCMC::no_uturn(const PhasePoint& minus, const PhasePoint& plus,
+                    const std::vector<double>& inv_metric) {
+  double dot_minus = 0;
+  double dot_plus = 0;
+  for (size_t j=0; j<minus.q.size(); j++) {
+    double dq = plus.q[j] - minus.q[j];
+    dot_minus += dq * inv_metric[j] * minus.p[j];
+    dot_plus += dq * inv_metric[j] * plus.p[j];
+  }
+  return dot_minus >= 0 && dot_plus >= 0;
 }
 
 
-void MCMC::nll(const float* lut, const int* dataweights, size_t nevents,
-               const double* v, double* nll, double* event_partial_sums,
-               double* event_total_sum) {
-  // Partial sums of event term
-  HEMI_KERNEL_LAUNCH(nll_event_chunks,
-                     this->nnllblocks, this->nllblocksize, 0, 0,
-                     lut, dataweights, v, nevents, this->nsignals,
-                     event_partial_sums);
+void MCMC::hmc_evaluate(NLLEvaluator& nll, hemi::Array<double>& scratch,
+                        PhasePoint& z) {
+  // Out of bounds, the trajectory diverges without an evaluation
+  if (!this->in_bounds(&z.q[0])) {
+    z.nll = 1e18;
+    std::fill(z.grad.begin(), z.grad.end(), 0);
+    return;
+  }
+  std::copy(z.q.begin(), z.q.end(), scratch.writeOnlyHostPtr());
+  z.nll = nll.nll_gradient(&scratch, &z.grad[0]);
+}
 
-  // Total of event term
-  HEMI_KERNEL_LAUNCH(nll_event_reduce, 1, this->nreducethreads,  
-                     this->nreducethreads * sizeof(double), 0,
-                     this->nnllthreads, event_partial_sums, event_total_sum);
 
-  // Constraints + event term
-  HEMI_KERNEL_LAUNCH(nll_total, 1, 1, 0, 0,
-                     this->nparameters, v, this->nsignals,
-                     this->parameter_means->readOnlyPtr(),
-                     this->parameter_sigma->readOnlyPtr(),
-                     event_total_sum, nll);
+void MCMC::leapfrog(NLLEvaluator& nll, hemi::Array<double>& scratch,
+                    const std::vector<double>& inv_metric, double epsilon,
+                    PhasePoint& z) {
+  const size_t np = z.q.size();
+  for (size_t j=0; j<np; j++) {
+    z.p[j] -= 0.5 * epsilon * z.grad[j];
+  }
+  for (size_t j=0; j<np; j++) {
+    z.q[j] += epsilon * inv_metric[j] * z.p[j];
+  }
+  this->hmc_evaluate(nll, scratch, z);
+  for (size_t j=0; j<np; j++) {
+    z.p[j] -= 0.5 * epsilon * z.grad[j];
+  }
 }
 
+
+void MCMC::build_tree(NLLEvaluator& nll, hemi::Array<double>& scratch,
+                      const std::vector<double>& inv_metric,
+                      const PhasePoint& z, double log_u, int direction,
+                      unsigned depth, double epsilon, double h0,
+                      TRandom* rng, NUTSTree& tree) {
+  const double max_energy_error = 1000;  // Divergence threshold
+
+  // Base case: one leapfrog step
+  if (depth == 0) {
+    PhasePoint z1 = z;
+    this->leapfrog(nll, scratch, inv_metric, direction * epsilon, z1);
+    double h = hamiltonian(z1, inv_metric);
+    tree.minus = z1;
+    tree.plus = z1;
+    tree.proposal = z1;
+    tree.n = (log_u <= -h ? 1 : 0);
+    tree.s = (log_u < max_energy_error - h);
+    tree.alpha = (h < HUGE_VAL ? std::min(1.0, exp(h0 - h)) : 0);
+    tree.nalpha = 1;
+    return;
+  }
+
+  // Recursion: two subtrees of half the depth, extending the same end
+  this->build_tree(nll, scratch, inv_metric, z, log_u, direction, depth - 1,
+                   epsilon, h0, rng, tree);
+  if (!tree.s) {
+    return;
+  }
+
+  NUTSTree tree2;
+  const PhasePoint& end = (direction < 0 ? tree.minus : tree.plus);
+  this->build_tree(nll, scratch, inv_metric, end, log_u, direction,
+                   depth - 1, epsilon, h0, rng, tree2);
+  if (direction < 0) {
+    tree.minus = tree2.minus;
+  }
+  else {
+    tree.plus = tree2.plus;
+  }
+
+  if (tree.n + tree2.n > 0 &&
+      rng->Uniform() * (tree.n + tree2.n) < tree2.n) {
+    tree.proposal = tree2.proposal;
+  }
+  tree.alpha += tree2.alpha;
+  tree.nalpha += tree2.nalpha;
+  tree.s = tree2.s && no_uturn(tree.minus, tree.plus, inv_metric);
+  tree.n += tree2.n;
+}
+
+
+void MCMC::run_hmc(Chain& chain, NLLEvaluator& nll, TRandom* rng) {
+  const size_t np = this->nparameters;
+  const bool nuts = (this->options.sampler == MCMCOptions::SAMPLER_NUTS);
+  const unsigned max_tree_depth = 10;
+  const double target_accept = 0.8;
+
+  std::string label;
+  if (this->options.chains > 1) {
+    std::ostringstream ss;
+    ss << "Chain " << chain.id << ": ";
+    label = ss.str();
+  }
+
+  // Start at the parameter means, with a mass matrix from the expected
+  // width of each parameter. Fixed parameters get no momentum.
+  hemi::Array<double> scratch(np, true);
+  PhasePoint z;
+  z.q.resize(np);
+  z.p.resize(np);
+  z.grad.resize(np);
+  std::vector<double> inv_metric(np);
+  for (size_t j=0; j<np; j++) {
+    double mean = this->parameter_means->readOnlyHostPtr()[j];
+    double sigma = this->parameter_sigma->readOnlyHostPtr()[j];
+    double width = (sigma > 0 ? sigma : sqrt(max(mean, 10.0)));
+    z.q[j] = mean;
+    inv_metric[j] = (this->parameter_fixed[j] ? 0 : width * width);
+  }
+  this->hmc_evaluate(nll, scratch, z);
+
+  // Dual averaging of the step size (Hoffman & Gelman, 2014, sec. 3.2)
+  double epsilon = 1.0 / sqrt((double) this->nfree);
+  double mu = log(10 * epsilon);
+  double h_bar = 0;
+  double log_epsilon_bar = 0;
+  unsigned m = 0;
+
+  // Mass matrix estimate, from the second quarter of burn-in
+  std::vector<double> q_sum(np, 0);
+  std::vector<double> q_sum2(np, 0);
+  unsigned nq = 0;
+
+  std::vector<float>& samples = chain.samples;
+  const unsigned burnin_steps = chain.burnin_steps;
+  double accept_sum = 0;
+  unsigned naccept_stats = 0;
+  unsigned nleapfrog = 0;
+
+  for (unsigned i=0; i<chain.nsteps; i++) {
+    // Switch to the estimated mass matrix, and restart step size tuning
+    if (i == burnin_steps / 2 && nq > 1) {
+      std::ostringstream ss;
+      for (size_t j=0; j<np; j++) {
+        if (this->parameter_fixed[j]) {
+          continue;
+        }
+        double mean = q_sum[j] / nq;
+        double var = (q_sum2[j] - nq * mean * mean) / (nq - 1);
+        if (var > 0) {
+          inv_metric[j] = var;
+        }
+        ss << "MCMC: " << label << "Mass matrix: "
+           << this->parameter_names[j] << ": " << sqrt(inv_metric[j])
+           << std::endl;
+      }
+      std::cout << ss.str() << std::flush;
+      mu = log(10 * epsilon);
+      h_bar = 0;
+      log_epsilon_bar = 0;
+      m = 0;
+    }
+    if (i == burnin_steps) {
+      if (m > 0) {
+        epsilon = exp(log_epsilon_bar);
+      }
+      std::ostringstream ss;
+      ss << "MCMC: " << label << "Burn-in phase completed after "
+         << burnin_steps << " steps, step size " << epsilon << std::endl;
+      std::cout << ss.str() << std::flush;
+    }
+
+    // Fresh momentum, p ~ N(0, M)
+    for (size_t j=0; j<np; j++) {
+      z.p[j] = \
+        (inv_metric[j] > 0 ? rng->Gaus(0, 1.0 / sqrt(inv_metric[j])) : 0);
+    }
+    const double h0 = hamiltonian(z, inv_metric);
+
+    double accept_stat = 0;
+    if (nuts) {
+      // Slice variable u ~ U(0, exp(-H0))
+      const double log_u = log(rng->Uniform()) - h0;
+      PhasePoint minus = z;
+      PhasePoint plus = z;
+      double n = 1;
+      bool s = true;
+      unsigned depth = 0;
+      double alpha = 0;
+      unsigned nalpha = 0;
+      while (s && depth < max_tree_depth) {
+        int direction = (rng->Uniform() < 0.5 ? -1 : 1);
+        NUTSTree tree;
+        if (direction < 0) {
+          this->build_tree(nll, scratch, inv_metric, minus, log_u, direction,
+                           depth, epsilon, h0, rng, tree);
+          minus = tree.minus;
+        }
+        else {
+          this->build_tree(nll, scratch, inv_metric, plus, log_u, direction,
+                           depth, epsilon, h0, rng, tree);
+          plus = tree.plus;
+        }
+        if (tree.s && rng->Uniform() * n < tree.n) {
+          z = tree.proposal;
+        }
+        n += tree.n;
+        s = tree.s && no_uturn(minus, plus, inv_metric);
+        alpha += tree.alpha;
+        nalpha += tree.nalpha;
+        nleapfrog += tree.nalpha;
+        depth++;
+      }
+      accept_stat = alpha / nalpha;
+      if (chain.debug_mode) {
+        z = plus;
+      }
+    }
+    else {
+      PhasePoint z1 = z;
+      for (unsigned k=0; k<this->options.leapfrog_steps; k++) {
+        this->leapfrog(nll, scratch, inv_metric, epsilon, z1);
+        if (!(z1.nll < 1e17)) {
+          break;
+        }
+      }
+      nleapfrog += this->options.leapfrog_steps;
+      double h1 = hamiltonian(z1, inv_metric);
+      accept_stat = (h1 < HUGE_VAL ? std::min(1.0, exp(h0 - h1)) : 0);
+      if (chain.debug_mode || rng->Uniform() < accept_stat) {
+        z = z1;
+      }
+    }
+    accept_sum += accept_stat;
+    naccept_stats++;
+
+    // Tune the step size during burn-in
+    if (i < burnin_steps) {
+      m++;
+      const double t0 = 10;
+      const double gamma = 0.05;
+      const double kappa = 0.75;
+      h_bar = (1 - 1.0 / (m + t0)) * h_bar +
+              (target_accept - accept_stat) / (m + t0);
+      double log_epsilon = mu - sqrt((double) m) / gamma * h_bar;
+      double w = pow((double) m, -kappa);
+      log_epsilon_bar = w * log_epsilon + (1 - w) * log_epsilon_bar;
+      epsilon = exp(log_epsilon);
+
+      if (i >= burnin_steps / 4 && i < burnin_steps / 2) {
+        for (size_t j=0; j<np; j++) {
+          q_sum[j] += z.q[j];
+          q_sum2[j] += z.q[j] * z.q[j];
+        }
+        nq++;
+      }
+    }
+
+    // Save the end of each trajectory after burn-in
+    if (i >= burnin_steps || chain.debug_mode) {
+      samples.insert(samples.end(), z.q.begin(), z.q.end());
+      samples.push_back(z.nll);
+    }
+
+    if (i % chain.sync_interval == 0 || i == chain.nsteps - 1) {
+      std::ostringstream ss;
+      ss << "MCMC: " << label << "Step " << i << "/" << chain.nsteps
+         << " (" << samples.size() / (np + 1) << " saved, acceptance "
+         << accept_sum / naccept_stats << ", step size "
+         << epsilon << ", " << nleapfrog << " leapfrog steps)" << std::endl;
+      std::cout << ss.str() << std::flush;
+      accept_sum = 0;
+      naccept_stats = 0;
+      nleapfrog = 0;
+    }
+  }
+}
+
+
+bool MCMC::mtm_step(NLLEvaluator& nll, hemi::Array<double>& current_vector,
+                    hemi::Array<double>& current_nll,
+                    hemi::Array<double>& trials,
+                    hemi::Array<double>& trial_nlls,
+                    const float* jump_width, TRandom* rng,
+                    const bool debug_mode) {
+  const size_t ntrials = this->options.proposals;
+  const size_t np = this->nparameters;
+  std::vector<double> x(current_vector.readOnlyHostPtr(),
+                        current_vector.readOnlyHostPtr() + np);
+  const double nll_x = current_nll.readOnlyHostPtr()[0];
+
+  // Trials around the current point, reflected at the bounds if asked
+  const bool reflect = this->options.reflect_bounds;
+  const double* lower = this->parameter_lower->readOnlyHostPtr();
+  const double* upper = this->parameter_upper->readOnlyHostPtr();
+  double* t = trials.writeOnlyHostPtr();
+  for (size_t i=0; i<ntrials; i++) {
+    for (size_t j=0; j<np; j++) {
+      t[i * np + j] = rng->Gaus(x[j], jump_width[j]);
+      if (reflect) {
+        t[i * np + j] = reflect_into(t[i * np + j], lower[j], upper[j]);
+      }
+    }
+  }
+  nll.nll_batch(trials.readOnlyPtr(), ntrials, trial_nlls.writeOnlyPtr());
+  std::vector<double> nll_y(trial_nlls.readOnlyHostPtr(),
+                            trial_nlls.readOnlyHostPtr() + ntrials);
+
+  // Pick one trial with probability proportional to its likelihood
+  const double nll_min = *std::min_element(nll_y.begin(), nll_y.end());
+  std::vector<double> w_y(ntrials);
+  double sum_y = 0;
+  for (size_t i=0; i<ntrials; i++) {
+    w_y[i] = exp(nll_min - nll_y[i]);
+    sum_y += w_y[i];
+  }
+  size_t pick = 0;
+  double u = rng->Uniform(sum_y);
+  while (pick < ntrials - 1 && u > w_y[pick]) {
+    u -= w_y[pick];
+    pick++;
+  }
+  std::vector<double> y(trials.readOnlyHostPtr() + pick * np,
+                        trials.readOnlyHostPtr() + (pick + 1) * np);
+
+  // Reference points around the pick, with the current point as the last
+  t = trials.writeOnlyHostPtr();
+  for (size_t i=0; i<ntrials-1; i++) {
+    for (size_t j=0; j<np; j++) {
+      t[i * np + j] = rng->Gaus(y[j], jump_width[j]);
+      if (reflect) {
+        t[i * np + j] = reflect_into(t[i * np + j], lower[j], upper[j]);
+      }
+    }
+  }
+  nll.nll_batch(trials.readOnlyPtr(), ntrials - 1, trial_nlls.writeOnlyPtr());
+  double sum_x = exp(nll_min - nll_x);
+  for (size_t i=0; i<ntrials-1; i++) {
+    sum_x += exp(nll_min - trial_nlls.readOnlyHostPtr()[i]);
+  }
+
+  // Generalized Metropolis acceptance, min(1, sum_y / sum_x)
+  if (!debug_mode && rng->Uniform() * sum_x > sum_y) {
+    return false;
+  }
+
+  double* v = current_vector.writeOnlyHostPtr();
+  for (size_t j=0; j<np; j++) {
+    v[j] = y[j];
+  }
+  current_nll.writeOnlyHostPtr()[0] = nll_y[pick];
+
+  return true;
+}
@@ -10,31 +10,185 @@
 #include <vector>
 #include <cmath>
 #include <string>
+#include <iosfwd>
+#include <pthread.h>
 #include <cuda.h>
 #include <hemi/hemi.h>
 
 #include <sxmc/signals.h>
+#include <sxmc/checkpoint.h>
 #include <sxmc/nll_kernels.h>
+#include <sxmc/nll_evaluator.h>
 #include <sxmc/pdfz.h>
 
-#ifdef __CUDACC__
-#include <curand_kernel.h>
-#endif
-
 #ifndef __HEMI_ARRAY_H__
 #define __HEMI_ARRAY_H__
 #include <hemi/array.h>
 #endif
 
 class TNtuple;
+class TRandom;
 class LikelihoodSpace;
 
+/**
+ * \struct MCMCOptions
+ * \brief Settings controlling how the MCMC samples and evaluates the NLL
+ */
+struct MCMCOptions {
+  /** Algorithm used to draw samples */
+  enum Sampler {
+    SAMPLER_METROPOLIS,  //!< random-walk Metropolis, tuned during burn-in
+    SAMPLER_ENSEMBLE,  //!< affine-invariant stretch-move ensemble
+    SAMPLER_HMC,  //!< Hamiltonian Monte Carlo, fixed trajectory length
+    SAMPLER_NUTS,  //!< No-U-Turn sampler
+  };
+
+  MCMCOptions()
+      : lookup_table(NLLEvaluator::LUT_AUTO), proposals(1), chains(1),
+        sampler(SAMPLER_METROPOLIS), walkers(0), leapfrog_steps(16),
+        adapt_covariance(true), rate_steps(0), component_updates(false),
+        reflect_bounds(false), speculation_depth(0),
+        delayed_acceptance(false), replicas(0), max_temperature(10),
+        swap_interval(10), seed_from_fit(false), auto_burnin(false),
+        target_ess(0), checkpoint_interval(100000), resume(false),
+        seed(1234), experiment(0), recycle(false), max_block_size(0),
+        thin(1), mc_statistics(false) {}
+
+  NLLEvaluator::LookupTable lookup_table;  //!< storage of pdf values
+  unsigned proposals;  //!< trials per step, > 1 for multiple-try Metropolis
+  unsigned chains;  //!< independent chains, each run on its own thread
+  Sampler sampler;  //!< sampling algorithm
+  unsigned walkers;  //!< walkers per ensemble, even; 0 for automatic
+  unsigned leapfrog_steps;  //!< leapfrog steps per HMC trajectory
+  bool adapt_covariance;  //!< correlated Metropolis jumps after burn-in
+  unsigned rate_steps;  //!< rate-only Metropolis steps per systematic step,
+                        //!< 0 to propose all parameters together
+  bool component_updates;  //!< Metropolis steps move one rate at a time
+  bool reflect_bounds;  //!< reflect independent jumps at parameter bounds
+  unsigned speculation_depth;  //!< Metropolis steps decided per round of
+                               //!< speculative evaluation, 0 or 1 for none
+  bool delayed_acceptance;  //!< screen systematic moves before evaluating
+                            //!< the PDFs
+  unsigned replicas;  //!< tempered replicas, 0 or 1 for no tempering
+  double max_temperature;  //!< temperature of the hottest replica
+  unsigned swap_interval;  //!< steps between replica exchanges
+  bool seed_from_fit;  //!< start Metropolis at the best fit, with jumps from
+                       //!< the covariance there
+  bool auto_burnin;  //!< end each Metropolis burn-in phase once the walk is
+                     //!< stationary, at most after the burn-in fraction
+  double target_ess;  //!< stop Metropolis chains once every free parameter
+                      //!< has this effective sample size, 0 to run all steps
+  std::string checkpoint_file;  //!< file for Metropolis checkpoints, with
+                                //!< the experiment, the seed and, for
+                                //!< several chains, the chain index
+                                //!< appended; empty for none
+  unsigned checkpoint_interval;  //!< steps between checkpoints
+  bool resume;  //!< continue from the checkpoint file, if there is one
+  unsigned long long seed;  //!< master seed for the chains' RNG streams
+  unsigned experiment;  //!< index of the experiment, which selects the
+                        //!< chains' RNG streams (see rng_stream)
+  bool recycle;  //!< keep the point not taken at each Metropolis step, for
+                 //!< waste-recycled estimates (see jump_decider)
+  unsigned max_block_size;  //!< most parameters a Metropolis step moves
+                            //!< together, 0 for no limit
+  unsigned thin;  //!< save every thin-th Metropolis step
+  bool mc_statistics;  //!< profile the PDF sample statistics of each bin,
+                       //!< when the NLL is read from histograms
+};
+
+
+/**
+ * \struct FitResult
+ * \brief The maximum a posteriori point found by MCMC::fit
+ */
+struct FitResult {
+  std::vector<double> best_fit;  //!< parameters at the mode
+  std::vector<double> covariance;  //!< inverse Hessian of the NLL at the
+                                   //!< mode, np x np, zero for fixed
+                                   //!< parameters
+  double nll;  //!< NLL at the mode
+  unsigned iterations;  //!< number of optimizer iterations
+  bool converged;  //!< true if the optimizer met its tolerance
+  bool hessian_ok;  //!< false if the Hessian was not positive-definite, and
+                    //!< the covariance is only diagonal
+};
+
 /**
  * \class MCMC
  * \brief Markov Chain Monte Carlo simulator
  *
  * Given a set of signal PDFs and a dataset, random walk to map out the
  * likelihood space.
+ *
+ * Systematics marked as fixed are held at their means: they are never
+ * proposed, and PDFs depending only on fixed systematics are evaluated once.
+ *
+ * With MCMCOptions::rate_steps set, Metropolis proposals are blocked
+ * (Metropolis-within-Gibbs): several steps moving only the rates, which
+ * reuse the evaluated PDFs, then one step moving only the systematics.
+ * With MCMCOptions::component_updates, each rate step moves a single rate,
+ * and the NLL is updated from kept per-event mixture sums (see
+ * NLLEvaluator::component_sums) rather than recomputed over all signals.
+ *
+ * With MCMCOptions::delayed_acceptance, a proposal that moves the
+ * systematics is first screened with the NLL under the PDFs of the current
+ * point, which is exact in the rates and the constraints, and the PDFs are
+ * only evaluated for proposals that pass (Christen & Fox, 2005). A second
+ * evaluator holds the PDFs at the proposal, and takes over when it is
+ * accepted.
+ *
+ * With MCMCOptions::seed_from_fit, the Metropolis walk starts at the best
+ * fit from fit(), with jumps set by the covariance there, rather than at
+ * the parameter means with jumps set by the constraint widths. The fit is
+ * run once, before the chains start, and shared by them; it is skipped if
+ * every chain resumes from a checkpoint.
+ *
+ * With MCMCOptions::auto_burnin, each of the two Metropolis burn-in phases
+ * ends as soon as Geweke's diagnostic finds no drift in the NLL or the
+ * free parameters, and the steps it would have taken go to the final
+ * sample instead. The burn-in fraction remains the longest a phase can run.
+ *
+ * With MCMCOptions::target_ess, Metropolis chains stop as soon as the
+ * effective sample size of every free parameter, summed over the chains,
+ * reaches the target. The number of steps remains the longest a chain can
+ * run.
+ *
+ * With MCMCOptions::checkpoint_file set, a Metropolis chain saves its whole
+ * state every MCMCOptions::checkpoint_interval steps, from a thread of its
+ * own, and with MCMCOptions::resume a chain continues from its checkpoint.
+ * The host RNG is reseeded at every checkpoint, so a resumed chain repeats
+ * the uninterrupted one exactly. A chain that finishes removes its
+ * checkpoint. A checkpoint from another experiment or seed, or of a walk
+ * with another layout, is ignored and the chain starts afresh.
+ *
+ * With MCMCOptions::max_block_size set, proposal blocks with more
+ * parameters are split into chunks of rates and chunks of systematics,
+ * moved in turn. Jump widths, jump covariances and the adaptation
+ * statistics are kept per block. Beyond the event term, a step draws,
+ * checks and decides only the parameters it moves, and folds them into
+ * the adaptation statistics only when they change (see walk_update), so
+ * it costs O(block size), or O(block size^2) with correlated jumps, plus
+ * O(np) for each step saved. Memory and re-tuning cost O(sum of squared
+ * block sizes) rather than O(np^2). With MCMCOptions::thin, only every
+ * thin-th step is saved.
+ *
+ * Rates must be non-negative, and systematics may have hard limits.
+ * Proposals outside these bounds are rejected before the PDFs or the NLL
+ * are evaluated, or, with MCMCOptions::reflect_bounds, independent jumps
+ * are reflected back inside them.
+ *
+ * With MCMCOptions::replicas set, each chain is a set of tempered replicas
+ * run side by side, which exchange states now and then (see
+ * run_tempering).
+ *
+ * With MCMCOptions::speculation_depth set, Metropolis steps are taken in
+ * rounds, evaluating the proposals for several steps ahead under every
+ * sequence of accept/reject outcomes at once (see run_speculative).
+ *
+ * Several independent chains may be run concurrently, each on its own CPU
+ * thread with its own PDFs, RNG streams and jump-width adaptation. Their
+ * samples are merged into one LikelihoodSpace, with the chain index of each
+ * sample in the "chain" column.
  */
 class MCMC {
   public:
@@ -44,10 +198,12 @@ class MCMC {
      * \param signals List of Signals defining the PDFs and expectations
      * \param systematics List of systematic parameter definitions
      * \param observables List of observables in the data
+     * \param options Sampler settings
      */
     MCMC(const std::vector<Signal>& signals,
          const std::vector<Systematic>& systematics,
-         const std::vector<Observable>& observables);
+         const std::vector<Observable>& observables,
+         const MCMCOptions& options=MCMCOptions());
 
     /**
      * Destructor
@@ -61,11 +217,12 @@ class MCMC {
      *
      * \param data TODO
      * \param weights TODO
-     * \param nsteps Number of random-walk steps to take
+     * \param nsteps Number of random-walk steps to take, in each chain
      * \param burnin_fraction Fraction of initial steps to throw out
      * \param debug_mode If true, accept and save all steps
      * \param sync_interval How often to copy accepted from GPU to storage
-     * \returns LikelihoodSpace built from samples
+     * \returns LikelihoodSpace built from samples, with the recycled points
+     *          if MCMCOptions::recycle
      */
     LikelihoodSpace* operator()(std::vector<float>& data,
                                 std::vector<int>& weights,
@@ -74,49 +231,798 @@ class MCMC {
                                 const bool debug_mode=false,
                                 unsigned sync_interval=10000);
 
+    /**
+     * Find the maximum a posteriori point, without a random walk.
+     *
+     * \param data Events, as for operator()
+     * \param weights Weight of each event
+     * \returns The best fit, and the covariance from the Hessian there
+     */
+    FitResult fit(std::vector<float>& data, std::vector<int>& weights);
+
   protected:
     /**
-     * Evaluate the NLL function
+     * Create an NLL evaluator for a data set, with the fixed parameters
+     * held.
+     *
+     * \param pdfs Signal PDFs to evaluate, which must outlive the evaluator
+     * \param data Events, as for operator()
+     * \param weights Weight of each event
+     * \returns The evaluator, which the caller deletes
+     */
+    NLLEvaluator* new_evaluator(const std::vector<pdfz::Eval*>& pdfs,
+                                const std::vector<float>& data,
+                                const std::vector<int>& weights) const;
+
+    /**
+     * Minimize the NLL, starting from the parameter means.
+     *
+     * Uses L-BFGS (Nocedal, 1980) with NLLEvaluator::nll_gradient, in
+     * parameters scaled by the curvature of the NLL at the start. Steps are
+     * projected onto the parameter bounds, and parameters held at a bound
+     * by the gradient stay there. The covariance is the inverse of a
+     * Hessian found by central differences of the gradient.
+     *
+     * \param nll Evaluator for the data set; its PDFs are left at the mode
+     * \param result Output: the best fit
+     */
+    void find_mode(NLLEvaluator& nll, FitResult& result);
+
+    /**
+     * \struct Chain
+     * \brief Inputs and outputs of one chain of the random walk
+     */
+    struct Chain {
+      MCMC* mcmc;  //!< the sampler running this chain
+      unsigned id;  //!< index of the chain
+      std::vector<pdfz::Eval*> pdfs;  //!< signal pdfs, private to this chain
+      unsigned long long seed;  //!< master seed for the RNG streams
+      unsigned stream;  //!< this chain's RNG stream, see rng_stream
+      const std::vector<float>* data;  //!< data events
+      const std::vector<int>* weights;  //!< weight of each data event
+      unsigned nsteps;  //!< number of random-walk steps to take
+      unsigned burnin_steps;  //!< number of steps in each burn-in phase
+      bool debug_mode;  //!< accept and save all steps
+      unsigned sync_interval;  //!< steps between jump buffer flushes
+      const FitResult* fit;  //!< best fit to start a Metropolis walk at,
+                             //!< shared by the chains, or NULL if every
+                             //!< chain is resumable
+      std::vector<float> samples;  //!< output: saved steps, parameters then
+                                   //!< NLL for each
+      std::vector<float> recycled;  //!< output: the point not taken at each
+                                    //!< saved step, its NLL and its weight,
+                                    //!< if MCMCOptions::recycle
+    };
+
+    /**
+     * The checkpoint file of a chain: MCMCOptions::checkpoint_file with the
+     * experiment, the seed and, for several chains, the chain index
+     * appended.
+     *
+     * \param chain The chain
+     * \returns The path, empty if checkpoints are off
+     */
+    std::string checkpoint_path(const Chain& chain) const;
+
+    /**
+     * Check whether a chain will continue from a checkpoint, from its
+     * header alone. The walk's block layout is only checked once the chain
+     * starts, so a chain may still start afresh.
+     *
+     * \param chain The chain
+     * \returns True if a checkpoint of this experiment, seed and walk
+     *          length is there to resume
+     */
+    bool resumable(const Chain& chain) const;
+
+    /**
+     * Run one chain of the random walk.
+     *
+     * \param chain The chain to run; its samples are filled in
+     */
+    void run_chain(Chain& chain);
+
+    /**
+     * Merge the samples of finished chains into one likelihood space.
+     *
+     * \param chains The chains
+     * \returns LikelihoodSpace of the saved steps, tagged with the chain
+     *          index, and of the recycled points if any chain kept them
+     */
+    LikelihoodSpace* merge_chains(const std::vector<Chain>& chains) const;
+
+    /**
+     * \struct BlockLayout
+     * \brief How Metropolis proposals are split into blocks, and the order
+     *        in which the blocks are moved
+     *
+     * On the device, the parameter indices of each block lie one after
+     * another, starting at block_start; jump widths follow the same layout.
+     * Each block's Cholesky factor is an nb x nb square, starting at
+     * square_start. The adaptation statistics are the step count, then
+     * each block's statistics in turn, starting at stats_start (see
+     * walk_update).
+     */
+    struct BlockLayout {
+      size_t ngroups;  //!< groups of parameters, before any are split
+      size_t nrate_blocks;  //!< groups of rates, moved in turn
+      unsigned nrate_steps;  //!< rate steps per systematic step
+      std::vector<std::vector<size_t> > blocks;  //!< parameters moved
+                                                 //!< together
+      std::vector<size_t> schedule;  //!< block moved at each step of a cycle
+      std::vector<bool> block_systematic;  //!< blocks moving systematics
+      std::vector<int> parameter_block;  //!< block of each parameter, -1 if
+                                         //!< it is fixed
+      std::vector<size_t> parameter_slot;  //!< device slot of each parameter
+      std::vector<int> block_start;  //!< first slot of each block, then the
+                                     //!< total
+      std::vector<size_t> square_start;  //!< first element of each block's
+                                         //!< square, then the total
+      std::vector<size_t> stats_start;  //!< first element of each block's
+                                        //!< adaptation statistics, then
+                                        //!< the total
+      std::vector<float> scale_factor;  //!< jump scale of each block,
+                                        //!< Haario (2001)
+    };
+
+    /**
+     * Split the free parameters into Metropolis proposal blocks.
+     *
+     * All free parameters move together, or the rates and the systematics
+     * apart when blocked. Component-wise, each rate is a block of its own.
+     * A cycle moves the rate groups in turn, then the systematics. Groups
+     * larger than max_block are split into blocks of rates and blocks of
+     * systematics, moved one after another in the group's place.
+     *
+     * \param component Move one rate at a time
+     * \param blocked Move the rates and the systematics apart
+     * \param max_block Most parameters in a block, 0 for no limit
+     * \param layout Output: the blocks and their schedule
+     */
+    void setup_blocks(bool component, bool blocked, size_t max_block,
+                      BlockLayout& layout) const;
+
+    /**
+     * \struct Jumps
+     * \brief Metropolis jump proposals over a block layout, and the walk
+     *        statistics they are tuned from during burn-in
+     */
+    struct Jumps {
+      BlockLayout layout;  //!< the proposal blocks
+      bool adapt_covariance;  //!< keep full co-moments within each block
+      hemi::Array<float>* width;  //!< jump widths, in the block layout
+      hemi::Array<float>* cholesky;  //!< Cholesky factor of each block's
+                                     //!< jump covariance
+      std::vector<bool> use_cholesky;  //!< blocks with correlated jumps
+      hemi::Array<double>* walk_stats;  //!< step count and per-block
+                                        //!< statistics of the walk (see
+                                        //!< BlockLayout and walk_update)
+    };
+
+    /**
+     * Allocate the jumps for a block layout, with independent jumps of a
+     * tenth of each parameter's constraint (or Poisson) width, and empty
+     * walk statistics.
+     *
+     * \param adapt_covariance Correlate the jumps within each block once
+     *                         they are tuned
+     * \param jumps The jumps, with the layout set; the rest is filled in,
+     *              and must be freed with release_jumps
+     */
+    void setup_jumps(bool adapt_covariance, Jumps& jumps) const;
+
+    /**
+     * Free the arrays of a set of jumps.
+     *
+     * \param jumps The jumps
+     */
+    static void release_jumps(Jumps& jumps);
+
+    /**
+     * Re-tune Metropolis jumps from the walk over a burn-in phase.
+     *
+     * Each jump width becomes the block's scale factor times the RMS of the
+     * walk in that dimension (Haario, 2001). With adapt_covariance, blocks
+     * whose co-moments are positive-definite get correlated jumps. Every
+     * block is first folded in up to the last step.
+     *
+     * \param jumps The jumps; updated, and the walk statistics folded in
+     * \param current The current point of the walk
+     * \param label Prefix for messages
+     * \param log Stream for the messages
+     */
+    void retune_jumps(Jumps& jumps, const double* current,
+                      const std::string& label, std::ostream& log) const;
+
+    /**
+     * End a Metropolis burn-in phase: report it, re-tune the jumps (see
+     * retune_jumps), and start the walk statistics afresh.
+     *
+     * \param jumps The jumps; updated
+     * \param current The current point of the walk
+     * \param nsteps Steps in the phase
+     * \param stationary The phase ended early, at a stationary walk
+     * \param reset Empty the walk statistics
+     * \param label Prefix for messages
+     * \param log Stream for the messages
+     */
+    void end_burnin_phase(Jumps& jumps, const double* current,
+                          unsigned nsteps, bool stationary, bool reset,
+                          const std::string& label, std::ostream& log) const;
+
+    /**
+     * Move the steps in a Metropolis jump buffer to the saved steps, report
+     * progress, and reset the counters.
+     *
+     * \param label Prefix for messages
+     * \param step Index of the current step
+     * \param nsteps Number of steps in the walk
+     * \param jump_counter Steps in the buffer; reset
+     * \param accept_counter Steps accepted since the last flush; reset
+     * \param jump_buffer Buffered steps, parameters then NLL for each
+     * \param recycle_buffer Points not taken at the buffered steps, or NULL
+     * \param nexact Exact evaluations since the last flush, to report and
+     *               reset, or NULL
+     * \param samples Saved steps; the buffered steps are appended
+     * \param recycled Saved points not taken; appended if recycle_buffer is
+     *                 set
+     */
+    void flush_steps(const std::string& label, unsigned step, unsigned nsteps,
+                     hemi::Array<int>& jump_counter,
+                     hemi::Array<int>& accept_counter,
+                     hemi::Array<float>& jump_buffer,
+                     hemi::Array<float>* recycle_buffer, unsigned* nexact,
+                     std::vector<float>& samples,
+                     std::vector<float>& recycled) const;
+
+    /**
+     * \struct Walk
+     * \brief The state of one chain's random-walk Metropolis run
+     *
+     * The arrays are allocated by setup_walk and freed by finish_walk. The
+     * block, next_block and save fields describe the step being taken.
+     */
+    struct Walk {
+      Chain* chain;  //!< the chain being run
+      std::string label;  //!< prefix for messages
+      TRandom* rng;  //!< host random number generator for this chain
+      NLLEvaluator* nll;  //!< the chain's own evaluator
+      NLLEvaluator* evaluator;  //!< evaluator with the PDFs at the current
+                                //!< point
+      NLLEvaluator* proposal_evaluator;  //!< evaluator for proposals that
+                                         //!< pass screening, with delayed
+                                         //!< acceptance, or NULL
+      std::vector<pdfz::Eval*> proposal_pdfs;  //!< PDFs of the second
+                                               //!< evaluator
+      bool mtm;  //!< multiple-try Metropolis
+      bool component;  //!< component-wise rate updates
+      bool blocked;  //!< rates and systematics moved apart
+      size_t max_block;  //!< most parameters in a block, 0 for no limit
+      bool recycle;  //!< keep the point not taken at each saved step
+      bool reflect;  //!< reflect independent jumps at the bounds
+      Jumps jumps;  //!< the proposal blocks and their jumps
+      hemi::Array<int>* block_start;  //!< first slot of each block
+      hemi::Array<int>* block_params;  //!< parameters of each block
+      hemi::Array<RNGState>* rngs;  //!< device RNG streams, one per
+                                    //!< parameter
+      hemi::Array<double>* current_vector;  //!< the current point
+      hemi::Array<double>* proposed_vector;  //!< the next proposal
+      hemi::Array<double>* current_nll;  //!< NLL at the current point
+      hemi::Array<double>* proposed_nll;  //!< NLL at the proposal
+      hemi::Array<double>* constraint;  //!< constraint terms at the current
+                                        //!< point
+      hemi::Array<double>* normals;  //!< scratch normal deviates
+      hemi::Array<double>* trials;  //!< multiple-try trial points
+      hemi::Array<double>* trial_nlls;  //!< NLL at the trial points
+      hemi::Array<double>* screen_nll;  //!< screening NLL of a proposal
+      hemi::Array<double>* exact_vectors;  //!< proposal and current point,
+                                           //!< for the exact NLLs
+      hemi::Array<double>* exact_nlls;  //!< NLLs under the proposal's PDFs
+      hemi::Array<int>* jump_counter;  //!< steps in the jump buffer
+      hemi::Array<int>* accept_counter;  //!< steps accepted since the last
+                                         //!< flush
+      hemi::Array<float>* jump_buffer;  //!< steps not yet flushed
+      hemi::Array<float>* recycle_buffer;  //!< points not taken at the
+                                           //!< steps not yet flushed
+      unsigned nexact;  //!< exact evaluations since the last flush
+      bool pdfs_current;  //!< PDFs evaluated at the current systematics
+      bool mixture_current;  //!< kept mixture sums match the current point
+      bool constraint_current;  //!< constraint terms match the current
+                                //!< point
+      size_t block;  //!< block moved at this step
+      size_t next_block;  //!< block moved at the next step
+      bool save;  //!< save this step
+      bool auto_burnin;  //!< end burn-in phases at a stationary walk
+      unsigned min_phase;  //!< steps between stationarity tests
+      std::vector<size_t> tested_fields;  //!< fields tested for
+                                          //!< stationarity and ESS
+      double z_crit;  //!< Geweke z for the combined 5% level
+      double chain_ess;  //!< effective sample size to stop at, 0 for none
+      unsigned adapt_phase;  //!< adaptation phases completed
+      unsigned phase_start;  //!< step at which the current phase began
+      unsigned phase_end;  //!< step at which it ends
+      size_t phase_first;  //!< first saved step of the current phase
+      bool checkpointing;  //!< write checkpoints of the walk
+      unsigned first_step;  //!< step to start from
+      unsigned last_checkpoint;  //!< step of the last checkpoint
+      CheckpointWrite checkpoint;  //!< checkpoint being written
+      pthread_t checkpoint_thread;  //!< thread writing it
+      bool writing;  //!< checkpoint_thread must be joined
+    };
+
+    /**
+     * Run a chain as a Metropolis walk.
+     *
+     * \param chain The chain to run; its samples are filled in
+     * \param nll Evaluator for the data set, with the PDFs evaluated at the
+     *            parameter means
+     * \param rng Host random number generator for this chain
+     * \param label Prefix for messages
+     */
+    void run_walk(Chain& chain, NLLEvaluator& nll, TRandom* rng,
+                  const std::string& label);
+
+    /**
+     * Set up a Metropolis walk: pick the kind of proposals, split them into
+     * blocks, and allocate the buffers.
+     *
+     * \param chain The chain to run
+     * \param nll Evaluator for the data set, with the PDFs evaluated at the
+     *            parameter means
+     * \param rng Host random number generator for this chain
+     * \param label Prefix for messages
+     * \param walk Output: the walk, at the parameter means
+     */
+    void setup_walk(Chain& chain, NLLEvaluator& nll, TRandom* rng,
+                    const std::string& label, Walk& walk);
+
+    /**
+     * Find where a Metropolis walk starts: at a checkpoint, if there is one
+     * that fits the walk, else at the best fit with jumps from its
+     * covariance if MCMCOptions::seed_from_fit, else at the parameter
+     * means. The first proposal is drawn.
+     *
+     * \param walk The walk
+     */
+    void start_walk(Walk& walk);
+
+    /**
+     * Draw a proposal that moves one block, from the current point.
+     *
+     * \param walk The walk
+     * \param block The block to move
+     */
+    void pick_walk_proposal(Walk& walk, size_t block);
+
+    /**
+     * End a burn-in phase of a Metropolis walk, re-tuning the jumps and
+     * dropping the phase's steps.
+     *
+     * \param walk The walk
+     * \param step Index of the current step
+     */
+    void end_walk_phase(Walk& walk, unsigned step);
+
+    /**
+     * Take one step of a Metropolis walk, deciding the proposal with the
+     * combined reduction, accept/reject and pick kernel. Steps that move
+     * one rate update the kept mixture sums.
+     *
+     * \param walk The walk
+     * \param systematic_step The proposal moves systematics of varying PDFs
+     */
+    void metropolis_walk_step(Walk& walk, bool systematic_step);
+
+    /**
+     * Reject the proposal of a Metropolis walk without evaluating it,
+     * recording the current point again, and draw the next one.
+     *
+     * \param walk The walk
+     */
+    void reject_walk_step(Walk& walk);
+
+    /**
+     * Take one step of a Metropolis walk with delayed acceptance (Christen
+     * & Fox, 2005).
+     *
+     * The proposal is screened with the PDFs at the current point. Only if
+     * it passes are the PDFs evaluated there, in the second evaluator, for
+     * the exact decision. On a move the evaluators trade places.
+     *
+     * \param walk The walk
+     */
+    void delayed_walk_step(Walk& walk);
+
+    /**
+     * Take one multiple-try Metropolis step of a walk (see mtm_step).
+     *
+     * \param walk The walk
+     */
+    void mtm_walk_step(Walk& walk);
+
+    /**
+     * Flush the jump buffer of a Metropolis walk when it is due, and then
+     * test for a stationary walk or a large enough sample, and checkpoint
+     * the walk now and then.
+     *
+     * \param walk The walk
+     * \param step Index of the current step
+     * \returns True if the walk is done
+     */
+    bool flush_walk(Walk& walk, unsigned step);
+
+    /**
+     * Snapshot a Metropolis walk, and write it out on another thread.
+     *
+     * \param walk The walk, just after a flush
+     * \param step Next step to take
+     */
+    void checkpoint_walk(Walk& walk, unsigned step);
+
+    /**
+     * Copy the state of a Metropolis walk into a chain state.
+     *
+     * \param walk The walk
+     * \param step Next step to take
+     * \param s Output: the chain state, but for the host RNG seed
+     */
+    void snapshot_walk(const Walk& walk, unsigned step, ChainState& s) const;
+
+    /**
+     * Copy a chain state back into a Metropolis walk.
+     *
+     * \param s The chain state, with buffers of the walk's sizes
+     * \param walk The walk
+     */
+    void restore_walk(const ChainState& s, Walk& walk) const;
+
+    /**
+     * Finish a Metropolis walk: wait for any checkpoint being written,
+     * remove the checkpoint, and free the walk's buffers.
+     *
+     * \param walk The walk
+     */
+    void finish_walk(Walk& walk);
+
+    /**
+     * Run one chain as an affine-invariant ensemble (Goodman & Weare, 2010).
+     *
+     * The walkers are split into halves, and each walker in a half takes a
+     * stretch move along the line to a random walker in the other half.
+     * A whole half is evaluated at once: with NLLEvaluator::nll_batch if
+     * the PDFs are fixed, else concurrently on CPU threads, each walker with
+     * its own evaluator and PDFs (see speculate). The moves are invariant
+     * under affine maps of the parameter space, so strong correlations
+     * between the rates do not slow mixing and no jump widths need tuning.
+     * Each sweep of the ensemble saves every walker, so nsteps counts
+     * walker moves.
+     *
+     * \param chain The chain to run; its samples are filled in
+     * \param nll Evaluator for the data set, with the PDFs evaluated at the
+     *            parameter means
+     * \param rng Host random number generator for this chain
+     */
+    void run_ensemble(Chain& chain, NLLEvaluator& nll, TRandom* rng);
+
+    /**
+     * Run one chain of random-walk Metropolis with speculative evaluation
+     * (prefetching, Brockwell 2006).
+     *
+     * Each round decides d = options.speculation_depth steps. The proposal
+     * for every step in the round is drawn up front for each way the
+     * earlier steps in the round could go, a binary tree of 2^d - 1 points,
+     * and all of them are evaluated at once: with NLLEvaluator::nll_batch
+     * if the PDFs are fixed, else concurrently on CPU threads, each with its
+     * own evaluator and PDFs. The steps are then decided in order, following
+     * the branch that matches each outcome, so the chain is exactly a
+     * Metropolis chain while the wall time per step drops by up to d.
+     * Threads only help where evaluations can run side by side, as on a
+     * multi-core CPU build.
+     *
+     * Jumps are tuned during burn-in as in run_chain, for all free
+     * parameters together; multiple-try, blocked and component-wise
+     * proposals are not used.
+     *
+     * \param chain The chain to run; its samples are filled in
+     * \param nll Evaluator for the data set
+     * \param rng Host random number generator for this chain
+     */
+    void run_speculative(Chain& chain, NLLEvaluator& nll, TRandom* rng);
+
+    /**
+     * \struct Speculation
+     * \brief One NLL evaluation in a round of speculative steps
+     */
+    struct Speculation {
+      NLLEvaluator* nll;  //!< evaluator for this point
+      hemi::Array<double>* vector;  //!< parameter vector to evaluate
+      hemi::Array<double>* result;  //!< output: NLL at the vector
+    };
+
+    /**
+     * Thread entry point for a speculative evaluation.
+     *
+     * Evaluates the PDFs and then the NLL at the vector, and copies the
+     * result to the host.
+     *
+     * \param speculation Pointer to the Speculation to evaluate
+     * \returns NULL
+     */
+    static void* speculate_thread(void* speculation);
+
+    /**
+     * Evaluate several points side by side, each on a thread of its own.
+     *
+     * The first point is evaluated on the calling thread, as is any point
+     * whose thread cannot be started. Each point needs its own evaluator.
+     *
+     * \param speculations The points, with a NULL evaluator for any to skip
+     * \param nlls Output: the NLL at each point, 1e18 for those skipped
+     */
+    static void speculate(std::vector<Speculation>& speculations,
+                          double* nlls);
+
+    /**
+     * \struct Barrier
+     * \brief A reusable meeting point for a fixed number of threads
+     *
+     * Built on a mutex and a condition variable, since pthread_barrier_t
+     * is not available everywhere.
+     */
+    struct Barrier {
+      pthread_mutex_t mutex;  //!< guards the counts
+      pthread_cond_t cond;  //!< signalled when all threads have arrived
+      unsigned nthreads;  //!< threads that meet at the barrier
+      unsigned waiting;  //!< threads arrived in this round
+      unsigned round;  //!< rounds completed
+    };
+
+    /**
+     * Wait until every thread of a barrier has arrived.
+     *
+     * \param barrier The barrier
+     */
+    static void barrier_wait(Barrier& barrier);
+
+    /**
+     * \struct Replica
+     * \brief One tempered copy of the random walk in parallel tempering
+     */
+    struct Replica {
+      MCMC* mcmc;  //!< the sampler running this replica
+      NLLEvaluator* nll;  //!< evaluator, private to this replica
+      hemi::Array<double>* vector;  //!< scratch parameter vector
+      hemi::Array<double>* result;  //!< scratch NLL output
+      TRandom* rng;  //!< host random number generator for this replica
+      double beta;  //!< inverse temperature
+      std::vector<double> x;  //!< current parameters
+      double nll_x;  //!< NLL at the current parameters
+      Jumps jumps;  //!< independent jumps over all free parameters
+      unsigned nsteps;  //!< steps to take in the next segment
+      unsigned naccepted;  //!< number of accepted steps
+      bool debug_mode;  //!< accept every step
+      bool adapt;  //!< accumulate the walk statistics
+      bool record;  //!< keep the steps of each segment
+      std::vector<float> trace;  //!< output: steps of the last segment,
+                                 //!< parameters then NLL for each
+      Barrier* barrier;  //!< where the replica threads meet before and
+                         //!< after each segment
+      bool stop;  //!< leave the thread at the next segment
+    };
+
+    /**
+     * Run one chain with parallel tempering (replica exchange; Geyer, 1991).
+     *
+     * options.replicas copies of the walk sample L^beta, with temperatures
+     * 1/beta spaced geometrically from 1 up to options.max_temperature. They
+     * take random-walk Metropolis steps side by side, each with its own
+     * evaluator, PDFs and jump widths, for options.swap_interval steps at a
+     * time. Every replica but the cold one runs on a CPU thread of its own
+     * for the whole chain, meeting the others at a barrier around each
+     * segment. Neighbouring replicas then propose to exchange their
+     * states, alternating between even and odd pairs. Hot replicas cross
+     * between separated or weakly identified modes easily, and pass those
+     * states down the ladder. Only the cold replica is saved.
+     *
+     * Each replica tunes independent jump widths from its own walk during
+     * burn-in, with the helpers of run_chain (see retune_jumps).
+     *
+     * \param chain The chain to run; its samples are filled in
+     * \param nll Evaluator for the data set, used by the cold replica
+     * \param rng Host random number generator for this chain
+     */
+    void run_tempering(Chain& chain, NLLEvaluator& nll, TRandom* rng);
+
+    /**
+     * Take a segment of tempered Metropolis steps in one replica.
+     *
+     * \param replica The replica to move
+     */
+    void replica_steps(Replica& replica);
+
+    /**
+     * Thread entry point for a replica: take a segment of steps (see
+     * replica_steps) between each pair of barrier meetings, until stopped.
+     *
+     * \param replica Pointer to the Replica to move
+     * \returns NULL
+     */
+    static void* replica_thread(void* replica);
+
+    /**
+     * \struct PhasePoint
+     * \brief A point in the phase space of Hamiltonian Monte Carlo
+     */
+    struct PhasePoint {
+      std::vector<double> q;  //!< position, the parameter vector
+      std::vector<double> p;  //!< momentum
+      std::vector<double> grad;  //!< gradient of the NLL at q
+      double nll;  //!< NLL at q, the potential energy
+    };
+
+    /**
+     * \struct NUTSTree
+     * \brief A subtree of the No-U-Turn sampler's trajectory
+     */
+    struct NUTSTree {
+      PhasePoint minus;  //!< leftmost point
+      PhasePoint plus;  //!< rightmost point
+      PhasePoint proposal;  //!< point sampled from the subtree
+      double n;  //!< number of points inside the slice
+      bool s;  //!< false if the subtree made a U-turn or diverged
+      double alpha;  //!< sum of acceptance probabilities, for adaptation
+      unsigned nalpha;  //!< number of points in the alpha sum
+    };
+
+    /**
+     * Run one chain with Hamiltonian Monte Carlo (Neal, 2011), or with its
+     * No-U-Turn variant (Hoffman & Gelman, 2014).
+     *
+     * Trajectories follow NLLEvaluator::nll_gradient with a diagonal mass
+     * matrix. During the first half of burn-in the step size is tuned by
+     * dual averaging, starting from a mass matrix set by the constraint
+     * widths (or Poisson widths) of the parameters; the mass matrix is then
+     * set from the variance of the samples and the step size re-tuned for
+     * the second half. Each trajectory saves one sample.
+     *
+     * \param chain The chain to run; its samples are filled in
+     * \param nll Evaluator for the data set
+     * \param rng Host random number generator for this chain
+     */
+    void run_hmc(Chain& chain, NLLEvaluator& nll, TRandom* rng);
+
+    /**
+     * Evaluate the NLL and its gradient at a phase point's position.
+     *
+     * \param nll Evaluator for the data set
+     * \param scratch Buffer for the parameter vector
+     * \param z The point; its nll and grad are set
+     */
+    void hmc_evaluate(NLLEvaluator& nll, hemi::Array<double>& scratch,
+                      PhasePoint& z);
+
+    /**
+     * Take one leapfrog step.
+     *
+     * \param nll Evaluator for the data set
+     * \param scratch Buffer for the parameter vector
+     * \param inv_metric Inverse of the diagonal mass matrix
+     * \param epsilon Step size, negative to go backward in time
+     * \param z The point to move
+     */
+    void leapfrog(NLLEvaluator& nll, hemi::Array<double>& scratch,
+                  const std::vector<double>& inv_metric, double epsilon,
+                  PhasePoint& z);
+
+    /**
+     * Total energy of a phase point, NLL plus kinetic energy.
+     *
+     * \param z The point
+     * \param inv_metric Inverse of the diagonal mass matrix
+     * \returns The Hamiltonian, infinite if the NLL is out of bounds
+     */
+    static double hamiltonian(const PhasePoint& z,
+                              const std::vector<double>& inv_metric);
+
+    /**
+     * Check that a trajectory has not started to double back on itself.
+     *
+     * \param minus Leftmost point of the trajectory
+     * \param plus Rightmost point of the trajectory
+     * \param inv_metric Inverse of the diagonal mass matrix
+     * \returns True if both ends still move apart
+     */
+    static bool no_uturn(const PhasePoint& minus, const PhasePoint& plus,
+                         const std::vector<double>& inv_metric);
+
+    /**
+     * Build a No-U-Turn subtree of 2^depth leapfrog steps.
      *
-     * -logL = sum(Nj) + 1/2*sum((r-r')^2/s^2) - sum(log(sum(Nj*Pj(xi))))
+     * \param nll Evaluator for the data set
+     * \param scratch Buffer for the parameter vector
+     * \param inv_metric Inverse of the diagonal mass matrix
+     * \param z Starting point, the end of the trajectory so far
+     * \param log_u Log of the slice variable
+     * \param direction 1 to go forward in time, -1 to go backward
+     * \param depth Depth of the subtree
+     * \param epsilon Step size
+     * \param h0 Hamiltonian at the start of the trajectory
+     * \param rng Host random number generator for this chain
+     * \param tree Output subtree
+     */
+    void build_tree(NLLEvaluator& nll, hemi::Array<double>& scratch,
+                    const std::vector<double>& inv_metric,
+                    const PhasePoint& z, double log_u, int direction,
+                    unsigned depth, double epsilon, double h0,
+                    TRandom* rng, NUTSTree& tree);
+
+    /**
+     * Check a parameter vector against the parameter bounds.
      *
-     * Nothing is returned -- the output stays in the nll array, so it can stay
-     * on the device.
+     * \param v Parameter vector, on the host
+     * \returns True if every parameter is within its bounds
+     */
+    bool in_bounds(const double* v) const;
+
+    /**
+     * Check some parameters of a vector against their bounds.
      *
-     * This is done in three steps, to support running on the GPU:
+     * \param v Parameter vector, on the host
+     * \param indices Parameters to check, e.g. those a proposal moved
+     * \returns True if each of those parameters is within its bounds
+     */
+    bool in_bounds(const double* v, const std::vector<size_t>& indices) const;
+
+    /**
+     * Thread entry point for run_chain.
+     *
+     * \param chain Pointer to the Chain to run
+     * \returns NULL
+     */
+    static void* run_chain_thread(void* chain);
+
+    /**
+     * Take one multiple-try Metropolis step (Liu, Liang & Wong, 2000).
      *
-     *   1. Compute partial sums of chunks of events for the last term
-     *   2. Total up partial sums from step 1
-     *   3. Add normalization and other constraints with sum from step 2
+     * Draws options.proposals trials around the current point and picks one
+     * in proportion to its likelihood, then draws reference points around
+     * the pick. The move is accepted with probability
+     * min(1, sum(L(trials)) / sum(L(references))). Both sets are evaluated
+     * with NLLEvaluator::nll_batch, so the PDFs must not change.
      *
-     * \param v Parameter vector at which to evaluate
-     * \param nll Container for output NLL value
-     * \param event_partial_sums Pre-allocated buffer for event term
-     *                           calculation
-     * \param event_total_sum Pre-allocated buffer for event term total
+     * \param nll Evaluator for the data set
+     * \param current_vector Current parameters, updated if accepted
+     * \param current_nll NLL at the current parameters, updated if accepted
+     * \param trials Scratch buffer for options.proposals parameter vectors
+     * \param trial_nlls Scratch buffer for options.proposals NLL values
+     * \param jump_width Gaussian proposal width for each parameter
+     * \param rng Host random number generator for this chain
+     * \param debug_mode If true, accept every step
+     * \returns True if the move was accepted
      */
-    void nll(const float* lut, const int* dataweights, size_t nevents,
-             const double* v, double* nll,
-             double* event_partial_sums,
-             double* event_total_sum);
+    bool mtm_step(NLLEvaluator& nll, hemi::Array<double>& current_vector,
+                  hemi::Array<double>& current_nll,
+                  hemi::Array<double>& trials,
+                  hemi::Array<double>& trial_nlls,
+                  const float* jump_width, TRandom* rng,
+                  const bool debug_mode);
 
   private:
     size_t nsignals;  //!< number of signal parameters
     size_t nsystematics;  //!< number of systematic parameters
     size_t nparameters;  //!< total number of parameters
     size_t nobservables;  //!< number of observables in data
-    unsigned nnllblocks;  //!< number of cuda blocks for nll partial sums
-    unsigned nllblocksize;  //!< size of cuda blocks for nll partial sums
-    unsigned nnllthreads;  //!< number of threads for nll partial sums
     unsigned nreducethreads; //!< number of threads to use in partial sum
                              //!< reduction kernel
-    unsigned blocksize;  //!< size of blocks for per-signal kernels
-    unsigned nblocks;  //!< number of blocks for per-signal kernels
+    MCMCOptions options;  //!< sampler settings
     std::string varlist;  //!< string identifier list for ntuple indexing
     hemi::Array<double>* parameter_means;  //!< parameter central values
     hemi::Array<double>* parameter_sigma;  //!< parameter Gaussian uncertainty
-    hemi::Array<RNGState>* rngs;  //!< CURAND RNGs, ignored in CPU mode
+    hemi::Array<double>* parameter_lower;  //!< parameter lower bounds
+    hemi::Array<double>* parameter_upper;  //!< parameter upper bounds
     std::vector<std::string> parameter_names;  //!< string name of each param
+    std::vector<bool> parameter_fixed;  //!< parameters held at their means
+    size_t nfree;  //!< number of parameters that are not fixed
     std::vector<pdfz::Eval*> pdfs;  //!< references to signal pdfs
 };
 
@@ -0,0 +1,219 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <assert.h>
+#include <hemi/hemi.h>
+#include <TRandom.h>
+
+#include <sxmc/mcmc.h>
+#include <sxmc/nll_kernels.h>
+#include <sxmc/nll_evaluator.h>
+
+#ifndef __HEMI_ARRAY_H__
+#define __HEMI_ARRAY_H__
+#include <hemi/array.h>
+#endif
+
+void MCMC::run_speculative(Chain& chain, NLLEvaluator& nll, TRandom* rng) {
+  const size_t np = this->nparameters;
+  const unsigned depth = this->options.speculation_depth;
+  const size_t nnodes = (1 << depth) - 1;
+  const unsigned nsteps = chain.nsteps;
+  const unsigned burnin_steps = chain.burnin_steps;
+  const bool debug_mode = chain.debug_mode;
+  const bool fixed = nll.pdfs_fixed();
+  const double* lower = this->parameter_lower->readOnlyHostPtr();
+  const double* upper = this->parameter_upper->readOnlyHostPtr();
+  assert(nnodes <= NLL_MAX_BATCH);
+
+  std::string label;
+  if (this->options.chains > 1) {
+    std::ostringstream ss;
+    ss << "Chain " << chain.id << ": ";
+    label = ss.str();
+  }
+  if (chain.id == 0) {
+    std::cout << "MCMC: Speculative Metropolis, " << depth
+              << " steps per round of " << nnodes << " evaluations"
+              << (fixed ? "" : " on threads") << std::endl;
+  }
+
+  // Free parameters all move together, in one block, with jumps tuned as
+  // in run_chain
+  Jumps jumps;
+  this->setup_blocks(false, false, 0, jumps.layout);
+  this->setup_jumps(this->options.adapt_covariance, jumps);
+  const std::vector<size_t>& free = jumps.layout.blocks[0];
+  const size_t nb = free.size();
+  const std::vector<int> block(free.begin(), free.end());
+  double* walk_stats = jumps.walk_stats->hostPtr();
+  double* block_stats = walk_stats + jumps.layout.stats_start[0];
+
+  // Nodes of the tree of proposals, one vector each. Node 0 uses the
+  // chain's evaluator; if the PDFs vary, every other node gets its own
+  // evaluator and PDFs, so they can be evaluated side by side.
+  hemi::Array<double> node_vectors(nnodes * np, true);
+  hemi::Array<double> node_nlls(nnodes, true);
+  std::vector<hemi::Array<double>*> vectors(nnodes, NULL);
+  std::vector<hemi::Array<double>*> results(nnodes, NULL);
+  std::vector<NLLEvaluator*> evaluators(nnodes, &nll);
+  std::vector<std::vector<pdfz::Eval*> > node_pdfs(nnodes);
+  for (size_t n=0; n<nnodes && !fixed; n++) {
+    vectors[n] = new hemi::Array<double>(np, true);
+    results[n] = new hemi::Array<double>(1, true);
+    if (n == 0) {
+      continue;
+    }
+    for (size_t i=0; i<this->nsignals; i++) {
+      node_pdfs[n].push_back(chain.pdfs[i]->Clone());
+    }
+    evaluators[n] = this->new_evaluator(node_pdfs[n], *chain.data,
+                                        *chain.weights);
+  }
+  std::vector<Speculation> speculations(nnodes);
+
+  // Start at the parameter means
+  std::vector<double> x(this->parameter_means->readOnlyHostPtr(),
+                        this->parameter_means->readOnlyHostPtr() + np);
+  hemi::Array<double> start(np, true);
+  std::copy(x.begin(), x.end(), start.writeOnlyHostPtr());
+  nll.eval_pdfs(&start);
+  nll.nll(start.readOnlyPtr(), node_nlls.writeOnlyPtr());
+  double nll_x = node_nlls.readOnlyHostPtr()[0];
+
+  std::vector<float>& samples = chain.samples;
+  const size_t nfields = np + 1;
+  std::vector<double> base(nnodes * np);
+  std::vector<double> jump(np, 0);
+  std::vector<double> g(nb);
+  unsigned naccepted = 0;
+  unsigned i = 0;
+
+  while (i < nsteps) {
+    // Proposals for every path through the round: node n jumps from its
+    // base point, child 2n+1 starts from node n's proposal (accepted) and
+    // child 2n+2 from node n's base (rejected). Only one node at each depth
+    // is on the path taken, so the nodes at a depth share a jump.
+    const bool correlated = jumps.use_cholesky[0];
+    const bool reflect = (this->options.reflect_bounds && !correlated);
+    const float* width = jumps.width->readOnlyHostPtr();
+    const float* l = jumps.cholesky->readOnlyHostPtr();
+    double* t = node_vectors.writeOnlyHostPtr();
+    for (unsigned d=0; d<depth; d++) {
+      for (size_t k=0; k<nb; k++) {
+        g[k] = rng->Gaus();
+      }
+      for (size_t k=0; k<nb; k++) {
+        double dx = width[k] * g[k];
+        if (correlated) {
+          dx = 0;
+          for (size_t m=0; m<=k; m++) {
+            dx += l[k * nb + m] * g[m];
+          }
+        }
+        jump[free[k]] = dx;
+      }
+      const size_t first = (1 << d) - 1;
+      for (size_t n=first; n<2*first+1; n++) {
+        const double* b = &x[0];
+        if (n > 0) {
+          const size_t parent = (n - 1) / 2;
+          b = (n % 2 == 1 ? t + parent * np : &base[parent * np]);
+        }
+        std::copy(b, b + np, base.begin() + n * np);
+        for (size_t j=0; j<np; j++) {
+          t[n * np + j] = b[j] + jump[j];
+          if (reflect) {
+            t[n * np + j] = reflect_into(t[n * np + j], lower[j], upper[j]);
+          }
+        }
+      }
+    }
+
+    // Evaluate every node at once; points out of bounds are rejected
+    // without evaluating
+    if (fixed) {
+      nll.nll_batch(node_vectors.readOnlyPtr(), nnodes,
+                    node_nlls.writeOnlyPtr());
+    }
+    else {
+      const double* tv = node_vectors.readOnlyHostPtr();
+      for (size_t n=0; n<nnodes; n++) {
+        speculations[n].nll = NULL;
+        if (this->in_bounds(tv + n * np)) {
+          std::copy(tv + n * np, tv + (n + 1) * np,
+                    vectors[n]->writeOnlyHostPtr());
+          speculations[n].nll = evaluators[n];
+          speculations[n].vector = vectors[n];
+          speculations[n].result = results[n];
+        }
+      }
+      MCMC::speculate(speculations, node_nlls.writeOnlyHostPtr());
+    }
+
+    // Decide the steps in order, following the branch that matches
+    const double* tv = node_vectors.readOnlyHostPtr();
+    const double* tn = node_nlls.readOnlyHostPtr();
+    size_t n = 0;
+    for (unsigned d=0; d<depth && i<nsteps; d++, i++) {
+      // Re-tune jump distribution based on burn-in phase. The new jumps
+      // take effect from the next round.
+      if (i == burnin_steps || i == 2 * burnin_steps) {
+        std::ostringstream ss;
+        this->end_burnin_phase(jumps, &x[0], burnin_steps, false,
+                               !debug_mode, label, ss);
+        std::cout << ss.str() << std::flush;
+
+        // Save all steps when in debug mode
+        if (!debug_mode) {
+          samples.clear();
+        }
+      }
+
+      // Accumulate adaptation statistics only during burn-in, folding in
+      // the current point when the walk leaves it (see walk_update)
+      const bool accepted = \
+        (debug_mode || log(rng->Uniform()) < nll_x - tn[n]);
+      if (i < 2 * burnin_steps) {
+        walk_stats[0] += 1;
+        if (accepted) {
+          walk_update(&x[0], nb, &block[0], walk_stats[0] - 1, block_stats,
+                      jumps.adapt_covariance);
+        }
+      }
+      if (accepted) {
+        std::copy(tv + n * np, tv + (n + 1) * np, x.begin());
+        nll_x = tn[n];
+        naccepted++;
+      }
+      n = 2 * n + (accepted ? 1 : 2);
+
+      samples.insert(samples.end(), x.begin(), x.end());
+      samples.push_back(nll_x);
+
+      if (i % chain.sync_interval == 0 || i == nsteps - 1) {
+        std::ostringstream ss;
+        ss << "MCMC: " << label << "Step " << i << "/" << nsteps
+           << " (" << samples.size() / nfields << " saved, "
+           << naccepted << " accepted)" << std::endl;
+        std::cout << ss.str() << std::flush;
+        naccepted = 0;
+      }
+    }
+  }
+
+  release_jumps(jumps);
+  for (size_t n=0; n<nnodes; n++) {
+    delete vectors[n];
+    delete results[n];
+    if (n > 0 && !fixed) {
+      delete evaluators[n];
+      for (size_t k=0; k<node_pdfs[n].size(); k++) {
+        delete node_pdfs[n][k];
+      }
+    }
+  }
+}
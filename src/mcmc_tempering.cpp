@@ -0,0 +1,310 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <pthread.h>
+#include <hemi/hemi.h>
+#include <TRandom.h>
+#include <TRandom3.h>
+
+#include <sxmc/mcmc.h>
+#include <sxmc/nll_kernels.h>
+#include <sxmc/nll_evaluator.h>
+
+#ifndef __HEMI_ARRAY_H__
+#define __HEMI_ARRAY_H__
+#include <hemi/array.h>
+#endif
+
+void MCMC::barrier_wait(Barrier& barrier) {
+  pthread_mutex_lock(&barrier.mutex);
+  const unsigned round = barrier.round;
+  barrier.waiting++;
+  if (barrier.waiting == barrier.nthreads) {
+    barrier.waiting = 0;
+    barrier.round++;
+    pthread_cond_broadcast(&barrier.cond);
+  }
+  while (barrier.round == round) {
+    pthread_cond_wait(&barrier.cond, &barrier.mutex);
+  }
+  pthread_mutex_unlock(&barrier.mutex);
+}
+
+
+void* MCMC::replica_thread(void* replica) {
+  Replica* r = static_cast<Replica*>(replica);
+  while (true) {
+    barrier_wait(*r->barrier);  // segment set up
+    if (r->stop) {
+      break;
+    }
+    r->mcmc->replica_steps(*r);
+    barrier_wait(*r->barrier);  // segment done
+  }
+  return NULL;
+}
+
+
+void MCMC::run_tempering(Chain& chain, NLLEvaluator& nll, TRandom* rng) {
+  const size_t np = this->nparameters;
+  const size_t nfields = np + 1;
+  const size_t nreplicas = this->options.replicas;
+  const double max_temperature = this->options.max_temperature;
+  const unsigned nsteps = chain.nsteps;
+  const unsigned burnin_steps = chain.burnin_steps;
+
+  std::string label;
+  if (this->options.chains > 1) {
+    std::ostringstream ss;
+    ss << "Chain " << chain.id << ": ";
+    label = ss.str();
+  }
+  if (chain.id == 0) {
+    std::cout << "MCMC: Parallel tempering, " << nreplicas
+              << " replicas up to temperature " << max_temperature
+              << ", swaps every " << this->options.swap_interval
+              << " steps" << std::endl;
+  }
+
+  // Replicas on a geometric temperature ladder, the first one cold. All
+  // but the cold replica get their own evaluator and PDFs.
+  Barrier barrier;
+  pthread_mutex_init(&barrier.mutex, NULL);
+  pthread_cond_init(&barrier.cond, NULL);
+  barrier.nthreads = 1;
+  barrier.waiting = 0;
+  barrier.round = 0;
+  std::vector<Replica> replicas(nreplicas);
+  std::vector<std::vector<pdfz::Eval*> > replica_pdfs(nreplicas);
+  for (size_t r=0; r<nreplicas; r++) {
+    Replica& replica = replicas[r];
+    replica.mcmc = this;
+    replica.nll = &nll;
+    if (r > 0) {
+      for (size_t i=0; i<this->nsignals; i++) {
+        replica_pdfs[r].push_back(chain.pdfs[i]->Clone());
+      }
+      replica.nll = this->new_evaluator(replica_pdfs[r], *chain.data,
+                                        *chain.weights);
+    }
+    replica.vector = new hemi::Array<double>(np, true);
+    replica.result = new hemi::Array<double>(1, true);
+    replica.rng = new TRandom3(rng->Integer(0xffffffff));
+    replica.beta = pow(max_temperature, -(double) r / (nreplicas - 1));
+
+    // Start at the parameter means, with jumps widened by sqrt(T)
+    replica.x.assign(this->parameter_means->readOnlyHostPtr(),
+                     this->parameter_means->readOnlyHostPtr() + np);
+    std::copy(replica.x.begin(), replica.x.end(),
+              replica.vector->writeOnlyHostPtr());
+    replica.nll->eval_pdfs(replica.vector);
+    replica.nll->nll(replica.vector->readOnlyPtr(),
+                     replica.result->writeOnlyPtr());
+    replica.nll_x = replica.result->readOnlyHostPtr()[0];
+
+    this->setup_blocks(false, false, 0, replica.jumps.layout);
+    this->setup_jumps(false, replica.jumps);
+    float* width = replica.jumps.width->hostPtr();
+    for (size_t k=0; k<replica.jumps.layout.blocks[0].size(); k++) {
+      width[k] /= sqrt(replica.beta);
+    }
+
+    replica.naccepted = 0;
+    replica.debug_mode = chain.debug_mode;
+    replica.record = (r == 0);
+    replica.barrier = &barrier;
+    replica.stop = false;
+  }
+
+  // Every replica but the cold one steps on a thread of its own, for the
+  // whole chain. Any that cannot be started step on this thread instead.
+  // The threads wait on the barrier's lock until it knows their number.
+  std::vector<pthread_t> threads(nreplicas);
+  std::vector<bool> threaded(nreplicas, false);
+  pthread_mutex_lock(&barrier.mutex);
+  for (size_t r=1; r<nreplicas; r++) {
+    threaded[r] = (pthread_create(&threads[r], NULL, MCMC::replica_thread,
+                                  &replicas[r]) == 0);
+    barrier.nthreads += (threaded[r] ? 1 : 0);
+  }
+  pthread_mutex_unlock(&barrier.mutex);
+
+  std::vector<unsigned> nswaps(nreplicas - 1, 0);
+  std::vector<unsigned> nswap_tries(nreplicas - 1, 0);
+  std::vector<float>& samples = chain.samples;
+  unsigned i = 0;
+  unsigned round = 0;
+
+  while (i < nsteps) {
+    // Re-tune jump distributions based on burn-in phase, reporting only
+    // the cold replica's
+    if (i > 0 && (i == burnin_steps || i == 2 * burnin_steps)) {
+      std::ostringstream ss;
+      for (size_t r=0; r<nreplicas; r++) {
+        std::ostringstream hot;
+        this->end_burnin_phase(replicas[r].jumps, &replicas[r].x[0],
+                               burnin_steps, false, !chain.debug_mode,
+                               label, (r == 0 ? ss : hot));
+      }
+      std::cout << ss.str() << std::flush;
+
+      // Save all steps when in debug mode
+      if (!chain.debug_mode) {
+        samples.clear();
+      }
+    }
+
+    // Move every replica side by side, stopping at the burn-in boundaries
+    unsigned nseg = std::min(this->options.swap_interval, nsteps - i);
+    if (i < burnin_steps) {
+      nseg = std::min(nseg, burnin_steps - i);
+    }
+    else if (i < 2 * burnin_steps) {
+      nseg = std::min(nseg, 2 * burnin_steps - i);
+    }
+    for (size_t r=0; r<nreplicas; r++) {
+      replicas[r].nsteps = nseg;
+      replicas[r].adapt = (i < 2 * burnin_steps);
+    }
+    barrier_wait(barrier);
+    for (size_t r=0; r<nreplicas; r++) {
+      if (!threaded[r]) {
+        this->replica_steps(replicas[r]);
+      }
+    }
+    barrier_wait(barrier);
+    samples.insert(samples.end(), replicas[0].trace.begin(),
+                   replicas[0].trace.end());
+    const unsigned first = i;
+    i += nseg;
+
+    // Exchange states between neighbours, even and odd pairs in turn,
+    // with probability min(1, exp((b_r - b_r+1) * (NLL_r - NLL_r+1))).
+    // During burn-in, each walk folds in the point it leaves.
+    for (size_t r=round%2; r+1<nreplicas; r+=2) {
+      Replica& a = replicas[r];
+      Replica& b = replicas[r + 1];
+      double log_a = (a.beta - b.beta) * (a.nll_x - b.nll_x);
+      nswap_tries[r]++;
+      if (log(rng->Uniform()) < log_a) {
+        for (int k=0; k<2 && a.adapt; k++) {
+          Replica& c = (k == 0 ? a : b);
+          const std::vector<int> block(c.jumps.layout.blocks[0].begin(),
+                                       c.jumps.layout.blocks[0].end());
+          double* stats = c.jumps.walk_stats->hostPtr();
+          walk_update(&c.x[0], block.size(), &block[0], stats[0],
+                      stats + c.jumps.layout.stats_start[0], false);
+        }
+        std::swap(a.x, b.x);
+        std::swap(a.nll_x, b.nll_x);
+        nswaps[r]++;
+      }
+    }
+    round++;
+
+    if (first % chain.sync_interval == 0 ||
+        first / chain.sync_interval != (i - 1) / chain.sync_interval ||
+        i == nsteps) {
+      std::ostringstream ss;
+      ss << "MCMC: " << label << "Step " << i - 1 << "/" << nsteps
+         << " (" << samples.size() / nfields << " saved, "
+         << replicas[0].naccepted << " accepted)" << std::endl;
+      ss << "MCMC: " << label << "Replica swaps accepted:";
+      for (size_t r=0; r+1<nreplicas; r++) {
+        ss << " " << nswaps[r] << "/" << nswap_tries[r];
+        nswaps[r] = 0;
+        nswap_tries[r] = 0;
+      }
+      ss << std::endl;
+      std::cout << ss.str() << std::flush;
+      replicas[0].naccepted = 0;
+    }
+  }
+
+  // Release the replica threads
+  for (size_t r=0; r<nreplicas; r++) {
+    replicas[r].stop = true;
+  }
+  barrier_wait(barrier);
+  for (size_t r=0; r<nreplicas; r++) {
+    if (threaded[r]) {
+      pthread_join(threads[r], NULL);
+    }
+  }
+  pthread_mutex_destroy(&barrier.mutex);
+  pthread_cond_destroy(&barrier.cond);
+
+  for (size_t r=0; r<nreplicas; r++) {
+    release_jumps(replicas[r].jumps);
+    delete replicas[r].vector;
+    delete replicas[r].result;
+    delete replicas[r].rng;
+    if (r > 0) {
+      delete replicas[r].nll;
+      for (size_t k=0; k<replica_pdfs[r].size(); k++) {
+        delete replica_pdfs[r][k];
+      }
+    }
+  }
+}
+
+
+void MCMC::replica_steps(Replica& replica) {
+  const size_t np = this->nparameters;
+  const double* lower = this->parameter_lower->readOnlyHostPtr();
+  const double* upper = this->parameter_upper->readOnlyHostPtr();
+  const std::vector<size_t>& free = replica.jumps.layout.blocks[0];
+  const std::vector<int> block(free.begin(), free.end());
+  const float* width = replica.jumps.width->readOnlyHostPtr();
+  double* walk_stats = replica.jumps.walk_stats->hostPtr();
+  double* block_stats = walk_stats + replica.jumps.layout.stats_start[0];
+  std::vector<double> y(replica.x);
+  replica.trace.clear();
+
+  for (unsigned s=0; s<replica.nsteps; s++) {
+    for (size_t k=0; k<free.size(); k++) {
+      const size_t j = free[k];
+      y[j] = replica.rng->Gaus(replica.x[j], width[k]);
+      if (this->options.reflect_bounds) {
+        y[j] = reflect_into(y[j], lower[j], upper[j]);
+      }
+    }
+
+    // Proposals out of bounds are rejected without evaluating
+    double nll_y = 1e18;
+    if (this->in_bounds(&y[0])) {
+      std::copy(y.begin(), y.end(), replica.vector->writeOnlyHostPtr());
+      replica.nll->eval_pdfs(replica.vector);
+      replica.nll->nll(replica.vector->readOnlyPtr(),
+                       replica.result->writeOnlyPtr());
+      nll_y = replica.result->readOnlyHostPtr()[0];
+    }
+
+    // Metropolis acceptance for the tempered target L^beta. During
+    // burn-in, the walk folds in the point it leaves (see walk_update).
+    double log_r = replica.beta * (replica.nll_x - nll_y);
+    const bool accepted = \
+      (replica.debug_mode || log(replica.rng->Uniform()) < log_r);
+    if (replica.adapt) {
+      walk_stats[0] += 1;
+      if (accepted) {
+        walk_update(&replica.x[0], block.size(), &block[0],
+                    walk_stats[0] - 1, block_stats, false);
+      }
+    }
+    if (accepted) {
+      replica.x = y;
+      replica.nll_x = nll_y;
+      replica.naccepted++;
+    }
+
+    if (replica.record) {
+      replica.trace.insert(replica.trace.end(), replica.x.begin(),
+                           replica.x.end());
+      replica.trace.push_back(replica.nll_x);
+    }
+  }
+}
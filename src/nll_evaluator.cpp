@@ -0,0 +1,685 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <assert.h>
+#include <hemi/hemi.h>
+
+#include <sxmc/nll_evaluator.h>
+#include <sxmc/nll_kernels.h>
+#include <sxmc/pdfz.h>
+
+#ifndef __HEMI_ARRAY_H__
+#define __HEMI_ARRAY_H__
+#include <hemi/array.h>
+#endif
+
+NLLEvaluator::NLLEvaluator(const std::vector<pdfz::Eval*>& pdfs,
+                           size_t nsystematics, size_t nobservables,
+                           hemi::Array<double>* parameter_means,
+                           hemi::Array<double>* parameter_sigma,
+                           hemi::Array<double>* parameter_lower,
+                           hemi::Array<double>* parameter_upper,
+                           LookupTable lookup_table,
+                           bool mc_statistics)
+    : pdfs(pdfs) {
+  this->nsignals = pdfs.size();
+  this->nsystematics = nsystematics;
+  this->nparameters = this->nsignals + this->nsystematics;
+  this->nobservables = nobservables;
+  this->parameter_means = parameter_means;
+  this->parameter_sigma = parameter_sigma;
+  this->parameter_lower = parameter_lower;
+  this->parameter_upper = parameter_upper;
+  this->nevents = 0;
+  this->nbins = 0;
+  this->bin_volume = 0;
+  this->use_hists = false;
+  this->lookup_table = lookup_table;
+  this->mc_statistics = mc_statistics;
+
+#ifdef __CUDACC__
+  this->nnllblocks = 64;
+  this->nllblocksize = 256;
+  this->event_major = false;
+#else
+  this->nnllblocks = 1;
+  this->nllblocksize = 1;
+  this->event_major = true;
+#endif
+  this->nnllthreads = this->nnllblocks * this->nllblocksize;
+  this->nreducethreads = 128;
+  this->blocksize = 128;
+  this->nblocks = this->nsignals / this->blocksize + 1;
+
+  this->dataweights = NULL;
+  this->bin_ids = NULL;
+  this->lut = NULL;
+  this->lut_bf16 = NULL;
+  this->hists = NULL;
+  this->sumw2 = NULL;
+  this->mixture = NULL;
+  this->proposed_mixture = NULL;
+
+  this->hist_scales = \
+    new hemi::Array<double>(this->nsignals * NLL_MAX_BATCH, true);
+  this->hist_scales->writeOnlyHostPtr();
+
+  this->normalizations = new hemi::Array<unsigned>(this->nsignals, true);
+  this->normalizations->writeOnlyHostPtr();
+
+  this->event_partial_sums = new hemi::Array<double>(this->nnllthreads, true);
+  this->event_partial_sums->writeOnlyHostPtr();
+
+  this->event_total_sum = new hemi::Array<double>(1, true);
+  this->event_total_sum->writeOnlyHostPtr();
+
+  this->batch_partial_sums = \
+    new hemi::Array<double>(this->nnllthreads * NLL_MAX_BATCH, true);
+  this->batch_partial_sums->writeOnlyHostPtr();
+
+  this->batch_total_sums = new hemi::Array<double>(NLL_MAX_BATCH, true);
+  this->batch_total_sums->writeOnlyHostPtr();
+
+  this->grad_partial_sums = \
+    new hemi::Array<double>(this->nnllthreads * this->nsignals, true);
+  this->grad_partial_sums->writeOnlyHostPtr();
+
+  this->grad_totals = new hemi::Array<double>(this->nsignals, true);
+  this->grad_totals->writeOnlyHostPtr();
+
+  this->nll_value = new hemi::Array<double>(1, true);
+  this->nll_value->writeOnlyHostPtr();
+
+  this->shifted_vector = new hemi::Array<double>(this->nparameters, true);
+  this->shifted_vector->writeOnlyHostPtr();
+
+  this->rate_proposed = new hemi::Array<double>(1, true);
+  this->rate_proposed->writeOnlyHostPtr();
+
+  this->parameter_fixed.resize(this->nparameters, false);
+  this->pdf_frozen.resize(this->nsignals, false);
+  this->pdf_current.resize(this->nsignals, false);
+}
+
+
+NLLEvaluator::~NLLEvaluator() {
+  // Hand the PDFs back their own histograms before ours go away
+  if (this->hists) {
+    for (size_t i=0; i<this->pdfs.size(); i++) {
+      dynamic_cast<pdfz::EvalHist*>(this->pdfs[i])->SetHistogramBuffer(NULL);
+      dynamic_cast<pdfz::EvalHist*>(this->pdfs[i])->SetSumw2Buffer(NULL);
+    }
+  }
+
+  delete dataweights;
+  delete bin_ids;
+  delete lut;
+  delete lut_bf16;
+  delete hists;
+  delete sumw2;
+  delete hist_scales;
+  delete normalizations;
+  delete event_partial_sums;
+  delete event_total_sum;
+  delete batch_partial_sums;
+  delete batch_total_sums;
+  delete grad_partial_sums;
+  delete grad_totals;
+  delete nll_value;
+  delete shifted_vector;
+  delete mixture;
+  delete proposed_mixture;
+  delete rate_proposed;
+}
+
+
+void NLLEvaluator::set_data(const std::vector<float>& data,
+                            const std::vector<int>& weights) {
+  // Evaluate the PDFs once per occupied bin rather than once per event
+  std::vector<float> points;
+  std::vector<int> point_weights;
+  std::vector<int> point_bins;
+  bool collapsed = \
+    this->collapse_events(data, weights, points, point_weights, point_bins);
+  if (!collapsed) {
+    points = data;
+    point_weights = weights;
+  }
+  this->use_hists = (collapsed && this->lookup_table == LUT_AUTO);
+
+  this->nevents = point_weights.size();
+
+  // New buffers, so even frozen PDFs must be evaluated again
+  std::fill(this->pdf_current.begin(), this->pdf_current.end(), false);
+
+  // Create hemi buffer for weighting data points
+  delete this->dataweights;
+  this->dataweights = new hemi::Array<int>(this->nevents, true);
+  this->dataweights->copyFromHost(&point_weights.front(), this->nevents);
+
+  delete this->mixture;
+  delete this->proposed_mixture;
+  this->mixture = new hemi::Array<double>(this->nevents, true);
+  this->proposed_mixture = new hemi::Array<double>(this->nevents, true);
+
+  if (this->use_hists) {
+    pdfz::EvalHist* h0 = dynamic_cast<pdfz::EvalHist*>(this->pdfs[0]);
+    this->nbins = h0->GetNbins();
+    this->bin_volume = h0->GetBinVolume();
+
+    delete this->bin_ids;
+    this->bin_ids = new hemi::Array<int>(this->nevents, true);
+    this->bin_ids->copyFromHost(&point_bins.front(), this->nevents);
+
+    // The PDFs bin their samples straight into a shared buffer, which is
+    // read by bin index in place of a table of PDF values
+    delete this->hists;
+    this->hists = new hemi::Array<unsigned>(this->nbins * this->nsignals,
+                                            true);
+    this->hists->writeOnlyPtr();
+
+    // Sums of squared sample weights, in the same layout, for the variance
+    // of the bin contents
+    delete this->sumw2;
+    this->sumw2 = NULL;
+    if (this->mc_statistics) {
+      this->sumw2 = \
+        new hemi::Array<unsigned long long>(this->nbins * this->nsignals,
+                                            true);
+      this->sumw2->writeOnlyPtr();
+    }
+
+    for (size_t i=0; i<this->pdfs.size(); i++) {
+      pdfz::EvalHist* h = dynamic_cast<pdfz::EvalHist*>(this->pdfs[i]);
+      if (this->event_major) {
+        h->SetHistogramBuffer(this->hists, i, this->nsignals);
+        h->SetSumw2Buffer(this->sumw2, i, this->nsignals);
+      }
+      else {
+        h->SetHistogramBuffer(this->hists, i * this->nbins, 1);
+        h->SetSumw2Buffer(this->sumw2, i * this->nbins, 1);
+      }
+      h->SetNormalizationBuffer(this->normalizations, i);
+    }
+  }
+  else {
+    const size_t size = this->nevents * this->nsignals;
+    delete this->lut;
+    delete this->lut_bf16;
+    this->lut = NULL;
+    this->lut_bf16 = NULL;
+    if (this->lookup_table == LUT_BFLOAT16) {
+      this->lut_bf16 = new hemi::Array<unsigned short>(size, true);
+    }
+    else {
+      this->lut = new hemi::Array<float>(size, true);
+    }
+
+    for (size_t i=0; i<this->pdfs.size(); i++) {
+      pdfz::Eval* p = this->pdfs[i];
+      p->SetEvalPoints(points);
+      p->SetNormalizationBuffer(this->normalizations, i);
+    }
+    this->set_lut_buffers();
+  }
+}
+
+
+void NLLEvaluator::fix_parameters(const std::vector<bool>& fixed) {
+  assert(fixed.size() == this->nparameters);
+  this->parameter_fixed = fixed;
+
+  for (size_t i=0; i<this->pdfs.size(); i++) {
+    std::vector<int> pars = this->pdfs[i]->GetSystematicParameters();
+    bool frozen = true;
+    for (size_t j=0; j<pars.size(); j++) {
+      frozen = frozen && fixed[this->nsignals + pars[j]];
+    }
+    this->pdf_frozen[i] = frozen;
+    this->pdf_current[i] = false;
+  }
+}
+
+
+bool NLLEvaluator::pdfs_fixed() const {
+  for (size_t i=0; i<this->pdf_frozen.size(); i++) {
+    if (!this->pdf_frozen[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void NLLEvaluator::eval_pdfs(hemi::Array<double>* v) {
+  std::vector<bool> launched(this->pdfs.size(), false);
+  for (size_t i=0; i<this->pdfs.size(); i++) {
+    if (this->pdf_frozen[i] && this->pdf_current[i]) {
+      continue;
+    }
+    this->pdfs[i]->SetParameterBuffer(v, this->nsignals);
+    this->pdfs[i]->EvalAsync(!this->use_hists);
+    launched[i] = true;
+  }
+  for (size_t i=0; i<this->pdfs.size(); i++) {
+    if (launched[i]) {
+      this->pdfs[i]->EvalFinished();
+      this->pdf_current[i] = true;
+    }
+  }
+}
+
+
+void NLLEvaluator::event_sums(const double* v) {
+  if (this->use_hists) {
+    HEMI_KERNEL_LAUNCH(nll_hist_scales, this->nblocks, this->blocksize, 0, 0,
+                       this->nsignals, 1, v, this->nparameters,
+                       this->normalizations->readOnlyPtr(),
+                       this->bin_volume, this->hist_scales->writeOnlyPtr());
+
+    HEMI_KERNEL_LAUNCH(nll_event_chunks_hist,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       this->hists->readOnlyPtr(), this->bin_ids->readOnlyPtr(),
+                       this->dataweights->readOnlyPtr(),
+                       this->hist_scales->readOnlyPtr(),
+                       this->nevents, this->nsignals, this->nbins,
+                       this->event_major, this->event_partial_sums->ptr());
+
+    if (this->sumw2) {
+      HEMI_KERNEL_LAUNCH(nll_bin_profile,
+                         this->nnllblocks, this->nllblocksize, 0, 0,
+                         this->hists->readOnlyPtr(),
+                         this->sumw2->readOnlyPtr(),
+                         this->bin_ids->readOnlyPtr(),
+                         this->dataweights->readOnlyPtr(),
+                         this->hist_scales->readOnlyPtr(), this->bin_volume,
+                         this->nevents, this->nsignals, this->nbins,
+                         this->event_major, 1,
+                         this->event_partial_sums->ptr(), NULL);
+    }
+  }
+  else {
+    HEMI_KERNEL_LAUNCH(nll_event_chunks,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       (this->lut ? this->lut->readOnlyPtr() : NULL),
+                       (this->lut_bf16 ? this->lut_bf16->readOnlyPtr() : NULL),
+                       this->dataweights->readOnlyPtr(), v,
+                       this->nevents, this->nsignals, this->event_major,
+                       this->event_partial_sums->ptr());
+  }
+}
+
+
+void NLLEvaluator::mixture_sums(const double* v) {
+  if (this->use_hists) {
+    HEMI_KERNEL_LAUNCH(nll_hist_scales, this->nblocks, this->blocksize, 0, 0,
+                       this->nsignals, 1, v, this->nparameters,
+                       this->normalizations->readOnlyPtr(),
+                       this->bin_volume, this->hist_scales->writeOnlyPtr());
+
+    HEMI_KERNEL_LAUNCH(nll_mixture_sums_hist,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       this->hists->readOnlyPtr(), this->bin_ids->readOnlyPtr(),
+                       this->hist_scales->readOnlyPtr(),
+                       this->nevents, this->nsignals, this->nbins,
+                       this->event_major, this->mixture->writeOnlyPtr());
+  }
+  else {
+    HEMI_KERNEL_LAUNCH(nll_mixture_sums,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       (this->lut ? this->lut->readOnlyPtr() : NULL),
+                       (this->lut_bf16 ? this->lut_bf16->readOnlyPtr() : NULL),
+                       v, this->nevents, this->nsignals, this->event_major,
+                       this->mixture->writeOnlyPtr());
+  }
+}
+
+
+void NLLEvaluator::component_sums(size_t k, const double* current,
+                                  const double* proposed) {
+  if (this->use_hists) {
+    HEMI_KERNEL_LAUNCH(nll_component_chunks_hist,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       this->hists->readOnlyPtr(), this->bin_ids->readOnlyPtr(),
+                       this->dataweights->readOnlyPtr(),
+                       this->normalizations->readOnlyPtr(), this->bin_volume,
+                       current, proposed, k, this->nevents, this->nsignals,
+                       this->nbins, this->event_major,
+                       this->mixture->readOnlyPtr(),
+                       this->proposed_mixture->writeOnlyPtr(),
+                       this->rate_proposed->writeOnlyPtr(),
+                       this->event_partial_sums->ptr());
+  }
+  else {
+    HEMI_KERNEL_LAUNCH(nll_component_chunks,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       (this->lut ? this->lut->readOnlyPtr() : NULL),
+                       (this->lut_bf16 ? this->lut_bf16->readOnlyPtr() : NULL),
+                       this->dataweights->readOnlyPtr(),
+                       current, proposed, k, this->nevents, this->nsignals,
+                       this->event_major, this->mixture->readOnlyPtr(),
+                       this->proposed_mixture->writeOnlyPtr(),
+                       this->rate_proposed->writeOnlyPtr(),
+                       this->event_partial_sums->ptr());
+  }
+}
+
+
+void NLLEvaluator::commit_component(size_t k, const double* current) {
+  HEMI_KERNEL_LAUNCH(nll_component_commit,
+                     this->nnllblocks, this->nllblocksize, 0, 0,
+                     this->nevents, k, current,
+                     this->rate_proposed->readOnlyPtr(),
+                     this->proposed_mixture->readOnlyPtr(),
+                     this->mixture->ptr());
+}
+
+
+void NLLEvaluator::nll(const double* v, double* nll) {
+  // Partial sums of event term
+  this->event_sums(v);
+
+  // Total of event term
+  HEMI_KERNEL_LAUNCH(nll_event_reduce, 1, this->nreducethreads,
+                     this->nreducethreads * sizeof(double), 0,
+                     this->nnllthreads, this->event_partial_sums->ptr(),
+                     this->event_total_sum->ptr());
+
+  // Constraints + event term
+  HEMI_KERNEL_LAUNCH(nll_total, 1, 1, 0, 0,
+                     this->nparameters, v, this->nsignals,
+                     this->parameter_means->readOnlyPtr(),
+                     this->parameter_sigma->readOnlyPtr(),
+                     this->parameter_lower->readOnlyPtr(),
+                     this->parameter_upper->readOnlyPtr(),
+                     this->event_total_sum->ptr(), nll);
+}
+
+
+double NLLEvaluator::nll_gradient(hemi::Array<double>* v, double* grad) {
+  const size_t ns = this->nsignals;
+  const double* means = this->parameter_means->readOnlyHostPtr();
+  const double* sigmas = this->parameter_sigma->readOnlyHostPtr();
+
+  // Systematics: central differences, each with its own PDF evaluation
+  for (size_t k=ns; k<this->nparameters; k++) {
+    if (this->parameter_fixed[k]) {
+      grad[k] = 0;
+      continue;
+    }
+    const double h = (sigmas[k] > 0 ? 0.05 * sigmas[k] : 1e-3);
+    double nlls[2];
+    for (int d=0; d<2; d++) {
+      double* u = this->shifted_vector->writeOnlyHostPtr();
+      std::copy(v->readOnlyHostPtr(), v->readOnlyHostPtr() + this->nparameters,
+                u);
+      u[k] += (d == 0 ? h : -h);
+      this->eval_pdfs(this->shifted_vector);
+      this->nll(this->shifted_vector->readOnlyPtr(),
+                this->nll_value->writeOnlyPtr());
+      nlls[d] = this->nll_value->readOnlyHostPtr()[0];
+    }
+    grad[k] = (nlls[0] - nlls[1]) / (2 * h);
+  }
+  // Back to v after the shifts, or for the first time
+  this->eval_pdfs(v);
+
+  // Rates: event term and its gradient in one pass over the data
+  if (this->use_hists) {
+    HEMI_KERNEL_LAUNCH(nll_hist_scales, this->nblocks, this->blocksize, 0, 0,
+                       ns, 1, v->readOnlyPtr(), this->nparameters,
+                       this->normalizations->readOnlyPtr(),
+                       this->bin_volume, this->hist_scales->writeOnlyPtr());
+
+    HEMI_KERNEL_LAUNCH(nll_event_grad_hist,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       this->hists->readOnlyPtr(), this->bin_ids->readOnlyPtr(),
+                       this->dataweights->readOnlyPtr(),
+                       this->hist_scales->readOnlyPtr(),
+                       this->nevents, ns, this->nbins, this->event_major,
+                       this->event_partial_sums->ptr(),
+                       this->grad_partial_sums->writeOnlyPtr());
+
+    if (this->sumw2) {
+      HEMI_KERNEL_LAUNCH(nll_bin_profile,
+                         this->nnllblocks, this->nllblocksize, 0, 0,
+                         this->hists->readOnlyPtr(),
+                         this->sumw2->readOnlyPtr(),
+                         this->bin_ids->readOnlyPtr(),
+                         this->dataweights->readOnlyPtr(),
+                         this->hist_scales->readOnlyPtr(), this->bin_volume,
+                         this->nevents, ns, this->nbins, this->event_major, 1,
+                         this->event_partial_sums->ptr(),
+                         this->grad_partial_sums->ptr());
+    }
+  }
+  else {
+    HEMI_KERNEL_LAUNCH(nll_event_grad,
+                       this->nnllblocks, this->nllblocksize, 0, 0,
+                       (this->lut ? this->lut->readOnlyPtr() : NULL),
+                       (this->lut_bf16 ? this->lut_bf16->readOnlyPtr() : NULL),
+                       this->dataweights->readOnlyPtr(), v->readOnlyPtr(),
+                       this->nevents, ns, this->event_major,
+                       this->event_partial_sums->ptr(),
+                       this->grad_partial_sums->writeOnlyPtr());
+  }
+
+  HEMI_KERNEL_LAUNCH(nll_event_reduce, 1, this->nreducethreads,
+                     this->nreducethreads * sizeof(double), 0,
+                     this->nnllthreads, this->event_partial_sums->ptr(),
+                     this->event_total_sum->ptr());
+
+  HEMI_KERNEL_LAUNCH(nll_total, 1, 1, 0, 0,
+                     this->nparameters, v->readOnlyPtr(), ns,
+                     this->parameter_means->readOnlyPtr(),
+                     this->parameter_sigma->readOnlyPtr(),
+                     this->parameter_lower->readOnlyPtr(),
+                     this->parameter_upper->readOnlyPtr(),
+                     this->event_total_sum->ptr(),
+                     this->nll_value->writeOnlyPtr());
+
+  for (size_t j=0; j<ns; j++) {
+    HEMI_KERNEL_LAUNCH(nll_event_reduce, 1, this->nreducethreads,
+                       this->nreducethreads * sizeof(double), 0,
+                       this->nnllthreads,
+                       this->grad_partial_sums->ptr() + j * this->nnllthreads,
+                       this->grad_totals->ptr() + j);
+  }
+
+  // Histogram sums are of bin contents, not normalized PDF values
+  const double* x = v->readOnlyHostPtr();
+  const double* g = this->grad_totals->readOnlyHostPtr();
+  const unsigned* norms = this->normalizations->readOnlyHostPtr();
+  for (size_t j=0; j<ns; j++) {
+    double unit = 1;
+    if (this->use_hists) {
+      double norm = norms[j] * this->bin_volume;
+      unit = (norm > 0 ? 1.0 / norm : 0);
+    }
+    grad[j] = 1 - unit * g[j];
+    if (sigmas[j] > 0) {
+      grad[j] += 2 * (x[j] - means[j]) / (sigmas[j] * sigmas[j]);
+    }
+  }
+
+  return this->nll_value->readOnlyHostPtr()[0];
+}
+
+
+void NLLEvaluator::nll_batch(const double* vs, size_t nv, double* nlls) {
+  for (size_t k0=0; k0<nv; k0+=NLL_MAX_BATCH) {
+    const unsigned nb = std::min(nv - k0, (size_t) NLL_MAX_BATCH);
+    const double* v = vs + k0 * this->nparameters;
+
+    // Partial sums of event terms, one pass over the data for all vectors
+    if (this->use_hists) {
+      HEMI_KERNEL_LAUNCH(nll_hist_scales, this->nblocks, this->blocksize,
+                         0, 0, this->nsignals, nb, v, this->nparameters,
+                         this->normalizations->readOnlyPtr(),
+                         this->bin_volume, this->hist_scales->writeOnlyPtr());
+
+      HEMI_KERNEL_LAUNCH(nll_event_chunks_hist_batch,
+                         this->nnllblocks, this->nllblocksize, 0, 0,
+                         this->hists->readOnlyPtr(),
+                         this->bin_ids->readOnlyPtr(),
+                         this->dataweights->readOnlyPtr(),
+                         this->hist_scales->readOnlyPtr(),
+                         this->nevents, this->nsignals, this->nbins,
+                         this->event_major, nb,
+                         this->batch_partial_sums->ptr());
+
+      if (this->sumw2) {
+        HEMI_KERNEL_LAUNCH(nll_bin_profile,
+                           this->nnllblocks, this->nllblocksize, 0, 0,
+                           this->hists->readOnlyPtr(),
+                           this->sumw2->readOnlyPtr(),
+                           this->bin_ids->readOnlyPtr(),
+                           this->dataweights->readOnlyPtr(),
+                           this->hist_scales->readOnlyPtr(), this->bin_volume,
+                           this->nevents, this->nsignals, this->nbins,
+                           this->event_major, nb,
+                           this->batch_partial_sums->ptr(), NULL);
+      }
+    }
+    else {
+      HEMI_KERNEL_LAUNCH(nll_event_chunks_batch,
+                         this->nnllblocks, this->nllblocksize, 0, 0,
+                         (this->lut ? this->lut->readOnlyPtr() : NULL),
+                         (this->lut_bf16 ? this->lut_bf16->readOnlyPtr() : NULL),
+                         this->dataweights->readOnlyPtr(),
+                         v, this->nparameters,
+                         this->nevents, this->nsignals, this->event_major, nb,
+                         this->batch_partial_sums->ptr());
+    }
+
+    // Totals and constraints for each vector
+    for (unsigned k=0; k<nb; k++) {
+      HEMI_KERNEL_LAUNCH(nll_event_reduce, 1, this->nreducethreads,
+                         this->nreducethreads * sizeof(double), 0,
+                         this->nnllthreads,
+                         this->batch_partial_sums->ptr() + k * this->nnllthreads,
+                         this->batch_total_sums->ptr() + k);
+
+      HEMI_KERNEL_LAUNCH(nll_total, 1, 1, 0, 0,
+                         this->nparameters, v + k * this->nparameters,
+                         this->nsignals,
+                         this->parameter_means->readOnlyPtr(),
+                         this->parameter_sigma->readOnlyPtr(),
+                         this->parameter_lower->readOnlyPtr(),
+                         this->parameter_upper->readOnlyPtr(),
+                         this->batch_total_sums->ptr() + k, nlls + k0 + k);
+    }
+  }
+}
+
+
+void NLLEvaluator::report_lut_error(hemi::Array<double>* v) {
+  if (!this->lut_bf16) {
+    return;
+  }
+
+  hemi::Array<double> nll_value(1, true);
+
+  // Reference: the same table in full precision
+  this->lut = new hemi::Array<float>(this->lut_bf16->size(), true);
+  this->set_lut_buffers();
+  this->eval_pdfs(v);
+  this->nll(v->readOnlyPtr(), nll_value.writeOnlyPtr());
+  const double nll_float = nll_value.readOnlyHostPtr()[0];
+
+  // Back to bfloat16 storage
+  hemi::Array<float>* lut_float = this->lut;
+  this->lut = NULL;
+  this->set_lut_buffers();
+  this->eval_pdfs(v);
+  this->nll(v->readOnlyPtr(), nll_value.writeOnlyPtr());
+  const double nll_bf16 = nll_value.readOnlyHostPtr()[0];
+
+  const float* pf = lut_float->readOnlyHostPtr();
+  const unsigned short* pb = this->lut_bf16->readOnlyHostPtr();
+  double max_error = 0;
+  for (size_t i=0; i<lut_float->size(); i++) {
+    if (pf[i] > 0) {
+      double error = fabs(pdfz::from_bfloat16(pb[i]) - pf[i]) / pf[i];
+      max_error = std::max(max_error, error);
+    }
+  }
+  delete lut_float;
+
+  std::cout << "NLLEvaluator: bfloat16 lookup table: max relative PDF error "
+            << max_error << ", NLL " << nll_bf16 << " (float: " << nll_float
+            << ", error " << nll_bf16 - nll_float << ")" << std::endl;
+}
+
+
+void NLLEvaluator::set_lut_buffers() {
+  std::fill(this->pdf_current.begin(), this->pdf_current.end(), false);
+  for (size_t i=0; i<this->pdfs.size(); i++) {
+    pdfz::Eval* p = this->pdfs[i];
+    const size_t offset = (this->event_major ? i : i * this->nevents);
+    const size_t stride = (this->event_major ? this->nsignals : 1);
+    if (this->lut) {
+      p->SetPDFValueBuffer(this->lut, offset, stride);
+    }
+    else {
+      p->SetPDFValueBuffer(this->lut_bf16, offset, stride);
+    }
+  }
+}
+
+
+bool NLLEvaluator::collapse_events(const std::vector<float>& data,
+                                   const std::vector<int>& weights,
+                                   std::vector<float>& points,
+                                   std::vector<int>& point_weights,
+                                   std::vector<int>& point_bins) {
+  // Only histogram PDFs sharing a binning give every event in a bin the same
+  // row of PDF values
+  std::vector<int> bin_ids;
+  pdfz::EvalHist* h0 = dynamic_cast<pdfz::EvalHist*>(this->pdfs[0]);
+  for (size_t i=0; i<this->pdfs.size(); i++) {
+    pdfz::EvalHist* hist = dynamic_cast<pdfz::EvalHist*>(this->pdfs[i]);
+    if (!hist || hist->GetNbins() != h0->GetNbins() ||
+        hist->GetBinVolume() != h0->GetBinVolume()) {
+      return false;
+    }
+
+    std::vector<int> ids;
+    hist->GetBinIndices(data, ids);
+    if (i == 0) {
+      bin_ids.swap(ids);
+    }
+    else if (ids != bin_ids) {
+      return false;
+    }
+  }
+
+  // One point per occupied bin, at the first event found in it, carrying the
+  // total weight of the events in that bin
+  std::map<int, size_t> bin_point;
+  points.clear();
+  point_weights.clear();
+  point_bins.clear();
+  for (size_t i=0; i<bin_ids.size(); i++) {
+    std::map<int, size_t>::iterator it = bin_point.find(bin_ids[i]);
+    if (it != bin_point.end()) {
+      point_weights[it->second] += weights[i];
+      continue;
+    }
+
+    bin_point[bin_ids[i]] = point_weights.size();
+    point_weights.push_back(weights[i]);
+    point_bins.push_back(bin_ids[i]);
+    for (size_t j=0; j<this->nobservables; j++) {
+      points.push_back(data[i * this->nobservables + j]);
+    }
+  }
+
+  std::cout << "NLLEvaluator: Collapsed " << bin_ids.size() << " events into "
+            << point_weights.size() << " occupied bins" << std::endl;
+
+  return true;
+}
+
@@ -0,0 +1,307 @@
+/**
+ * \file nll_evaluator.h
+ *
+ * Device-side evaluation of the negative log likelihood of a data set.
+ */
+
+#ifndef __NLL_EVALUATOR_H__
+#define __NLL_EVALUATOR_H__
+
+#include <vector>
+#include <cuda.h>
+#include <hemi/hemi.h>
+
+#include <sxmc/pdfz.h>
+
+#ifndef __HEMI_ARRAY_H__
+#define __HEMI_ARRAY_H__
+#include <hemi/array.h>
+#endif
+
+/**
+ * \class NLLEvaluator
+ * \brief Evaluates the NLL of a data set under a mixture of signal PDFs
+ *
+ * Owns the buffers needed to evaluate the NLL for one data set. Parameter
+ * vectors are read from, and results are written to, hemi buffers, so a
+ * random walk never needs to copy them back to the host.
+ *
+ * When all PDFs are histograms with a common binning, events are grouped by
+ * bin and the event term is gathered straight from the PDF histograms, with
+ * no table of PDF values at each event. Otherwise, the PDFs are evaluated at
+ * every event into a lookup table, which may be stored in bfloat16 to halve
+ * its size.
+ *
+ * In the histogram mode, the finite statistics of the PDF samples may also
+ * be accounted for, with one scale factor per occupied bin profiled in
+ * closed form (see bin_profile).
+ */
+class NLLEvaluator {
+  public:
+    /** Storage for the PDF values at each event */
+    enum LookupTable {
+      LUT_AUTO,  //!< read histograms if possible, else a float table
+      LUT_FLOAT,  //!< always use a float table
+      LUT_BFLOAT16,  //!< always use a bfloat16 table
+    };
+
+    /**
+     * Constructor
+     *
+     * \param pdfs PDF for each signal, in rate parameter order
+     * \param nsystematics Number of systematic parameters, after the rates
+     * \param nobservables Number of observables in the data
+     * \param parameter_means Parameter central values
+     * \param parameter_sigma Parameter Gaussian uncertainty
+     * \param parameter_lower Lower bound of each parameter, >= 0 for rates
+     * \param parameter_upper Upper bound of each parameter
+     * \param lookup_table Storage for the PDF values at each event
+     * \param mc_statistics Profile the PDF sample statistics in each bin,
+     *                      if the event term is read from histograms
+     */
+    NLLEvaluator(const std::vector<pdfz::Eval*>& pdfs,
+                 size_t nsystematics, size_t nobservables,
+                 hemi::Array<double>* parameter_means,
+                 hemi::Array<double>* parameter_sigma,
+                 hemi::Array<double>* parameter_lower,
+                 hemi::Array<double>* parameter_upper,
+                 LookupTable lookup_table=LUT_AUTO,
+                 bool mc_statistics=false);
+
+    /**
+     * Destructor
+     *
+     * Free HEMI arrays, and detach the PDFs from them.
+     */
+    ~NLLEvaluator();
+
+    /**
+     * Set the data set.
+     *
+     * This does non-trivial calculation, so it should not be called in
+     * performance-critical loops. The PDFs must be evaluated with
+     * eval_pdfs() before computing an NLL.
+     *
+     * \param data Events, in the layout given to pdfz::Eval::SetEvalPoints
+     * \param weights Weight of each event
+     */
+    void set_data(const std::vector<float>& data,
+                  const std::vector<int>& weights);
+
+    /**
+     * Hold some parameters at their current values.
+     *
+     * A PDF whose systematics are all fixed is evaluated once, on the next
+     * call to eval_pdfs(), and then left alone. Fixed parameters have zero
+     * gradient in nll_gradient().
+     *
+     * \param fixed For each parameter, rates then systematics, true if fixed
+     */
+    void fix_parameters(const std::vector<bool>& fixed);
+
+    /** True if no PDF depends on a floating systematic */
+    bool pdfs_fixed() const;
+
+    /**
+     * True if the event term is profiled over the PDF sample statistics.
+     *
+     * Only possible when reading histograms, and known after set_data().
+     * One-rate updates (component_sums()) do not include the profile.
+     */
+    bool profiles_mc_statistics() const { return this->sumw2 != NULL; }
+
+    /**
+     * Re-evaluate the PDFs with the systematic parameters in a vector.
+     *
+     * PDFs frozen by fix_parameters() are only evaluated the first time.
+     *
+     * \param v Parameter vector, rates then systematics
+     */
+    void eval_pdfs(hemi::Array<double>* v);
+
+    /**
+     * NLL Part 1: partial sums of the event term.
+     *
+     * Uses the PDFs from the last call to eval_pdfs(). Output is left in
+     * the partial_sums() buffer, for reduction in a later kernel.
+     *
+     * \param v Parameter vector, rates then systematics
+     */
+    void event_sums(const double* v);
+
+    /**
+     * Compute and keep the mixture sum sum(Nj*Pj(xi)) of each event.
+     *
+     * Starts a sequence of one-rate updates with component_sums(). Must be
+     * called again whenever the PDFs are re-evaluated or the current
+     * parameters change other than through commit_component().
+     *
+     * \param v Current parameter vector
+     */
+    void mixture_sums(const double* v);
+
+    /**
+     * NLL Part 1, for a proposal that moves only one rate.
+     *
+     * Updates the kept mixture sums with the change in one signal's rate,
+     * reading a single column of PDF values, so a step costs about 1/ns of
+     * event_sums(). Output is left in the partial_sums() buffer.
+     *
+     * \param k Index of the signal whose rate is proposed
+     * \param current Current parameter vector, as in mixture_sums()
+     * \param proposed Proposed parameter vector, differing only in rate k
+     */
+    void component_sums(size_t k, const double* current,
+                        const double* proposed);
+
+    /**
+     * Keep the mixture sums from component_sums() if the step was taken.
+     *
+     * \param k Index of the signal whose rate was proposed
+     * \param current Current parameter vector, after the accept/reject step
+     */
+    void commit_component(size_t k, const double* current);
+
+    /**
+     * Evaluate the NLL function
+     *
+     * -logL = sum(Nj) + 1/2*sum((r-r')^2/s^2) - sum(log(sum(Nj*Pj(xi))))
+     *
+     * Uses the PDFs from the last call to eval_pdfs(). Nothing is returned
+     * -- the output stays in the nll array, so it can stay on the device.
+     *
+     * \param v Parameter vector at which to evaluate
+     * \param nll Container for output NLL value
+     */
+    void nll(const double* v, double* nll);
+
+    /**
+     * Evaluate the NLL function at several parameter vectors.
+     *
+     * All vectors share the PDFs from the last call to eval_pdfs(), so they
+     * should differ only in their rates. Each event is read once for up to
+     * NLL_MAX_BATCH vectors, so a batch costs little more than one vector.
+     *
+     * \param vs Parameter vectors, one after another
+     * \param nv Number of parameter vectors
+     * \param nlls Container for output NLL values, one per vector
+     */
+    void nll_batch(const double* vs, size_t nv, double* nlls);
+
+    /**
+     * Evaluate the NLL function and its gradient.
+     *
+     * Derivatives with respect to the rates are exact:
+     *
+     * dNLL/dNj = 1 + 2*(Nj-Nj')/s^2 - sum(Pj(xi)/sum(Nk*Pk(xi)))
+     *
+     * and come from the same pass over the data as the NLL. Derivatives
+     * with respect to systematics are central finite differences, each
+     * re-evaluating the PDFs twice. Histogram PDFs are step functions of the
+     * systematics, so the difference step is a sizeable fraction of the
+     * constraint width (or an absolute step for unconstrained parameters).
+     *
+     * Leaves the PDFs evaluated at v, as in eval_pdfs().
+     *
+     * \param v Parameter vector at which to evaluate
+     * \param grad Output: the gradient, nparameters long, on the host
+     * \returns The NLL at v
+     */
+    double nll_gradient(hemi::Array<double>* v, double* grad);
+
+    /**
+     * Report the error induced by a reduced-precision lookup table.
+     *
+     * Evaluates the PDFs at v into both a float and the bfloat16 table and
+     * prints the largest relative error in a PDF value and the resulting
+     * error in the NLL. Leaves the PDFs evaluated at v, as in eval_pdfs().
+     * Does nothing unless the table is stored in bfloat16.
+     *
+     * \param v Parameter vector at which to compare
+     */
+    void report_lut_error(hemi::Array<double>* v);
+
+    /** Number of partial sums written by event_sums() */
+    size_t npartial_sums() const { return this->nnllthreads; }
+
+    /** Partial sums written by event_sums() */
+    double* partial_sums() { return this->event_partial_sums->ptr(); }
+
+  protected:
+    /**
+     * Point the PDFs at the lookup table, float if allocated, else bfloat16.
+     */
+    void set_lut_buffers();
+
+    /**
+     * Group data events by histogram bin.
+     *
+     * When all PDFs are histograms with a common binning, every event in a
+     * bin has the same PDF values, so the event term of the NLL only needs
+     * one evaluation per occupied bin, weighted by the bin's total event
+     * weight. This is exact, and shrinks the event loop from O(events) to
+     * O(occupied bins).
+     *
+     * \param data Events, in the layout given to pdfz::Eval::SetEvalPoints
+     * \param weights Weight of each event
+     * \param points Output: one representative event per occupied bin
+     * \param point_weights Output: total event weight in each occupied bin
+     * \param point_bins Output: histogram bin index of each point
+     * \returns False, with outputs unset, if the PDFs cannot be collapsed
+     */
+    bool collapse_events(const std::vector<float>& data,
+                         const std::vector<int>& weights,
+                         std::vector<float>& points,
+                         std::vector<int>& point_weights,
+                         std::vector<int>& point_bins);
+
+  private:
+    size_t nsignals;  //!< number of signal parameters
+    size_t nsystematics;  //!< number of systematic parameters
+    size_t nparameters;  //!< total number of parameters
+    size_t nobservables;  //!< number of observables in data
+    size_t nevents;  //!< number of (collapsed) events in data
+    size_t nbins;  //!< number of bins in each pdf histogram
+    double bin_volume;  //!< volume of one pdf histogram bin
+    unsigned nnllblocks;  //!< number of cuda blocks for nll partial sums
+    unsigned nllblocksize;  //!< size of cuda blocks for nll partial sums
+    unsigned nnllthreads;  //!< number of threads for nll partial sums
+    unsigned nreducethreads; //!< number of threads to use in partial sum
+                             //!< reduction kernel
+    unsigned blocksize;  //!< size of blocks for per-signal kernels
+    unsigned nblocks;  //!< number of blocks for per-signal kernels
+    bool event_major;  //!< store pdf values one row per event (or bin)
+    bool use_hists;  //!< read pdf histograms instead of a lookup table
+    LookupTable lookup_table;  //!< requested pdf value storage
+    bool mc_statistics;  //!< profile the pdf sample statistics if possible
+    hemi::Array<double>* parameter_means;  //!< parameter central values
+    hemi::Array<double>* parameter_sigma;  //!< parameter Gaussian uncertainty
+    hemi::Array<double>* parameter_lower;  //!< parameter lower bounds
+    hemi::Array<double>* parameter_upper;  //!< parameter upper bounds
+    hemi::Array<int>* dataweights;  //!< weight of each event
+    hemi::Array<int>* bin_ids;  //!< histogram bin of each event
+    hemi::Array<float>* lut;  //!< pdf values at each event
+    hemi::Array<unsigned short>* lut_bf16;  //!< bfloat16 pdf values
+    hemi::Array<unsigned>* hists;  //!< pdf histogram bin contents
+    hemi::Array<unsigned long long>* sumw2;  //!< pdf sums of squared weights
+    hemi::Array<double>* hist_scales;  //!< per-signal histogram scales
+    hemi::Array<unsigned>* normalizations;  //!< pdf normalizations
+    hemi::Array<double>* event_partial_sums;  //!< event term partial sums
+    hemi::Array<double>* event_total_sum;  //!< event term total
+    hemi::Array<double>* batch_partial_sums;  //!< batched partial sums
+    hemi::Array<double>* batch_total_sums;  //!< batched event term totals
+    hemi::Array<double>* grad_partial_sums;  //!< event gradient partial sums
+    hemi::Array<double>* grad_totals;  //!< event gradient totals
+    hemi::Array<double>* nll_value;  //!< scratch NLL output
+    hemi::Array<double>* shifted_vector;  //!< scratch finite-difference point
+    hemi::Array<double>* mixture;  //!< mixture sum of each event
+    hemi::Array<double>* proposed_mixture;  //!< mixture sums as proposed
+    hemi::Array<double>* rate_proposed;  //!< rate in the last component step
+    std::vector<pdfz::Eval*> pdfs;  //!< references to signal pdfs
+    std::vector<bool> parameter_fixed;  //!< parameters held constant
+    std::vector<bool> pdf_frozen;  //!< pdfs with only fixed systematics
+    std::vector<bool> pdf_current;  //!< frozen pdfs already in the buffers
+};
+
+#endif  // __NLL_EVALUATOR_H__
+
@@ -1,13 +1,11 @@
 #include <iostream>
 #include <cmath>
 #include <hemi/hemi.h>
-#include <TRandom.h>
 
 #include <sxmc/nll_kernels.h>
+#include <sxmc/pdfz.h>
 
-#ifdef __CUDACC__
-#include <curand_kernel.h>
-#else
+#ifndef __CUDACC__
 #include <TMath.h>
 #endif
 
@@ -16,94 +14,715 @@
 #include <hemi/array.h>
 #endif
 
-#ifdef __CUDACC__
-__global__ void init_device_rngs(int nthreads, unsigned long long seed,
-                                 curandStateXORWOW* state) {
-  int idx = hemiGetElementOffset();
-  if (idx >= nthreads) {
-    return;
+HEMI_KERNEL(init_rngs)(const int nthreads, const unsigned long long seed,
+                       const unsigned stream, RNGState* state) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  for (int i=offset; i<nthreads; i+=stride) {
+    rng_init(&state[i], seed, stream, i);
   }
-  curand_init(seed, idx, 0, &state[idx]);
 }
-#endif
 
 
 HEMI_DEV_CALLABLE_INLINE
-void pick_new_vector_device(int nthreads, RNGState* rng,
-                            const float* sigma,
+void pick_new_vector_device(RNGState* rng, const int nblock, const int* block,
+                            const float* sigma, const float* cholesky,
+                            const double* lower, const double* upper,
+                            double* normals,
                             const double* current_vector,
                             double* proposed_vector) {
   int offset = hemiGetElementOffset();
   int stride = hemiGetElementStride();
 
-  for (int i=offset; i<(int)nthreads; i+=stride) {
+  if (!cholesky) {
+    for (int k=offset; k<nblock; k+=stride) {
+      const int i = block[k];
+      double u = rng_normal(&rng[i]);
+      double x = current_vector[i] + sigma[k] * u;
+      proposed_vector[i] = (lower ? reflect_into(x, lower[i], upper[i]) : x);
+    }
+    return;
+  }
+
+  // Correlated jump L * u, where L is the lower-triangular Cholesky factor
+  // of the proposal covariance; every element needs all of the u's
+  for (int k=offset; k<nblock; k+=stride) {
+    normals[k] = rng_normal(&rng[block[k]]);
+  }
+
 #ifdef HEMI_DEV_CODE
-    double u = curand_normal(&rng[i]);
-    proposed_vector[i] = current_vector[i] + sigma[i] * u;
-#else
-    double u = gRandom->Gaus(current_vector[i], sigma[i]);
-    proposed_vector[i] = u;
+  __syncthreads();
 #endif
+
+  for (int k=offset; k<nblock; k+=stride) {
+    const float* row = cholesky + k * nblock;
+    double d = 0;
+    for (int l=0; l<=k; l++) {
+      d += row[l] * normals[l];
+    }
+    proposed_vector[block[k]] = current_vector[block[k]] + d;
   }
 }
 
 
 HEMI_DEV_CALLABLE_INLINE
-void jump_decider_device(RNGState* rng, double* nll_current,
+bool jump_decider_device(RNGState* rng, double* nll_current,
                          const double* nll_proposed, double* v_current,
-                         const double* v_proposed, unsigned nparameters,
+                         double* v_proposed, unsigned nparameters,
+                         const unsigned nchanged, const int* changed,
                          int* accepted, int* counter, float* jump_buffer,
-                         const bool debug_mode=false) {
-#ifdef HEMI_DEV_CODE
-  double u = curand_uniform(&rng[0]);
-#else
-  double u = gRandom->Uniform();
-#endif
+                         const bool save, const bool debug_mode=false,
+                         const double log_correction=0,
+                         double* walk_stats=NULL, double* block_stats=NULL,
+                         const bool walk_covariance=false,
+                         float* recycle_buffer=NULL) {
+  double u = rng_uniform(&rng[0]);
+  int count = counter[0];
 
-  // Metropolis algorithm
+  // Metropolis algorithm, with any correction to the acceptance ratio
   double np = nll_proposed[0];
   double nc = nll_current[0];
-  if (debug_mode || (np < nc || u <= exp(nc - np))) {
-    nll_current[0] = np;
+  double log_r = nc - np + log_correction;
+  const bool accept = (debug_mode || (log_r > 0 || u <= exp(log_r)));
+
+  // Keep the point not taken, weighted by its chance of being taken
+  if (recycle_buffer && save) {
+    const double a = (debug_mode || log_r > 0 ? 1.0 : exp(log_r));
+    const double* other = (accept ? v_current : v_proposed);
+    float* row = recycle_buffer + count * (nparameters + 2);
     for (unsigned i=0; i<nparameters; i++) {
-      v_current[i] = v_proposed[i];
+      row[i] = other[i];
+    }
+    row[nparameters] = (accept ? nc : np);
+    row[nparameters + 1] = (accept ? 1.0 - a : a);
+  }
+
+  // The block leaves the point it held since its last fold, if it moves
+  if (walk_stats) {
+    walk_stats[0] += 1;
+    if (accept) {
+      walk_update(v_current, nchanged, changed, walk_stats[0] - 1,
+                  block_stats, walk_covariance);
+    }
+  }
+
+  // Only the block differs between the vectors, so only it is copied
+  // across: to take the step, or to reset a rejected proposal
+  if (accept) {
+    nll_current[0] = np;
+    for (unsigned k=0; k<nchanged; k++) {
+      v_current[changed[k]] = v_proposed[changed[k]];
     }
     accepted[0] += 1;
   }
+  else {
+    for (unsigned k=0; k<nchanged; k++) {
+      v_proposed[changed[k]] = v_current[changed[k]];
+    }
+  }
 
-  // Append all steps to jump buffer
-  int count = counter[0];
-  for (unsigned i=0; i<nparameters; i++) {
-    jump_buffer[count * (nparameters + 1) + i] = v_current[i];
+  // Append kept steps to jump buffer
+  if (save) {
+    for (unsigned i=0; i<nparameters; i++) {
+      jump_buffer[count * (nparameters + 1) + i] = v_current[i];
+    }
+    jump_buffer[count * (nparameters + 1) + nparameters] = nll_current[0];
+    counter[0] = count + 1;
   }
-  jump_buffer[count * (nparameters + 1) + nparameters] = nll_current[0];
-  counter[0] = count + 1;    
+
+  return accept;
+}
+
+
+#ifndef HEMI_DEV_CODE
+/** Number of events handled together by the host NLL loop */
+const size_t NLL_EVENT_BLOCK = 64;
+#endif
+
+
+/** Read PDF values (or bin contents) stored in any supported format */
+HEMI_DEV_CALLABLE_INLINE
+float lut_value(const float* p, const size_t j) {
+  return p[j];
+}
+
+
+HEMI_DEV_CALLABLE_INLINE
+float lut_value(const unsigned short* p, const size_t j) {
+  return pdfz::from_bfloat16(p[j]);
+}
+
+
+HEMI_DEV_CALLABLE_INLINE
+double lut_value(const unsigned* p, const size_t j) {
+  return p[j];
+}
+
+
+template <typename T>
+HEMI_DEV_CALLABLE_INLINE
+double row_dot(const double* __restrict__ pars,
+               const T* __restrict__ row, const size_t ns) {
+  // Independent partial sums, so the products can be issued in parallel
+  // without reassociating a single floating-point accumulator
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  size_t j = 0;
+  for (; j + 4 <= ns; j += 4) {
+    s0 += pars[j + 0] * lut_value(row, j + 0);
+    s1 += pars[j + 1] * lut_value(row, j + 1);
+    s2 += pars[j + 2] * lut_value(row, j + 2);
+    s3 += pars[j + 3] * lut_value(row, j + 3);
+  }
+  for (; j<ns; j++) {
+    s0 += pars[j] * lut_value(row, j);
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+
+template <typename T>
+HEMI_DEV_CALLABLE_INLINE
+double nll_event_chunks_device(const T* __restrict__ lut,
+                               const int* __restrict__ dataweights,
+                               const double* __restrict__ pars,
+                               const size_t ne, const size_t ns,
+                               const bool event_major) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  double sum = 0;
+#ifdef HEMI_DEV_CODE
+  for (int i=offset; i<(int)ne; i+=stride) {
+    double s = 0;
+    if (event_major) {
+      s = row_dot(pars, lut + i * ns, ns);
+    }
+    else {
+      for (size_t j=0; j<ns; j++) {
+        s += pars[j] * lut_value(lut, j * ne + i);
+      }
+    }
+    sum += log(s) * dataweights[i];
+  }
+#else
+  // Work through a block of events at a time: all mixture sums first, then
+  // all of the logs, so each inner loop streams through contiguous memory
+  // and is free of branches.
+  double s[NLL_EVENT_BLOCK];
+  for (size_t i0=offset; i0<ne; i0+=NLL_EVENT_BLOCK*stride) {
+    const size_t nb = (ne - i0 < NLL_EVENT_BLOCK ? ne - i0 : NLL_EVENT_BLOCK);
+
+    if (event_major) {
+      const T* rows = lut + i0 * ns;
+      for (size_t k=0; k<nb; k++) {
+        s[k] = row_dot(pars, rows + k * ns, ns);
+      }
+    }
+    else {
+      for (size_t k=0; k<nb; k++) {
+        s[k] = 0;
+      }
+      for (size_t j=0; j<ns; j++) {
+        const T* row = lut + j * ne + i0;
+        const double p = pars[j];
+        for (size_t k=0; k<nb; k++) {
+          s[k] += p * lut_value(row, k);
+        }
+      }
+    }
+
+    for (size_t k=0; k<nb; k++) {
+      s[k] = log(s[k]);
+    }
+
+    const int* w = dataweights + i0;
+    for (size_t k=0; k<nb; k++) {
+      sum += s[k] * w[k];
+    }
+  }
+#endif
+  return sum;
 }
 
 
 HEMI_KERNEL(nll_event_chunks)(const float* __restrict__ lut,
+                              const unsigned short* __restrict__ lut_bf16,
                               const int* __restrict__ dataweights,
                               const double* __restrict__ pars,
                               const size_t ne, const size_t ns,
+                              const bool event_major,
                               double* sums) {
+  double sum;
+  if (lut) {
+    sum = nll_event_chunks_device(lut, dataweights, pars, ne, ns, event_major);
+  }
+  else {
+    sum = nll_event_chunks_device(lut_bf16, dataweights, pars, ne, ns,
+                                  event_major);
+  }
+  if (!isnan(sum)) {
+    sums[hemiGetElementOffset()] = sum;
+  }
+}
+
+
+HEMI_KERNEL(nll_hist_scales)(const size_t ns, const size_t nv,
+                             const double* pars, const size_t par_stride,
+                             const unsigned* norms, const double bin_volume,
+                             double* scales) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  for (int i=offset; i<(int)(ns * nv); i+=stride) {
+    const size_t k = i / ns;
+    const size_t j = i % ns;
+    const double norm = norms[j] * bin_volume;
+    scales[i] = (norm > 0 ? pars[k * par_stride + j] / norm : 0);
+  }
+}
+
+
+HEMI_KERNEL(nll_event_chunks_hist)(const unsigned* __restrict__ hists,
+                                   const int* __restrict__ bin_ids,
+                                   const int* __restrict__ dataweights,
+                                   const double* __restrict__ scales,
+                                   const size_t ne, const size_t ns,
+                                   const size_t nbins, const bool bin_major,
+                                   double* sums) {
   int offset = hemiGetElementOffset();
   int stride = hemiGetElementStride();
 
   double sum = 0;
+#ifdef HEMI_DEV_CODE
   for (int i=offset; i<(int)ne; i+=stride) {
+    const int b = bin_ids[i];
     double s = 0;
-    for (size_t j=0; j<ns; j++) {
-      float v = lut[j * ne + i];
-      s += pars[j] * (!isnan(v) ? v : 0);  // Handle nans from empty hists
+    if (b >= 0) {
+      if (bin_major) {
+        s = row_dot(scales, hists + b * ns, ns);
+      }
+      else {
+        for (size_t j=0; j<ns; j++) {
+          s += scales[j] * lut_value(hists, j * nbins + b);
+        }
+      }
     }
     sum += log(s) * dataweights[i];
   }
+#else
+  // As in nll_event_chunks, but gathering each event's row of bin contents
+  // from the histograms by its bin index
+  double s[NLL_EVENT_BLOCK];
+  for (size_t i0=offset; i0<ne; i0+=NLL_EVENT_BLOCK*stride) {
+    const size_t nb = (ne - i0 < NLL_EVENT_BLOCK ? ne - i0 : NLL_EVENT_BLOCK);
+    const int* b = bin_ids + i0;
+
+    for (size_t k=0; k<nb; k++) {
+      s[k] = 0;
+      if (b[k] < 0) {
+        continue;
+      }
+      if (bin_major) {
+        s[k] = row_dot(scales, hists + b[k] * ns, ns);
+      }
+      else {
+        for (size_t j=0; j<ns; j++) {
+          s[k] += scales[j] * lut_value(hists, j * nbins + b[k]);
+        }
+      }
+    }
+
+    for (size_t k=0; k<nb; k++) {
+      s[k] = log(s[k]);
+    }
+
+    const int* w = dataweights + i0;
+    for (size_t k=0; k<nb; k++) {
+      sum += s[k] * w[k];
+    }
+  }
+#endif
   if (!isnan(sum)) {
     sums[offset] = sum;
   }
 }
 
 
+template <typename T>
+HEMI_DEV_CALLABLE_INLINE
+void nll_event_chunks_batch_device(const T* __restrict__ table,
+                                   const size_t nrows, const bool row_major,
+                                   const int* __restrict__ row_ids,
+                                   const int* __restrict__ dataweights,
+                                   const double* __restrict__ coefs,
+                                   const size_t coef_stride,
+                                   const size_t ne, const size_t ns,
+                                   const unsigned nv, double* sums) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  double sum[NLL_MAX_BATCH];
+  for (unsigned k=0; k<nv; k++) {
+    sum[k] = 0;
+  }
+
+  // Each event's row of the table is read once and reused for all of the
+  // coefficient vectors
+  for (int i=offset; i<(int)ne; i+=stride) {
+    const int r = (row_ids ? row_ids[i] : i);
+    const int w = dataweights[i];
+    for (unsigned k=0; k<nv; k++) {
+      const double* c = coefs + k * coef_stride;
+      double s = 0;
+      if (r >= 0) {
+        if (row_major) {
+          s = row_dot(c, table + r * ns, ns);
+        }
+        else {
+          for (size_t j=0; j<ns; j++) {
+            s += c[j] * lut_value(table, j * nrows + r);
+          }
+        }
+      }
+      sum[k] += log(s) * w;
+    }
+  }
+
+  for (unsigned k=0; k<nv; k++) {
+    if (!isnan(sum[k])) {
+      sums[k * stride + offset] = sum[k];
+    }
+  }
+}
+
+
+HEMI_KERNEL(nll_event_chunks_batch)(const float* lut,
+                                    const unsigned short* lut_bf16,
+                                    const int* dataweights,
+                                    const double* pars,
+                                    const size_t par_stride,
+                                    const size_t ne, const size_t ns,
+                                    const bool event_major,
+                                    const unsigned nv, double* sums) {
+  if (lut) {
+    nll_event_chunks_batch_device(lut, ne, event_major, NULL, dataweights,
+                                  pars, par_stride, ne, ns, nv, sums);
+  }
+  else {
+    nll_event_chunks_batch_device(lut_bf16, ne, event_major, NULL,
+                                  dataweights, pars, par_stride, ne, ns, nv,
+                                  sums);
+  }
+}
+
+
+HEMI_KERNEL(nll_event_chunks_hist_batch)(const unsigned* hists,
+                                         const int* bin_ids,
+                                         const int* dataweights,
+                                         const double* scales,
+                                         const size_t ne, const size_t ns,
+                                         const size_t nbins,
+                                         const bool bin_major,
+                                         const unsigned nv, double* sums) {
+  nll_event_chunks_batch_device(hists, nbins, bin_major, bin_ids, dataweights,
+                                scales, ns, ne, ns, nv, sums);
+}
+
+
+template <typename T>
+HEMI_DEV_CALLABLE_INLINE
+void nll_event_grad_device(const T* __restrict__ table,
+                           const size_t nrows, const bool row_major,
+                           const int* __restrict__ row_ids,
+                           const int* __restrict__ dataweights,
+                           const double* __restrict__ coefs,
+                           const size_t ne, const size_t ns,
+                           double* sums, double* grads) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  // Each thread owns one column of grads, so it can accumulate in place
+  for (size_t j=0; j<ns; j++) {
+    grads[j * stride + offset] = 0;
+  }
+
+  double sum = 0;
+  for (int i=offset; i<(int)ne; i+=stride) {
+    const int r = (row_ids ? row_ids[i] : i);
+    const int w = dataweights[i];
+    double s = 0;
+    if (r >= 0) {
+      if (row_major) {
+        s = row_dot(coefs, table + r * ns, ns);
+      }
+      else {
+        for (size_t j=0; j<ns; j++) {
+          s += coefs[j] * lut_value(table, j * nrows + r);
+        }
+      }
+    }
+    sum += log(s) * w;
+
+    // d(log s)/d(coef j) = table value / s
+    if (s > 0) {
+      const double ws = w / s;
+      for (size_t j=0; j<ns; j++) {
+        const size_t idx = (row_major ? r * ns + j : j * nrows + r);
+        grads[j * stride + offset] += ws * lut_value(table, idx);
+      }
+    }
+  }
+
+  if (!isnan(sum)) {
+    sums[offset] = sum;
+  }
+}
+
+
+HEMI_KERNEL(nll_event_grad)(const float* lut, const unsigned short* lut_bf16,
+                            const int* dataweights, const double* pars,
+                            const size_t ne, const size_t ns,
+                            const bool event_major,
+                            double* sums, double* grads) {
+  if (lut) {
+    nll_event_grad_device(lut, ne, event_major, NULL, dataweights, pars,
+                          ne, ns, sums, grads);
+  }
+  else {
+    nll_event_grad_device(lut_bf16, ne, event_major, NULL, dataweights, pars,
+                          ne, ns, sums, grads);
+  }
+}
+
+
+HEMI_KERNEL(nll_event_grad_hist)(const unsigned* hists, const int* bin_ids,
+                                 const int* dataweights,
+                                 const double* scales,
+                                 const size_t ne, const size_t ns,
+                                 const size_t nbins, const bool bin_major,
+                                 double* sums, double* grads) {
+  nll_event_grad_device(hists, nbins, bin_major, bin_ids, dataweights, scales,
+                        ne, ns, sums, grads);
+}
+
+
+HEMI_KERNEL(nll_bin_profile)(const unsigned* hists,
+                             const unsigned long long* sumw2,
+                             const int* bin_ids, const int* dataweights,
+                             const double* scales, const double bin_volume,
+                             const size_t ne, const size_t ns,
+                             const size_t nbins, const bool bin_major,
+                             const unsigned nv, double* sums, double* grads) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  double delta[NLL_MAX_BATCH];
+  for (unsigned k=0; k<nv; k++) {
+    delta[k] = 0;
+  }
+
+  for (int i=offset; i<(int)ne; i+=stride) {
+    const int b = bin_ids[i];
+    if (b < 0) {
+      continue;
+    }
+    for (unsigned k=0; k<nv; k++) {
+      const double* c = scales + k * ns;
+      double s = 0;
+      double q = 0;
+      for (size_t j=0; j<ns; j++) {
+        const size_t idx = (bin_major ? b * ns + j : j * nbins + b);
+        s += c[j] * hists[idx];
+        q += c[j] * c[j] * sumw2[idx];
+      }
+      if (!(s > 0 && q > 0)) {
+        continue;
+      }
+
+      double beta;
+      delta[k] += bin_profile(bin_volume * s, bin_volume * bin_volume * q,
+                              dataweights[i], &beta);
+
+      // d(delta)/d(Nj), in the bin content units of the event gradient
+      if (grads) {
+        const double shift = beta - 1;
+        const double r = shift * shift * s / (q * q);
+        for (size_t j=0; j<ns; j++) {
+          const size_t idx = (bin_major ? b * ns + j : j * nbins + b);
+          grads[j * stride + offset] -= \
+            shift * bin_volume * hists[idx] +
+            r * (hists[idx] * q - s * c[j] * sumw2[idx]);
+        }
+      }
+    }
+  }
+
+  for (unsigned k=0; k<nv; k++) {
+    if (!isnan(delta[k])) {
+      sums[k * stride + offset] -= delta[k];
+    }
+  }
+}
+
+
+template <typename T>
+HEMI_DEV_CALLABLE_INLINE
+void nll_mixture_sums_device(const T* __restrict__ table,
+                             const size_t nrows, const bool row_major,
+                             const int* __restrict__ row_ids,
+                             const double* __restrict__ coefs,
+                             const size_t ne, const size_t ns,
+                             double* mixture) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  for (int i=offset; i<(int)ne; i+=stride) {
+    const int r = (row_ids ? row_ids[i] : i);
+    double s = 0;
+    if (r >= 0) {
+      if (row_major) {
+        s = row_dot(coefs, table + r * ns, ns);
+      }
+      else {
+        for (size_t j=0; j<ns; j++) {
+          s += coefs[j] * lut_value(table, j * nrows + r);
+        }
+      }
+    }
+    mixture[i] = s;
+  }
+}
+
+
+HEMI_KERNEL(nll_mixture_sums)(const float* lut, const unsigned short* lut_bf16,
+                              const double* pars, const size_t ne,
+                              const size_t ns, const bool event_major,
+                              double* mixture) {
+  if (lut) {
+    nll_mixture_sums_device(lut, ne, event_major, NULL, pars, ne, ns,
+                            mixture);
+  }
+  else {
+    nll_mixture_sums_device(lut_bf16, ne, event_major, NULL, pars, ne, ns,
+                            mixture);
+  }
+}
+
+
+HEMI_KERNEL(nll_mixture_sums_hist)(const unsigned* hists, const int* bin_ids,
+                                   const double* scales, const size_t ne,
+                                   const size_t ns, const size_t nbins,
+                                   const bool bin_major, double* mixture) {
+  nll_mixture_sums_device(hists, nbins, bin_major, bin_ids, scales, ne, ns,
+                          mixture);
+}
+
+
+template <typename T>
+HEMI_DEV_CALLABLE_INLINE
+void nll_component_chunks_device(const T* __restrict__ table,
+                                 const size_t nrows, const bool row_major,
+                                 const int* __restrict__ row_ids,
+                                 const int* __restrict__ dataweights,
+                                 const double delta, const size_t k,
+                                 const size_t ne, const size_t ns,
+                                 const double* __restrict__ mixture,
+                                 double* __restrict__ proposed_mixture,
+                                 double* sums) {
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+
+  // One column of the table, strided if it is stored row-major
+  const T* column = table + (row_major ? k : k * nrows);
+  const size_t column_stride = (row_major ? ns : 1);
+
+  double sum = 0;
+  for (int i=offset; i<(int)ne; i+=stride) {
+    const int r = (row_ids ? row_ids[i] : i);
+    double s = mixture[i];
+    if (r >= 0) {
+      s += delta * lut_value(column, r * column_stride);
+    }
+    proposed_mixture[i] = s;
+    sum += log(s) * dataweights[i];
+  }
+
+  if (!isnan(sum)) {
+    sums[offset] = sum;
+  }
+}
+
+
+HEMI_KERNEL(nll_component_chunks)(const float* lut,
+                                  const unsigned short* lut_bf16,
+                                  const int* dataweights,
+                                  const double* v_current,
+                                  const double* v_proposed, const size_t k,
+                                  const size_t ne, const size_t ns,
+                                  const bool event_major,
+                                  const double* mixture,
+                                  double* proposed_mixture,
+                                  double* rate_proposed, double* sums) {
+  const double delta = v_proposed[k] - v_current[k];
+  if (lut) {
+    nll_component_chunks_device(lut, ne, event_major, NULL, dataweights,
+                                delta, k, ne, ns, mixture, proposed_mixture,
+                                sums);
+  }
+  else {
+    nll_component_chunks_device(lut_bf16, ne, event_major, NULL, dataweights,
+                                delta, k, ne, ns, mixture, proposed_mixture,
+                                sums);
+  }
+  if (hemiGetElementOffset() == 0) {
+    rate_proposed[0] = v_proposed[k];
+  }
+}
+
+
+HEMI_KERNEL(nll_component_chunks_hist)(const unsigned* hists,
+                                       const int* bin_ids,
+                                       const int* dataweights,
+                                       const unsigned* norms,
+                                       const double bin_volume,
+                                       const double* v_current,
+                                       const double* v_proposed,
+                                       const size_t k, const size_t ne,
+                                       const size_t ns, const size_t nbins,
+                                       const bool bin_major,
+                                       const double* mixture,
+                                       double* proposed_mixture,
+                                       double* rate_proposed, double* sums) {
+  const double norm = norms[k] * bin_volume;
+  const double delta = \
+    (norm > 0 ? (v_proposed[k] - v_current[k]) / norm : 0);
+  nll_component_chunks_device(hists, nbins, bin_major, bin_ids, dataweights,
+                              delta, k, ne, ns, mixture, proposed_mixture,
+                              sums);
+  if (hemiGetElementOffset() == 0) {
+    rate_proposed[0] = v_proposed[k];
+  }
+}
+
+
+HEMI_KERNEL(nll_component_commit)(const size_t ne, const size_t k,
+                                  const double* v_current,
+                                  const double* rate_proposed,
+                                  const double* proposed_mixture,
+                                  double* mixture) {
+  if (v_current[k] != rate_proposed[0]) {
+    return;
+  }
+
+  int offset = hemiGetElementOffset();
+  int stride = hemiGetElementStride();
+  for (int i=offset; i<(int)ne; i+=stride) {
+    mixture[i] = proposed_mixture[i];
+  }
+}
+
+
 HEMI_DEV_CALLABLE_INLINE
 void nll_event_reduce_device(const size_t nthreads, const double* sums,
                              double* total_sum) {
@@ -139,6 +758,8 @@ void nll_total_device(const size_t nparameters, const size_t nsignals,
                       const double* pars,
                       const double* means,
                       const double* sigmas,
+                      const double* lower,
+                      const double* upper,
                       const double* events_total,
                       double* nll) {
   // Total from sum over events, once
@@ -150,43 +771,97 @@ void nll_total_device(const size_t nparameters, const size_t nsignals,
   }
 
   for (unsigned i=0; i<nparameters; i++) {
-    // Non-negative rates
-    if (i < nsignals && pars[i] < 0) {
+    // Support: non-negative rates, and any hard limits
+    if (pars[i] < lower[i] || pars[i] > upper[i]) {
       nll[0] = 1e18;
-      return;      
-    }
-
-    // Normalization constraints
-    if (i < nsignals) {
-      sum += pars[i];
+      return;
     }
 
-    // Gaussian constraints
-    if (sigmas[i] > 0) {
-      double x = (pars[i] - means[i]) / sigmas[i];
-      sum += x * x;
-    }
+    // Normalization and Gaussian constraints
+    sum += constraint_term(i, pars[i], nsignals, means, sigmas);
   }
 
   nll[0] = sum;
 }
 
 
-HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
-                             const float* sigma,
+/**
+ * Change in the constraint terms from the current to the proposed point,
+ * where only the given parameters differ.
+ *
+ * \returns false if a proposed parameter is out of bounds
+ */
+HEMI_DEV_CALLABLE_INLINE
+bool constraint_delta_device(const unsigned nchanged, const int* changed,
+                             const size_t nsignals,
+                             const double* current, const double* proposed,
+                             const double* means, const double* sigmas,
+                             const double* lower, const double* upper,
+                             double* delta) {
+  double d = 0;
+  for (unsigned k=0; k<nchanged; k++) {
+    const int i = changed[k];
+    if (proposed[i] < lower[i] || proposed[i] > upper[i]) {
+      return false;
+    }
+    d += constraint_term(i, proposed[i], nsignals, means, sigmas) -
+         constraint_term(i, current[i], nsignals, means, sigmas);
+  }
+  delta[0] = d;
+  return true;
+}
+
+
+HEMI_KERNEL(pick_new_vector)(RNGState* rng, const int nblock,
+                             const int* block, const float* sigma,
+                             const float* cholesky,
+                             const double* lower, const double* upper,
+                             double* normals,
                              const double* current_vector,
                              double* proposed_vector) {
-  pick_new_vector_device(nthreads, rng, sigma, current_vector,
-                         proposed_vector);
+  pick_new_vector_device(rng, nblock, block, sigma, cholesky, lower, upper,
+                         normals, current_vector, proposed_vector);
 }
 
 
 HEMI_KERNEL(jump_decider)(RNGState* rng, double* nll_current,
                           const double* nll_proposed, double* v_current,
-                          const double* v_proposed, unsigned nparameters,
-                          int* accepted, int* counter, float* jump_buffer) {
+                          double* v_proposed, unsigned nparameters,
+                          const unsigned nchanged, const int* changed,
+                          int* accepted, int* counter, float* jump_buffer,
+                          const bool save, double* walk_stats,
+                          double* block_stats, const bool walk_covariance,
+                          float* recycle_buffer) {
+  jump_decider_device(rng, nll_current, nll_proposed, v_current, v_proposed,
+                      nparameters, nchanged, changed, accepted, counter,
+                      jump_buffer, save, false, 0, walk_stats, block_stats,
+                      walk_covariance, recycle_buffer);
+}
+
+
+HEMI_KERNEL(delayed_jump_decider)(RNGState* rng, double* nll_current,
+                                  const double* nll_screen,
+                                  const double* nll_proposed,
+                                  double* v_current, double* v_proposed,
+                                  unsigned nparameters,
+                                  const unsigned nchanged, const int* changed,
+                                  int* accepted, int* counter,
+                                  float* jump_buffer, const bool save,
+                                  double* walk_stats, double* block_stats,
+                                  const bool walk_covariance,
+                                  float* recycle_buffer,
+                                  const bool debug_mode) {
+  // Log of the first-stage acceptance, forward and in reverse
+  double log_forward = nll_current[0] - nll_screen[0];
+  double log_reverse = nll_proposed[0] - nll_proposed[1];
+  log_forward = (log_forward < 0 ? log_forward : 0);
+  log_reverse = (log_reverse < 0 ? log_reverse : 0);
+
   jump_decider_device(rng, nll_current, nll_proposed, v_current, v_proposed,
-                      nparameters, accepted, counter, jump_buffer);
+                      nparameters, nchanged, changed, accepted, counter,
+                      jump_buffer, save, debug_mode,
+                      log_reverse - log_forward, walk_stats, block_stats,
+                      walk_covariance, recycle_buffer);
 }
 
 
@@ -199,9 +874,23 @@ HEMI_KERNEL(nll_event_reduce)(const size_t nthreads, const double* sums,
 HEMI_KERNEL(nll_total)(const size_t npars, const double* pars,
                        const size_t nsignals,
                        const double* means, const double* sigmas,
+                       const double* lower, const double* upper,
                        const double* events_total,
                        double* nll) {
-  nll_total_device(npars, nsignals, pars, means, sigmas, events_total, nll);
+  nll_total_device(npars, nsignals, pars, means, sigmas, lower, upper,
+                   events_total, nll);
+}
+
+
+HEMI_KERNEL(nll_constraints)(const size_t npars, const double* pars,
+                             const size_t nsignals,
+                             const double* means, const double* sigmas,
+                             double* constraint) {
+  double sum = 0;
+  for (size_t i=0; i<npars; i++) {
+    sum += constraint_term(i, pars[i], nsignals, means, sigmas);
+  }
+  constraint[0] = sum;
 }
 
 
@@ -209,13 +898,28 @@ HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
                                         const double* sums, const size_t ns,
                                         const double* means,
                                         const double* sigmas,
+                                        const double* lower,
+                                        const double* upper,
+                                        double* constraint,
+                                        const unsigned nblock,
+                                        const int* block,
                                         RNGState* rng,
                                         double *nll_current,
                                         double *nll_proposed,
                                         double *v_current, double *v_proposed,
                                         int* accepted, int* counter,
-                                        float* jump_buffer, int nparameters,
+                                        float* jump_buffer, const bool save,
+                                        int nparameters,
+                                        const unsigned next_nblock,
+                                        const int* next_block,
                                         const float* sigma,
+                                        const float* cholesky,
+                                        const bool reflect,
+                                        double* normals,
+                                        double* walk_stats,
+                                        double* block_stats,
+                                        const bool walk_covariance,
+                                        float* recycle_buffer,
                                         const bool debug_mode) {
   double total_sum;
 
@@ -226,18 +930,32 @@ HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
 #endif
 
   if (hemiGetElementOffset() == 0) {
-    nll_total_device(nparameters, ns, v_proposed, means, sigmas, &total_sum,
-                     nll_proposed);
+    // Only the block moved, so only its constraint terms change
+    double delta = 0;
+    if (isnan(total_sum) ||
+        !constraint_delta_device(nblock, block, ns, v_current, v_proposed,
+                                 means, sigmas, lower, upper, &delta)) {
+      nll_proposed[0] = 1e18;
+    }
+    else {
+      nll_proposed[0] = -total_sum + constraint[0] + delta;
+    }
 
-    jump_decider_device(rng, nll_current, nll_proposed, v_current, v_proposed,
-                        nparameters, accepted, counter, jump_buffer,
-                        debug_mode);
+    if (jump_decider_device(rng, nll_current, nll_proposed, v_current,
+                            v_proposed, nparameters, nblock, block, accepted,
+                            counter, jump_buffer, save, debug_mode, 0,
+                            walk_stats, block_stats, walk_covariance,
+                            recycle_buffer)) {
+      constraint[0] += delta;
+    }
   }
 
 #ifdef HEMI_DEV_CODE
   __syncthreads();
 #endif
 
-  pick_new_vector_device(nparameters, rng, sigma, v_current, v_proposed);
+  pick_new_vector_device(rng, next_nblock, next_block, sigma, cholesky,
+                         (reflect ? lower : NULL), (reflect ? upper : NULL),
+                         normals, v_current, v_proposed);
 }
 
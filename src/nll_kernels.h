@@ -9,55 +9,208 @@
 #include <cuda.h>
 #include <hemi/hemi.h>
 
-#ifdef __CUDACC__
-#include <curand_kernel.h>
-#endif
+#include <sxmc/rng.h>
 
 #ifndef __HEMI_ARRAY_H__
 #define __HEMI_ARRAY_H__
 #include <hemi/array.h>
 #endif
 
+class TNtuple;
+
+/** Most parameter vectors handled by one batched NLL kernel launch */
+const unsigned NLL_MAX_BATCH = 16;
+
+
 /**
- * \typedef RNGState
- * \brief Defines RNG for CURAND, ignored in CPU mode
+ * Fold a value back into [lower, upper], as if reflected at the bounds.
+ *
+ * Either bound may be infinite. Folding keeps a jump distribution that is
+ * symmetric in each dimension symmetric, so no Hastings correction is
+ * needed.
  */
-#ifdef __CUDACC__
-typedef curandStateXORWOW RNGState;
-#else
-typedef int RNGState;
-#endif
-
-class TNtuple;
+HEMI_DEV_CALLABLE_INLINE
+double reflect_into(double x, const double lower, const double upper) {
+  if (x >= lower && x <= upper) {
+    return x;
+  }
+  if (!(upper > lower)) {
+    return lower;
+  }
+  const double w = upper - lower;
+  if (w < HUGE_VAL) {
+    double t = fmod(x - lower, 2 * w);
+    if (t < 0) {
+      t += 2 * w;
+    }
+    return lower + (t <= w ? t : 2 * w - t);
+  }
+  return (x < lower ? 2 * lower - x : 2 * upper - x);
+}
 
-#ifdef __CUDACC__
 /**
- * Initialize device-side RNGs.
+ * Initialize RNGs, one stream per thread.
  *
- * Generators all have the same seed but a different offset in the sequence.
+ * State i is substream i of the given stream (see rng_init), so the
+ * numbers are the same on the host and the device.
  *
  * \param nthreads Number of threads (same as the number of states)
- * \param seed Random seed shared by all generators
- * \param state Array of CUDA RNG states
+ * \param seed Master seed shared by all generators
+ * \param stream Stream index shared by all generators, see rng_stream
+ * \param state Array of RNG states
  */
-__global__ void init_device_rngs(int nthreads, unsigned long long seed,
-                                 curandState* state);
-#endif
+HEMI_KERNEL(init_rngs)(const int nthreads, const unsigned long long seed,
+                       const unsigned stream, RNGState* state);
+
+
+/**
+ * Fold the point a proposal block has held into running (Welford)
+ * statistics of the walk.
+ *
+ * Only parameters in a proposal block are tracked, and co-moments only
+ * within each block, which is all that re-tuning the jumps needs, so the
+ * size grows with the sum of the squared block sizes rather than the
+ * square of the number of parameters.
+ *
+ * Each block keeps [nfolded, mean[nb], co-moments], where the co-moments
+ * are a row-major nb x nb square, filled on and below the diagonal, or
+ * only on the diagonal without covariance. A block's parameters change
+ * only when a step that moves the block is accepted, so its point is
+ * folded in then, once, weighted by the steps it was held since the last
+ * fold (West, 1979), and a step costs nothing for the blocks it leaves
+ * alone. Dividing a co-moment by the number of steps gives the
+ * (co)variance, once every block has been folded up to the same step, so
+ * re-tuning needs no pass over the stored steps.
+ *
+ * \param v Parameter vector holding the block's point
+ * \param nb The number of parameters in the block
+ * \param block Indices of the parameters in the block
+ * \param nsteps Steps the walk has taken at that point; those since the
+ *               block's last fold are added
+ * \param block_stats The block's statistics, or NULL to do nothing
+ * \param covariance Accumulate the full co-moment, not just the diagonal
+ */
+HEMI_DEV_CALLABLE_INLINE
+void walk_update(const double* v, const unsigned nb, const int* block,
+                 const double nsteps, double* block_stats,
+                 const bool covariance) {
+  if (!block_stats || nsteps <= block_stats[0]) {
+    return;
+  }
+  const double w = nsteps - block_stats[0];
+  double* mean = block_stats + 1;
+  double* comoment = block_stats + 1 + nb;
+
+  // (x - new mean) = (x - old mean) * (n - w) / n
+  const double f = w * block_stats[0] / nsteps;
+  for (unsigned k=0; k<nb; k++) {
+    const double dk = (v[block[k]] - mean[k]) * f;
+    if (!covariance) {
+      comoment[k * nb + k] += dk * (v[block[k]] - mean[k]);
+      continue;
+    }
+    for (unsigned l=0; l<=k; l++) {
+      comoment[k * nb + l] += dk * (v[block[l]] - mean[l]);
+    }
+  }
+  for (unsigned k=0; k<nb; k++) {
+    mean[k] += (v[block[k]] - mean[k]) * w / nsteps;
+  }
+  block_stats[0] = nsteps;
+}
+
+
+/**
+ * Contribution of one parameter to the NLL outside the event term.
+ *
+ * Rates add their expectation, and parameters with a Gaussian constraint
+ * add ((x - mean) / sigma)^2.
+ *
+ * \param i Index of the parameter
+ * \param x Value of the parameter
+ * \param nsignals Number of signal (rate) parameters
+ * \param means Expected rates and means of systematics
+ * \param sigmas Gaussian constraint sigma, same units as means
+ * \returns The term
+ */
+HEMI_DEV_CALLABLE_INLINE
+double constraint_term(const size_t i, const double x, const size_t nsignals,
+                       const double* means, const double* sigmas) {
+  double t = (i < nsignals ? x : 0);
+  if (sigmas[i] > 0) {
+    const double d = (x - means[i]) / sigmas[i];
+    t += d * d;
+  }
+  return t;
+}
+
+
+/**
+ * Profile the Monte Carlo statistics nuisance of one histogram bin.
+ *
+ * A light Barlow-Beeston treatment: the expectation mu of a bin holding n
+ * events is scaled by one factor beta, with a Gaussian constraint of width
+ * sqrt(var) / mu from the statistics of the PDF samples. Minimizing
+ *
+ *   beta * mu - n * log(beta) + (beta - 1)^2 * mu^2 / (2 * var)
+ *
+ * over beta is a quadratic, beta^2 + (var/mu - 1) beta - n var/mu^2 = 0,
+ * so the profiled nuisance costs a square root rather than a fit.
+ *
+ * \param mu Expected events in the bin, > 0
+ * \param var Variance of mu from the PDF sample statistics, > 0
+ * \param n Observed events in the bin
+ * \param beta Output: the profiled scale factor
+ * \returns Change in the bin's NLL from profiling, <= 0
+ */
+HEMI_DEV_CALLABLE_INLINE
+double bin_profile(const double mu, const double var, const double n,
+                   double* beta) {
+  // Larger root, in the form without cancellation
+  const double b = var / mu - 1;
+  const double c = n * var / (mu * mu);
+  const double d = sqrt(b * b + 4 * c);
+  *beta = (b > 0 ? 2 * c / (b + d) : 0.5 * (d - b));
+
+  const double shift = *beta - 1;
+  double delta = shift * mu + 0.5 * shift * shift * mu * mu / var;
+  if (n > 0) {
+    delta -= n * log(*beta);
+  }
+  return delta;
+}
 
 
 /**
  * Pick a new position distributed around the given one.
  *
- * Uses CURAND XORWOW generator on GPU, or ROOT's gRandom on the CPU.
+ * Only the parameters in one block move, and only they are written: the
+ * proposed vector must already equal the current one elsewhere, as the
+ * jump deciders leave it. Uses a Philox stream for each dimension (see
+ * rng.h), drawn from only when the parameter moves.
+ *
+ * The jump is either independent in each dimension, or correlated, with
+ * covariance L * L^T for a lower-triangular Cholesky factor L. The vectors
+ * must be handled by a single thread block. Independent jumps may be
+ * reflected at the bounds of each parameter, so they never leave its
+ * support.
  *
- * \param nthreads Number of threads == length of vectors
- * \param rng CUDA RNG states, ignored on CPU
- * \param sigma Standard deviations to sample for each dimension
+ * \param rng RNG states, one per parameter
+ * \param nblock Number of parameters in the block
+ * \param block Indices of the parameters in the block
+ * \param sigma Standard deviation of the jump of each block parameter
+ * \param cholesky Row-major nblock x nblock Cholesky factor L, or NULL to
+ *                 use sigma
+ * \param lower Lower bound of each parameter, or NULL not to reflect
+ * \param upper Upper bound of each parameter, used with lower
+ * \param normals Scratch space for one normal deviate per block parameter
  * \param current_vector Vector of current parameters
- * \param proposed_vector Output vector of proposed parameters
+ * \param proposed_vector Proposed parameters; the block is set
  */
-HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
-                             const float* sigma,
+HEMI_KERNEL(pick_new_vector)(RNGState* rng, const int nblock, const int* block,
+                             const float* sigma, const float* cholesky,
+                             const double* lower, const double* upper,
+                             double* normals,
                              const double* current_vector,
                              double* proposed_vector);
 
@@ -72,20 +225,95 @@ HEMI_KERNEL(pick_new_vector)(int nthreads, RNGState* rng,
  * The step buffer is an (Nsignals + 1 x Nsteps) matrix, where the last column
  * contains the likelihood value.
  *
- * \param rng Random-number generator states, used in GPU mode only
+ * Optionally, the point not taken at each step is kept too, for waste
+ * recycling (Frenkel, 2004): the rejected proposal, or the previous point
+ * if the proposal was accepted. The recycling buffer is an (Nparameters + 2
+ * x Nsteps) matrix, in step with the step buffer, holding that point, its
+ * NLL and its weight: the acceptance probability a if it is a rejected
+ * proposal, or 1 - a if it is the previous point. The step itself has
+ * weight one minus that, and averages over both points with these weights
+ * are Rao-Blackwellized estimates, using every NLL evaluation.
+ *
+ * \param rng Random-number generator states
  * \param nll_current The NLL of the current parameters
  * \param nll_proposed the NLL of the proposed parameters
  * \param v_current The current parameters
  * \param v_proposed The proposed parameters
  * \param nparameters The number of parameters
+ * \param nchanged Number of parameters the proposal moves
+ * \param changed Indices of the parameters the proposal moves, a proposal
+ *                block; the rest must be the same in both vectors, and
+ *                are again once a rejected proposal is reset
  * \param accepted Number of accepted steps
  * \param counter The number of steps in the buffer
  * \param jump_buffer The step buffer
+ * \param save Store this step in the buffers (false to thin the walk)
+ * \param walk_stats Running statistics of the walk, whose first element
+ *                   counts the steps, or NULL
+ * \param block_stats Statistics of the moved block, folded in if it moves
+ *                    (see walk_update), or NULL
+ * \param walk_covariance Accumulate the full co-moment in block_stats
+ * \param recycle_buffer The recycling buffer, or NULL to keep only steps
  */
 HEMI_KERNEL(jump_decider)(RNGState* rng, double* nll_current,
                           const double* nll_proposed, double* v_current,
-                          const double* v_proposed, unsigned nparameters,
-                          int* accepted, int* counter, float* jump_buffer);
+                          double* v_proposed, unsigned nparameters,
+                          const unsigned nchanged, const int* changed,
+                          int* accepted, int* counter, float* jump_buffer,
+                          const bool save, double* walk_stats,
+                          double* block_stats, const bool walk_covariance,
+                          float* recycle_buffer);
+
+
+/**
+ * Decide whether to accept an MCMC step that passed a screening stage.
+ *
+ * Second stage of delayed acceptance (Christen & Fox, 2005). The proposal
+ * was accepted by a first stage with probability min(1, exp(nc - ns)),
+ * where ns is the NLL of the proposal with the PDFs of the current point.
+ * It is accepted now with probability
+ *
+ * min(1, exp(nc - np) * min(1, exp(np - nr)) / min(1, exp(nc - ns)))
+ *
+ * where np is the exact NLL of the proposal and nr the NLL of the current
+ * point with the PDFs of the proposal, so the chain keeps the exact target.
+ * Steps are stored as in jump_decider. The weights in the recycling buffer
+ * use the second-stage acceptance probability, given that the proposal
+ * passed screening; screened-out steps are recorded by jump_decider with
+ * a rejected proposal of weight 0.
+ *
+ * \param rng Random-number generator states
+ * \param nll_current The NLL of the current parameters
+ * \param nll_screen The first-stage NLL of the proposed parameters
+ * \param nll_proposed The exact NLL of the proposed parameters, then the
+ *                     NLL of the current parameters with the proposed PDFs
+ * \param v_current The current parameters
+ * \param v_proposed The proposed parameters
+ * \param nparameters The number of parameters
+ * \param nchanged Number of parameters the proposal moves
+ * \param changed Indices of the parameters the proposal moves
+ * \param accepted Number of accepted steps
+ * \param counter The number of steps in the buffer
+ * \param jump_buffer The step buffer
+ * \param save Store this step in the buffers
+ * \param walk_stats Running statistics of the walk, or NULL
+ * \param block_stats Statistics of the moved block, or NULL
+ * \param walk_covariance Accumulate the full co-moment in block_stats
+ * \param recycle_buffer The recycling buffer, or NULL
+ * \param debug_mode If true, accept every step
+ */
+HEMI_KERNEL(delayed_jump_decider)(RNGState* rng, double* nll_current,
+                                  const double* nll_screen,
+                                  const double* nll_proposed,
+                                  double* v_current, double* v_proposed,
+                                  unsigned nparameters,
+                                  const unsigned nchanged, const int* changed,
+                                  int* accepted, int* counter,
+                                  float* jump_buffer, const bool save,
+                                  double* walk_stats, double* block_stats,
+                                  const bool walk_covariance,
+                                  float* recycle_buffer,
+                                  const bool debug_mode);
 
 
 /**
@@ -93,16 +321,345 @@ HEMI_KERNEL(jump_decider)(RNGState* rng, double* nll_current,
  *
  * Calculate -sum(log(sum(Nj * Pj(xi)))) contribution to NLL.
  *
- * \param lut Pj(xi) lookup table
- * \param dataweights TODO
+ * The lookup table may be stored signal-major (Pj(xi) at lut[j * ne + i]),
+ * which gives coalesced reads on the GPU, or event-major (at lut[i * ns + j]),
+ * where each event's row is contiguous for the CPU. Entries must not be NaN.
+ * The table is stored either as floats or, at half the size, as bfloat16
+ * (see pdfz::to_bfloat16); sums are accumulated in double precision.
+ *
+ * \param lut Pj(xi) lookup table, or NULL if stored as bfloat16
+ * \param lut_bf16 Pj(xi) lookup table in bfloat16, used if lut is NULL
+ * \param dataweights Weight of each event
+ * \param pars Event rates (normalizations) for each signal
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param event_major True if lut is stored event-major
+ * \param sums Output sums for subsets of events
+ */
+HEMI_KERNEL(nll_event_chunks)(const float* lut, const unsigned short* lut_bf16,
+                              const int* dataweights,
+                              const double* pars, const size_t ne,
+                              const size_t ns, const bool event_major,
+                              double* sums);
+
+
+/**
+ * Per-signal scale factors for nll_event_chunks_hist.
+ *
+ * Converts histogram bin contents to the expected event density of each
+ * signal, Nj / (norm_j * bin_volume). Empty histograms get a zero scale.
+ *
+ * \param ns Number of signals
+ * \param nv Number of parameter vectors
+ * \param pars Event rates (normalizations) for each signal, for each vector
+ * \param par_stride Distance between parameter vectors
+ * \param norms Histogram normalizations for each signal
+ * \param bin_volume Volume of one histogram bin, shared by all signals
+ * \param scales Output scale factors for each signal, ns per vector
+ */
+HEMI_KERNEL(nll_hist_scales)(const size_t ns, const size_t nv,
+                             const double* pars, const size_t par_stride,
+                             const unsigned* norms, const double bin_volume,
+                             double* scales);
+
+
+/**
+ * NLL Part 1, read directly from the PDF histograms
+ *
+ * Equivalent to nll_event_chunks for histogram PDFs sharing a binning, with
+ * Nj * Pj(xi) computed as scales[j] times the contents of the bin holding
+ * event i, so no lookup table of PDF values is needed. Events outside the
+ * PDF domain have a bin index of -1.
+ *
+ * The histograms may be stored bin-major (bin b of signal j at
+ * hists[b * ns + j]) or signal-major (at hists[j * nbins + b]).
+ *
+ * \param hists Histogram bin contents for all signals
+ * \param bin_ids Histogram bin index of each event
+ * \param dataweights Weight of each event
+ * \param scales Scale factors from nll_hist_scales
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param nbins Number of bins in each histogram
+ * \param bin_major True if hists is stored bin-major
+ * \param sums Output sums for subsets of events
+ */
+HEMI_KERNEL(nll_event_chunks_hist)(const unsigned* hists, const int* bin_ids,
+                                   const int* dataweights,
+                                   const double* scales, const size_t ne,
+                                   const size_t ns, const size_t nbins,
+                                   const bool bin_major, double* sums);
+
+
+/**
+ * NLL Part 1, for several parameter vectors in one pass over the data
+ *
+ * As nll_event_chunks, but for nv rate vectors sharing the same PDF values,
+ * so each event's row of the table is read once for all of them. Partial
+ * sums for vector k are written to sums[k * nthreads + thread].
+ *
+ * \param lut Pj(xi) lookup table, or NULL if stored as bfloat16
+ * \param lut_bf16 Pj(xi) lookup table in bfloat16, used if lut is NULL
+ * \param dataweights Weight of each event
+ * \param pars Parameter vectors, rates first
+ * \param par_stride Distance between parameter vectors
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param event_major True if lut is stored event-major
+ * \param nv Number of parameter vectors, at most NLL_MAX_BATCH
+ * \param sums Output sums for subsets of events, for each vector
+ */
+HEMI_KERNEL(nll_event_chunks_batch)(const float* lut,
+                                    const unsigned short* lut_bf16,
+                                    const int* dataweights,
+                                    const double* pars,
+                                    const size_t par_stride,
+                                    const size_t ne, const size_t ns,
+                                    const bool event_major,
+                                    const unsigned nv, double* sums);
+
+
+/**
+ * NLL Part 1, read from the PDF histograms, for several parameter vectors
+ *
+ * The batched form of nll_event_chunks_hist; see nll_event_chunks_batch.
+ *
+ * \param hists Histogram bin contents for all signals
+ * \param bin_ids Histogram bin index of each event
+ * \param dataweights Weight of each event
+ * \param scales Scale factors from nll_hist_scales, ns per vector
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param nbins Number of bins in each histogram
+ * \param bin_major True if hists is stored bin-major
+ * \param nv Number of parameter vectors, at most NLL_MAX_BATCH
+ * \param sums Output sums for subsets of events, for each vector
+ */
+HEMI_KERNEL(nll_event_chunks_hist_batch)(const unsigned* hists,
+                                         const int* bin_ids,
+                                         const int* dataweights,
+                                         const double* scales,
+                                         const size_t ne, const size_t ns,
+                                         const size_t nbins,
+                                         const bool bin_major,
+                                         const unsigned nv, double* sums);
+
+
+/**
+ * NLL Part 1, with the gradient of the event term
+ *
+ * As nll_event_chunks, and also accumulates sum(w_i * Pj(xi) / s_i) for
+ * each signal, where s_i = sum(Nj * Pj(xi)); this is the derivative of the
+ * event term with respect to Nj. Events with s_i = 0 add nothing to it.
+ * Partial sums for signal j are written to grads[j * nthreads + thread].
+ *
+ * \param lut Pj(xi) lookup table, or NULL if stored as bfloat16
+ * \param lut_bf16 Pj(xi) lookup table in bfloat16, used if lut is NULL
+ * \param dataweights Weight of each event
  * \param pars Event rates (normalizations) for each signal
  * \param ne Number of events in the data
  * \param ns Number of signals
+ * \param event_major True if lut is stored event-major
  * \param sums Output sums for subsets of events
+ * \param grads Output gradient sums for subsets of events, for each signal
  */
-HEMI_KERNEL(nll_event_chunks)(const float* lut, const int* dataweights,
+HEMI_KERNEL(nll_event_grad)(const float* lut, const unsigned short* lut_bf16,
+                            const int* dataweights, const double* pars,
+                            const size_t ne, const size_t ns,
+                            const bool event_major,
+                            double* sums, double* grads);
+
+
+/**
+ * NLL Part 1 and its gradient, read from the PDF histograms
+ *
+ * The gradient form of nll_event_chunks_hist; see nll_event_grad. The
+ * gradient sums are of w_i * (bin content) / s_i, so the derivative with
+ * respect to Nj is found by dividing by norm_j * bin_volume.
+ *
+ * \param hists Histogram bin contents for all signals
+ * \param bin_ids Histogram bin index of each event
+ * \param dataweights Weight of each event
+ * \param scales Scale factors from nll_hist_scales
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param nbins Number of bins in each histogram
+ * \param bin_major True if hists is stored bin-major
+ * \param sums Output sums for subsets of events
+ * \param grads Output gradient sums for subsets of events, for each signal
+ */
+HEMI_KERNEL(nll_event_grad_hist)(const unsigned* hists, const int* bin_ids,
+                                 const int* dataweights,
+                                 const double* scales,
+                                 const size_t ne, const size_t ns,
+                                 const size_t nbins, const bool bin_major,
+                                 double* sums, double* grads);
+
+
+/**
+ * NLL Part 1, profiled over the MC statistics of the PDF histograms
+ *
+ * Adds the bin_profile change of each occupied bin to the partial sums left
+ * by nll_event_chunks_hist, nll_event_chunks_hist_batch or
+ * nll_event_grad_hist, and must use the same launch configuration. The
+ * variance of the expectation in bin b is the sum over signals of
+ * (scales[j] * bin_volume)^2 * sumw2[j, b]. Bins without data keep beta = 1,
+ * so the cost is one more pass over the occupied bins.
+ *
+ * With grads (and nv = 1), the gradient sums are corrected as well. Since
+ * beta is at its minimum, only the explicit dependence on the rates enters.
+ *
+ * \param hists Histogram bin contents for all signals
+ * \param sumw2 Sum of squared sample weights, in the same layout as hists
+ * \param bin_ids Histogram bin index of each event
+ * \param dataweights Weight of each event
+ * \param scales Scale factors from nll_hist_scales, ns per vector
+ * \param bin_volume Volume of one histogram bin, shared by all signals
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param nbins Number of bins in each histogram
+ * \param bin_major True if hists is stored bin-major
+ * \param nv Number of parameter vectors, at most NLL_MAX_BATCH
+ * \param sums Partial sums to correct, for each vector
+ * \param grads Gradient sums to correct, or NULL
+ */
+HEMI_KERNEL(nll_bin_profile)(const unsigned* hists,
+                             const unsigned long long* sumw2,
+                             const int* bin_ids, const int* dataweights,
+                             const double* scales, const double bin_volume,
+                             const size_t ne, const size_t ns,
+                             const size_t nbins, const bool bin_major,
+                             const unsigned nv, double* sums, double* grads);
+
+
+/**
+ * Mixture sums s_i = sum(Nj * Pj(xi)) of each event, for later updates
+ * one component at a time with nll_component_chunks.
+ *
+ * \param lut Pj(xi) lookup table, or NULL if stored as bfloat16
+ * \param lut_bf16 Pj(xi) lookup table in bfloat16, used if lut is NULL
+ * \param pars Event rates (normalizations) for each signal
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param event_major True if lut is stored event-major
+ * \param mixture Output mixture sum of each event
+ */
+HEMI_KERNEL(nll_mixture_sums)(const float* lut, const unsigned short* lut_bf16,
                               const double* pars, const size_t ne,
-                              const size_t ns, double* sums);
+                              const size_t ns, const bool event_major,
+                              double* mixture);
+
+
+/**
+ * Mixture sums of each event, read from the PDF histograms
+ *
+ * The histogram form of nll_mixture_sums; see nll_event_chunks_hist.
+ *
+ * \param hists Histogram bin contents for all signals
+ * \param bin_ids Histogram bin index of each event
+ * \param scales Scale factors from nll_hist_scales
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param nbins Number of bins in each histogram
+ * \param bin_major True if hists is stored bin-major
+ * \param mixture Output mixture sum of each event
+ */
+HEMI_KERNEL(nll_mixture_sums_hist)(const unsigned* hists, const int* bin_ids,
+                                   const double* scales, const size_t ne,
+                                   const size_t ns, const size_t nbins,
+                                   const bool bin_major, double* mixture);
+
+
+/**
+ * NLL Part 1, for a proposal that moves only the rate of signal k
+ *
+ * Each event's mixture sum changes by (N'k - Nk) * Pk(xi), so only one
+ * column of the lookup table is read. The updated sums are written to
+ * proposed_mixture, to be kept by nll_component_commit if the step is
+ * accepted, and N'k is saved in rate_proposed to tell.
+ *
+ * \param lut Pj(xi) lookup table, or NULL if stored as bfloat16
+ * \param lut_bf16 Pj(xi) lookup table in bfloat16, used if lut is NULL
+ * \param dataweights Weight of each event
+ * \param v_current The current parameters, matching mixture
+ * \param v_proposed The proposed parameters
+ * \param k Index of the signal whose rate is proposed
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param event_major True if lut is stored event-major
+ * \param mixture Mixture sum of each event at the current parameters
+ * \param proposed_mixture Output mixture sum of each event as proposed
+ * \param rate_proposed Output proposed rate of signal k
+ * \param sums Output sums for subsets of events
+ */
+HEMI_KERNEL(nll_component_chunks)(const float* lut,
+                                  const unsigned short* lut_bf16,
+                                  const int* dataweights,
+                                  const double* v_current,
+                                  const double* v_proposed, const size_t k,
+                                  const size_t ne, const size_t ns,
+                                  const bool event_major,
+                                  const double* mixture,
+                                  double* proposed_mixture,
+                                  double* rate_proposed, double* sums);
+
+
+/**
+ * NLL Part 1 for a proposal of one rate, read from the PDF histograms
+ *
+ * The histogram form of nll_component_chunks, with Pk(xi) the contents of
+ * event i's bin divided by norm_k * bin_volume.
+ *
+ * \param hists Histogram bin contents for all signals
+ * \param bin_ids Histogram bin index of each event
+ * \param dataweights Weight of each event
+ * \param norms Histogram normalizations for each signal
+ * \param bin_volume Volume of one histogram bin, shared by all signals
+ * \param v_current The current parameters, matching mixture
+ * \param v_proposed The proposed parameters
+ * \param k Index of the signal whose rate is proposed
+ * \param ne Number of events in the data
+ * \param ns Number of signals
+ * \param nbins Number of bins in each histogram
+ * \param bin_major True if hists is stored bin-major
+ * \param mixture Mixture sum of each event at the current parameters
+ * \param proposed_mixture Output mixture sum of each event as proposed
+ * \param rate_proposed Output proposed rate of signal k
+ * \param sums Output sums for subsets of events
+ */
+HEMI_KERNEL(nll_component_chunks_hist)(const unsigned* hists,
+                                       const int* bin_ids,
+                                       const int* dataweights,
+                                       const unsigned* norms,
+                                       const double bin_volume,
+                                       const double* v_current,
+                                       const double* v_proposed,
+                                       const size_t k, const size_t ne,
+                                       const size_t ns, const size_t nbins,
+                                       const bool bin_major,
+                                       const double* mixture,
+                                       double* proposed_mixture,
+                                       double* rate_proposed, double* sums);
+
+
+/**
+ * Keep the proposed mixture sums if the proposed rate was accepted.
+ *
+ * Run after the accept/reject step, so the mixture sums again match the
+ * current parameters.
+ *
+ * \param ne Number of events in the data
+ * \param k Index of the signal whose rate was proposed
+ * \param v_current The current parameters, after the accept/reject step
+ * \param rate_proposed Proposed rate, from nll_component_chunks
+ * \param proposed_mixture Mixture sum of each event as proposed
+ * \param mixture Mixture sum of each event, updated if accepted
+ */
+HEMI_KERNEL(nll_component_commit)(const size_t ne, const size_t k,
+                                  const double* v_current,
+                                  const double* rate_proposed,
+                                  const double* proposed_mixture,
+                                  double* mixture);
 
 
 /**
@@ -122,13 +679,16 @@ HEMI_KERNEL(nll_event_reduce)(const size_t nthreads, const double* sums,
  * NLL Part 3
  *
  * Calculate overall normalization and constraints contributions to NLL, add
- * in the event term to get the total.
+ * in the event term to get the total. Parameters outside their bounds give
+ * an NLL of 1e18.
  *
  * \param nparameters The number of parameters
  * \param pars Parameters, normalizations then systematics
  * \param nsignals Number of signal parameters
  * \param means Expected rates and means of systematics
  * \param sigmas Gaussian constraint sigma, same units as means
+ * \param lower Lower bound of each parameter (at least 0 for rates)
+ * \param upper Upper bound of each parameter
  * \param events_total Sum of event term contribution
  * \param nll The total NLL
  */
@@ -136,44 +696,109 @@ HEMI_KERNEL(nll_total)(const size_t nparameters, const double* pars,
                        const size_t nsignals,
                        const double* means,
                        const double* sigmas,
+                       const double* lower,
+                       const double* upper,
                        const double* events_total,
                        double* nll);
 
 
+/**
+ * Sum the terms of the NLL outside the event term (see constraint_term).
+ *
+ * A random walk keeps this sum for its current point, and updates it with
+ * only the parameters each step moves (see finish_nll_jump_pick_combo).
+ * Recomputing it now and then keeps rounding errors from building up.
+ *
+ * \param nparameters The number of parameters
+ * \param pars Parameters, normalizations then systematics
+ * \param nsignals Number of signal parameters
+ * \param means Expected rates and means of systematics
+ * \param sigmas Gaussian constraint sigma, same units as means
+ * \param constraint Output: the sum
+ */
+HEMI_KERNEL(nll_constraints)(const size_t nparameters, const double* pars,
+                             const size_t nsignals,
+                             const double* means,
+                             const double* sigmas,
+                             double* constraint);
+
+
 /**
  * All-in-one MCMC step kernel.
  *
  * Combines the operations of computing the final NLL, picking a new parameter
  * vector, and possibly jumping, all in one kernel to reduce launch overhead.
  *
+ * The terms outside the event sum are updated from their total at the
+ * current point with only the parameters in the proposal's block (see
+ * nll_constraints). The decision, the adaptation statistics and the next
+ * proposal also touch only the moved blocks, so beyond the event term a
+ * step costs O(block size), or O(block size^2) with correlated jumps,
+ * plus O(nparameters) when it is saved.
+ *
  * \param npartial_sums The number of partial sums of event terms to add up
  * \param sums Partial sums from event terms
  * \param ns The number of signals
  * \param means Expected rates and means of systematics
  * \param sigmas Gaussian constraint sigma, same units as means
+ * \param lower Lower bound of each parameter
+ * \param upper Upper bound of each parameter
+ * \param constraint Sum of the terms outside the event sum at the current
+ *                   point, updated if the step is taken
+ * \param nblock Number of parameters the proposal moves
+ * \param block Indices of the parameters the proposal moves
  * \param rng Random-number generators
  * \param nll_current The NLL at the current step
  * \param nll_proposed The NLL at the proposed step
  * \param v_current The current parameter vector
- * \param v_proposed The proposed parameter vector
+ * \param v_proposed The proposed parameter vector, reset to the current
+ *                   one if the step is rejected, then holding the next
+ *                   proposal
  * \param accepted The number of accepted steps
  * \param counter The number of steps in the jump buffer
  * \param jump_buffer The buffer of steps (vectors and likelihoods)
+ * \param save Store this step in the buffers
  * \param nparameters The number of parameters (dimensions in the L space)
- * \param sigma The jump distribution widths in each dimension
+ * \param next_nblock Number of parameters the next proposal moves
+ * \param next_block Indices of the parameters the next proposal moves
+ * \param sigma The jump widths of the next block
+ * \param cholesky Cholesky factor of the next block's jump covariance, or
+ *                 NULL to use sigma; see pick_new_vector
+ * \param reflect Reflect independent jumps at the parameter bounds
+ * \param normals Scratch space for one normal deviate per dimension
+ * \param walk_stats Running statistics of the walk, or NULL
+ * \param block_stats Statistics of the moved block (see jump_decider), or
+ *                    NULL
+ * \param walk_covariance Accumulate the full co-moment in block_stats
+ * \param recycle_buffer The recycling buffer (see jump_decider), or NULL
  * \param debug_mode Enable debugging mode, where every step is accepted
  */
 HEMI_KERNEL(finish_nll_jump_pick_combo)(const size_t npartial_sums,
                                         const double* sums, const size_t ns,
                                         const double* means,
                                         const double* sigmas,
+                                        const double* lower,
+                                        const double* upper,
+                                        double* constraint,
+                                        const unsigned nblock,
+                                        const int* block,
                                         RNGState* rng,
                                         double *nll_current,
                                         double *nll_proposed,
                                         double *v_current, double *v_proposed,
                                         int* accepted, int* counter,
-                                        float* jump_buffer, int nparameters,
+                                        float* jump_buffer, const bool save,
+                                        int nparameters,
+                                        const unsigned next_nblock,
+                                        const int* next_block,
                                         const float* sigma,
+                                        const float* cholesky,
+                                        const bool reflect,
+                                        double* normals,
+                                        double* walk_stats,
+                                        double* block_stats,
+                                        const bool walk_covariance,
+                                        float* recycle_buffer,
                                         const bool debug_mode=false);
 
 #endif  // __NLL_H__
@@ -47,7 +47,8 @@ namespace pdfz {
     Eval::Eval(const std::vector<float> &_samples, int _nfields, int _nobservables,
                const std::vector<double> &_lower, const std::vector<double> &_upper) :
         nfields(_nfields), nobservables(_nobservables),
-        lower(_lower.size(), true), upper(_upper.size(), true), syst(0)
+        lower(_lower.size(), true), upper(_upper.size(), true),
+        pdf_buffer(0), pdf_bf16_buffer(0), syst(0)
     {
         if (_samples.size() % _nfields != 0)
             throw Error("Length of samples array is not divisible by number of fields.");
@@ -88,6 +89,15 @@ namespace pdfz {
     void Eval::SetPDFValueBuffer(hemi::Array<float> *output, int offset, int stride)
     {
         this->pdf_buffer = output;
+        this->pdf_bf16_buffer = 0;
+        this->pdf_offset = offset;
+        this->pdf_stride = stride;
+    }
+
+    void Eval::SetPDFValueBuffer(hemi::Array<unsigned short> *output, int offset, int stride)
+    {
+        this->pdf_buffer = 0;
+        this->pdf_bf16_buffer = output;
         this->pdf_offset = offset;
         this->pdf_stride = stride;
     }
@@ -136,6 +146,17 @@ namespace pdfz {
         this->syst->writeOnlyHostPtr()[this->syst->size() - 1] = desc;
     }
 
+    std::vector<int> Eval::GetSystematicParameters()
+    {
+        std::vector<int> pars;
+        if (this->syst) {
+            const SystematicDescriptor *desc = this->syst->readOnlyHostPtr();
+            for (size_t i=0; i < this->syst->size(); i++)
+                pars.push_back(desc[i].par);
+        }
+        return pars;
+    }
+
 
     ///////////////////// EvalHist ///////////////////////
 
@@ -144,7 +165,10 @@ namespace pdfz {
                        const std::vector<int> &_nbins, bool optimize) :
         Eval(_samples, nfields, nobservables, lower, upper),
         samples(_samples.size(), false), weights(_weights.size(), true), read_bins(0), 
-        nbins(_nbins.size(), true), bin_stride(_nbins.size(), true), bins(0), needs_optimization(optimize)
+        nbins(_nbins.size(), true), bin_stride(_nbins.size(), true), bins(0),
+        hist_buffer(0), hist_offset(0), hist_stride(1),
+        sumw2_buffer(0), sumw2_offset(0), sumw2_stride(1), needs_optimization(optimize),
+        needs_bin_optimization(optimize)
     {
         if ( (int) _nbins.size() != nobservables)
             throw Error("Size of nbins array must be same as number of observables.");
@@ -176,6 +200,7 @@ namespace pdfz {
             throw Error("Cannot make histogram with zero bins.");
 
         this->bins = new hemi::Array<unsigned int>(this->total_nbins, true);
+        this->hist_buffer = this->bins;
 
 
         this->bin_nthreads_per_block = 256;
@@ -196,18 +221,81 @@ namespace pdfz {
         delete this->bins;
     }
 
+    EvalHist* EvalHist::Clone()
+    {
+        const float *samples_host = this->samples.readOnlyHostPtr();
+        const int *weights_host = this->weights.readOnlyHostPtr();
+        const double *lower_host = this->lower.readOnlyHostPtr();
+        const double *upper_host = this->upper.readOnlyHostPtr();
+        const int *nbins_host = this->nbins.readOnlyHostPtr();
+
+        std::vector<float> _samples(samples_host, samples_host + this->samples.size());
+        std::vector<int> _weights(weights_host, weights_host + this->weights.size());
+        std::vector<double> _lower(lower_host, lower_host + this->lower.size());
+        std::vector<double> _upper(upper_host, upper_host + this->upper.size());
+        std::vector<int> _nbins(nbins_host, nbins_host + this->nbins.size());
+
+        EvalHist *clone = new EvalHist(_samples, _weights, this->nfields, this->nobservables,
+                                       _lower, _upper, _nbins, this->needs_optimization);
+
+        if (this->syst) {
+            clone->syst = new hemi::Array<SystematicDescriptor>(this->syst->size(), true);
+            clone->syst->copyFromHost(this->syst->readOnlyHostPtr(), this->syst->size());
+        }
+
+        // Reuse any launch configuration already found by Optimize()
+        clone->bin_nthreads_per_block = this->bin_nthreads_per_block;
+        clone->bin_nblocks = this->bin_nblocks;
+        clone->eval_nthreads_per_block = this->eval_nthreads_per_block;
+        clone->eval_nblocks = this->eval_nblocks;
+        clone->needs_bin_optimization = this->needs_bin_optimization;
+
+        return clone;
+    }
+
     void EvalHist::SetEvalPoints(const std::vector<float> &points)
     {
         if (points.size() % this->nobservables != 0)
             throw Error("Number of entries in evaluation points array not divisible by number of observables.");
 
-        delete this->read_bins;
-        this->read_bins = new hemi::Array<int>(points.size() / this->nobservables, false);
-        int *read_bins = this->read_bins->writeOnlyHostPtr();
-
         // Precompute the bin number corresponding to each evaluation point
         // *** This never changes between PDF evaluations! ***
+        std::vector<int> bin_ids;
+        this->GetBinIndices(points, bin_ids);
+
+        delete this->read_bins;
+        this->read_bins = new hemi::Array<int>(bin_ids.size(), false);
+        if (!bin_ids.empty())
+            this->read_bins->copyFromHost(&bin_ids.front(), bin_ids.size());
+    }
 
+    void EvalHist::SetHistogramBuffer(hemi::Array<unsigned int> *hists, int offset, int stride)
+    {
+        if (hists) {
+            this->hist_buffer = hists;
+            this->hist_offset = offset;
+            this->hist_stride = stride;
+        }
+        else {
+            this->hist_buffer = this->bins;
+            this->hist_offset = 0;
+            this->hist_stride = 1;
+        }
+    }
+
+    void EvalHist::SetSumw2Buffer(hemi::Array<unsigned long long> *sumw2, int offset, int stride)
+    {
+        this->sumw2_buffer = sumw2;
+        this->sumw2_offset = offset;
+        this->sumw2_stride = stride;
+    }
+
+    void EvalHist::GetBinIndices(const std::vector<float> &points, std::vector<int> &bin_ids)
+    {
+        if (points.size() % this->nobservables != 0)
+            throw Error("Number of entries in points array not divisible by number of observables.");
+
+        bin_ids.resize(points.size() / this->nobservables);
 
         // Pointer aliases to Hemi array contents (for convenience)
         const double *lower = this->lower.readOnlyHostPtr();
@@ -240,9 +328,9 @@ namespace pdfz {
             }
 
             if (in_pdf_domain)
-                read_bins[ipoint] = (int) bin_id;
+                bin_ids[ipoint] = (int) bin_id;
             else
-                read_bins[ipoint] = -1; // Filled in with NaN during evaluation
+                bin_ids[ipoint] = -1; // Evaluates to zero
         }
     }
 
@@ -263,7 +351,8 @@ namespace pdfz {
         }
     }
 
-    HEMI_KERNEL(zero_hist)(int total_nbins, unsigned int *bins, unsigned int *norm)
+    HEMI_KERNEL(zero_hist)(int total_nbins, unsigned int *bins, int bins_stride, unsigned int *norm,
+                           unsigned long long *sumw2, int sumw2_stride)
     {
         int offset = hemiGetElementOffset();
         int stride = hemiGetElementStride();
@@ -272,7 +361,12 @@ namespace pdfz {
             *norm = 0;
 
         for (int i=offset; i < total_nbins; i += stride)
-            bins[i] = 0;
+            bins[i * bins_stride] = 0;
+
+        if (sumw2) {
+            for (int i=offset; i < total_nbins; i += stride)
+                sumw2[i * sumw2_stride] = 0;
+        }
     }
 
     HEMI_KERNEL(bin_samples)(int ndata, const float *data, const int *weights,
@@ -281,7 +375,8 @@ namespace pdfz {
                              const double * __restrict__ lower, const double * __restrict__ upper,
                              const int nsyst, const SystematicDescriptor * __restrict__ syst,
                              const double * __restrict__ parameters, const int param_stride,
-                             unsigned int *bins, unsigned int *norm)
+                             unsigned int *bins, int bins_stride, unsigned int *norm,
+                             unsigned long long *sumw2, int sumw2_stride)
     {
         int offset = hemiGetElementOffset();
         int stride = hemiGetElementStride();
@@ -320,8 +415,12 @@ namespace pdfz {
 
             // Add to histogram if sample in PDF domain
             if (in_pdf_domain) {
-                atomicAdd(bins + bin_id, weights[isample]);
+                atomicAdd(bins + bin_id * bins_stride, weights[isample]);
                 thread_norm += weights[isample];
+                if (sumw2) {
+                    const unsigned long long w = weights[isample];
+                    atomicAdd(sumw2 + bin_id * sumw2_stride, w * w);
+                }
             }
         }
 
@@ -329,25 +428,28 @@ namespace pdfz {
     }
 
     HEMI_KERNEL(eval_pdf)(int npoints, const int *read_bins,
-                          const unsigned int * __restrict__ bins,
+                          const unsigned int * __restrict__ bins, int bins_stride,
                           const unsigned int * __restrict__ norm,
                           double bin_volume,
-                          float *output, int output_stride)
+                          float *output, unsigned short *output_bf16, int output_stride)
     {
         int offset = hemiGetElementOffset();
         int stride = hemiGetElementStride();
         const double bin_norm = *norm * bin_volume;
 
+        // Points outside the PDF domain and empty histograms evaluate to
+        // zero here, once, so consumers of the output need no NaN checks
         for (int ipoint=offset; ipoint < npoints; ipoint += stride) {
             int bin_id = read_bins[ipoint];
 
             double pdf_value = 0.0f;
-            if (bin_id < 0)
-                pdf_value = nanf("");
-            else
-                pdf_value = bins[bin_id] / bin_norm;
+            if (bin_id >= 0 && bin_norm > 0)
+                pdf_value = bins[bin_id * bins_stride] / bin_norm;
 
-            output[output_stride * ipoint] = pdf_value;
+            if (output)
+                output[output_stride * ipoint] = pdf_value;
+            else
+                output_bf16[output_stride * ipoint] = to_bfloat16(pdf_value);
         }
     }
     ///// End EvalHist kernels
@@ -365,8 +467,14 @@ namespace pdfz {
             syst_ptr = this->syst->readOnlyPtr();
         }
 
+        unsigned long long *sumw2 = 0;
+        if (this->sumw2_buffer)
+            sumw2 = this->sumw2_buffer->ptr() + this->sumw2_offset;
+
         HEMI_KERNEL_LAUNCH(zero_hist, this->eval_nblocks, this->eval_nthreads_per_block, 0, this->cuda_state->stream,
-                           this->total_nbins, this->bins->writeOnlyPtr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
+                           this->total_nbins, this->hist_buffer->ptr() + this->hist_offset, this->hist_stride,
+                           this->norm_buffer->writeOnlyPtr() + this->norm_offset,
+                           sumw2, this->sumw2_stride);
         HEMI_KERNEL_LAUNCH(bin_samples, this->bin_nblocks, this->bin_nthreads_per_block, 0, this->cuda_state->stream,
                            (int) this->samples.size(), this->samples.readOnlyPtr(), this->weights.readOnlyPtr(), 
                            this->nobservables, this->nfields,
@@ -374,16 +482,26 @@ namespace pdfz {
                            this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
                            nsyst, syst_ptr,
                            this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
-                           this->bins->ptr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
+                           this->hist_buffer->ptr() + this->hist_offset, this->hist_stride,
+                           this->norm_buffer->writeOnlyPtr() + this->norm_offset,
+                           sumw2, this->sumw2_stride);
 
         if (this->read_bins == 0 || !do_eval_pdf)
             return; // This can happen if someone wants to create a histogram with no eval points.
 
+        float *output = 0;
+        unsigned short *output_bf16 = 0;
+        if (this->pdf_buffer)
+            output = this->pdf_buffer->writeOnlyPtr() + this->pdf_offset;
+        else
+            output_bf16 = this->pdf_bf16_buffer->writeOnlyPtr() + this->pdf_offset;
+
         HEMI_KERNEL_LAUNCH(eval_pdf, this->eval_nblocks, this->eval_nthreads_per_block, 0, this->cuda_state->stream,
                            (int) this->read_bins->size(), this->read_bins->readOnlyPtr(),
-                           this->bins->readOnlyPtr(), this->norm_buffer->readOnlyPtr() + this->norm_offset,
+                           this->hist_buffer->readOnlyPtr() + this->hist_offset, this->hist_stride,
+                           this->norm_buffer->readOnlyPtr() + this->norm_offset,
                            this->bin_volume,
-                           this->pdf_buffer->writeOnlyPtr() + this->pdf_offset, this->pdf_stride);
+                           output, output_bf16, this->pdf_stride);
     }
 
     void EvalHist::EvalFinished()
@@ -406,7 +524,7 @@ namespace pdfz {
         const double *lower = this->lower.readOnlyHostPtr();
         const double *upper = this->upper.readOnlyHostPtr();
         const int *nbins = this->nbins.readOnlyHostPtr();
-        const unsigned int *bins = this->bins->readOnlyHostPtr();
+        const unsigned int *bins = this->hist_buffer->readOnlyHostPtr() + this->hist_offset;
         const int *bin_stride = this->bin_stride.readOnlyHostPtr();
         const unsigned int norm = this->norm_buffer->readOnlyHostPtr()[this->norm_offset];
 
@@ -419,8 +537,8 @@ namespace pdfz {
                 int source_bin = x * bin_stride[0];
                 int target_bin = hist->GetBin(x+1);
                 if (norm > 0){
-                  hist->SetBinContent(target_bin, bins[source_bin] / this->bin_volume / norm);
-                  hist->SetBinError(target_bin, sqrt(bins[source_bin]) / this->bin_volume / norm);
+                  hist->SetBinContent(target_bin, bins[source_bin * this->hist_stride] / this->bin_volume / norm);
+                  hist->SetBinError(target_bin, sqrt(bins[source_bin * this->hist_stride]) / this->bin_volume / norm);
                 }else{
                   hist->SetBinContent(target_bin, 0);
                   hist->SetBinError(target_bin, 0);
@@ -438,8 +556,8 @@ namespace pdfz {
                     int source_bin = x * bin_stride[0] + y * bin_stride[1];
                     int target_bin = hist->GetBin(x+1, y+1);
                     if (norm > 0){
-                      hist->SetBinContent(target_bin, bins[source_bin] / this->bin_volume / norm);
-                      hist->SetBinError(target_bin, sqrt(bins[source_bin]) / this->bin_volume / norm);
+                      hist->SetBinContent(target_bin, bins[source_bin * this->hist_stride] / this->bin_volume / norm);
+                      hist->SetBinError(target_bin, sqrt(bins[source_bin * this->hist_stride]) / this->bin_volume / norm);
                     }else{
                       hist->SetBinContent(target_bin, 0);
                       hist->SetBinError(target_bin, 0);
@@ -460,8 +578,8 @@ namespace pdfz {
                         int source_bin = x * bin_stride[0] + y * bin_stride[1] + z * bin_stride[2];
                         int target_bin = hist->GetBin(x+1, y+1, z+1);
                         if (norm > 0){
-                          hist->SetBinContent(target_bin, bins[source_bin] / this->bin_volume / norm);
-                          hist->SetBinError(target_bin, sqrt(bins[source_bin]) / this->bin_volume / norm);
+                          hist->SetBinContent(target_bin, bins[source_bin * this->hist_stride] / this->bin_volume / norm);
+                          hist->SetBinError(target_bin, sqrt(bins[source_bin * this->hist_stride]) / this->bin_volume / norm);
                         }else{
                           hist->SetBinContent(target_bin, 0);
                           hist->SetBinError(target_bin, 0);
@@ -482,8 +600,13 @@ namespace pdfz {
 
     void EvalHist::Optimize()
     {
-      if (this->read_bins){
+      // The binning kernel can be tuned without evaluation points, which
+      // callers reading the histogram buffer directly never set
+      if (this->needs_bin_optimization){
         OptimizeBin();
+        needs_bin_optimization = false;
+      }
+      if (this->read_bins){
         OptimizeEval();
         needs_optimization = false;
       }
@@ -525,9 +648,13 @@ namespace pdfz {
         }
 
         // Force allocation of these buffers (since we are not calling the zero bin kernel first)
-        this->bins->writeOnlyPtr(); 
+        this->hist_buffer->writeOnlyPtr(); 
         this->norm_buffer->writeOnlyPtr();
 
+        unsigned long long *sumw2 = 0;
+        if (this->sumw2_buffer)
+            sumw2 = this->sumw2_buffer->ptr() + this->sumw2_offset;
+
         // Benchmark all possible grid sizes
         double best_time = 1e9;
         TStopwatch timer;
@@ -551,7 +678,9 @@ namespace pdfz {
                       this->lower.readOnlyPtr(), this->upper.readOnlyPtr(),
                       nsyst, syst_ptr,
                       this->param_buffer->readOnlyPtr() + this->param_offset, this->param_stride,
-                      this->bins->ptr(), this->norm_buffer->writeOnlyPtr() + this->norm_offset);
+                      this->hist_buffer->ptr() + this->hist_offset, this->hist_stride,
+                      this->norm_buffer->writeOnlyPtr() + this->norm_offset,
+                      sumw2, this->sumw2_stride);
                 }
                 checkCuda( cudaStreamSynchronize(this->cuda_state->stream) );
                 timer.Stop();
@@ -604,9 +733,16 @@ namespace pdfz {
         const double improvement_threshold = 0.9;
 
         // Force allocation of these buffers (since we are not calling the zero bin kernel first)
-        this->bins->writeOnlyPtr(); 
+        this->hist_buffer->writeOnlyPtr(); 
         this->norm_buffer->writeOnlyPtr();
 
+        float *output = 0;
+        unsigned short *output_bf16 = 0;
+        if (this->pdf_buffer)
+            output = this->pdf_buffer->writeOnlyPtr() + this->pdf_offset;
+        else
+            output_bf16 = this->pdf_bf16_buffer->writeOnlyPtr() + this->pdf_offset;
+
         // Benchmark all possible grid sizes
         float best_time = 1e9;
         TStopwatch timer;
@@ -625,9 +761,10 @@ namespace pdfz {
                 for (int irep=0; irep < nreps; irep++) {
                     HEMI_KERNEL_LAUNCH(eval_pdf, grid_size, block_size, 0, this->cuda_state->stream,
                            (int) this->read_bins->size(), this->read_bins->readOnlyPtr(),
-                           this->bins->readOnlyPtr(), this->norm_buffer->readOnlyPtr() + this->norm_offset,
+                           this->hist_buffer->readOnlyPtr() + this->hist_offset, this->hist_stride,
+                           this->norm_buffer->readOnlyPtr() + this->norm_offset,
                            this->bin_volume,
-                           this->pdf_buffer->writeOnlyPtr() + this->pdf_offset, this->pdf_stride);
+                           output, output_bf16, this->pdf_stride);
                 }
                 checkCuda( cudaStreamSynchronize(this->cuda_state->stream) );
                 timer.Stop();
@@ -657,7 +794,7 @@ namespace pdfz {
                                std::vector<double> &syst_vals,
                                std::vector<float> &uppers,
                                std::vector<float> &lowers, bool poisson,
-                               long int maxsamples) {
+                               long int maxsamples, RNGState* rng) {
       hemi::Array<double> params_buffer(syst_vals.size(), true);
       for (size_t i=0; i<syst_vals.size(); i++){
         params_buffer.writeOnlyHostPtr()[i] = syst_vals[i];
@@ -675,7 +812,8 @@ namespace pdfz {
 
       long int observed;
       if (poisson) {
-        observed = gRandom->Poisson(nexpected);
+        observed = (rng ? rng_poisson(rng, nexpected) :
+                          static_cast<long int>(gRandom->Poisson(nexpected)));
       }
       else {
         observed = nint(nexpected);
@@ -728,11 +866,11 @@ namespace pdfz {
         for (j=0; j<observed; j++) {
           if (uppers.size() > 0) {
             do {
-              obs = ht->GetRandom();
+              sample_histogram(ht, rng, &obs);
             } while(obs > uppers[0] || obs < lowers[0]);
           }
           else {
-            obs = ht->GetRandom();
+            sample_histogram(ht, rng, &obs);
           }
 
           events.push_back(obs);
@@ -753,19 +891,20 @@ namespace pdfz {
       else if (hist->IsA() == TH2D::Class()) {
         TH2D* ht = dynamic_cast<TH2D*>(hist);
 
-        double obs0;
-        double obs1;
+        double obs[2];
         unsigned j;
         for (j=0; j<observed; j++) {
           if (uppers.size() > 0) {
             do {
-              ht->GetRandom2(obs0, obs1);
-            } while(obs0 > uppers[0] || obs0 < lowers[0] ||
-                obs1 > uppers[1] || obs1 < lowers[1]);
+              sample_histogram(ht, rng, obs);
+            } while(obs[0] > uppers[0] || obs[0] < lowers[0] ||
+                obs[1] > uppers[1] || obs[1] < lowers[1]);
           }
           else {
-            ht->GetRandom2(obs0, obs1);
+            sample_histogram(ht, rng, obs);
           }
+          const double obs0 = obs[0];
+          const double obs1 = obs[1];
 
           events.push_back(obs0);
           events.push_back(obs1);
@@ -788,21 +927,22 @@ namespace pdfz {
       else if (hist->IsA() == TH3D::Class()) {
         TH3D* ht = dynamic_cast<TH3D*>(hist);
 
-        double obs0;
-        double obs1;
-        double obs2;
+        double obs[3];
         unsigned j;
         for (j=0; j<observed; j++) {
           if (uppers.size() > 0) {
             do {
-              ht->GetRandom3(obs0, obs1, obs2);
-            } while(obs0 > uppers[0] || obs0 < lowers[0] ||
-                obs1 > uppers[1] || obs1 < lowers[1] ||
-                obs2 > uppers[2] || obs2 < lowers[2]);
+              sample_histogram(ht, rng, obs);
+            } while(obs[0] > uppers[0] || obs[0] < lowers[0] ||
+                obs[1] > uppers[1] || obs[1] < lowers[1] ||
+                obs[2] > uppers[2] || obs[2] < lowers[2]);
           }
           else {
-            ht->GetRandom3(obs0, obs1, obs2);
+            sample_histogram(ht, rng, obs);
           }
+          const double obs0 = obs[0];
+          const double obs1 = obs[1];
+          const double obs2 = obs[2];
 
           events.push_back(obs0);
           events.push_back(obs1);
@@ -79,6 +79,8 @@
 #include <string>
 #include <vector>
 #include <TH1.h>
+#include <hemi/hemi.h>
+#include <sxmc/rng.h>
 
 #ifndef __HEMI_ARRAY_H__                                                        
 #define __HEMI_ARRAY_H__                                                        
@@ -169,6 +171,28 @@ namespace pdfz {
     };
 
 
+    /** Round a float to the nearest bfloat16, returned as its bit pattern.
+
+        bfloat16 is the upper half of an IEEE float: the same exponent range,
+        with an 8-bit significand.  Ties round to even.
+    */
+    HEMI_DEV_CALLABLE_INLINE unsigned short to_bfloat16(float x)
+    {
+        union { float f; unsigned int u; } v;
+        v.f = x;
+        v.u += 0x7fff + ((v.u >> 16) & 1);
+        return (unsigned short) (v.u >> 16);
+    }
+
+    /** Expand a bfloat16 bit pattern to a float (exact) */
+    HEMI_DEV_CALLABLE_INLINE float from_bfloat16(unsigned short x)
+    {
+        union { float f; unsigned int u; } v;
+        v.u = ((unsigned int) x) << 16;
+        return v.f;
+    }
+
+
     struct CudaState; // Hide CUDA-related state from callers
     struct SystematicDescriptor; // Also hide representation of systematics
 
@@ -193,6 +217,16 @@ namespace pdfz {
         virtual ~Eval();
 
 
+        /** Create an independent copy of this evaluator.
+
+            The copy has the same samples, bounds and systematics, but none of
+            the buffers set with the Set*Buffer() methods, and no evaluation
+            points, so it can be evaluated concurrently with the original
+            (e.g. by another thread).  The caller owns the copy.
+        */
+        virtual Eval* Clone()=0;
+
+
         /** Set the points where the PDF will be evaluated.
 
             ``points`` is a flattened 2D array in row-major order
@@ -209,12 +243,22 @@ namespace pdfz {
             saves a pointer to a hemi:Array to be used during evaluation.  The
             PDF values will be normalized such that the integral of the PDF
             over the range given by lower and upper in the constructor is 1.
+            Points outside of that range, and all points of a PDF with no
+            samples inside it, are written as zero.
 
             At evaulation time, the PDF evaluated at t_i will be written to:
                 output[offset + i * stride]
         */
         virtual void SetPDFValueBuffer(hemi::Array<float> *output, int offset=0, int stride=1);
 
+        /** Set a bfloat16 output array where the PDF values will be written.
+
+            Same as the float version, but each PDF value is rounded with
+            to_bfloat16(), halving the size of the output array at a relative
+            precision of about 0.4%.  Replaces any float output array.
+        */
+        virtual void SetPDFValueBuffer(hemi::Array<unsigned short> *output, int offset=0, int stride=1);
+
 
         /** Set the output array where the PDF normalization will be written for each point.
 
@@ -243,6 +287,13 @@ namespace pdfz {
         virtual void AddSystematic(const Systematic &syst);
 
 
+        /** Indices of the systematic parameters this PDF depends on, in the
+            order the systematics were added.  A parameter controlling more
+            than one systematic is listed once per systematic.
+        */
+        virtual std::vector<int> GetSystematicParameters();
+
+
         /** Launch evaluation of the PDF at all the points given in the last call to
             SetEvalPoints() using the systematic parameters read from the
             parameter buffer specified in SetParameterBuffer().
@@ -271,6 +322,7 @@ namespace pdfz {
         hemi::Array<double> upper;
 
         hemi::Array<float> *pdf_buffer;
+        hemi::Array<unsigned short> *pdf_bf16_buffer;
         int pdf_offset;
         int pdf_stride;
 
@@ -307,8 +359,49 @@ namespace pdfz {
                  const std::vector<int> &nbins, bool optimize=true);
 
         virtual ~EvalHist();
+        virtual EvalHist* Clone();
         virtual void SetEvalPoints(const std::vector<float> &points);
 
+        /** Find the histogram bin containing each point.
+
+            ``points`` has the same layout as in SetEvalPoints().  On return,
+            bin_ids[i] is the flattened (row-major) bin index of point i, or
+            -1 if the point lies outside the PDF domain.  Every point in the
+            same bin has the same PDF value, whatever the systematics.
+        */
+        virtual void GetBinIndices(const std::vector<float> &points, std::vector<int> &bin_ids);
+
+        /** Set the storage buffer for the histogram bin contents.
+
+            By default each EvalHist bins its samples into a private
+            histogram.  To allow the histograms of several PDFs to be read
+            together (e.g. to compute a likelihood directly from the bin
+            contents), this method saves a pointer to a larger hemi::Array
+            to be used during evaluation instead.  Pass NULL to go back to
+            the private histogram.
+
+            At evaluation time, the contents of bin i will be written to:
+                hists[offset + i * stride]
+        */
+        virtual void SetHistogramBuffer(hemi::Array<unsigned int> *hists, int offset=0, int stride=1);
+
+        /** Set a buffer for the sum of squared sample weights in each bin.
+
+            Tracks the Monte Carlo statistical uncertainty of the bin
+            contents (sumw2 is the variance of bin i) alongside the
+            histogram, with the same layout as in SetHistogramBuffer():
+                sumw2[offset + i * stride]
+            Pass NULL (the default) to not track it.  The sums are 64-bit,
+            so they cannot overflow while the bin contents fit in 32 bits.
+        */
+        virtual void SetSumw2Buffer(hemi::Array<unsigned long long> *sumw2, int offset=0, int stride=1);
+
+        /** Total number of histogram bins, over all dimensions */
+        int GetNbins() const { return this->total_nbins; }
+
+        /** Volume of one histogram bin, in units of the observables */
+        double GetBinVolume() const { return this->bin_volume; }
+
         /** Dump the current PDF contents (as of the last EvalAsync/Finished call)
          *  into a new TH1 object and return it.  Obviously only works for 
          *  1, 2 or 3 histograms.
@@ -334,16 +427,17 @@ namespace pdfz {
                          std::vector<double> &syst_vals,
                          std::vector<float> &uppers,
                          std::vector<float> &lowers, bool poisson=false,
-                         long int maxsamples=1e7);
+                         long int maxsamples=1e7, RNGState* rng=NULL);
 
         int RandomSample(std::vector<float> &events,
                          std::vector<int> &eventweights, double nexpected,
-                         bool poisson=false, long int maxsamples=1e7) {
+                         bool poisson=false, long int maxsamples=1e7,
+                         RNGState* rng=NULL) {
           std::vector<double> syst_vals(syst->size(), 0);
           std::vector<float> _upper;
           std::vector<float> _lower;
           return RandomSample(events, eventweights, nexpected, syst_vals,
-                              _upper, _lower, poisson, maxsamples);
+                              _upper, _lower, poisson, maxsamples, rng);
         };
 
     protected:
@@ -353,6 +447,12 @@ namespace pdfz {
         hemi::Array<int> nbins;
         hemi::Array<int> bin_stride;
         hemi::Array<unsigned int> *bins;
+        hemi::Array<unsigned int> *hist_buffer;
+        int hist_offset;
+        int hist_stride;
+        hemi::Array<unsigned long long> *sumw2_buffer;
+        int sumw2_offset;
+        int sumw2_stride;
         int total_nbins;
         double bin_volume;
 
@@ -362,6 +462,7 @@ namespace pdfz {
         int eval_nblocks;
 
         bool needs_optimization;
+        bool needs_bin_optimization;
     };
 
 
@@ -381,6 +482,7 @@ namespace pdfz {
                    const std::vector<double> &bandwidth_scale);
 
         virtual ~EvalKernel();
+        virtual EvalKernel* Clone();
         virtual void SetEvalPoints(const std::vector<float> &points);
         virtual void EvalAsync(bool do_eval_pdf=true);
         virtual void EvalFinished();
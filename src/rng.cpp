@@ -0,0 +1,77 @@
+#include <cmath>
+#include <algorithm>
+#include <assert.h>
+#include <TH1.h>
+#include <TH2.h>
+#include <TH3.h>
+
+#include <sxmc/rng.h>
+
+void rng_uniforms(RNGState* rng, double* out, size_t n) {
+  for (size_t i=0; i<n; i++) {
+    out[i] = rng_uniform(rng);
+  }
+}
+
+
+void rng_normals(RNGState* rng, double* out, size_t n) {
+  for (size_t i=0; i<n; i+=2) {
+    const double r = sqrt(-2.0 * log(rng_uniform(rng)));
+    const double phi = 2.0 * M_PI * rng_uniform(rng);
+    out[i] = r * cos(phi);
+    if (i + 1 < n) {
+      out[i + 1] = r * sin(phi);
+    }
+  }
+}
+
+
+void rng_poissons(RNGState* rng, const double* mean, long* out, size_t n) {
+  for (size_t i=0; i<n; i++) {
+    out[i] = rng_poisson(rng, mean[i]);
+  }
+}
+
+
+void sample_histogram(TH1* hist, RNGState* rng, double* x) {
+  const int dim = hist->GetDimension();
+  if (!rng) {
+    if (dim == 1) {
+      x[0] = hist->GetRandom();
+    }
+    else if (dim == 2) {
+      dynamic_cast<TH2*>(hist)->GetRandom2(x[0], x[1]);
+    }
+    else {
+      dynamic_cast<TH3*>(hist)->GetRandom3(x[0], x[1], x[2]);
+    }
+    return;
+  }
+
+  // Cumulative content of the bins, x fastest, normalized to 1
+  const int nx = hist->GetNbinsX();
+  const int ny = hist->GetNbinsY();
+  const int nz = hist->GetNbinsZ();
+  const int nbins = nx * ny * nz;
+  // Recompute if the contents changed since the last draw, as GetRandom does
+  double* integral = hist->GetIntegral();
+  if (integral[nbins + 1] != hist->GetEntries()) {
+    hist->ComputeIntegral(true);
+    integral = hist->GetIntegral();
+  }
+  assert(integral[nbins] > 0);
+
+  const double u = rng_uniform(rng) * integral[nbins];
+  int ibin = std::lower_bound(integral + 1, integral + nbins + 1, u) -
+             (integral + 1);
+  ibin = std::min(ibin, nbins - 1);
+
+  const int bin[3] = { ibin % nx, (ibin / nx) % ny, ibin / (nx * ny) };
+  const TAxis* axis[3] = { hist->GetXaxis(), hist->GetYaxis(),
+                           hist->GetZaxis() };
+  for (int d=0; d<dim; d++) {
+    x[d] = axis[d]->GetBinLowEdge(bin[d] + 1) +
+           axis[d]->GetBinWidth(bin[d] + 1) * (1 - rng_uniform(rng));
+  }
+}
+
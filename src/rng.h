@@ -0,0 +1,248 @@
+/**
+ * \file rng.h
+ *
+ * Counter-based random number generation, on the host and the device.
+ *
+ * Numbers come from the Philox4x32-10 generator (Salmon et al., 2011), a
+ * keyed bijection of a 128-bit counter. A stream is just a (key, counter)
+ * starting point, so any number of independent streams can be derived from
+ * one master seed without any shared state, and the same seed gives the
+ * same numbers on the CPU and the GPU, with any number of threads.
+ *
+ * The key is the master seed. The counter holds a 64-bit position, a
+ * substream (e.g. a parameter index) and a stream (see rng_stream).
+ */
+
+#ifndef __RNG_H__
+#define __RNG_H__
+
+#include <cstddef>
+#include <cmath>
+#include <hemi/hemi.h>
+
+class TH1;
+
+/** Stream index reserved for fake data generation, see rng_stream */
+const unsigned RNG_DATA = 0xffff;
+
+/**
+ * \struct RNGState
+ * \brief State of one Philox4x32-10 stream
+ *
+ * Each state is an independent stream, so concurrent chains and threads do
+ * not share (or race on) a global generator. The state is plain data, and
+ * may be copied to the device or to a checkpoint as bytes.
+ */
+struct RNGState {
+  unsigned key[2];  //!< the master seed
+  unsigned counter[4];  //!< position (low, high), substream, stream
+  unsigned block[4];  //!< output for the last counter
+  unsigned used;  //!< words of the block already returned
+};
+
+
+/**
+ * Get the stream index for one use of the RNG in one experiment.
+ *
+ * \param experiment Index of the experiment, < 65536
+ * \param index Chain index, or RNG_DATA for the fake data
+ * \returns The stream index, for rng_init
+ */
+HEMI_DEV_CALLABLE_INLINE
+unsigned rng_stream(const unsigned experiment, const unsigned index) {
+  return (experiment << 16) | (index & 0xffff);
+}
+
+
+/** One Philox round: 32x32 -> 64-bit products and a key mix */
+HEMI_DEV_CALLABLE_INLINE
+void philox_round(unsigned* c, const unsigned k0, const unsigned k1) {
+  const unsigned long long p0 = 0xD2511F53ULL * c[0];
+  const unsigned long long p1 = 0xCD9E8D57ULL * c[2];
+  const unsigned hi0 = static_cast<unsigned>(p0 >> 32);
+  const unsigned hi1 = static_cast<unsigned>(p1 >> 32);
+  const unsigned c1 = c[1];
+  const unsigned c3 = c[3];
+  c[0] = hi1 ^ c1 ^ k0;
+  c[1] = static_cast<unsigned>(p1);
+  c[2] = hi0 ^ c3 ^ k1;
+  c[3] = static_cast<unsigned>(p0);
+}
+
+
+/**
+ * The Philox4x32-10 bijection.
+ *
+ * \param counter The 128-bit counter
+ * \param key The 64-bit key
+ * \param out Output: four random 32-bit words
+ */
+HEMI_DEV_CALLABLE_INLINE
+void philox4x32(const unsigned* counter, const unsigned* key, unsigned* out) {
+  unsigned k0 = key[0];
+  unsigned k1 = key[1];
+  for (int i=0; i<4; i++) {
+    out[i] = counter[i];
+  }
+  for (int r=0; r<10; r++) {
+    philox_round(out, k0, k1);
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+}
+
+
+/**
+ * Start a stream.
+ *
+ * \param rng The state to set
+ * \param seed Master seed
+ * \param stream Stream index, see rng_stream
+ * \param substream Substream index, e.g. of a parameter
+ */
+HEMI_DEV_CALLABLE_INLINE
+void rng_init(RNGState* rng, const unsigned long long seed,
+              const unsigned stream, const unsigned substream) {
+  rng->key[0] = static_cast<unsigned>(seed);
+  rng->key[1] = static_cast<unsigned>(seed >> 32);
+  rng->counter[0] = 0;
+  rng->counter[1] = 0;
+  rng->counter[2] = substream;
+  rng->counter[3] = stream;
+  rng->used = 4;
+}
+
+
+/** Next random 32-bit word of a stream */
+HEMI_DEV_CALLABLE_INLINE
+unsigned rng_next(RNGState* rng) {
+  if (rng->used == 4) {
+    philox4x32(rng->counter, rng->key, rng->block);
+    if (++rng->counter[0] == 0) {
+      rng->counter[1]++;
+    }
+    rng->used = 0;
+  }
+  return rng->block[rng->used++];
+}
+
+
+/** Uniform random number in (0, 1], with 53 random bits */
+HEMI_DEV_CALLABLE_INLINE
+double rng_uniform(RNGState* rng) {
+  const unsigned a = rng_next(rng) >> 5;
+  const unsigned b = rng_next(rng) >> 6;
+  return (a * 67108864.0 + b + 1) * (1.0 / 9007199254740992.0);
+}
+
+
+/** Normally-distributed random number with mean 0 and sigma 1 */
+HEMI_DEV_CALLABLE_INLINE
+double rng_normal(RNGState* rng) {
+  // Box-Muller
+  const double u1 = rng_uniform(rng);
+  const double u2 = rng_uniform(rng);
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+/**
+ * Poisson-distributed random number.
+ *
+ * Multiplies uniforms for small means, and otherwise uses the transformed
+ * rejection method PTRS (Hormann, 1993), which takes about one pair of
+ * uniforms per number for any mean.
+ *
+ * \param rng The stream
+ * \param mean The Poisson mean, >= 0
+ * \returns A Poisson deviate
+ */
+HEMI_DEV_CALLABLE_INLINE
+long rng_poisson(RNGState* rng, const double mean) {
+  if (mean < 10) {
+    const double l = exp(-mean);
+    long k = 0;
+    double p = rng_uniform(rng);
+    while (p > l) {
+      k++;
+      p *= rng_uniform(rng);
+    }
+    return k;
+  }
+
+  const double slam = sqrt(mean);
+  const double loglam = log(mean);
+  const double b = 0.931 + 2.53 * slam;
+  const double a = -0.059 + 0.02483 * b;
+  const double invalpha = 1.1239 + 1.1328 / (b - 3.4);
+  const double vr = 0.9277 - 3.6224 / (b - 2);
+  while (true) {
+    const double u = rng_uniform(rng) - 0.5;
+    const double v = rng_uniform(rng);
+    const double us = 0.5 - fabs(u);
+    const double k = floor((2 * a / us + b) * u + mean + 0.43);
+    if (us >= 0.07 && v <= vr) {
+      return static_cast<long>(k);
+    }
+    if (k < 0 || (us < 0.013 && v > us)) {
+      continue;
+    }
+    if (log(v) + log(invalpha) - log(a / (us * us) + b) <=
+        -mean + k * loglam - lgamma(k + 1)) {
+      return static_cast<long>(k);
+    }
+  }
+}
+
+
+/**
+ * Fill an array with uniform random numbers in (0, 1].
+ *
+ * Gives the same numbers as n calls to rng_uniform, in a loop the compiler
+ * can keep in registers.
+ *
+ * \param rng The stream
+ * \param out Output array
+ * \param n Number of values
+ */
+void rng_uniforms(RNGState* rng, double* out, size_t n);
+
+
+/**
+ * Fill an array with normal random numbers, mean 0 and sigma 1.
+ *
+ * Uses both outputs of each Box-Muller transform, so it takes half the
+ * uniforms of n calls to rng_normal (and gives different numbers).
+ *
+ * \param rng The stream
+ * \param out Output array
+ * \param n Number of values
+ */
+void rng_normals(RNGState* rng, double* out, size_t n);
+
+
+/**
+ * Fill an array with Poisson random numbers.
+ *
+ * \param rng The stream
+ * \param mean The Poisson mean of each value
+ * \param out Output array
+ * \param n Number of values
+ */
+void rng_poissons(RNGState* rng, const double* mean, long* out, size_t n);
+
+
+/**
+ * Draw a random point from a ROOT histogram (TH1D, TH2D, or TH3D).
+ *
+ * Picks a bin with probability proportional to its content, then a point
+ * uniformly within the bin, like TH1::GetRandom, GetRandom2 and GetRandom3.
+ *
+ * \param hist The histogram
+ * \param rng The stream, or NULL to use TH1::GetRandom and gRandom
+ * \param x Output: the point, one value per histogram dimension
+ */
+void sample_histogram(TH1* hist, RNGState* rng, double* x);
+
+#endif  // __RNG_H__
+
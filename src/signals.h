@@ -49,6 +49,8 @@ struct Systematic {
   double mean;  //!< Mean value
   double sigma;  //!< Standard deviation (constraint)
   bool fixed;  //! Fix the value of the parameter to the mean
+  double lower;  //!< Hard lower limit, -HUGE_VAL if none
+  double upper;  //!< Hard upper limit, HUGE_VAL if none
 };
 
 
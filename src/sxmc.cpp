@@ -18,6 +18,8 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <map>
+#include <cmath>
 #include <TStyle.h>
 #include <TLegend.h>
 #include <TFile.h>
@@ -36,6 +38,7 @@
 #include <sxmc/config.h>
 #include <sxmc/generator.h>
 #include <sxmc/mcmc.h>
+#include <sxmc/rng.h>
 #include <sxmc/utils.h>
 #include <sxmc/likelihood.h>
 #include <sxmc/plots.h>
@@ -43,7 +46,7 @@
 /**
  * Run an ensemble of independent fake experiments
  *
- * Run experiments, fit each with MCMC.
+ * Run experiments, fit each with MCMC, or only find the best fit of each.
  *
  * \param signals List of Signals defining PDFs, rates, etc.
  * \param systematics List of Systematics applied to PDFs
@@ -55,6 +58,9 @@
  * \param nexperiments Number of fake experiments to run
  * \param live_time Experiment live time in years
  * \param debug_mode If true, accept and save all steps
+ * \param output_path Directory for output files
+ * \param mcmc_options MCMC sampler settings
+ * \param fit_only If true, find the best fit and its Hessian errors only
  * \returns A list of the upper limits
  */
 std::vector<float> ensemble(std::vector<Signal>& signals,
@@ -64,7 +70,9 @@ std::vector<float> ensemble(std::vector<Signal>& signals,
                              unsigned steps, float burnin_fraction,
                              float confidence, unsigned nexperiments,
                              float live_time, const bool debug_mode,
-                             std::string output_path) {
+                             std::string output_path,
+                             const MCMCOptions& mcmc_options,
+                             const bool fit_only) {
   std::vector<float> limits;
 
   for (size_t i=0; i<signals.size(); i++) {
@@ -92,12 +100,39 @@ std::vector<float> ensemble(std::vector<Signal>& signals,
       param_names.push_back(systematics[j].name);
     }
 
-    // Make fake data
+    // Make fake data, and run the chains, with this experiment's streams
+    RNGState data_rng;
+    rng_init(&data_rng, mcmc_options.seed, rng_stream(i, RNG_DATA), 0);
     std::pair<std::vector<float>, std::vector<int> > data = \
-      make_fake_dataset(signals, systematics, observables, params, true);
+      make_fake_dataset(signals, systematics, observables, params, true,
+                        1e7, &data_rng);
+
+    MCMCOptions options = mcmc_options;
+    options.experiment = i;
+
+    // Fit only, with errors from the Hessian
+    MCMC mcmc(signals, systematics, observables, options);
+    if (fit_only) {
+      FitResult fit = mcmc.fit(data.first, data.second);
+      std::map<std::string, Interval> best_fit;
+      std::cout << "-- Best fit --" << std::endl;
+      for (size_t j=0; j<params.size(); j++) {
+        double error = sqrt(fit.covariance[j * params.size() + j]);
+        Interval interval;
+        interval.point_estimate = fit.best_fit[j];
+        interval.lower = fit.best_fit[j] - error;
+        interval.upper = fit.best_fit[j] + error;
+        interval.cl = 0.6827;
+        best_fit[param_names[j]] = interval;
+        std::cout << " " << param_names[j] << ": " << interval.str()
+                  << std::endl;
+      }
+      plot_fit(best_fit, live_time, signals, systematics, observables,
+               data.first, data.second, output_path);
+      continue;
+    }
 
     // Run MCMC
-    MCMC mcmc(signals, systematics, observables);
     LikelihoodSpace* ls = \
       mcmc(data.first, data.second, steps, burnin_fraction, debug_mode);
 
@@ -106,10 +141,18 @@ std::vector<float> ensemble(std::vector<Signal>& signals,
     TNtuple* lsclone = dynamic_cast<TNtuple*>(ls->get_samples()->Clone("ls"));
     lsclone->Write();
     lsclone->Delete();
+    if (ls->get_recycled()) {
+      TNtuple* rclone = \
+        dynamic_cast<TNtuple*>(ls->get_recycled()->Clone("ls_recycled"));
+      rclone->Write();
+      rclone->Delete();
+    }
     f.Close();
 
     ls->print_best_fit();
+    ls->print_means();
     ls->print_correlations();
+    ls->print_convergence();
 
     // Make spectral plots
     plot_fit(ls->get_best_fit(), live_time, signals, systematics, observables,
@@ -184,6 +227,10 @@ int main(int argc, char* argv[]) {
   std::cout << "sxmc: Loading configuration..." << std::endl;
   std::string config_filename = std::string(argv[1]);
   FitConfig fc(config_filename);
+  if (fc.mcmc_options.seed == 0) {
+    fc.mcmc_options.seed = 1 + gRandom->Integer(0xfffffffe);
+  }
+  gRandom->SetSeed(fc.mcmc_options.seed);
   fc.print();
 
   // Run ensemble
@@ -191,7 +238,7 @@ int main(int argc, char* argv[]) {
   std::vector<float> limits = \
     ensemble(fc.signals, fc.systematics, fc.observables, fc.cuts, fc.steps,
              fc.burnin_fraction, fc.confidence, fc.experiments, fc.live_time,
-             fc.debug_mode, output_path);
+             fc.debug_mode, output_path, fc.mcmc_options, fc.fit_only);
 
   // TODO: Find average (median) limit
 
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <cmath>
 #include <assert.h>
 #include <TCanvas.h>
 #include <TLegend.h>
@@ -28,7 +29,7 @@ std::vector<float> get_correlation_matrix(TNtuple* nt) {
   std::vector<std::string> names;
   for (int i=0; i<nt->GetListOfBranches()->GetEntries(); i++) {
     std::string name = nt->GetListOfBranches()->At(i)->GetName();
-    if (name == "likelihood") {
+    if (name == "likelihood" || name == "chain") {
       continue;
     }
     names.push_back(name);
@@ -72,3 +73,133 @@ std::vector<float> get_correlation_matrix(TNtuple* nt) {
   return matrix;
 }
 
+
+bool cholesky(std::vector<double>& a, size_t n) {
+  for (size_t j=0; j<n; j++) {
+    double d = a[j * n + j];
+    for (size_t k=0; k<j; k++) {
+      d -= a[j * n + k] * a[j * n + k];
+    }
+    if (!(d > 0)) {
+      return false;
+    }
+    d = sqrt(d);
+    a[j * n + j] = d;
+
+    for (size_t i=j+1; i<n; i++) {
+      double x = a[i * n + j];
+      for (size_t k=0; k<j; k++) {
+        x -= a[i * n + k] * a[j * n + k];
+      }
+      a[i * n + j] = x / d;
+      a[j * n + i] = 0;
+    }
+  }
+  return true;
+}
+
+
+bool invert_spd(std::vector<double>& a, size_t n) {
+  std::vector<double> l(a);
+  if (!cholesky(l, n)) {
+    return false;
+  }
+
+  // Solve L * L^T * x = e_c for each column c of the identity
+  std::vector<double> x(n);
+  for (size_t c=0; c<n; c++) {
+    for (size_t i=0; i<n; i++) {
+      double t = (i == c ? 1 : 0);
+      for (size_t k=0; k<i; k++) {
+        t -= l[i * n + k] * x[k];
+      }
+      x[i] = t / l[i * n + i];
+    }
+    for (size_t i=n; i-->0;) {
+      double t = x[i];
+      for (size_t k=i+1; k<n; k++) {
+        t -= l[k * n + i] * x[k];
+      }
+      x[i] = t / l[i * n + i];
+    }
+    for (size_t i=0; i<n; i++) {
+      a[i * n + c] = x[i];
+    }
+  }
+  return true;
+}
+
+
+double effective_sample_size(const std::vector<float>& samples,
+                             size_t nfields, size_t first, size_t n,
+                             size_t field) {
+  const size_t b = static_cast<size_t>(sqrt(static_cast<double>(n)));
+  if (b < 2) {
+    return 0;
+  }
+  const size_t nbatches = n / b;
+  const size_t m = nbatches * b;
+
+  // Use the last m steps, so the batches are all full
+  const size_t start = first + n - m;
+  double mean = 0;
+  for (size_t i=0; i<m; i++) {
+    mean += samples[(start + i) * nfields + field];
+  }
+  mean /= m;
+
+  double var = 0;
+  double batch_var = 0;
+  for (size_t k=0; k<nbatches; k++) {
+    double batch_mean = 0;
+    for (size_t i=k*b; i<(k+1)*b; i++) {
+      double d = samples[(start + i) * nfields + field] - mean;
+      var += d * d;
+      batch_mean += d;
+    }
+    batch_mean /= b;
+    batch_var += batch_mean * batch_mean;
+  }
+  var /= m - 1;
+  batch_var /= nbatches - 1;
+
+  if (!(var > 0)) {
+    return 0;
+  }
+  if (!(batch_var > 0)) {
+    return m;
+  }
+  return m * var / (b * batch_var);
+}
+
+
+double geweke_z(const std::vector<float>& samples, size_t nfields,
+                size_t first, size_t n, size_t field) {
+  const size_t nbatches = 10;
+  const size_t begin[2] = {first, first + n / 2};
+  const size_t length[2] = {n / 10, n - n / 2};
+  double mean[2];
+  double var[2];
+  for (size_t s=0; s<2; s++) {
+    const size_t bs = length[s] / nbatches;
+    std::vector<double> batch_mean(nbatches, 0);
+    mean[s] = 0;
+    for (size_t b=0; b<nbatches; b++) {
+      for (size_t k=0; k<bs; k++) {
+        batch_mean[b] += samples[(begin[s] + b * bs + k) * nfields + field];
+      }
+      batch_mean[b] /= bs;
+      mean[s] += batch_mean[b];
+    }
+    mean[s] /= nbatches;
+    var[s] = 0;
+    for (size_t b=0; b<nbatches; b++) {
+      var[s] += (batch_mean[b] - mean[s]) * (batch_mean[b] - mean[s]);
+    }
+    var[s] /= (nbatches - 1) * nbatches;
+  }
+  if (!(var[0] > 0 && var[1] > 0)) {
+    return HUGE_VAL;
+  }
+  return (mean[0] - mean[1]) / sqrt(var[0] + var[1]);
+}
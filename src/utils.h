@@ -35,6 +35,69 @@ float get_ntuple_entry(TNtuple* nt, int i, std::string field);
 std::vector<float> get_correlation_matrix(TNtuple* nt);
 
 
+/**
+ * Cholesky decomposition of a symmetric positive-definite matrix.
+ *
+ * Finds the lower-triangular L with L * L^T = A, in place. Elements above
+ * the diagonal are set to zero.
+ *
+ * \param a The n x n matrix A, row-major; replaced by L
+ * \param n The dimension of the matrix
+ * \returns False, with a partly overwritten, if A is not positive-definite
+ */
+bool cholesky(std::vector<double>& a, size_t n);
+
+
+/**
+ * Invert a symmetric positive-definite matrix, by Cholesky decomposition.
+ *
+ * \param a The n x n matrix, row-major; replaced by its inverse
+ * \param n The dimension of the matrix
+ * \returns False, with a unchanged, if a is not positive-definite
+ */
+bool invert_spd(std::vector<double>& a, size_t n);
+
+
+/**
+ * Estimate the effective sample size of one field of a Markov chain.
+ *
+ * Uses batch means: the steps are cut into about sqrt(n) batches of about
+ * sqrt(n) steps, and the variance of the batch means, compared with that
+ * of single steps, gives the integrated autocorrelation time. The cost is
+ * linear in n.
+ *
+ * \param samples Saved steps, nfields values each
+ * \param nfields Number of values per step
+ * \param first Index of the first step to include
+ * \param n Number of steps to include
+ * \param field Index of the value to use
+ * \returns The effective sample size, zero if the field never changes or
+ *          there are fewer than four steps
+ */
+double effective_sample_size(const std::vector<float>& samples,
+                             size_t nfields, size_t first, size_t n,
+                             size_t field);
+
+
+/**
+ * Geweke's (1992) convergence diagnostic for one field of a walk.
+ *
+ * Compares the mean of the first 10% of the steps with that of the last
+ * half, in units of the standard error of the difference. Standard errors
+ * come from the means of ten batches in each segment, which accounts for
+ * the autocorrelation of the walk.
+ *
+ * \param samples Saved steps, nfields values each
+ * \param nfields Number of values per step
+ * \param first Index of the first step to include
+ * \param n Number of steps to include, at least 100
+ * \param field Index of the value to test
+ * \returns The z-score, or HUGE_VAL if either segment does not vary
+ */
+double geweke_z(const std::vector<float>& samples, size_t nfields,
+                size_t first, size_t n, size_t field);
+
+
 /**
  * Get the index of an object in a vector.
  *
@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <map>
+#include <string>
+#include <TNtuple.h>
+#include <TH1F.h>
+
+#include <sxmc/likelihood.h>
+
+// Four chains spread evenly over a unit interval: x covers the same range
+// in every chain, y a range offset differently in each
+TEST(LikelihoodSpace, SplitRHat)
+{
+    TNtuple* nt = new TNtuple("lspace_rhat", "", "x:y:likelihood:chain");
+    float row[4];
+    for (int c=0; c<4; c++) {
+        for (int i=0; i<2000; i++) {
+            // Golden-ratio steps, so both halves of a chain look alike
+            const double u = fmod(0.6180339887498949 * (2000 * c + i), 1.0);
+            row[0] = u - 0.5;
+            row[1] = u + 5 * c;
+            row[2] = 0.5 * (row[0] * row[0] + row[1] * row[1]);
+            row[3] = c;
+            nt->Fill(row);
+        }
+    }
+
+    LikelihoodSpace ls(nt);
+    std::map<std::string, float> rhat = ls.get_split_rhat();
+    ASSERT_EQ((size_t) 1, rhat.count("x"));
+    ASSERT_EQ((size_t) 1, rhat.count("y"));
+    EXPECT_NEAR(1.0, rhat["x"], 0.01);
+    EXPECT_GT(rhat["y"], 2.0);
+}
+
+TEST(LikelihoodSpace, SplitRHatTooFewSamples)
+{
+    TNtuple* nt = new TNtuple("lspace_rhat_short", "", "x:likelihood:chain");
+    float row[3] = { 1, 0, 0 };
+    nt->Fill(row);
+    row[0] = 2;
+    nt->Fill(row);
+
+    LikelihoodSpace ls(nt);
+    EXPECT_TRUE(ls.get_split_rhat().empty());
+}
+
+// Three steps, each with the point not taken there, weighted by its
+// acceptance probability
+TEST(LikelihoodSpace, RecycledEstimates)
+{
+    TNtuple* nt = new TNtuple("lspace_steps", "", "x:likelihood:chain");
+    TNtuple* steps_only = \
+        new TNtuple("lspace_steps_only", "", "x:likelihood:chain");
+    TNtuple* recycled = \
+        new TNtuple("lspace_weighted", "", "x:likelihood:chain:weight");
+    const float steps[3] = { 1, 1, 3 };
+    const float others[3] = { 2, 4, 5 };
+    const float w[3] = { 0.25, 0.5, 0 };
+    for (int i=0; i<3; i++) {
+        float row[4] = { steps[i], 0, 0, 1 - w[i] };
+        nt->Fill(row);
+        steps_only->Fill(row);
+        recycled->Fill(row);
+        if (w[i] > 0) {
+            row[0] = others[i];
+            row[3] = w[i];
+            recycled->Fill(row);
+        }
+    }
+
+    // (0.75 * 1 + 0.25 * 2 + 0.5 * 1 + 0.5 * 4 + 1 * 3) / 3
+    LikelihoodSpace ls(nt, recycled);
+    std::map<std::string, double> means = ls.get_means();
+    ASSERT_EQ((size_t) 1, means.count("x"));
+    EXPECT_NEAR(2.25, means["x"], 1e-6);
+
+    TH1F* hp = ls.get_projection("x");
+    EXPECT_NEAR(3.0, hp->Integral(), 1e-6);
+    EXPECT_NEAR(1.25, hp->GetBinContent(hp->FindBin(1)), 1e-6);
+    EXPECT_NEAR(0.25, hp->GetBinContent(hp->FindBin(2)), 1e-6);
+    EXPECT_NEAR(1.0, hp->GetBinContent(hp->FindBin(3)), 1e-6);
+    EXPECT_NEAR(0.5, hp->GetBinContent(hp->FindBin(4)), 1e-6);
+    EXPECT_EQ(0, hp->GetBinContent(hp->FindBin(5)));
+    delete hp;
+
+    // Without the recycled points, the steps alone
+    LikelihoodSpace unweighted(steps_only);
+    EXPECT_NEAR(5.0 / 3, unweighted.get_means()["x"], 1e-6);
+    hp = unweighted.get_projection("x");
+    EXPECT_NEAR(2.0, hp->GetBinContent(hp->FindBin(1)), 1e-6);
+    delete hp;
+}
@@ -0,0 +1,816 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <TRandom3.h>
+#include <TNtuple.h>
+#include <TH1F.h>
+
+#include <sxmc/signals.h>
+#include <sxmc/rng.h>
+#include <sxmc/checkpoint.h>
+#include <sxmc/nll_evaluator.h>
+#include <sxmc/nll_kernels.h>
+#include <sxmc/likelihood.h>
+#include <sxmc/mcmc.h>
+
+// Exposes the pieces of a Metropolis walk for testing
+class WalkingMCMC : public MCMC {
+public:
+    WalkingMCMC(const std::vector<Signal>& signals,
+                const std::vector<Systematic>& systematics,
+                const std::vector<Observable>& observables,
+                const MCMCOptions& options)
+        : MCMC(signals, systematics, observables, options) {}
+
+    using MCMC::Chain;
+    using MCMC::Walk;
+    using MCMC::new_evaluator;
+    using MCMC::checkpoint_path;
+    using MCMC::resumable;
+    using MCMC::run_chain;
+    using MCMC::BlockLayout;
+    using MCMC::setup_blocks;
+    using MCMC::merge_chains;
+    using MCMC::setup_walk;
+    using MCMC::start_walk;
+    using MCMC::in_bounds;
+    using MCMC::reject_walk_step;
+    using MCMC::metropolis_walk_step;
+    using MCMC::delayed_walk_step;
+    using MCMC::flush_walk;
+    using MCMC::checkpoint_walk;
+    using MCMC::finish_walk;
+
+    // Take steps first to last, as run_walk does between burn-in phases
+    void take_steps(Walk& walk, unsigned first, unsigned last) {
+        const BlockLayout& layout = walk.jumps.layout;
+        const std::vector<size_t>& schedule = layout.schedule;
+        for (unsigned i=first; i<=last; i++) {
+            walk.block = schedule[i % schedule.size()];
+            walk.next_block = schedule[(i + 1) % schedule.size()];
+            walk.save = true;
+            const bool systematic_step = \
+                (layout.block_systematic[walk.block] &&
+                 !walk.nll->pdfs_fixed());
+            if (!in_bounds(walk.proposed_vector->readOnlyHostPtr(),
+                           layout.blocks[walk.block])) {
+                reject_walk_step(walk);
+            }
+            else if (walk.proposal_evaluator && systematic_step) {
+                delayed_walk_step(walk);
+            }
+            else {
+                metropolis_walk_step(walk, systematic_step);
+            }
+            flush_walk(walk, i);
+        }
+    }
+
+    // Write a checkpoint of the walk at a step, and wait for it
+    void write_checkpoint(Walk& walk, unsigned step) {
+        checkpoint_walk(walk, step);
+        if (walk.writing) {
+            pthread_join(walk.checkpoint_thread, NULL);
+            walk.writing = false;
+        }
+    }
+};
+
+// A chain of a walk, with its own evaluator and host RNG
+struct TestChain {
+    TestChain(WalkingMCMC& _mcmc, const std::vector<Signal>& signals,
+              const std::vector<float>& data, const std::vector<int>& weights,
+              unsigned long long seed, unsigned experiment)
+        : mcmc(_mcmc), nll(NULL), rng(NULL) {
+        chain.mcmc = &mcmc;
+        chain.id = 0;
+        for (size_t i=0; i<signals.size(); i++) {
+            chain.pdfs.push_back(signals[i].histogram->Clone());
+        }
+        chain.seed = seed;
+        chain.stream = rng_stream(experiment, 0);
+        chain.data = &data;
+        chain.weights = &weights;
+        chain.nsteps = 1000;
+        chain.burnin_steps = 500;
+        chain.debug_mode = false;
+        chain.sync_interval = 50;
+        chain.fit = NULL;
+    }
+
+    ~TestChain() {
+        if (nll) {
+            mcmc.finish_walk(walk);
+        }
+        delete nll;
+        delete rng;
+        for (size_t i=0; i<chain.pdfs.size(); i++) {
+            delete chain.pdfs[i];
+        }
+    }
+
+    // Set up the walk, and start it from a checkpoint if there is one
+    void start() {
+        nll = mcmc.new_evaluator(chain.pdfs, *chain.data, *chain.weights);
+        rng = new TRandom3(chain.seed);
+        mcmc.setup_walk(chain, *nll, rng, "", walk);
+        nll->eval_pdfs(walk.current_vector);
+        mcmc.start_walk(walk);
+    }
+
+    WalkingMCMC& mcmc;
+    WalkingMCMC::Chain chain;
+    WalkingMCMC::Walk walk;
+    NLLEvaluator* nll;
+    TRandom3* rng;
+};
+
+// Two signals binned in one observable on [0, 1), and data drawn from
+// their sum
+class WalkTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    fields.push_back("x");
+    observables.resize(1);
+    observables[0].name = "x";
+    observables[0].field = "x";
+    observables[0].field_index = 0;
+    observables[0].bins = 20;
+    observables[0].lower = 0;
+    observables[0].upper = 1;
+    observables[0].exclude = false;
+
+    // A flat signal and one rising linearly in x
+    std::vector<float> flat(1000);
+    std::vector<float> rising(1000);
+    std::vector<int> sample_weights(1000, 1);
+    for (size_t i=0; i<flat.size(); i++) {
+      flat[i] = (i + 0.5) / flat.size();
+      rising[i] = sqrt(flat[i]);
+    }
+    signals.push_back(Signal("flat", "flat", 100, 20, "", observables, cuts,
+                             systematics, flat, fields, sample_weights));
+    signals.push_back(Signal("rising", "rising", 50, 10, "", observables,
+                             cuts, systematics, rising, fields,
+                             sample_weights));
+
+    for (size_t i=0; i<150; i++) {
+      const float u = fmod(0.6180339887498949 * i, 1.0);
+      data.push_back(i % 3 == 0 ? sqrt(u) : u);
+      weights.push_back(1);
+    }
+
+    options.checkpoint_file = "test_mcmc_checkpoint";
+    options.resume = true;
+    options.seed = 7;
+  }
+
+  virtual void TearDown() {
+    for (size_t i=0; i<signals.size(); i++) {
+      delete signals[i].histogram;
+    }
+  }
+
+  std::vector<std::string> fields;
+  std::vector<Observable> observables;
+  std::vector<Observable> cuts;
+  std::vector<Systematic> systematics;
+  std::vector<Signal> signals;
+  std::vector<float> data;
+  std::vector<int> weights;
+  MCMCOptions options;
+};
+
+// The same signals with a shift and a scale of x
+class SystematicWalkTest : public WalkTest {
+protected:
+  virtual void SetUp() {
+    systematics.resize(2);
+    set_systematic(systematics[0], "shift", pdfz::Systematic::SHIFT, 0.02);
+    set_systematic(systematics[1], "scale", pdfz::Systematic::SCALE, 0);
+    WalkTest::SetUp();
+  }
+
+  void set_systematic(Systematic& s, std::string name,
+                      pdfz::Systematic::Type type, double mean) {
+    s.name = name;
+    s.observable_field = "x";
+    s.observable_field_index = 0;
+    s.truth_field_index = 0;
+    s.type = type;
+    s.mean = mean;
+    s.sigma = 0.01;
+    s.fixed = false;
+    s.lower = -HUGE_VAL;
+    s.upper = HUGE_VAL;
+  }
+};
+
+TEST(ChainState, RoundTrip)
+{
+    ChainState s;
+    s.seed = 1234567890123ULL;
+    s.experiment = 3;
+    s.nparameters = 2;
+    s.nblocks = 1;
+    s.nsteps = 1000;
+    s.burnin_steps = 100;
+    s.step = 251;
+    s.adapt_phase = 1;
+    s.phase_start = 100;
+    s.phase_end = 200;
+    s.phase_first = 99;
+    s.host_seed = 42;
+    s.current_nll = -12.5;
+    s.current_vector.push_back(1.5);
+    s.current_vector.push_back(2.5);
+    s.proposed_vector.push_back(1.75);
+    s.proposed_vector.push_back(2.25);
+    s.jump_width.push_back(0.1);
+    s.jump_width.push_back(0.2);
+    s.cholesky.push_back(0.3);
+    s.use_cholesky.push_back(1);
+    s.walk_stats.push_back(4);
+    s.walk_stats.push_back(0.5);
+    s.samples.push_back(1.5);
+    s.samples.push_back(2.5);
+    s.samples.push_back(-12.5);
+
+    // A Philox stream partway along
+    RNGState rng;
+    rng_init(&rng, s.seed, rng_stream(s.experiment, 0), 0);
+    for (int i=0; i<5; i++) {
+        rng_next(&rng);
+    }
+    const char* raw = reinterpret_cast<const char*>(&rng);
+    s.rngs.assign(raw, raw + sizeof(rng));
+
+    const std::string path = "test_chain_state";
+    ASSERT_TRUE(write_chain_state(path, s));
+
+    ChainState header;
+    ASSERT_TRUE(read_chain_state(path, header, true));
+    EXPECT_EQ(s.step, header.step);
+    EXPECT_TRUE(header.current_vector.empty());
+
+    ChainState t;
+    ASSERT_TRUE(read_chain_state(path, t));
+    remove(path.c_str());
+    EXPECT_EQ(s.seed, t.seed);
+    EXPECT_EQ(s.experiment, t.experiment);
+    EXPECT_EQ(s.nparameters, t.nparameters);
+    EXPECT_EQ(s.nblocks, t.nblocks);
+    EXPECT_EQ(s.nsteps, t.nsteps);
+    EXPECT_EQ(s.burnin_steps, t.burnin_steps);
+    EXPECT_EQ(s.step, t.step);
+    EXPECT_EQ(s.adapt_phase, t.adapt_phase);
+    EXPECT_EQ(s.phase_start, t.phase_start);
+    EXPECT_EQ(s.phase_end, t.phase_end);
+    EXPECT_EQ(s.phase_first, t.phase_first);
+    EXPECT_EQ(s.host_seed, t.host_seed);
+    EXPECT_EQ(s.current_nll, t.current_nll);
+    EXPECT_EQ(s.current_vector, t.current_vector);
+    EXPECT_EQ(s.proposed_vector, t.proposed_vector);
+    EXPECT_EQ(s.jump_width, t.jump_width);
+    EXPECT_EQ(s.cholesky, t.cholesky);
+    EXPECT_EQ(s.use_cholesky, t.use_cholesky);
+    EXPECT_EQ(s.walk_stats, t.walk_stats);
+    EXPECT_EQ(s.samples, t.samples);
+    EXPECT_TRUE(t.recycled.empty());
+
+    // The restored generator continues the same stream
+    ASSERT_EQ(sizeof(RNGState), t.rngs.size());
+    RNGState restored;
+    std::copy(t.rngs.begin(), t.rngs.end(),
+              reinterpret_cast<char*>(&restored));
+    for (int i=0; i<10; i++) {
+        EXPECT_EQ(rng_next(&rng), rng_next(&restored));
+    }
+
+    EXPECT_FALSE(read_chain_state(path, t));
+}
+
+TEST_F(WalkTest, ResumeContinuesTheWalk)
+{
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+
+    TestChain a(mcmc, signals, data, weights, 7, 0);
+    remove(mcmc.checkpoint_path(a.chain).c_str());
+    a.start();
+    EXPECT_EQ((unsigned) 0, a.walk.first_step);
+    mcmc.take_steps(a.walk, 0, 150);
+    mcmc.write_checkpoint(a.walk, 151);
+
+    TestChain b(mcmc, signals, data, weights, 7, 0);
+    EXPECT_TRUE(mcmc.resumable(b.chain));
+    b.start();
+    EXPECT_EQ((unsigned) 151, b.walk.first_step);
+    EXPECT_EQ(a.chain.samples, b.chain.samples);
+
+    const size_t np = signals.size();
+    for (size_t i=0; i<np; i++) {
+        EXPECT_EQ(a.walk.current_vector->readOnlyHostPtr()[i],
+                  b.walk.current_vector->readOnlyHostPtr()[i]);
+        EXPECT_EQ(a.walk.proposed_vector->readOnlyHostPtr()[i],
+                  b.walk.proposed_vector->readOnlyHostPtr()[i]);
+        EXPECT_EQ(a.walk.jumps.width->readOnlyHostPtr()[i],
+                  b.walk.jumps.width->readOnlyHostPtr()[i]);
+    }
+    EXPECT_EQ(a.walk.current_nll->readOnlyHostPtr()[0],
+              b.walk.current_nll->readOnlyHostPtr()[0]);
+    const char* rngs_a = \
+        reinterpret_cast<const char*>(a.walk.rngs->readOnlyHostPtr());
+    const char* rngs_b = \
+        reinterpret_cast<const char*>(b.walk.rngs->readOnlyHostPtr());
+    EXPECT_TRUE(std::equal(rngs_a, rngs_a + np * sizeof(RNGState), rngs_b));
+
+    // Both walks go on to take the same steps
+    mcmc.take_steps(a.walk, 151, 400);
+    mcmc.take_steps(b.walk, 151, 400);
+    ASSERT_EQ((size_t) 401 * (np + 1), a.chain.samples.size());
+    EXPECT_EQ(a.chain.samples, b.chain.samples);
+}
+
+TEST_F(WalkTest, MismatchStartsAfresh)
+{
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    MCMCOptions other_options = options;
+    other_options.experiment = 1;
+    WalkingMCMC other(signals, systematics, observables, other_options);
+    MCMCOptions fresh_options = options;
+    fresh_options.resume = false;
+    WalkingMCMC fresh(signals, systematics, observables, fresh_options);
+
+    // A checkpoint of a walk with seed 7 in experiment 0
+    TestChain a(mcmc, signals, data, weights, 7, 0);
+    remove(mcmc.checkpoint_path(a.chain).c_str());
+    a.start();
+    mcmc.take_steps(a.walk, 0, 150);
+    mcmc.write_checkpoint(a.walk, 151);
+    ChainState s;
+    ASSERT_TRUE(read_chain_state(mcmc.checkpoint_path(a.chain), s));
+
+    // ...put where a chain with seed 8, and one in experiment 1, look for
+    // their own
+    WalkingMCMC* samplers[2] = { &mcmc, &other };
+    const unsigned long long seeds[2] = { 8, 7 };
+    const unsigned experiments[2] = { 0, 1 };
+    const size_t np = signals.size();
+    for (int k=0; k<2; k++) {
+        TestChain b(*samplers[k], signals, data, weights, seeds[k],
+                    experiments[k]);
+        const std::string path = samplers[k]->checkpoint_path(b.chain);
+        ASSERT_TRUE(write_chain_state(path, s));
+        EXPECT_FALSE(samplers[k]->resumable(b.chain));
+        b.start();
+        EXPECT_EQ((unsigned) 0, b.walk.first_step);
+        EXPECT_TRUE(b.chain.samples.empty());
+        remove(path.c_str());
+
+        TestChain c(fresh, signals, data, weights, seeds[k], experiments[k]);
+        c.start();
+        for (size_t i=0; i<np; i++) {
+            EXPECT_EQ(c.walk.current_vector->readOnlyHostPtr()[i],
+                      b.walk.current_vector->readOnlyHostPtr()[i]);
+            EXPECT_EQ(c.walk.proposed_vector->readOnlyHostPtr()[i],
+                      b.walk.proposed_vector->readOnlyHostPtr()[i]);
+        }
+    }
+}
+
+// Steps of two chains, with the points not taken there
+TEST_F(WalkTest, MergeRecycledChains)
+{
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    std::vector<WalkingMCMC::Chain> chains(2);
+    const float steps0[6] = { 10, 20, 1, 12, 22, 2 };
+    const float others0[8] = { 11, 21, 1.5, 0.25, 9, 19, 3, 0 };
+    const float steps1[3] = { 30, 40, 1 };
+    const float others1[4] = { 31, 41, 0.5, 1 };
+    chains[0].samples.assign(steps0, steps0 + 6);
+    chains[0].recycled.assign(others0, others0 + 8);
+    chains[1].samples.assign(steps1, steps1 + 3);
+    chains[1].recycled.assign(others1, others1 + 4);
+
+    // The first step and the point not taken share it, the second step
+    // keeps it all, and the point not taken at the third has it all
+    LikelihoodSpace* ls = mcmc.merge_chains(chains);
+    EXPECT_EQ(3, ls->get_samples()->GetEntries());
+    ASSERT_TRUE(ls->get_recycled() != NULL);
+    EXPECT_EQ(4, ls->get_recycled()->GetEntries());
+
+    // (0.75 * 10 + 0.25 * 11 + 12 + 31) / 3
+    std::map<std::string, double> means = ls->get_means();
+    EXPECT_NEAR(17.75, means["flat"], 1e-5);
+    EXPECT_NEAR(27.75, means["rising"], 1e-5);
+
+    TH1F* hp = ls->get_projection("chain");
+    EXPECT_NEAR(2.0, hp->GetBinContent(hp->FindBin(0)), 1e-6);
+    EXPECT_NEAR(1.0, hp->GetBinContent(hp->FindBin(1)), 1e-6);
+    delete hp;
+    delete ls;
+
+    // Without recycling, only the steps
+    chains[0].recycled.clear();
+    chains[1].recycled.clear();
+    ls = mcmc.merge_chains(chains);
+    EXPECT_EQ(3, ls->get_samples()->GetEntries());
+    EXPECT_TRUE(ls->get_recycled() == NULL);
+    EXPECT_NEAR(52.0 / 3, ls->get_means()["flat"], 1e-5);
+    delete ls;
+}
+
+TEST_F(WalkTest, EnsembleIsReproducible)
+{
+    options.sampler = MCMCOptions::SAMPLER_ENSEMBLE;
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+
+    TestChain a(mcmc, signals, data, weights, 7, 0);
+    TestChain b(mcmc, signals, data, weights, 7, 0);
+    TestChain c(mcmc, signals, data, weights, 8, 0);
+    a.chain.nsteps = b.chain.nsteps = c.chain.nsteps = 6000;
+    a.chain.burnin_steps = b.chain.burnin_steps = c.chain.burnin_steps = 3000;
+    mcmc.run_chain(a.chain);
+    mcmc.run_chain(b.chain);
+    mcmc.run_chain(c.chain);
+
+    // Six walkers for two rates, saved every sweep after the first half
+    const size_t nfields = signals.size() + 1;
+    ASSERT_EQ((size_t) 500 * 6 * nfields, a.chain.samples.size());
+    EXPECT_EQ(a.chain.samples, b.chain.samples);
+    EXPECT_NE(a.chain.samples, c.chain.samples);
+
+    // The walkers stay in the support, and find the number of events
+    const size_t n = a.chain.samples.size() / nfields;
+    double total = 0;
+    for (size_t i=0; i<n; i++) {
+        const float* v = &a.chain.samples[i * nfields];
+        EXPECT_GE(v[0], 0);
+        EXPECT_GE(v[1], 0);
+        total += v[0] + v[1];
+    }
+    EXPECT_NEAR(data.size(), total / n, 10);
+}
+
+TEST_F(SystematicWalkTest, FixedSystematicStaysPut)
+{
+    systematics[0].fixed = true;
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+
+    TestChain a(mcmc, signals, data, weights, 7, 0);
+    mcmc.run_chain(a.chain);
+
+    // The fixed shift never moves; the free scale does
+    const size_t nfields = signals.size() + systematics.size() + 1;
+    const size_t n = a.chain.samples.size() / nfields;
+    ASSERT_GT(n, (size_t) 0);
+    float scale_min = HUGE_VAL;
+    float scale_max = -HUGE_VAL;
+    for (size_t i=0; i<n; i++) {
+        const float* v = &a.chain.samples[i * nfields];
+        EXPECT_EQ((float) 0.02, v[2]);
+        scale_min = std::min(scale_min, v[3]);
+        scale_max = std::max(scale_max, v[3]);
+    }
+    EXPECT_LT(scale_min, scale_max);
+}
+
+// The NLL at the parameter means, with the PDFs evaluated there and then
+// with them evaluated with the systematics moved
+static void nll_before_and_after(NLLEvaluator* nll, double& before,
+                                 double& after)
+{
+    hemi::Array<double> v(4, true);
+    hemi::Array<double> result(1, true);
+    const double means[4] = { 100, 50, 0.02, 0 };
+    std::copy(means, means + 4, v.writeOnlyHostPtr());
+    nll->eval_pdfs(&v);
+    nll->nll(v.readOnlyPtr(), result.writeOnlyPtr());
+    before = result.readOnlyHostPtr()[0];
+
+    v.hostPtr()[2] = 0.1;
+    v.hostPtr()[3] = 0.1;
+    nll->eval_pdfs(&v);
+    std::copy(means, means + 4, v.writeOnlyHostPtr());
+    nll->nll(v.readOnlyPtr(), result.writeOnlyPtr());
+    after = result.readOnlyHostPtr()[0];
+}
+
+TEST_F(SystematicWalkTest, FixedSystematicsFreezeThePDFs)
+{
+    std::vector<pdfz::Eval*> pdfs;
+    for (size_t i=0; i<signals.size(); i++) {
+        pdfs.push_back(signals[i].histogram);
+    }
+    double before, after;
+
+    // With the scale free, the PDFs follow it
+    systematics[0].fixed = true;
+    WalkingMCMC floating(signals, systematics, observables, options);
+    NLLEvaluator* nll = floating.new_evaluator(pdfs, data, weights);
+    EXPECT_FALSE(nll->pdfs_fixed());
+    nll_before_and_after(nll, before, after);
+    EXPECT_NE(before, after);
+    delete nll;
+
+    // With both fixed, they are evaluated once, at the first parameters
+    // they are given
+    systematics[1].fixed = true;
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    nll = mcmc.new_evaluator(pdfs, data, weights);
+    EXPECT_TRUE(nll->pdfs_fixed());
+    nll_before_and_after(nll, before, after);
+    EXPECT_EQ(before, after);
+    delete nll;
+}
+
+TEST_F(SystematicWalkTest, BlockLayouts)
+{
+    options.rate_steps = 3;
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    WalkingMCMC::BlockLayout layout;
+
+    // Everything together
+    mcmc.setup_blocks(false, false, 0, layout);
+    ASSERT_EQ((size_t) 1, layout.blocks.size());
+    EXPECT_EQ((size_t) 4, layout.blocks[0].size());
+    EXPECT_EQ(std::vector<size_t>(1, 0), layout.schedule);
+    EXPECT_TRUE(layout.block_systematic[0]);
+
+    // Three rate steps, then a systematic step
+    mcmc.setup_blocks(false, true, 0, layout);
+    ASSERT_EQ((size_t) 2, layout.blocks.size());
+    const size_t rates[2] = { 0, 1 };
+    const size_t systs[2] = { 2, 3 };
+    EXPECT_EQ(std::vector<size_t>(rates, rates + 2), layout.blocks[0]);
+    EXPECT_EQ(std::vector<size_t>(systs, systs + 2), layout.blocks[1]);
+    const size_t blocked_schedule[4] = { 0, 0, 0, 1 };
+    EXPECT_EQ(std::vector<size_t>(blocked_schedule, blocked_schedule + 4),
+              layout.schedule);
+    EXPECT_FALSE(layout.block_systematic[0]);
+    EXPECT_TRUE(layout.block_systematic[1]);
+
+    // One rate at a time, with the rate steps sweeping the rates
+    mcmc.setup_blocks(true, true, 0, layout);
+    ASSERT_EQ((size_t) 3, layout.blocks.size());
+    EXPECT_EQ(std::vector<size_t>(1, 0), layout.blocks[0]);
+    EXPECT_EQ(std::vector<size_t>(1, 1), layout.blocks[1]);
+    const size_t component_schedule[4] = { 0, 1, 0, 2 };
+    EXPECT_EQ(std::vector<size_t>(component_schedule, component_schedule + 4),
+              layout.schedule);
+
+    // At most three parameters a block: the rates, then the systematics,
+    // in the one group's place
+    mcmc.setup_blocks(false, false, 3, layout);
+    ASSERT_EQ((size_t) 2, layout.blocks.size());
+    EXPECT_EQ(std::vector<size_t>(rates, rates + 2), layout.blocks[0]);
+    EXPECT_EQ(std::vector<size_t>(systs, systs + 2), layout.blocks[1]);
+    const size_t split_schedule[2] = { 0, 1 };
+    EXPECT_EQ(std::vector<size_t>(split_schedule, split_schedule + 2),
+              layout.schedule);
+
+    // Slots and statistics of one-parameter blocks
+    mcmc.setup_blocks(false, false, 1, layout);
+    ASSERT_EQ((size_t) 4, layout.blocks.size());
+    const int block_start[5] = { 0, 1, 2, 3, 4 };
+    const size_t stats_start[5] = { 1, 4, 7, 10, 13 };
+    EXPECT_EQ(std::vector<int>(block_start, block_start + 5),
+              layout.block_start);
+    EXPECT_EQ(std::vector<size_t>(stats_start, stats_start + 5),
+              layout.stats_start);
+}
+
+TEST_F(SystematicWalkTest, FixedParametersAreLeftOut)
+{
+    systematics[0].fixed = true;
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    WalkingMCMC::BlockLayout layout;
+    mcmc.setup_blocks(false, true, 0, layout);
+    ASSERT_EQ((size_t) 2, layout.blocks.size());
+    EXPECT_EQ(std::vector<size_t>(1, 3), layout.blocks[1]);
+    EXPECT_EQ(-1, layout.parameter_block[2]);
+    EXPECT_EQ(1, layout.parameter_block[3]);
+    EXPECT_EQ((size_t) 2, layout.parameter_slot[3]);
+    EXPECT_EQ(3, layout.block_start[2]);
+}
+
+TEST_F(SystematicWalkTest, RateStepsLeaveTheSystematics)
+{
+    options.rate_steps = 3;
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    TestChain a(mcmc, signals, data, weights, 7, 0);
+    a.chain.debug_mode = true;
+    mcmc.run_chain(a.chain);
+
+    // Every step is saved; each moves either the rates or the systematics
+    const size_t nfields = signals.size() + systematics.size() + 1;
+    ASSERT_EQ((size_t) a.chain.nsteps * nfields, a.chain.samples.size());
+    unsigned rate_moves = 0;
+    unsigned systematic_moves = 0;
+    for (size_t i=1; i<a.chain.nsteps; i++) {
+        const float* last = &a.chain.samples[(i - 1) * nfields];
+        const float* v = &a.chain.samples[i * nfields];
+        if (i % 4 == 3) {
+            EXPECT_EQ(last[0], v[0]);
+            EXPECT_EQ(last[1], v[1]);
+            systematic_moves += (v[2] != last[2]);
+        }
+        else {
+            EXPECT_EQ(last[2], v[2]);
+            EXPECT_EQ(last[3], v[3]);
+            rate_moves += (v[0] != last[0]);
+        }
+    }
+    EXPECT_GT(rate_moves, 0u);
+    EXPECT_GT(systematic_moves, 0u);
+}
+
+TEST_F(SystematicWalkTest, DelayedAcceptanceKeepsTheExactNLL)
+{
+    options.delayed_acceptance = true;
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    TestChain a(mcmc, signals, data, weights, 7, 0);
+    a.chain.burnin_steps = 1000;
+    a.start();
+    ASSERT_TRUE(a.walk.proposal_evaluator != NULL);
+
+    // Proposals are screened, so only some of them need the PDFs
+    // evaluated between flushes; the walk's NLL is always the exact one
+    // at its point, whichever evaluator holds the PDFs there
+    TestChain b(mcmc, signals, data, weights, 7, 0);
+    NLLEvaluator* exact = \
+        mcmc.new_evaluator(b.chain.pdfs, data, weights);
+    hemi::Array<double> result(1, true);
+    for (unsigned i=0; i<10; i++) {
+        mcmc.take_steps(a.walk, 50 * i, 50 * i + 49);
+        exact->eval_pdfs(a.walk.current_vector);
+        exact->nll(a.walk.current_vector->readOnlyPtr(),
+                   result.writeOnlyPtr());
+        EXPECT_NEAR(result.readOnlyHostPtr()[0],
+                    a.walk.current_nll->readOnlyHostPtr()[0], 1e-6);
+        EXPECT_GT(a.walk.nexact, 0u);
+        EXPECT_LT(a.walk.nexact, 49u);
+    }
+    delete exact;
+}
+
+TEST_F(SystematicWalkTest, DelayedAcceptanceTargetsThePosterior)
+{
+    WalkingMCMC plain(signals, systematics, observables, options);
+    options.delayed_acceptance = true;
+    WalkingMCMC delayed(signals, systematics, observables, options);
+
+    TestChain a(plain, signals, data, weights, 7, 0);
+    TestChain b(delayed, signals, data, weights, 7, 0);
+    TestChain c(delayed, signals, data, weights, 7, 0);
+    a.chain.nsteps = b.chain.nsteps = c.chain.nsteps = 20000;
+    a.chain.burnin_steps = b.chain.burnin_steps = c.chain.burnin_steps = 2000;
+    plain.run_chain(a.chain);
+    delayed.run_chain(b.chain);
+    delayed.run_chain(c.chain);
+    EXPECT_EQ(b.chain.samples, c.chain.samples);
+
+    // Means within a fraction of the posterior width of each other
+    const size_t nfields = signals.size() + systematics.size() + 1;
+    const size_t na = a.chain.samples.size() / nfields;
+    const size_t nb = b.chain.samples.size() / nfields;
+    ASSERT_GT(na, (size_t) 0);
+    ASSERT_GT(nb, (size_t) 0);
+    for (size_t j=0; j<nfields - 1; j++) {
+        double sum_a = 0, sum2_a = 0, sum_b = 0;
+        for (size_t i=0; i<na; i++) {
+            const double x = a.chain.samples[i * nfields + j];
+            sum_a += x;
+            sum2_a += x * x;
+        }
+        for (size_t i=0; i<nb; i++) {
+            sum_b += b.chain.samples[i * nfields + j];
+        }
+        const double mean_a = sum_a / na;
+        const double sigma = sqrt(sum2_a / na - mean_a * mean_a);
+        EXPECT_NEAR(mean_a, sum_b / nb, 0.25 * sigma) << "parameter " << j;
+    }
+}
+
+// Mean and co-moments of points, each held for some number of steps, the
+// usual way: the mean first, then the deviations from it
+static void two_pass(const std::vector<double>& points,
+                     const std::vector<unsigned>& held, size_t nb,
+                     std::vector<double>& mean,
+                     std::vector<double>& comoment)
+{
+    mean.assign(nb, 0);
+    comoment.assign(nb * nb, 0);
+    double n = 0;
+    for (size_t i=0; i<held.size(); i++) {
+        n += held[i];
+        for (size_t k=0; k<nb; k++) {
+            mean[k] += held[i] * points[i * nb + k];
+        }
+    }
+    for (size_t k=0; k<nb; k++) {
+        mean[k] /= n;
+    }
+    for (size_t i=0; i<held.size(); i++) {
+        for (size_t k=0; k<nb; k++) {
+            for (size_t l=0; l<=k; l++) {
+                comoment[k * nb + l] += \
+                    held[i] * (points[i * nb + k] - mean[k]) *
+                    (points[i * nb + l] - mean[l]);
+            }
+        }
+    }
+}
+
+TEST(WalkUpdate, WeightedFoldsMatchTwoPasses)
+{
+    // A block of parameters 2 and 0 of a vector, moving through points it
+    // holds for several steps each
+    const int block[2] = { 2, 0 };
+    const double xs[5][2] = {
+        { 1, 10 }, { 3, 7 }, { 2.5, 12 }, { -1, 9 }, { 4, 8 }
+    };
+    const unsigned held_steps[5] = { 3, 1, 4, 2, 5 };
+    std::vector<double> points(&xs[0][0], &xs[0][0] + 10);
+    std::vector<unsigned> held(held_steps, held_steps + 5);
+
+    double stats[1 + 2 + 4] = { 0, 0, 0, 0, 0, 0, 0 };
+    double diagonal[1 + 2 + 4] = { 0, 0, 0, 0, 0, 0, 0 };
+    double v[3] = { 0, 0, 0 };
+    unsigned nsteps = 0;
+    for (size_t i=0; i<5; i++) {
+        v[2] = xs[i][0];
+        v[0] = xs[i][1];
+        nsteps += held[i];
+        walk_update(v, 2, block, nsteps, stats, true);
+        walk_update(v, 2, block, nsteps, diagonal, false);
+
+        // Folding again at the same step changes nothing
+        walk_update(v, 2, block, nsteps, stats, true);
+    }
+    walk_update(v, 2, block, nsteps, NULL, true);
+
+    std::vector<double> mean;
+    std::vector<double> comoment;
+    two_pass(points, held, 2, mean, comoment);
+    EXPECT_EQ(nsteps, stats[0]);
+    EXPECT_EQ(nsteps, diagonal[0]);
+    for (size_t k=0; k<2; k++) {
+        EXPECT_NEAR(mean[k], stats[1 + k], 1e-12);
+        EXPECT_NEAR(mean[k], diagonal[1 + k], 1e-12);
+        EXPECT_NEAR(comoment[k * 2 + k], diagonal[3 + k * 2 + k], 1e-10);
+    }
+    EXPECT_NEAR(comoment[0], stats[3], 1e-10);
+    EXPECT_NEAR(comoment[2], stats[5], 1e-10);
+    EXPECT_NEAR(comoment[3], stats[6], 1e-10);
+    EXPECT_EQ(0, stats[4]);
+    EXPECT_EQ(0, diagonal[4]);
+    EXPECT_EQ(0, diagonal[5]);
+}
+
+TEST_F(WalkTest, WalkStatisticsFollowTheSteps)
+{
+    WalkingMCMC mcmc(signals, systematics, observables, options);
+    TestChain a(mcmc, signals, data, weights, 7, 0);
+    a.chain.burnin_steps = 1000;
+    a.start();
+    mcmc.take_steps(a.walk, 0, 300);
+
+    // Folding in the current point brings the block up to the last step;
+    // its statistics are then those of every saved step
+    const WalkingMCMC::BlockLayout& layout = a.walk.jumps.layout;
+    ASSERT_EQ((size_t) 1, layout.blocks.size());
+    const std::vector<int> block(layout.blocks[0].begin(),
+                                 layout.blocks[0].end());
+    std::vector<double> stats(a.walk.jumps.walk_stats->readOnlyHostPtr(),
+                              a.walk.jumps.walk_stats->readOnlyHostPtr() +
+                                layout.stats_start[1]);
+    walk_update(a.walk.current_vector->readOnlyHostPtr(), 2, &block[0],
+                stats[0], &stats[layout.stats_start[0]], true);
+
+    const size_t nfields = signals.size() + 1;
+    const size_t n = a.chain.samples.size() / nfields;
+    ASSERT_EQ((size_t) 301, n);
+    EXPECT_EQ(n, stats[0]);
+    std::vector<double> points;
+    for (size_t i=0; i<n; i++) {
+        points.push_back(a.chain.samples[i * nfields]);
+        points.push_back(a.chain.samples[i * nfields + 1]);
+    }
+    std::vector<double> mean;
+    std::vector<double> comoment;
+    two_pass(points, std::vector<unsigned>(n, 1), 2, mean, comoment);
+    const double* block_stats = &stats[layout.stats_start[0]];
+    for (size_t k=0; k<2; k++) {
+        EXPECT_NEAR(mean[k], block_stats[1 + k], 1e-4);
+        for (size_t l=0; l<=k; l++) {
+            EXPECT_NEAR(comoment[k * 2 + l], block_stats[3 + k * 2 + l],
+                        1e-5 * fabs(comoment[k * 2 + l]) + 1e-3);
+        }
+    }
+}
@@ -0,0 +1,281 @@
+#include "test_nll_fixtures.h"
+
+#include <cmath>
+#include <vector>
+
+// Exposes the event grouping for testing
+class CollapsingNLLEvaluator : public NLLEvaluator {
+public:
+    CollapsingNLLEvaluator(const std::vector<pdfz::Eval*>& pdfs,
+                           hemi::Array<double>* means,
+                           hemi::Array<double>* sigma,
+                           hemi::Array<double>* lower,
+                           hemi::Array<double>* upper)
+        : NLLEvaluator(pdfs, 0, 1, means, sigma, lower, upper) {}
+
+    using NLLEvaluator::collapse_events;
+};
+
+TEST_F(NLLEvaluatorFixture, CollapseEvents)
+{
+    CollapsingNLLEvaluator nll(pdfs, parameter_means, parameter_sigma,
+                               parameter_lower, parameter_upper);
+
+    const float x[6] = { 0.01, 0.02, 0.51, 0.03, 0.52, 0.99 };
+    const int w[6] = { 1, 2, 3, 1, 1, 4 };
+    std::vector<float> events(x, x + 6);
+    std::vector<int> weights(w, w + 6);
+    std::vector<float> points;
+    std::vector<int> point_weights;
+    std::vector<int> point_bins;
+    ASSERT_TRUE(nll.collapse_events(events, weights, points, point_weights,
+                                    point_bins));
+
+    // One point per occupied bin, in order of first appearance
+    ASSERT_EQ((size_t) 3, points.size());
+    EXPECT_FLOAT_EQ(0.01, points[0]);
+    EXPECT_FLOAT_EQ(0.51, points[1]);
+    EXPECT_FLOAT_EQ(0.99, points[2]);
+    ASSERT_EQ((size_t) 3, point_weights.size());
+    EXPECT_EQ(4, point_weights[0]);
+    EXPECT_EQ(4, point_weights[1]);
+    EXPECT_EQ(4, point_weights[2]);
+    ASSERT_EQ((size_t) 3, point_bins.size());
+    EXPECT_EQ(0, point_bins[0]);
+    EXPECT_EQ(10, point_bins[1]);
+    EXPECT_EQ(19, point_bins[2]);
+}
+
+TEST_F(NLLEvaluatorFixture, CollapsedNLLMatchesEventSum)
+{
+    const double v[2] = { 90, 230 };
+    const double expected = reference_nll(v);
+
+    // Read from the histograms, and from a table at the collapsed points
+    NLLEvaluator::LookupTable luts[2] = { NLLEvaluator::LUT_AUTO,
+                                          NLLEvaluator::LUT_FLOAT };
+    for (int i=0; i<2; i++) {
+        NLLEvaluator* nll = make_nll(luts[i]);
+        EXPECT_NEAR(expected, nll_at(nll, v), 1e-6 * fabs(expected));
+        delete nll;
+    }
+}
+
+TEST_F(NLLEvaluatorFixture, BFloat16TableNLL)
+{
+    const double v[2] = { 90, 230 };
+    const double expected = reference_nll(v);
+
+    // Each table entry keeps 8 significant bits, so each event's log is off
+    // by less than 2^-8
+    double total_weight = 0;
+    for (size_t i=0; i<data_weights.size(); i++) {
+        total_weight += data_weights[i];
+    }
+    NLLEvaluator* nll = make_nll(NLLEvaluator::LUT_BFLOAT16);
+    EXPECT_NEAR(expected, nll_at(nll, v), total_weight / 256);
+    delete nll;
+}
+
+TEST_F(NLLEvaluatorFixture, BatchMatchesSingle)
+{
+    // More vectors than one batch kernel handles, to cover the remainder
+    const size_t nv = NLL_MAX_BATCH + 3;
+    hemi::Array<double> vs(nv * nsignals, true);
+    hemi::Array<double> nlls(nv, true);
+    for (size_t k=0; k<nv; k++) {
+        vs.writeOnlyHostPtr()[k * nsignals] = 60 + 5 * k;
+        vs.writeOnlyHostPtr()[k * nsignals + 1] = 250 - 7 * k;
+    }
+    // One out of bounds
+    vs.writeOnlyHostPtr()[3 * nsignals] = -1;
+
+    NLLEvaluator::LookupTable luts[3] = { NLLEvaluator::LUT_AUTO,
+                                          NLLEvaluator::LUT_FLOAT,
+                                          NLLEvaluator::LUT_BFLOAT16 };
+    for (int i=0; i<3; i++) {
+        NLLEvaluator* nll = make_nll(luts[i]);
+        nll->eval_pdfs(&vs);
+        nll->nll_batch(vs.readOnlyPtr(), nv, nlls.writeOnlyPtr());
+        std::vector<double> batch(nlls.readOnlyHostPtr(),
+                                  nlls.readOnlyHostPtr() + nv);
+
+        for (size_t k=0; k<nv; k++) {
+            nll->nll(vs.readOnlyPtr() + k * nsignals, value->writeOnlyPtr());
+            EXPECT_DOUBLE_EQ(value->readOnlyHostPtr()[0], batch[k]);
+        }
+        EXPECT_EQ(1e18, batch[3]);
+        delete nll;
+    }
+}
+
+TEST_F(NLLEvaluatorFixture, RateGradientMatchesFiniteDifferences)
+{
+    const double v[2] = { 90, 230 };
+    NLLEvaluator::LookupTable luts[2] = { NLLEvaluator::LUT_AUTO,
+                                          NLLEvaluator::LUT_FLOAT };
+    for (int i=0; i<2; i++) {
+        NLLEvaluator* nll = make_nll(luts[i]);
+        std::copy(v, v + nsignals, pars->writeOnlyHostPtr());
+        double grad[2];
+        const double f = nll->nll_gradient(pars, grad);
+        EXPECT_DOUBLE_EQ(nll_at(nll, v), f);
+
+        for (size_t j=0; j<nsignals; j++) {
+            const double h = 1e-3 * v[j];
+            double u[2] = { v[0], v[1] };
+            u[j] = v[j] + h;
+            const double up = nll_at(nll, u);
+            u[j] = v[j] - h;
+            const double down = nll_at(nll, u);
+            EXPECT_NEAR((up - down) / (2 * h), grad[j], 1e-5);
+        }
+        delete nll;
+    }
+}
+
+TEST_F(NLLEvaluatorFixture, ComponentSumsMatchEventSums)
+{
+    NLLEvaluator::LookupTable luts[2] = { NLLEvaluator::LUT_AUTO,
+                                          NLLEvaluator::LUT_FLOAT };
+    for (int i=0; i<2; i++) {
+        NLLEvaluator* nll = make_nll(luts[i]);
+        hemi::Array<double> current(nsignals, true);
+        hemi::Array<double> proposed(nsignals, true);
+        current.writeOnlyHostPtr()[0] = 90;
+        current.writeOnlyHostPtr()[1] = 230;
+        nll->eval_pdfs(&current);
+        nll->mixture_sums(current.readOnlyPtr());
+
+        // A walk of single-rate steps, about half of them taken, with the
+        // kept mixture sums updated only through commit_component
+        for (int step=0; step<200; step++) {
+            const size_t k = step % nsignals;
+            const double u = fmod(0.6180339887498949 * step, 1.0);
+            std::copy(current.readOnlyHostPtr(),
+                      current.readOnlyHostPtr() + nsignals,
+                      proposed.writeOnlyHostPtr());
+            proposed.hostPtr()[k] = \
+                fabs(proposed.hostPtr()[k] + 40 * (u - 0.5));
+
+            nll->component_sums(k, current.readOnlyPtr(),
+                                proposed.readOnlyPtr());
+            const double incremental = event_total(nll);
+            nll->event_sums(proposed.readOnlyPtr());
+            const double fresh = event_total(nll);
+            ASSERT_NEAR(fresh, incremental, 1e-10 * fabs(fresh));
+
+            if (fmod(0.7548776662466927 * step, 1.0) < 0.5) {
+                std::copy(proposed.readOnlyHostPtr(),
+                          proposed.readOnlyHostPtr() + nsignals,
+                          current.writeOnlyHostPtr());
+            }
+            nll->commit_component(k, current.readOnlyPtr());
+        }
+        delete nll;
+    }
+}
+
+TEST(ReflectInto, SingleOvershoot)
+{
+    EXPECT_NEAR(0.7, reflect_into(1.3, 0, 1), 1e-12);
+    EXPECT_NEAR(0.2, reflect_into(-0.2, 0, 1), 1e-12);
+    EXPECT_DOUBLE_EQ(0.5, reflect_into(0.5, 0, 1));
+}
+
+TEST(ReflectInto, MultipleWidths)
+{
+    EXPECT_NEAR(0.3, reflect_into(2.3, 0, 1), 1e-12);
+    EXPECT_NEAR(0.6, reflect_into(3.4, 0, 1), 1e-12);
+    EXPECT_NEAR(0.3, reflect_into(-2.3, 0, 1), 1e-12);
+    EXPECT_NEAR(1.5, reflect_into(-6.5, 1, 2), 1e-12);
+}
+
+TEST(ReflectInto, OnBounds)
+{
+    EXPECT_DOUBLE_EQ(0.0, reflect_into(0, 0, 1));
+    EXPECT_DOUBLE_EQ(1.0, reflect_into(1, 0, 1));
+    // Whole numbers of widths out land back on a bound
+    EXPECT_DOUBLE_EQ(0.0, reflect_into(2, 0, 1));
+    EXPECT_DOUBLE_EQ(1.0, reflect_into(-1, 0, 1));
+    EXPECT_DOUBLE_EQ(3.0, reflect_into(5, 3, 3));
+}
+
+TEST(ReflectInto, OneSidedBounds)
+{
+    EXPECT_DOUBLE_EQ(3.0, reflect_into(-3, 0, HUGE_VAL));
+    EXPECT_DOUBLE_EQ(3.0, reflect_into(7, -HUGE_VAL, 5));
+    EXPECT_DOUBLE_EQ(-1e6, reflect_into(-1e6, -HUGE_VAL, HUGE_VAL));
+}
+
+TEST_F(NLLEvaluatorFixture, ProfiledGradientMatchesFiniteDifferences)
+{
+    // Evaluators bin the shared PDFs into their own buffers, so only the
+    // last one made can be used
+    const double v[2] = { 90, 230 };
+    NLLEvaluator* plain = make_nll(NLLEvaluator::LUT_AUTO, false);
+    const double unprofiled = nll_at(plain, v);
+    delete plain;
+
+    NLLEvaluator* nll = make_nll(NLLEvaluator::LUT_AUTO, true);
+    ASSERT_TRUE(nll->profiles_mc_statistics());
+    std::copy(v, v + nsignals, pars->writeOnlyHostPtr());
+    double grad[2];
+    const double f = nll->nll_gradient(pars, grad);
+    EXPECT_DOUBLE_EQ(nll_at(nll, v), f);
+
+    // Profiling only lowers the NLL
+    EXPECT_LT(f, unprofiled);
+
+    for (size_t j=0; j<nsignals; j++) {
+        const double h = 1e-3 * v[j];
+        double u[2] = { v[0], v[1] };
+        u[j] = v[j] + h;
+        const double up = nll_at(nll, u);
+        u[j] = v[j] - h;
+        const double down = nll_at(nll, u);
+        EXPECT_NEAR((up - down) / (2 * h), grad[j], 1e-5);
+    }
+    delete nll;
+}
+
+TEST_F(NLLEvaluatorFixture, ProfileNeedsHistograms)
+{
+    NLLEvaluator* nll = make_nll(NLLEvaluator::LUT_FLOAT, true);
+    EXPECT_FALSE(nll->profiles_mc_statistics());
+    delete nll;
+}
+
+// The per-bin NLL that bin_profile minimizes over beta
+static double bin_nll(double mu, double var, double n, double beta) {
+    return (beta * mu - (n > 0 ? n * log(beta) : 0) +
+            0.5 * (beta - 1) * (beta - 1) * mu * mu / var);
+}
+
+TEST(BinProfile, RootAndMinimum)
+{
+    // Rows of mu, var, n, with var / mu above and below 1
+    const double cases[5][3] = { { 10, 4, 13 },
+                                 { 10, 40, 3 },
+                                 { 5, 1, 0 },
+                                 { 100, 1, 90 },
+                                 { 0.5, 2, 1 } };
+    for (int i=0; i<5; i++) {
+        const double mu = cases[i][0];
+        const double var = cases[i][1];
+        const double n = cases[i][2];
+        double beta;
+        const double delta = bin_profile(mu, var, n, &beta);
+
+        EXPECT_GT(beta, 0);
+        EXPECT_NEAR(0, beta * beta + (var / mu - 1) * beta - n * var / (mu * mu),
+                    1e-12 * std::max(1.0, n * var / (mu * mu)));
+        EXPECT_NEAR(bin_nll(mu, var, n, beta) - bin_nll(mu, var, n, 1), delta,
+                    1e-12 * mu);
+        EXPECT_LE(delta, 0);
+
+        const double eps = 1e-3 * beta;
+        EXPECT_LT(bin_nll(mu, var, n, beta), bin_nll(mu, var, n, beta + eps));
+        EXPECT_LT(bin_nll(mu, var, n, beta), bin_nll(mu, var, n, beta - eps));
+    }
+}
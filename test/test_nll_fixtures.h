@@ -0,0 +1,148 @@
+#ifndef __TEST_NLL_FIXTURES__
+#define __TEST_NLL_FIXTURES__
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <vector>
+#include <hemi/hemi.h>
+#include <sxmc/pdfz.h>
+#include <sxmc/nll_kernels.h>
+#include <sxmc/nll_evaluator.h>
+
+// Two weighted histogram PDFs sharing a binning on [0, 1), one flat and one
+// rising, and a data set spread over their mixture
+class NLLEvaluatorFixture : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    nsignals = 2;
+
+    std::vector<double> lower(1, 0.0);
+    std::vector<double> upper(1, 1.0);
+    std::vector<int> nbins(1, 20);
+    for (size_t j=0; j<nsignals; j++) {
+      std::vector<float> samples(2000);
+      std::vector<int> weights(samples.size());
+      for (size_t i=0; i<samples.size(); i++) {
+        const double u = (i + 0.5) / samples.size();
+        samples[i] = (j == 0 ? u : sqrt(u));
+        weights[i] = 1 + i % 3;
+      }
+      pdfs.push_back(new pdfz::EvalHist(samples, weights, 1, 1, lower, upper,
+                                        nbins));
+    }
+
+    // Golden-ratio steps fill [0, 1) evenly
+    for (size_t i=0; i<300; i++) {
+      const double u = fmod(0.5 + 0.6180339887498949 * i, 1.0);
+      data.push_back(i % 3 == 0 ? u : sqrt(u));
+      data_weights.push_back(i % 7 == 0 ? 2 : 1);
+    }
+
+    const double means[2] = { 100, 200 };
+    const double sigmas[2] = { 0, 40 };
+    parameter_means = new hemi::Array<double>(nsignals, true);
+    parameter_sigma = new hemi::Array<double>(nsignals, true);
+    parameter_lower = new hemi::Array<double>(nsignals, true);
+    parameter_upper = new hemi::Array<double>(nsignals, true);
+    for (size_t j=0; j<nsignals; j++) {
+      parameter_means->writeOnlyHostPtr()[j] = means[j];
+      parameter_sigma->writeOnlyHostPtr()[j] = sigmas[j];
+      parameter_lower->writeOnlyHostPtr()[j] = 0;
+      parameter_upper->writeOnlyHostPtr()[j] = HUGE_VAL;
+    }
+
+    pars = new hemi::Array<double>(nsignals, true);
+    value = new hemi::Array<double>(1, true);
+  }
+
+  virtual void TearDown() {
+    for (size_t j=0; j<pdfs.size(); j++) {
+      delete pdfs[j];
+    }
+    delete parameter_means;
+    delete parameter_sigma;
+    delete parameter_lower;
+    delete parameter_upper;
+    delete pars;
+    delete value;
+  }
+
+  NLLEvaluator* make_nll(NLLEvaluator::LookupTable lut=NLLEvaluator::LUT_AUTO,
+                         bool mc_statistics=false) {
+    NLLEvaluator* nll = \
+      new NLLEvaluator(pdfs, 0, 1, parameter_means, parameter_sigma,
+                       parameter_lower, parameter_upper, lut, mc_statistics);
+    nll->set_data(data, data_weights);
+    return nll;
+  }
+
+  // Evaluate the PDFs, then the NLL, at v
+  double nll_at(NLLEvaluator* nll, const double* v) {
+    std::copy(v, v + nsignals, pars->writeOnlyHostPtr());
+    nll->eval_pdfs(pars);
+    nll->nll(pars->readOnlyPtr(), value->writeOnlyPtr());
+    return value->readOnlyHostPtr()[0];
+  }
+
+  // Total of the partial sums left by the last event term kernel
+  double event_total(NLLEvaluator* nll) {
+    HEMI_KERNEL_LAUNCH(nll_event_reduce, 1, 128, 128 * sizeof(double), 0,
+                       nll->npartial_sums(), nll->partial_sums(),
+                       value->writeOnlyPtr());
+    return value->readOnlyHostPtr()[0];
+  }
+
+  // The NLL summed over every event, without grouping them by bin. This
+  // points the PDFs at the events, so call it before making an evaluator.
+  double reference_nll(const double* v) {
+    const size_t ne = data.size();
+    hemi::Array<float> values(ne * nsignals, true);
+    hemi::Array<unsigned int> norms(nsignals, true);
+    hemi::Array<double> params(1, true);
+    params.writeOnlyHostPtr();
+    for (size_t j=0; j<nsignals; j++) {
+      pdfz::Eval* pdf = pdfs[j];
+      pdf->SetEvalPoints(data);
+      pdf->SetPDFValueBuffer(&values, j * ne, 1);
+      pdf->SetNormalizationBuffer(&norms, j);
+      pdf->SetParameterBuffer(&params);
+      pdf->EvalAsync();
+      pdf->EvalFinished();
+    }
+
+    // Rate totals and Gaussian constraints
+    const float* p = values.readOnlyHostPtr();
+    const double* means = parameter_means->readOnlyHostPtr();
+    const double* sigmas = parameter_sigma->readOnlyHostPtr();
+    double sum = 0;
+    for (size_t j=0; j<nsignals; j++) {
+      sum += v[j];
+      if (sigmas[j] > 0) {
+        const double d = (v[j] - means[j]) / sigmas[j];
+        sum += d * d;
+      }
+    }
+    for (size_t i=0; i<ne; i++) {
+      double s = 0;
+      for (size_t j=0; j<nsignals; j++) {
+        s += v[j] * p[j * ne + i];
+      }
+      sum -= data_weights[i] * log(s);
+    }
+    return sum;
+  }
+
+  size_t nsignals;
+  std::vector<pdfz::Eval*> pdfs;
+  std::vector<float> data;
+  std::vector<int> data_weights;
+  hemi::Array<double>* parameter_means;
+  hemi::Array<double>* parameter_sigma;
+  hemi::Array<double>* parameter_lower;
+  hemi::Array<double>* parameter_upper;
+  hemi::Array<double>* pars;
+  hemi::Array<double>* value;
+};
+
+#endif // __TEST_NLL_FIXTURES__
+
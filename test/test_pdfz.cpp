@@ -2,10 +2,6 @@
 
 #include <cmath>
 
-#ifndef __CUDACC__
-#define isnan std::isnan
-#endif
-
 TEST(PdfzError, Constructor)
 {
     pdfz::Error err("test");
@@ -41,36 +37,36 @@ TEST(SystematicObjects, ResolutionScaleSystematicConstructor)
 
 TEST_F(EvalHistConstructor, WrongSampleSize)
 {
-    ASSERT_THROW(pdfz::EvalHist(samples, 2 /* nfields */, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, 2 /* nfields */, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, NobsLargerThanNfields)
 {
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields , 7 /* nobservables */, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields , 7 /* nobservables */, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, WrongLowerSize)
 {
     lower.resize(2);
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, WrongUpperSize)
 {
     upper.resize(2);
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, WrongNbinsSize)
 {
     nbins.resize(2);
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 TEST_F(EvalHistConstructor, ZeroBins)
 {
     nbins[0] = 0;
-    ASSERT_THROW(pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins), pdfz::Error);
+    ASSERT_THROW(pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins), pdfz::Error);
 }
 
 ///////////////
@@ -87,12 +83,12 @@ TEST_F(EvalHistMethods, Evaluation)
     EXPECT_EQ((unsigned int) 5, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(1.6, results[1]);
     ASSERT_FLOAT_EQ(1.6, results[2]);
     ASSERT_FLOAT_EQ(0.4, results[3]);
     ASSERT_FLOAT_EQ(0.4, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 TEST_F(EvalHistMethods, EvaluationOffsetStride)
@@ -117,12 +113,12 @@ TEST_F(EvalHistMethods, EvaluationOffsetStride)
     EXPECT_EQ((unsigned int) 99, norm->readOnlyHostPtr()[2]);
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[3]));
+    ASSERT_FLOAT_EQ(0.0, results[3]);
     ASSERT_FLOAT_EQ(1.6, results[5]);
     ASSERT_FLOAT_EQ(1.6, results[7]);
     ASSERT_FLOAT_EQ(0.4, results[9]);
     ASSERT_FLOAT_EQ(0.4, results[11]);
-    ASSERT_TRUE(isnan(results[13]));
+    ASSERT_FLOAT_EQ(0.0, results[13]);
 }
 
 TEST_F(EvalHistMethods, CreateHistogram1D)
@@ -139,3 +135,144 @@ TEST_F(EvalHistMethods, CreateHistogram1D)
 
     delete hist;
 }
+
+TEST_F(EvalHistMethods, HistogramBufferOffsetStride)
+{
+    hemi::Array<unsigned int> hists(7, true);
+
+    evaluator->SetEvalPoints(eval_points);
+    evaluator->SetPDFValueBuffer(pdf_values);
+    evaluator->SetNormalizationBuffer(norm);
+    evaluator->SetParameterBuffer(params);
+    evaluator->SetHistogramBuffer(&hists, 1, 3);
+
+    // Detect incorrect writes
+    for (int i=0; i < 7; i++)
+        hists.writeOnlyHostPtr()[i] = 77;
+    // Force flush to device
+    hists.readOnlyDevicePtr();
+
+    evaluator->EvalAsync();
+    evaluator->EvalFinished();
+
+    const unsigned int *contents = hists.readOnlyHostPtr();
+    EXPECT_EQ((unsigned int) 77, contents[0]);
+    EXPECT_EQ((unsigned int) 4, contents[1]);
+    EXPECT_EQ((unsigned int) 77, contents[2]);
+    EXPECT_EQ((unsigned int) 77, contents[3]);
+    EXPECT_EQ((unsigned int) 1, contents[4]);
+    EXPECT_EQ((unsigned int) 77, contents[5]);
+    EXPECT_EQ((unsigned int) 77, contents[6]);
+
+    float *results = pdf_values->hostPtr();
+    ASSERT_FLOAT_EQ(1.6, results[2]);
+    ASSERT_FLOAT_EQ(0.4, results[4]);
+
+    evaluator->SetHistogramBuffer(NULL);
+}
+
+TEST_F(EvalHistMethods, Sumw2BufferOffsetStride)
+{
+    std::vector<int> weights(samples.size(), 1);
+    weights[0] = 3;
+    weights[4] = 2;
+    pdfz::EvalHist weighted(samples, weights, nfields, nobservables, lower, upper, nbins);
+    hemi::Array<unsigned long long> sumw2(5, true);
+
+    weighted.SetEvalPoints(eval_points);
+    weighted.SetPDFValueBuffer(pdf_values);
+    weighted.SetNormalizationBuffer(norm);
+    weighted.SetParameterBuffer(params);
+    weighted.SetSumw2Buffer(&sumw2, 1, 2);
+
+    // Detect incorrect writes
+    for (int i=0; i < 5; i++)
+        sumw2.writeOnlyHostPtr()[i] = 77;
+    // Force flush to device
+    sumw2.readOnlyDevicePtr();
+
+    weighted.EvalAsync();
+    weighted.EvalFinished();
+
+    const unsigned long long *contents = sumw2.readOnlyHostPtr();
+    EXPECT_EQ(77ULL, contents[0]);
+    EXPECT_EQ(12ULL, contents[1]);
+    EXPECT_EQ(77ULL, contents[2]);
+    EXPECT_EQ(4ULL, contents[3]);
+    EXPECT_EQ(77ULL, contents[4]);
+
+    // Bin contents are unchanged by the tracking
+    float *results = pdf_values->hostPtr();
+    ASSERT_FLOAT_EQ(1.5, results[2]);
+    ASSERT_FLOAT_EQ(0.5, results[4]);
+}
+
+TEST_F(EvalHistMethods, Sumw2LargeWeights)
+{
+    // Sums above 2^32, from squares each below it in the first bin, and
+    // from one square above it in the second
+    std::vector<int> weights(samples.size(), 1);
+    weights[1] = 50000;
+    weights[2] = 50000;
+    weights[4] = 100000;
+    pdfz::EvalHist weighted(samples, weights, nfields, nobservables, lower, upper, nbins);
+    hemi::Array<unsigned long long> sumw2(2, true);
+
+    weighted.SetEvalPoints(eval_points);
+    weighted.SetPDFValueBuffer(pdf_values);
+    weighted.SetNormalizationBuffer(norm);
+    weighted.SetParameterBuffer(params);
+    weighted.SetSumw2Buffer(&sumw2);
+
+    weighted.EvalAsync();
+    weighted.EvalFinished();
+
+    const unsigned long long *contents = sumw2.readOnlyHostPtr();
+    EXPECT_EQ(5000000002ULL, contents[0]);
+    EXPECT_EQ(10000000000ULL, contents[1]);
+}
+
+TEST_F(EvalHistMethods, EvaluationBFloat16)
+{
+    hemi::Array<unsigned short> pdf_values_bf16(6, true);
+
+    evaluator->SetEvalPoints(eval_points);
+    evaluator->SetPDFValueBuffer(&pdf_values_bf16);
+    evaluator->SetNormalizationBuffer(norm);
+    evaluator->SetParameterBuffer(params);
+    evaluator->EvalAsync();
+    evaluator->EvalFinished();
+
+    // bfloat16 keeps 8 significant bits
+    const unsigned short *results = pdf_values_bf16.readOnlyHostPtr();
+    ASSERT_FLOAT_EQ(0.0, pdfz::from_bfloat16(results[0]));
+    ASSERT_NEAR(1.6, pdfz::from_bfloat16(results[1]), 1.6 / 256);
+    ASSERT_NEAR(1.6, pdfz::from_bfloat16(results[2]), 1.6 / 256);
+    ASSERT_NEAR(0.4, pdfz::from_bfloat16(results[3]), 0.4 / 256);
+    ASSERT_NEAR(0.4, pdfz::from_bfloat16(results[4]), 0.4 / 256);
+    ASSERT_FLOAT_EQ(0.0, pdfz::from_bfloat16(results[5]));
+}
+
+TEST_F(EvalHistMethods, Clone)
+{
+    pdfz::EvalHist *clone = evaluator->Clone();
+
+    clone->SetEvalPoints(eval_points);
+    clone->SetPDFValueBuffer(pdf_values);
+    clone->SetNormalizationBuffer(norm);
+    clone->SetParameterBuffer(params);
+    clone->EvalAsync();
+    clone->EvalFinished();
+
+    EXPECT_EQ((unsigned int) 5, *norm->readOnlyHostPtr());
+
+    float *results = pdf_values->hostPtr();
+    ASSERT_FLOAT_EQ(0.0, results[0]);
+    ASSERT_FLOAT_EQ(1.6, results[1]);
+    ASSERT_FLOAT_EQ(1.6, results[2]);
+    ASSERT_FLOAT_EQ(0.4, results[3]);
+    ASSERT_FLOAT_EQ(0.4, results[4]);
+    ASSERT_FLOAT_EQ(0.0, results[5]);
+
+    delete clone;
+}
@@ -2,7 +2,7 @@
 #define __TEST_PDFZ_FIXTURES_2D__
 
 #include <gtest/gtest.h>
-#include "pdfz.h"
+#include <sxmc/pdfz.h>
 
 class EvalHist2DConstructor : public ::testing::Test {
 protected:
@@ -26,12 +26,15 @@ protected:
 
     nbins.resize(2);
     nbins[0] = 2; nbins[1] = 3;
+
+    weights.assign(samples.size(), 1);
   }
 
   // virtual void TearDown() {}
   int nobservables;
   int nfields;
   std::vector<float> samples;
+  std::vector<int> weights;
   std::vector<double> lower;
   std::vector<double> upper;
   std::vector<int> nbins;
@@ -41,7 +44,7 @@ class EvalHist2DMethods : public EvalHist2DConstructor {
 protected:
     virtual void SetUp() {
         EvalHist2DConstructor::SetUp();
-        evaluator = new pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins);
+        evaluator = new pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins);
         eval_points.resize(16);
         eval_points[0] = 0.2; eval_points[1] = 10.2;
         eval_points[2] = 0.7; eval_points[3] = 10.4;
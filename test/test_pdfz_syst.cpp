@@ -1,10 +1,6 @@
 #include "test_pdfz_fixtures.h"
 #include <cmath>
 
-#ifndef __CUDACC__
-#define isnan std::isnan
-#endif
-
 class EvalHistSystematics : public EvalHistMethods {
 protected:
     virtual void SetUp() {
@@ -43,12 +39,12 @@ TEST_F(EvalShiftSystematics, ZeroShift)
     EXPECT_EQ((unsigned int) 5, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(1.6, results[1]);
     ASSERT_FLOAT_EQ(1.6, results[2]);
     ASSERT_FLOAT_EQ(0.4, results[3]);
     ASSERT_FLOAT_EQ(0.4, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 TEST_F(EvalShiftSystematics, NegShift)
@@ -60,12 +56,12 @@ TEST_F(EvalShiftSystematics, NegShift)
     EXPECT_EQ((unsigned int) 4, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(1.5, results[1]);
     ASSERT_FLOAT_EQ(1.5, results[2]);
     ASSERT_FLOAT_EQ(0.5, results[3]);
     ASSERT_FLOAT_EQ(0.5, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 TEST_F(EvalShiftSystematics, PosShift)
@@ -77,12 +73,23 @@ TEST_F(EvalShiftSystematics, PosShift)
     EXPECT_EQ((unsigned int) 6, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(1.0, results[1]);
     ASSERT_FLOAT_EQ(1.0, results[2]);
     ASSERT_FLOAT_EQ(1.0, results[3]);
     ASSERT_FLOAT_EQ(1.0, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
+}
+
+TEST_F(EvalShiftSystematics, SystematicParameters)
+{
+    pdfz::ScaleSystematic scale(0, 2);
+    evaluator->AddSystematic(scale);
+
+    std::vector<int> pars = evaluator->GetSystematicParameters();
+    ASSERT_EQ((size_t) 2, pars.size());
+    EXPECT_EQ(0, pars[0]);
+    EXPECT_EQ(2, pars[1]);
 }
 
 ////////////// Scale Systematics
@@ -112,12 +119,12 @@ TEST_F(EvalScaleSystematics, ZeroScale)
     EXPECT_EQ((unsigned int) 5, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(1.6, results[1]);
     ASSERT_FLOAT_EQ(1.6, results[2]);
     ASSERT_FLOAT_EQ(0.4, results[3]);
     ASSERT_FLOAT_EQ(0.4, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 TEST_F(EvalScaleSystematics, NegScale)
@@ -129,12 +136,12 @@ TEST_F(EvalScaleSystematics, NegScale)
     EXPECT_EQ((unsigned int) 6, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(5.0/3, results[1]);
     ASSERT_FLOAT_EQ(5.0/3, results[2]);
     ASSERT_FLOAT_EQ(1.0/3, results[3]);
     ASSERT_FLOAT_EQ(1.0/3, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 TEST_F(EvalScaleSystematics, PosScale)
@@ -146,12 +153,12 @@ TEST_F(EvalScaleSystematics, PosScale)
     EXPECT_EQ((unsigned int) 4, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(1.0, results[1]);
     ASSERT_FLOAT_EQ(1.0, results[2]);
     ASSERT_FLOAT_EQ(1.0, results[3]);
     ASSERT_FLOAT_EQ(1.0, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 ////////////// Resolution Scale Systematics
@@ -172,7 +179,7 @@ protected:
         samples[10] = 1.1; samples[11] = 0.7;
         samples[12] = -0.1; samples[13] = 0.7;
 
-        evaluator = new pdfz::EvalHist(samples, nfields, nobservables, lower, upper, nbins);
+        evaluator = new pdfz::EvalHist(samples, weights, nfields, nobservables, lower, upper, nbins);
         eval_points.resize(6);
         eval_points[0] = -0.1;
         eval_points[1] = 0.0;
@@ -222,12 +229,12 @@ TEST_F(EvalResolutionScaleSystematics, ZeroScale)
     EXPECT_EQ((unsigned int) 5, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(1.6, results[1]);
     ASSERT_FLOAT_EQ(1.6, results[2]);
     ASSERT_FLOAT_EQ(0.4, results[3]);
     ASSERT_FLOAT_EQ(0.4, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 TEST_F(EvalResolutionScaleSystematics, NegScale)
@@ -239,12 +246,12 @@ TEST_F(EvalResolutionScaleSystematics, NegScale)
     EXPECT_EQ((unsigned int) 7, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(2.0*5/7, results[1]);
     ASSERT_FLOAT_EQ(2.0*5/7, results[2]);
     ASSERT_FLOAT_EQ(2.0*2/7, results[3]);
     ASSERT_FLOAT_EQ(2.0*2/7, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 TEST_F(EvalResolutionScaleSystematics, PosScale)
@@ -256,12 +263,12 @@ TEST_F(EvalResolutionScaleSystematics, PosScale)
     EXPECT_EQ((unsigned int) 4, *norm->readOnlyHostPtr());
 
     float *results = pdf_values->hostPtr();
-    ASSERT_TRUE(isnan(results[0]));
+    ASSERT_FLOAT_EQ(0.0, results[0]);
     ASSERT_FLOAT_EQ(2.0, results[1]);
     ASSERT_FLOAT_EQ(2.0, results[2]);
     ASSERT_FLOAT_EQ(0.0, results[3]);
     ASSERT_FLOAT_EQ(0.0, results[4]);
-    ASSERT_TRUE(isnan(results[5]));
+    ASSERT_FLOAT_EQ(0.0, results[5]);
 }
 
 
@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <vector>
+
+#include <sxmc/rng.h>
+
+// Known-answer tests from the Random123 distribution (kat_vectors)
+TEST(Philox, KnownAnswerZero)
+{
+    const unsigned counter[4] = { 0, 0, 0, 0 };
+    const unsigned key[2] = { 0, 0 };
+    unsigned out[4];
+    philox4x32(counter, key, out);
+    EXPECT_EQ(0x6627e8d5u, out[0]);
+    EXPECT_EQ(0xe169c58du, out[1]);
+    EXPECT_EQ(0xbc57ac4cu, out[2]);
+    EXPECT_EQ(0x9b00dbd8u, out[3]);
+}
+
+TEST(Philox, KnownAnswerOnes)
+{
+    const unsigned counter[4] = { 0xffffffff, 0xffffffff,
+                                  0xffffffff, 0xffffffff };
+    const unsigned key[2] = { 0xffffffff, 0xffffffff };
+    unsigned out[4];
+    philox4x32(counter, key, out);
+    EXPECT_EQ(0x408f276du, out[0]);
+    EXPECT_EQ(0x41c83b0eu, out[1]);
+    EXPECT_EQ(0xa20bc7c6u, out[2]);
+    EXPECT_EQ(0x6d5451fdu, out[3]);
+}
+
+TEST(Philox, KnownAnswerPi)
+{
+    const unsigned counter[4] = { 0x243f6a88, 0x85a308d3,
+                                  0x13198a2e, 0x03707344 };
+    const unsigned key[2] = { 0xa4093822, 0x299f31d0 };
+    unsigned out[4];
+    philox4x32(counter, key, out);
+    EXPECT_EQ(0xd16cfe09u, out[0]);
+    EXPECT_EQ(0x94fdccebu, out[1]);
+    EXPECT_EQ(0x5001e420u, out[2]);
+    EXPECT_EQ(0x24126ea1u, out[3]);
+}
+
+TEST(RNG, StreamsDiffer)
+{
+    RNGState a, b, c;
+    rng_init(&a, 1234, rng_stream(0, 0), 0);
+    rng_init(&b, 1234, rng_stream(0, 1), 0);
+    rng_init(&c, 1234, rng_stream(0, 0), 1);
+    const unsigned x = rng_next(&a);
+    EXPECT_NE(x, rng_next(&b));
+    EXPECT_NE(x, rng_next(&c));
+}
+
+TEST(RNG, Reproducible)
+{
+    RNGState a, b;
+    rng_init(&a, 42, rng_stream(3, RNG_DATA), 7);
+    rng_init(&b, 42, rng_stream(3, RNG_DATA), 7);
+    for (int i=0; i<100; i++) {
+        EXPECT_EQ(rng_uniform(&a), rng_uniform(&b));
+    }
+}
+
+TEST(RNG, BatchedUniformsMatch)
+{
+    RNGState a, b;
+    rng_init(&a, 42, 0, 0);
+    rng_init(&b, 42, 0, 0);
+    std::vector<double> u(101);
+    rng_uniforms(&a, &u[0], u.size());
+    for (size_t i=0; i<u.size(); i++) {
+        EXPECT_EQ(rng_uniform(&b), u[i]);
+    }
+}
+
+TEST(RNG, UniformMoments)
+{
+    RNGState rng;
+    rng_init(&rng, 1, 0, 0);
+    const int n = 100000;
+    double sum = 0;
+    for (int i=0; i<n; i++) {
+        const double u = rng_uniform(&rng);
+        ASSERT_GT(u, 0.0);
+        ASSERT_LE(u, 1.0);
+        sum += u;
+    }
+    EXPECT_NEAR(0.5, sum / n, 5 * sqrt(1.0 / 12 / n));
+}
+
+TEST(RNG, NormalMoments)
+{
+    RNGState rng;
+    rng_init(&rng, 1, 0, 0);
+    const int n = 100000;
+    std::vector<double> x(n);
+    rng_normals(&rng, &x[0], n);
+    double sum = 0;
+    double sum2 = 0;
+    for (int i=0; i<n; i++) {
+        sum += x[i];
+        sum2 += x[i] * x[i];
+    }
+    EXPECT_NEAR(0.0, sum / n, 5 / sqrt(1.0 * n));
+    EXPECT_NEAR(1.0, sum2 / n, 5 * sqrt(2.0 / n));
+}
+
+TEST(RNG, PoissonMoments)
+{
+    RNGState rng;
+    rng_init(&rng, 1, 0, 0);
+    const double means[3] = { 0.5, 9.5, 1000 };
+    const int n = 20000;
+    for (int j=0; j<3; j++) {
+        double sum = 0;
+        double sum2 = 0;
+        for (int i=0; i<n; i++) {
+            const long k = rng_poisson(&rng, means[j]);
+            ASSERT_GE(k, 0);
+            sum += k;
+            sum2 += 1.0 * k * k;
+        }
+        const double mean = sum / n;
+        EXPECT_NEAR(means[j], mean, 5 * sqrt(means[j] / n));
+        EXPECT_NEAR(means[j], sum2 / n - mean * mean, 0.05 * means[j]);
+    }
+}
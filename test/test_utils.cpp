@@ -0,0 +1,163 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <vector>
+
+#include <sxmc/utils.h>
+
+// A known symmetric positive-definite matrix and its Cholesky factor
+static const double spd[9] = { 4, 12, -16,
+                               12, 37, -43,
+                               -16, -43, 98 };
+static const double spd_factor[9] = { 2, 0, 0,
+                                      6, 1, 0,
+                                      -8, 5, 3 };
+
+TEST(Cholesky, KnownFactor)
+{
+    std::vector<double> a(spd, spd + 9);
+    ASSERT_TRUE(cholesky(a, 3));
+    for (int i=0; i<9; i++) {
+        EXPECT_NEAR(spd_factor[i], a[i], 1e-12);
+    }
+
+    // L * L^T gives back the matrix
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            double x = 0;
+            for (int k=0; k<3; k++) {
+                x += a[i * 3 + k] * a[j * 3 + k];
+            }
+            EXPECT_NEAR(spd[i * 3 + j], x, 1e-12);
+        }
+    }
+}
+
+TEST(Cholesky, NotPositiveDefinite)
+{
+    // Eigenvalues 3 and -1
+    const double m[4] = { 1, 2,
+                          2, 1 };
+    std::vector<double> a(m, m + 4);
+    EXPECT_FALSE(cholesky(a, 2));
+
+    std::vector<double> zero(4, 0);
+    EXPECT_FALSE(cholesky(zero, 2));
+}
+
+TEST(InvertSPD, ProductIsIdentity)
+{
+    std::vector<double> a(spd, spd + 9);
+    ASSERT_TRUE(invert_spd(a, 3));
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            double x = 0;
+            for (int k=0; k<3; k++) {
+                x += spd[i * 3 + k] * a[k * 3 + j];
+            }
+            EXPECT_NEAR((i == j ? 1.0 : 0.0), x, 1e-9);
+        }
+    }
+
+    // The inverse is symmetric
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<i; j++) {
+            EXPECT_NEAR(a[j * 3 + i], a[i * 3 + j], 1e-9);
+        }
+    }
+}
+
+TEST(InvertSPD, NotPositiveDefinite)
+{
+    const double m[4] = { 1, 2,
+                          2, 1 };
+    std::vector<double> a(m, m + 4);
+    EXPECT_FALSE(invert_spd(a, 2));
+    for (int i=0; i<4; i++) {
+        EXPECT_EQ(m[i], a[i]);
+    }
+}
+
+// Uniform deviates on [0, 1) from an xorshift64* generator
+static double uniform(unsigned long long* s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return ((*s * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+// Standard normal deviates by the Box-Muller transform
+static double normal(unsigned long long* s) {
+    const double r = sqrt(-2 * log(1 - uniform(s)));
+    return r * cos(2 * M_PI * uniform(s));
+}
+
+// A Gaussian AR(1) series with unit stationary variance, offset by drift
+// decaying from the start
+static std::vector<float> ar1(size_t n, double rho, double drift) {
+    unsigned long long s = 3;
+    std::vector<float> x(n);
+    double y = normal(&s);
+    for (size_t i=0; i<n; i++) {
+        x[i] = y + drift * exp(-(double) i / (0.05 * n));
+        y = rho * y + sqrt(1 - rho * rho) * normal(&s);
+    }
+    return x;
+}
+
+TEST(Geweke, Stationary)
+{
+    for (int k=0; k<2; k++) {
+        std::vector<float> x = ar1(10000, (k == 0 ? 0 : 0.9), 0);
+        EXPECT_LT(fabs(geweke_z(x, 1, 0, x.size(), 0)), 2);
+    }
+}
+
+TEST(Geweke, DriftingStart)
+{
+    std::vector<float> x = ar1(10000, 0.5, 5);
+    EXPECT_GT(fabs(geweke_z(x, 1, 0, x.size(), 0)), 5);
+
+    // Past the drift the walk looks settled
+    EXPECT_LT(fabs(geweke_z(x, 1, 5000, 5000, 0)), 2);
+}
+
+TEST(Geweke, ConstantField)
+{
+    // Steps of two fields, the first never changing
+    std::vector<float> y = ar1(1000, 0, 0);
+    std::vector<float> x(2 * 1000);
+    for (size_t i=0; i<1000; i++) {
+        x[2 * i] = 1;
+        x[2 * i + 1] = y[i];
+    }
+    EXPECT_EQ(HUGE_VAL, geweke_z(x, 2, 0, 1000, 0));
+    EXPECT_NE(HUGE_VAL, geweke_z(x, 2, 0, 1000, 1));
+}
+
+TEST(EffectiveSampleSize, Independent)
+{
+    const size_t n = 100000;
+    std::vector<float> x = ar1(n, 0, 0);
+    EXPECT_NEAR(n, effective_sample_size(x, 1, 0, n, 0), 0.15 * n);
+}
+
+TEST(EffectiveSampleSize, AR1)
+{
+    // The integrated autocorrelation time of AR(1) is (1 + rho) / (1 - rho)
+    const size_t n = 100000;
+    const double rhos[2] = { 0.5, 0.9 };
+    for (int k=0; k<2; k++) {
+        const double rho = rhos[k];
+        std::vector<float> x = ar1(n, rho, 0);
+        const double expected = n * (1 - rho) / (1 + rho);
+        EXPECT_NEAR(expected, effective_sample_size(x, 1, 0, n, 0),
+                    0.2 * expected);
+    }
+}
+
+TEST(EffectiveSampleSize, Degenerate)
+{
+    std::vector<float> x(100, 1);
+    EXPECT_EQ(0, effective_sample_size(x, 1, 0, 100, 0));
+    EXPECT_EQ(0, effective_sample_size(ar1(3, 0, 0), 1, 0, 3, 0));
+}